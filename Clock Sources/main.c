@@ -5,6 +5,11 @@
  *
  * @description:    Selects and configures various clock sources of STM32F4-Discovery  
  *
+ *                  Then runs a few loops under the DWT performance
+ *                  counters and prints where their cycles go
+ *                  (flash/multi-cycle stalls, load/store stalls,
+ *                  interrupt overhead, sleep) on ITM port 0.
+ *
  */
 
 /*
@@ -13,13 +18,109 @@
 
 #include "stm32f4xx.h"
 #include <stdint.h>
+#include <stdio.h>
 
 void SysClock_configHSI(void);
 void SysClock_configHSE(void);
 void SysClock_configPLL(void);
 
+/*
+  1: enable flash prefetch, instruction and data cache (ART
+  accelerator) with the PLL. Set to 0 to see flash wait
+  states in the CPI stall counts.
+*/
+#define   PERF_ART            1
+
+/*
+  DWT performance counters.
+  
+  CPICNT, EXCCNT, SLEEPCNT, LSUCNT and FOLDCNT are only 8-bit
+  wide. perf_sample() adds their change since the last sample
+  to 64-bit totals (CYCCNT as well), so it must run before any
+  of them moves by 256: SysTick calls it every
+  PERF_SAMPLE_CYCLES. The core has no interrupt on their wrap,
+  so the rate can not be lowered.
+  
+  At this rate the sampler itself takes about 9% of the CPU
+  (entry/exit in EXC, its body in CPI, LSU, FOLD). perf_init()
+  measures its cost per run while sleeping, where every
+  counter but SLEEP moves only for the sampler, and
+  perf_report() subtracts it times the samples taken in the
+  region (SMP).
+  
+    CPI     extra cycles of multi-cycle instructions, including
+            instruction fetch stalls (flash wait states)
+    EXC     cycles spent entering and leaving exceptions
+    SLEEP   cycles spent sleeping
+    LSU     extra cycles of load/store instructions
+    FOLD    instructions that took zero cycles
+  
+  instructions = CYC - CPI - EXC - SLEEP - LSU + FOLD
+*/
+#define   PERF_SAMPLE_CYCLES  240U
+
+enum {
+  PERF_CYC,
+  PERF_CPI,
+  PERF_EXC,
+  PERF_SLEEP,
+  PERF_LSU,
+  PERF_FOLD,
+  PERF_SMP,
+  PERF_COUNT
+};
+
+/*
+  code region, accumulates over all its runs
+*/
+typedef struct {
+  const char  * name;
+  uint32_t      runs;
+  uint64_t      start[PERF_COUNT];
+  uint64_t      cnt[PERF_COUNT];
+} perf_region_t;
+
+/* extended totals since perf_init(), examine in watch window */
+volatile uint64_t perfTotal[PERF_COUNT];
+
+static uint32_t perfLast[PERF_COUNT];
+
+/* sampler cost per run in 1/256 counts, see perf_calibrate() */
+static uint32_t perfCost[PERF_COUNT];
+
+void perf_init(void);
+static void perf_calibrate(void);
+void perf_sample(void);
+void perf_snapshot(uint64_t snap[PERF_COUNT]);
+void perf_begin(perf_region_t * r);
+void perf_end(perf_region_t * r);
+void perf_report(const perf_region_t * r);
+
+/*
+  regions measured by main()
+*/
+enum { REGION_FLASH, REGION_RAM, REGION_ALU, REGION_SLEEP, REGION_COUNT };
+
+perf_region_t region[REGION_COUNT] = {
+  { .name = "table in flash" },
+  { .name = "table in RAM" },
+  { .name = "multiply loop" },
+  { .name = "sleep (WFI)" },
+};
+
+#define   TABLE_SIZE          256U
+
+static const uint32_t flashTable[TABLE_SIZE] = { 1U, 2U, 3U, 5U, 8U, 13U, 21U, 34U };
+static uint32_t ramTable[TABLE_SIZE];
+
+volatile uint32_t perfSink;
+
 int main () {
 
+  uint32_t i;
+  uint32_t pass;
+  uint32_t sum;
+
   /*
     NOTE: uncomment the one required 
   */
@@ -28,6 +129,55 @@ int main () {
 //  SysClock_configHSE();  //Configure external 8Mhz clock as System Clock
   SysClock_configPLL();  //Configure PLL as System Clock (feed from internal 16Mhz oscillator)
   
+  perf_init();
+  
+  for (i = 0; i < TABLE_SIZE; ++i) {
+    ramTable[i] = flashTable[i];
+  }
+  
+  /*
+    same loads from flash and from SRAM
+  */
+  for (pass = 0; pass < 64U; ++pass) {
+    
+    perf_begin(&region[REGION_FLASH]);
+    for (i = 0, sum = 0; i < TABLE_SIZE; ++i) {
+      sum += flashTable[i];
+    }
+    perf_end(&region[REGION_FLASH]);
+    perfSink = sum;
+    
+    perf_begin(&region[REGION_RAM]);
+    for (i = 0, sum = 0; i < TABLE_SIZE; ++i) {
+      sum += ramTable[i];
+    }
+    perf_end(&region[REGION_RAM]);
+    perfSink = sum;
+  }
+  
+  /*
+    register only arithmetic
+  */
+  perf_begin(&region[REGION_ALU]);
+  for (i = 0, sum = 1; i < 16384U; ++i) {
+    sum = sum * 1664525U + 1013904223U;
+  }
+  perf_end(&region[REGION_ALU]);
+  perfSink = sum;
+  
+  /*
+    woken up by the sampler
+  */
+  perf_begin(&region[REGION_SLEEP]);
+  for (i = 0; i < 64U; ++i) {
+    __WFI();
+  }
+  perf_end(&region[REGION_SLEEP]);
+  
+  for (i = 0; i < REGION_COUNT; ++i) {
+    perf_report(&region[i]);
+  }
+  
   __ASM {    
     BKPT #0x3    
   }
@@ -128,9 +278,22 @@ void SysClock_configPLL(void) {
   RCC->CR |= (1U << 24);
   
   /*
-    wait until PLL get stable
+    wait until PLL get stable (PLLRDY)
   */
-  while (!(RCC->PLLCFGR & (1U << 24)));
+  while (!(RCC->CR & (1U << 25)));
+
+  /*
+    flash needs 5 wait states at 168Mhz (2.7 - 3.6V),
+    set before the clock goes up
+  */
+  regVal = FLASH->ACR & ~0x7U;
+  regVal |= 5U;
+#if (PERF_ART)
+  /* prefetch, instruction cache, data cache */
+  regVal |= (1U << 8) | (1U << 9) | (1U << 10);
+#endif
+  FLASH->ACR = regVal;
+  while ((FLASH->ACR & 0x7U) != 5U);
 
 
   /*
@@ -156,3 +319,195 @@ void SysClock_configPLL(void) {
   
 }
 
+/*
+  enable DWT counters and the SysTick sampler
+*/
+void perf_init(void) {
+
+  uint32_t i;
+  
+  SystemCoreClockUpdate();
+  
+  /* trace enable */
+  CoreDebug->DEMCR |= (1U << 24);
+  
+  DWT->CYCCNT   = 0;
+  DWT->CPICNT   = 0;
+  DWT->EXCCNT   = 0;
+  DWT->SLEEPCNT = 0;
+  DWT->LSUCNT   = 0;
+  DWT->FOLDCNT  = 0;
+  
+  /*
+    CYCCNTENA, CPIEVTENA, EXCEVTENA, SLEEPEVTENA, LSUEVTENA,
+    FOLDEVTENA. The 8-bit counters also emit an ITM event
+    packet when they wrap (if SWO trace is running).
+  */
+  DWT->CTRL |= (1U << 0) | (1U << 17) | (1U << 18) | (1U << 19) | (1U << 20) | (1U << 21);
+  
+  for (i = 0; i < PERF_COUNT; ++i) {
+    perfLast[i]  = 0;
+    perfTotal[i] = 0;
+  }
+  
+  /*
+    sampler at highest priority so that
+    sampling intervals stay regular
+  */
+  SysTick_Config(PERF_SAMPLE_CYCLES);
+  NVIC_SetPriority(SysTick_IRQn, 0);
+  
+  perf_calibrate();
+}
+
+/*
+  Sampler cost: sleep through PERF_CAL_SAMPLES sampler
+  runs, all cycles not spent asleep are the sampler's
+  (and a WFI loop branch per run).
+*/
+#define   PERF_CAL_SAMPLES    64U
+
+static void perf_calibrate(void) {
+
+  perf_region_t cal = { .name = "sampler" };
+  uint64_t      smp;
+  uint32_t      i;
+  
+  perf_begin(&cal);
+  for (i = 0; i < PERF_CAL_SAMPLES; ++i) {
+    __WFI();
+  }
+  perf_end(&cal);
+  
+  smp = cal.cnt[PERF_SMP];
+  
+  if (smp == 0U) {
+    return;
+  }
+  
+  perfCost[PERF_CYC] = (uint32_t)(((cal.cnt[PERF_CYC] - cal.cnt[PERF_SLEEP]) << 8) / smp);
+  
+  for (i = PERF_CPI; i <= PERF_FOLD; ++i) {
+    if (i != PERF_SLEEP) {
+      perfCost[i] = (uint32_t)((cal.cnt[i] << 8) / smp);
+    }
+  }
+}
+
+/*
+  fold counter changes since last sample into perfTotal
+*/
+void perf_sample(void) {
+
+  uint32_t primask = __get_PRIMASK();
+  uint32_t now[PERF_FOLD + 1];
+  uint32_t i;
+  
+  __disable_irq();
+  
+  now[PERF_CYC]   = DWT->CYCCNT;
+  now[PERF_CPI]   = DWT->CPICNT;
+  now[PERF_EXC]   = DWT->EXCCNT;
+  now[PERF_SLEEP] = DWT->SLEEPCNT;
+  now[PERF_LSU]   = DWT->LSUCNT;
+  now[PERF_FOLD]  = DWT->FOLDCNT;
+  
+  perfTotal[PERF_CYC] += now[PERF_CYC] - perfLast[PERF_CYC];
+  perfLast[PERF_CYC]   = now[PERF_CYC];
+  
+  for (i = PERF_CPI; i <= PERF_FOLD; ++i) {
+    perfTotal[i] += (now[i] - perfLast[i]) & 0xFFU;
+    perfLast[i]   = now[i];
+  }
+  
+  __set_PRIMASK(primask);
+}
+
+void perf_snapshot(uint64_t snap[PERF_COUNT]) {
+
+  uint32_t primask = __get_PRIMASK();
+  uint32_t i;
+  
+  __disable_irq();
+  
+  perf_sample();
+  
+  for (i = 0; i < PERF_COUNT; ++i) {
+    snap[i] = perfTotal[i];
+  }
+  
+  __set_PRIMASK(primask);
+}
+
+void perf_begin(perf_region_t * r) {
+  perf_snapshot(r->start);
+}
+
+void perf_end(perf_region_t * r) {
+
+  uint64_t now[PERF_COUNT];
+  uint32_t i;
+  
+  perf_snapshot(now);
+  
+  for (i = 0; i < PERF_COUNT; ++i) {
+    r->cnt[i] += now[i] - r->start[i];
+  }
+  
+  ++r->runs;
+}
+
+static void perf_puts(const char * s) {
+  while (*s != '\0') {
+    ITM_SendChar((uint32_t)*s++);
+  }
+}
+
+/*
+  cycle breakdown of a region less the sampler runs
+  that fell into it, percent of its cycles
+*/
+void perf_report(const perf_region_t * r) {
+
+  char      line[160];
+  uint64_t  c[PERF_COUNT];
+  uint64_t  cyc;
+  uint64_t  ins;
+  uint64_t  cost;
+  uint32_t  i;
+  
+  for (i = 0; i < PERF_SMP; ++i) {
+    cost = (r->cnt[PERF_SMP] * perfCost[i]) >> 8;
+    c[i] = (r->cnt[i] > cost) ? (r->cnt[i] - cost) : 0U;
+  }
+  
+  cyc = c[PERF_CYC];
+  ins = cyc - c[PERF_CPI] - c[PERF_EXC] - c[PERF_SLEEP] - c[PERF_LSU] + c[PERF_FOLD];
+  
+  if (cyc == 0U) {
+    return;
+  }
+  
+#define   PCT(___n)   ((uint32_t)((100U * (___n)) / cyc))
+
+  snprintf(line, sizeof(line),
+           "%-16s runs %u  cycles %u  instr %u  cpi-stall %u%%  lsu-stall %u%%  exc %u%%  sleep %u%%  fold %u  smp %u\n",
+           r->name, r->runs, (uint32_t)cyc, (uint32_t)ins,
+           PCT(c[PERF_CPI]), PCT(c[PERF_LSU]), PCT(c[PERF_EXC]),
+           PCT(c[PERF_SLEEP]), (uint32_t)c[PERF_FOLD], (uint32_t)r->cnt[PERF_SMP]);
+
+#undef    PCT
+
+  perf_puts(line);
+}
+
+#ifdef   __cplusplus
+    extern "C" {
+#endif
+void SysTick_Handler (void) {
+  perf_sample();
+  ++perfTotal[PERF_SMP];
+}
+#ifdef   __cplusplus
+    }
+#endif
@@ -0,0 +1,60 @@
+/*
+@descp:     Atomic GPIO set / reset / toggle (BSRR) and
+            peripheral bit-band access shared by the examples,
+            include it by relative path after stm32f4xx.h,
+            e.g. from GPIO-Interrupt/main.c
+                #include "../Common/gpio_atomic.h"
+
+@warrenty:  void
+*/
+
+#ifndef GPIO_ATOMIC_H
+#define GPIO_ATOMIC_H
+
+/*
+    Atomic GPIO access.
+    
+    __togglebit(GPIOD->ODR, 14) is a load, an EOR and a
+    store. An interrupt between the load and the store
+    that changes another pin of the port (e.g. an ISR
+    toggling PD.15) is undone when the stale value is
+    stored back.
+    
+    BSRR: bits 15:0 set, bits 31:16 reset the pins
+    written as 1, the others are left alone. Set and
+    reset are one store, no read.
+    
+    gpio_toggle(): ODR is read once, BSRR written once.
+    Other pins can't be disturbed, so main and ISRs may
+    toggle different pins of a port without locking.
+    The same pin from both still needs a critical section.
+    
+    BITBAND_PERI(): alias word of one bit of a peripheral
+    register (0x40000000 - 0x400FFFFF),
+        0x42000000 + (offset * 32) + (bit * 4)
+    a store writes just that bit, the bus matrix does the
+    read-modify-write as one locked transfer. Not for
+    write-1-to-clear registers (EXTI->PR, flag clear
+    registers): the read back value would clear every
+    pending bit.
+*/
+#define       BITBAND_PERI(___reg, ___bit)                                          \
+    (*(volatile uint32_t *)(PERIPH_BB_BASE +                                        \
+                            (((uint32_t)&(___reg) - PERIPH_BASE) * 32U) + ((___bit) * 4U)))
+
+static __inline void gpio_set(GPIO_TypeDef * port, uint32_t pins) {
+    port->BSRR = pins;
+}
+
+static __inline void gpio_reset(GPIO_TypeDef * port, uint32_t pins) {
+    port->BSRR = pins << 16;
+}
+
+static __inline void gpio_toggle(GPIO_TypeDef * port, uint32_t pins) {
+    
+    uint32_t odr = port->ODR;
+    
+    port->BSRR = ((odr & pins) << 16) | (~odr & pins);
+}
+
+#endif
@@ -0,0 +1,76 @@
+/*
+@descp:     Compile-time GPIO pin configuration shared by the
+            examples, include it by relative path after
+            stm32f4xx.h, e.g. from SPI-Interrupt/main.c
+                #include "../Common/gpio_config.h"
+
+@warrenty:  void
+*/
+
+#ifndef GPIO_CONFIG_H
+#define GPIO_CONFIG_H
+
+/*
+    Compile-time pin configuration.
+    
+    A pin list is a macro that applies its argument to
+    each pin: ___pin(pin, mode, type, speed, pull, af).
+    GPIO_CONFIGURE(port, list) ORs the fields of all the
+    pins into one constant mask and value per register
+    and writes each register once:
+        reg = (reg & ~mask) | value
+    registers no pin of the list uses are not touched.
+    The pin fields may also be run time values (one pin
+    of a table), then the writes are computed at run time.
+    AFR, OTYPER, OSPEEDR and PUPDR are written before
+    MODER, a pin becomes an alternate function with its
+    AF already selected (no glitch through AF0).
+*/
+#define       GPIO_IN           0U
+#define       GPIO_OUT          1U
+#define       GPIO_AF           2U
+#define       GPIO_ANALOG       3U
+
+#define       GPIO_PP           0U
+#define       GPIO_OD           1U
+
+#define       GPIO_LOW          0U
+#define       GPIO_MEDIUM       1U
+#define       GPIO_FAST         2U
+#define       GPIO_VHIGH        3U
+
+#define       GPIO_NOPULL       0U
+#define       GPIO_PU           1U
+#define       GPIO_PD           2U
+
+#define       GPIO_MODER_M(___p, ___m, ___t, ___s, ___u, ___af)    (3U << (2U * (___p))) |
+#define       GPIO_MODER_V(___p, ___m, ___t, ___s, ___u, ___af)    ((___m) << (2U * (___p))) |
+#define       GPIO_OTYPER_M(___p, ___m, ___t, ___s, ___u, ___af)   (1U << (___p)) |
+#define       GPIO_OTYPER_V(___p, ___m, ___t, ___s, ___u, ___af)   ((___t) << (___p)) |
+#define       GPIO_OSPEEDR_V(___p, ___m, ___t, ___s, ___u, ___af)  ((___s) << (2U * (___p))) |
+#define       GPIO_PUPDR_V(___p, ___m, ___t, ___s, ___u, ___af)    ((___u) << (2U * (___p))) |
+#define       GPIO_AFRL_M(___p, ___m, ___t, ___s, ___u, ___af)                      \
+    (((___p) < 8U) ? (0xFU << (4U * ((___p) & 7U))) : 0U) |
+#define       GPIO_AFRL_V(___p, ___m, ___t, ___s, ___u, ___af)                      \
+    (((___p) < 8U) ? ((___af) << (4U * ((___p) & 7U))) : 0U) |
+#define       GPIO_AFRH_M(___p, ___m, ___t, ___s, ___u, ___af)                      \
+    (((___p) >= 8U) ? (0xFU << (4U * ((___p) & 7U))) : 0U) |
+#define       GPIO_AFRH_V(___p, ___m, ___t, ___s, ___u, ___af)                      \
+    (((___p) >= 8U) ? ((___af) << (4U * ((___p) & 7U))) : 0U) |
+
+#define       GPIO_WRITE(___reg, ___mask, ___val)                                   \
+    if ((___mask) != 0U) {                                                          \
+        (___reg) = ((___reg) & ~(uint32_t)(___mask)) | (uint32_t)(___val);          \
+    }
+
+#define       GPIO_CONFIGURE(___port, ___pins)                                      \
+    do {                                                                            \
+        GPIO_WRITE((___port)->AFR[0], ___pins(GPIO_AFRL_M) 0U, ___pins(GPIO_AFRL_V) 0U) \
+        GPIO_WRITE((___port)->AFR[1], ___pins(GPIO_AFRH_M) 0U, ___pins(GPIO_AFRH_V) 0U) \
+        GPIO_WRITE((___port)->OTYPER, ___pins(GPIO_OTYPER_M) 0U, ___pins(GPIO_OTYPER_V) 0U) \
+        GPIO_WRITE((___port)->OSPEEDR, ___pins(GPIO_MODER_M) 0U, ___pins(GPIO_OSPEEDR_V) 0U) \
+        GPIO_WRITE((___port)->PUPDR, ___pins(GPIO_MODER_M) 0U, ___pins(GPIO_PUPDR_V) 0U) \
+        GPIO_WRITE((___port)->MODER, ___pins(GPIO_MODER_M) 0U, ___pins(GPIO_MODER_V) 0U) \
+    } while (0)
+
+#endif
@@ -0,0 +1,219 @@
+/*
+@descp:     DWT cycle counter probes shared by the examples,
+            include it by relative path after stm32f4xx.h,
+            e.g. from SPI-Interrupt/main.c
+                #include "../Common/prof.h"
+
+@warrenty:  void
+*/
+
+#ifndef PROF_H
+#define PROF_H
+
+/*
+    DWT cycle counter probes.
+    
+    PROF_BEGIN()/PROF_END() bracket a region in one block,
+    each is a single CYCCNT load. prof_record() keeps per
+    probe count, min, max, sum and a log2 histogram
+        hist[n]: 2^n <= cycles < 2^(n+1), last bin open ended
+    less the back to back probe cost measured by prof_init().
+    
+    Cost of one probe. The recorded interval only holds
+    the two CYCCNT loads (profBias, taken off), the code
+    around the probe also pays for prof_record(): bias,
+    CLZ, 64-bit sum, count, min, max and histogram, about
+    37 Thumb-2 instructions including both loads, ~40
+    cycles on the M4 from zero wait state memory (LLVM
+    cortex-m4 model of the compiled probe), more when the
+    code misses the flash accelerator. That is four times
+    a ~10 cycle budget: an enclosing probe, and the
+    latency of a probed ISR, grow by that much for each
+    probe inside them, keep probes off paths of less
+    than a few hundred cycles. prof_init() measures the
+    cost of the actual build into profCost (watch window).
+    
+    The example names its probes in an enum ending with
+    PROF_COUNT and owns the array the macros write:
+        static prof_t prof[PROF_COUNT];
+        prof_init(prof, PROF_COUNT);
+    
+    Dump prof[] from the debugger and format it on the PC:
+        SAVE prof.hex &prof[0], &prof[PROF_COUNT]
+        prof_dump prof.hex <probe names in enum order>
+    (Host-Tools/prof_dump.c), or stream it on ITM without
+    halting, see prof_itm_dump(). PROF_ENABLE 0 compiles
+    the probes away.
+*/
+#ifndef PROF_ENABLE
+#define       PROF_ENABLE       1
+#endif
+
+#ifndef PROF_BINS
+#define       PROF_BINS         16U
+#endif
+
+/*
+    ITM stimulus port of prof_itm_dump(), clear of the
+    ports 0..3 of Printf-to-Debugger
+*/
+#ifndef PROF_ITM_PORT
+#define       PROF_ITM_PORT     4U
+#endif
+
+#define       PROF_ITM_MAGIC    0x464F5250U     /* "PROF" */
+
+typedef struct {
+    uint64_t     sum;
+    uint32_t     count;
+    uint32_t     min;
+    uint32_t     max;
+    uint32_t     hist[PROF_BINS];
+} prof_t;
+
+static uint32_t profBias = 0;
+
+/*
+    cycles one PROF_BEGIN()/PROF_END() pair adds to the
+    code around it, see prof_init()
+*/
+volatile uint32_t profCost = 0;
+
+#if (PROF_ENABLE)
+#define       PROF_BEGIN(___id)     uint32_t __prof_##___id = DWT->CYCCNT
+#define       PROF_END(___id)       prof_record(&prof[___id], DWT->CYCCNT - __prof_##___id)
+#else
+#define       PROF_BEGIN(___id)
+#define       PROF_END(___id)
+#endif
+
+static __inline void prof_record(prof_t * p, uint32_t cycles) {
+
+    uint32_t bin;
+    
+    cycles = (cycles > profBias) ? (cycles - profBias) : 0U;
+    bin    = 31U - __CLZ(cycles | 1U);
+    
+    ++p->count;
+    p->sum += cycles;
+    
+    if (cycles < p->min) {
+        p->min = cycles;
+    }
+    
+    if (cycles > p->max) {
+        p->max = cycles;
+    }
+    
+    ++p->hist[(bin < PROF_BINS) ? bin : (PROF_BINS - 1U)];
+}
+
+/*
+    enable DWT cycle counter, reset the probes and
+    measure the probe cost
+*/
+static void prof_init(prof_t * p, uint32_t count) {
+
+    static prof_t scratch;
+    
+    uint32_t i;
+    uint32_t start;
+    uint32_t cycles;
+    
+    CoreDebug->DEMCR |= (1U << 24);     /* TRCENA */
+    DWT->CYCCNT = 0;
+    DWT->CTRL   |= (1U << 0);           /* CYCCNTENA */
+    
+    for (i = 0; i < count; ++i) {
+        p[i].min = 0xFFFFFFFFU;
+    }
+    
+    profBias = 0xFFFFFFFFU;
+    
+    for (i = 0; i < 8U; ++i) {
+        
+        start  = DWT->CYCCNT;
+        cycles = DWT->CYCCNT - start;
+        
+        if (cycles < profBias) {
+            profBias = cycles;
+        }
+    }
+    
+    /*
+        full probe on a scratch record, timed from outside:
+        both CYCCNT loads and prof_record()
+    */
+    profCost = 0xFFFFFFFFU;
+    
+    for (i = 0; i < 8U; ++i) {
+        
+        uint32_t outer = DWT->CYCCNT;
+        
+        start = DWT->CYCCNT;
+        prof_record(&scratch, DWT->CYCCNT - start);
+        cycles = DWT->CYCCNT - outer - profBias;
+        
+        if (cycles < profCost) {
+            profCost = cycles;
+        }
+    }
+}
+
+/*
+    ITM stream of the probes.
+    
+    prof_itm_dump() writes the probe array as it is in
+    memory, 32-bit words on stimulus port PROF_ITM_PORT,
+    after a two word header:
+        PROF_ITM_MAGIC, (PROF_BINS << 16) | count
+    Nothing is sent unless the debugger has enabled ITM
+    and the port (trace settings). The ISRs keep recording
+    while the words go out, a probe hit meanwhile may be
+    sent half updated.
+    
+    Set profItmDump to 1 in the watch window, the main
+    loop (prof_itm_poll()) sends one dump and clears it.
+    Capture raw SWO and format it on the PC:
+        prof_dump -i swo.bin <probe names in enum order>
+*/
+volatile uint32_t profItmDump = 0;
+
+static void prof_itm_word(uint32_t w) {
+    
+    /* PORT reads 0 while the stimulus FIFO is full */
+    while (ITM->PORT[PROF_ITM_PORT].u32 == 0U) {
+    }
+    
+    ITM->PORT[PROF_ITM_PORT].u32 = w;
+}
+
+static void prof_itm_dump(const prof_t * p, uint32_t count) {
+
+    const uint32_t * w = (const uint32_t *)p;
+    uint32_t         i;
+    
+    /*
+        TCR bit 0: ITMENA
+    */
+    if (!(ITM->TCR & (1U << 0)) || !(ITM->TER & (1U << PROF_ITM_PORT))) {
+        return;
+    }
+    
+    prof_itm_word(PROF_ITM_MAGIC);
+    prof_itm_word((PROF_BINS << 16) | count);
+    
+    for (i = 0; i < (count * sizeof(prof_t)) / 4U; ++i) {
+        prof_itm_word(w[i]);
+    }
+}
+
+static __inline void prof_itm_poll(const prof_t * p, uint32_t count) {
+    
+    if (profItmDump) {
+        profItmDump = 0;
+        prof_itm_dump(p, count);
+    }
+}
+
+#endif
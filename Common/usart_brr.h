@@ -0,0 +1,63 @@
+/*
+@descp:     Compile-time USART baudrate register (BRR) solver
+            shared by the examples, include it by relative
+            path, e.g. from UART-Interrupt/Source/main.c
+                #include "../../Common/usart_brr.h"
+
+@warrenty:  void
+*/
+
+#ifndef USART_BRR_H
+#define USART_BRR_H
+
+/*
+    Maximum tolerated baudrate error in ppm (1%)
+*/
+#ifndef USART_MAX_ERR_PPM
+#define       USART_MAX_ERR_PPM 10000U
+#endif
+
+/*
+    Compile time USART baudrate register (BRR) solver.
+
+    USARTDIV = Fclk / (8 x (2 - OVER8) x Baudrate)
+
+    BRR keeps USARTDIV in 1/16 steps (OVER8 = 0) or in
+    1/8 steps (OVER8 = 1), so in both cases the divider
+    in fraction steps is  N = Fclk / Baudrate.
+    Out of floor(N) and floor(N) + 1 the one giving the
+    lower baudrate error is taken.
+*/
+#define       __BRR_LO(___f, ___b)          ((___f) / (___b))
+#define       __BRR_HI(___f, ___b)          (__BRR_LO(___f, ___b) + 1U)
+
+#define       __BRR_N(___f, ___b)                                               \
+              ((((1ULL * (___f)) - (1ULL * __BRR_LO(___f, ___b) * (___b))) * __BRR_HI(___f, ___b) <= \
+                (((1ULL * __BRR_HI(___f, ___b) * (___b)) - (___f)) * __BRR_LO(___f, ___b)))       \
+                ? __BRR_LO(___f, ___b) : __BRR_HI(___f, ___b))
+
+#define       USART_BRR(___f, ___b, ___over8)                                   \
+              ((___over8) ? (((__BRR_N(___f, ___b) >> 3) << 4) | (__BRR_N(___f, ___b) & 0x7U)) \
+                          : __BRR_N(___f, ___b))
+
+/*
+    | Fclk - N x Baudrate | / (N x Baudrate) in ppm
+*/
+#define       USART_BAUD_ERR_PPM(___f, ___b)                                    \
+              (((((1ULL * __BRR_N(___f, ___b) * (___b)) > (___f))               \
+                 ? ((1ULL * __BRR_N(___f, ___b) * (___b)) - (___f))             \
+                 : ((___f) - (1ULL * __BRR_N(___f, ___b) * (___b))))            \
+                * 1000000ULL) / (1ULL * __BRR_N(___f, ___b) * (___b)))
+
+/*
+    Fail the build if the baudrate can not be reached:
+    error too big or mantissa out of its 12-bit range
+*/
+#define       USART_BRR_CHECK(___name, ___f, ___b, ___over8)                    \
+              typedef char ___name##_baud_error_too_big                         \
+                  [(USART_BAUD_ERR_PPM(___f, ___b) <= USART_MAX_ERR_PPM) ? 1 : -1]; \
+              typedef char ___name##_baud_out_of_range                          \
+                  [((__BRR_N(___f, ___b) >> (4U - (___over8))) >= 1U) &&        \
+                   ((__BRR_N(___f, ___b) >> (4U - (___over8))) <= 0xFFFU) ? 1 : -1]
+
+#endif
@@ -6,6 +6,14 @@
             interrupt, PD.15 (BLUE-LED) is toggled.
             The signal to PA.0 is given from PD.14, which is
             also connected to on-board RED-LED.
+            
+            The LEDs are driven through BSRR and bit-band
+            aliases (gpio_set(), gpio_toggle(), BITBAND_PERI()),
+            not read-modify-write of ODR. gpioMethod selects how
+            the main loop toggles PD.14: ODR read-modify-write,
+            BSRR or bit-band. The cost of each is in the
+            DWT probes (prof[]), PD.15 changes lost to
+            the race in gpioLost (watch window).
 
 @warrenty:  void
 
@@ -20,19 +28,52 @@
 
 #include <stdint.h>
 #include "stm32f4xx.h"
+#include "../Common/prof.h"
+#include "../Common/gpio_atomic.h"
 
 #define       __setbit(___reg, ___bit)      ((___reg) |= (1U << (___bit)))
 #define       __clearbit(___reg, ___bit)    ((___reg) &= (~(1U << (___bit))))
 #define       __togglebit(___reg, ___bit)   ((___reg) ^= (1U << (___bit)))
 #define       __getbit(___reg, ___bit)      (((___reg) & (1U << (___bit))) >> (___bit))
 
+/*
+    main loop toggle of PD.14, set in watch window
+*/
+enum { GPIO_RMW, GPIO_BSRR, GPIO_BITBAND };
+
+volatile uint32_t gpioMethod = GPIO_BSRR;
+
+/*
+    PD.15 toggles by EXTI0 and PD.15 changes found lost
+    in the main loop, examine in watch window.
+*/
+volatile uint32_t exti0Toggles = 0;
+volatile uint32_t gpioLost     = 0;
+
 static void configureLEDs (void);
 static void configInputPin (void);
+static void led_toggle (void);
+static void led_check (void);
+
+/*
+    DWT cycle counter probes (Common/prof.h), one per
+    entry, dumped with prof_dump in this order
+*/
+enum {
+    PROF_EXTI0,         /* EXTI0_IRQHandler */
+    PROF_ODR_RMW,       /* PD.14 toggle, ODR read-modify-write */
+    PROF_BSRR,          /* PD.14 toggle, BSRR */
+    PROF_BITBAND,       /* PD.14 toggle, bit-band */
+    PROF_COUNT
+};
+
+static prof_t prof[PROF_COUNT];
 
 int main () {
     
     volatile unsigned int i = 0 ;
     
+    prof_init(prof, PROF_COUNT);
     configureLEDs();
     configInputPin();
     
@@ -62,13 +103,13 @@ int main () {
    /*
         Enable Interrupt on EXTI0 line
    */ 
-   __setbit(EXTI->IMR, 0);
+   BITBAND_PERI(EXTI->IMR, 0) = 1U;
    
    
    /*
        trigger interrupt on rising edge
    */
-   __setbit(EXTI->RTSR, 0);
+   BITBAND_PERI(EXTI->RTSR, 0) = 1U;
    
    /*
        Now EXTI has been configured, finally
@@ -79,7 +120,9 @@ int main () {
     
     
     while (1) {
-       __togglebit(GPIOD->ODR, 14);
+       led_toggle();
+       led_check();
+       prof_itm_poll(prof, PROF_COUNT);
        for ( i = 0; i < 1000000; ++i);
     }
 
@@ -175,19 +218,83 @@ static void configInputPin (void) {
 #endif
 void EXTI0_IRQHandler (void) {
 
+    PROF_BEGIN(PROF_EXTI0);
+    
     /*
-        Clear the pending interrupt
+        Clear the pending interrupt: write 1 to clear,
+        one store, other pending lines are left alone
     */
-    __setbit (EXTI->PR, 0);
+    EXTI->PR = 1U << 0;
     
     /* 
         toggle the led to confirm that interrupt
         has called the ISR.
     */
-    __togglebit(GPIOD->ODR, 15);
+    gpio_toggle(GPIOD, 1U << 15);
+    ++exti0Toggles;
+    
+    PROF_END(PROF_EXTI0);
 }
 #ifdef   __cplusplus
     extern  "C" {
     }
 #endif
 
+/*
+    toggle PD.14 the way gpioMethod selects, timed
+*/
+static void led_toggle (void) {
+    
+    switch (gpioMethod) {
+        
+        case GPIO_RMW: {
+            PROF_BEGIN(PROF_ODR_RMW);
+            __togglebit(GPIOD->ODR, 14);
+            PROF_END(PROF_ODR_RMW);
+            break;
+        }
+        
+        case GPIO_BITBAND: {
+            PROF_BEGIN(PROF_BITBAND);
+            BITBAND_PERI(GPIOD->ODR, 14) ^= 1U;
+            PROF_END(PROF_BITBAND);
+            break;
+        }
+        
+        default: {
+            PROF_BEGIN(PROF_BSRR);
+            gpio_toggle(GPIOD, 1U << 14);
+            PROF_END(PROF_BSRR);
+            break;
+        }
+    }
+}
+
+/*
+    PD.15 must follow the number of EXTI0 toggles
+    (off after configureLEDs()). A mismatch is an
+    ISR toggle overwritten by the main loop: counted
+    and put right.
+*/
+static void led_check (void) {
+    
+    uint32_t on;
+    
+    __disable_irq();
+    
+    on = exti0Toggles & 1U;
+    
+    if (__getbit(GPIOD->ODR, 15) != on) {
+        
+        ++gpioLost;
+        
+        if (on) {
+            gpio_set(GPIOD, 1U << 15);
+        } else {
+            gpio_reset(GPIOD, 1U << 15);
+        }
+    }
+    
+    __enable_irq();
+}
+
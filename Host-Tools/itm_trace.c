@@ -0,0 +1,809 @@
+/*
+@descp:     Host (Linux) decoder for raw SWO / ITM captures, e.g.
+            the Printf-to-Debugger output saved by the probe
+            software, or the trace of the profiled examples.
+
+            Packets understood (ARMv7-M ITM/DWT protocol):
+                synchronisation, overflow
+                local timestamp (format 1 and 2)
+                global timestamp (GTS1, GTS2)
+                extension (skipped)
+                instrumentation (stimulus ports 0..31)
+                hardware source: event counter wrap, exception
+                trace, PC sample, data trace PC / address / value
+
+            Output:
+            - summary of packets, per port byte counts, overflows
+            - -o prefix: raw byte stream of every stimulus port
+              in prefix_portNN.bin (port 1 feeds log_decode.c)
+            - -j file: Chrome trace JSON (chrome://tracing or
+              ui.perfetto.dev). Exceptions are nested slices on
+              the "exceptions" track, text lines of port 0,
+              stimulus words, data trace hits and DWT counter
+              wraps are instant or counter events.
+
+            Timestamps are cycles of the trace clock, -f converts
+            them to real time. A local timestamp applies to the
+            packets received since the previous one. Captures
+            without local timestamps use the global ones instead
+            (-f is then the global timestamp clock).
+
+            -g writes a synthetic capture (text, nested
+            exceptions, counter wraps, data trace, an overflow)
+            so the decoder can be tried without a probe.
+
+@build:     gcc -O2 -Wall -o itm_trace itm_trace.c
+
+@usage:     itm_trace [-f trace_hz] [-o prefix] [-j trace.json] capture.bin
+            itm_trace -g capture.bin
+
+@warrenty:  void
+*/
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PORT_COUNT          32U
+#define MAX_PENDING         256U
+#define MAX_NEST            16U
+#define TEXT_LINE           256U
+
+/*
+    decoded event, waits for its timestamp
+*/
+typedef enum {
+    EV_STIM,
+    EV_EXC,
+    EV_COUNTER,
+    EV_PC,
+    EV_DATA
+} ev_kind_t;
+
+typedef struct {
+    ev_kind_t   kind;
+    uint32_t    a;          /* port, exception, counter bits, comparator */
+    uint32_t    b;          /* value, exception function, pc */
+    uint32_t    size;
+} event_t;
+
+static event_t      pending[MAX_PENDING];
+static unsigned     npending;
+
+static uint64_t     now;
+
+/*
+    global timestamp: GTS1 low bits [25:0], GTS2 high bits.
+    gtsWrap: GTS1 had the wrap bit, time moves on the GTS2
+    that follows with the new high bits.
+*/
+static uint64_t     gtsLo;
+static uint64_t     gtsHi;
+static uint64_t     gtsLast;
+static int          gtsSeen;
+static int          gtsWrap;
+static double       hz;
+static FILE       * json;
+static int          jsonFirst = 1;
+
+static FILE       * portFile[PORT_COUNT];
+static const char * prefix;
+
+static unsigned long nPkt[16];
+static unsigned long portBytes[PORT_COUNT];
+static unsigned long overflows;
+static unsigned long syncs;
+static unsigned long unknown;
+static unsigned long pcSamples;
+static unsigned long dataHits;
+static unsigned long excEvents;
+static uint64_t      wraps[6];
+
+static uint32_t     excStack[MAX_NEST];
+static unsigned     excDepth;
+
+static char         textLine[TEXT_LINE];
+static unsigned     textLen;
+
+enum { P_SYNC, P_OVF, P_LTS, P_GTS, P_EXT, P_SW, P_HW };
+
+static const char * const counterName[6] = { "CPI", "EXC", "SLEEP", "LSU", "FOLD", "CYC" };
+
+/*
+    exception names, IRQs as used by the examples
+*/
+static const char * exc_name(uint32_t n, char * buf, size_t len) {
+
+    static const char * const core[16] = {
+        "Thread", "Reset", "NMI", "HardFault", "MemManage", "BusFault", "UsageFault",
+        "7", "8", "9", "10", "SVCall", "DebugMon", "13", "PendSV", "SysTick"
+    };
+
+    static const struct { uint32_t irq; const char * name; } irq[] = {
+        {  6, "EXTI0" },        { 11, "DMA1_Stream0" }, { 12, "DMA1_Stream1" },
+        { 13, "DMA1_Stream2" }, { 14, "DMA1_Stream3" }, { 15, "DMA1_Stream4" },
+        { 16, "DMA1_Stream5" }, { 17, "DMA1_Stream6" }, { 28, "TIM2" },
+        { 35, "SPI1" },         { 36, "SPI2" },         { 37, "USART1" },
+        { 38, "USART2" },       { 39, "USART3" },       { 47, "DMA1_Stream7" },
+        { 51, "SPI3" },         { 52, "UART4" },        { 53, "UART5" },
+        { 56, "DMA2_Stream0" }, { 57, "DMA2_Stream1" }, { 58, "DMA2_Stream2" },
+        { 59, "DMA2_Stream3" }, { 68, "DMA2_Stream5" }, { 71, "USART6" },
+    };
+
+    unsigned i;
+
+    if (n < 16U) {
+        return core[n];
+    }
+
+    for (i = 0; i < sizeof(irq) / sizeof(irq[0]); ++i) {
+        if (irq[i].irq == n - 16U) {
+            return irq[i].name;
+        }
+    }
+
+    snprintf(buf, len, "IRQ%u", n - 16U);
+    return buf;
+}
+
+static double ts_us(void) {
+    return (hz > 0.0) ? (double)now * 1e6 / hz : (double)now;
+}
+
+static void json_event(const char * fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void json_event(const char * fmt, ...) {
+
+    va_list ap;
+
+    if (json == NULL) {
+        return;
+    }
+
+    fputs(jsonFirst ? "\n  " : ",\n  ", json);
+    jsonFirst = 0;
+
+    va_start(ap, fmt);
+    vfprintf(json, fmt, ap);
+    va_end(ap);
+}
+
+static void json_string(const char * s, char * out, size_t len) {
+
+    size_t n = 0;
+
+    while ((*s != '\0') && (n + 7U < len)) {
+
+        unsigned char c = (unsigned char)*s++;
+
+        if ((c == '"') || (c == '\\')) {
+            out[n++] = '\\';
+            out[n++] = (char)c;
+        } else if (c < 0x20U) {
+            n += (size_t)snprintf(&out[n], len - n, "\\u%04x", c);
+        } else {
+            out[n++] = (char)c;
+        }
+    }
+
+    out[n] = '\0';
+}
+
+/*
+    text of port 0, one instant event per line
+*/
+static void text_put(uint8_t c) {
+
+    char esc[4 * TEXT_LINE];
+
+    if ((c != '\n') && (textLen + 1U < TEXT_LINE)) {
+        if (c != '\r') {
+            textLine[textLen++] = (char)c;
+        }
+        return;
+    }
+
+    textLine[textLen] = '\0';
+    json_string(textLine, esc, sizeof(esc));
+    json_event("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":100}",
+               esc, ts_us());
+    textLen = 0;
+}
+
+/*
+    an event gets its time: write it out
+*/
+static void emit(const event_t * e) {
+
+    char     name[32];
+    uint32_t i;
+
+    switch (e->kind) {
+
+        case EV_STIM:
+            if (portFile[e->a] != NULL) {
+                for (i = 0; i < e->size; ++i) {
+                    fputc((int)((e->b >> (8U * i)) & 0xFFU), portFile[e->a]);
+                }
+            }
+
+            if (e->a == 0U) {
+                for (i = 0; i < e->size; ++i) {
+                    text_put((uint8_t)(e->b >> (8U * i)));
+                }
+            } else {
+                json_event("{\"name\":\"port %u\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+                           "\"args\":{\"value\":%u}}", e->a, ts_us(), 100U + e->a, e->b);
+            }
+            break;
+
+        case EV_EXC:
+            ++excEvents;
+
+            /*
+                1: entered, 2: exited, 3: returned to
+            */
+            if (e->b == 1U) {
+                if (excDepth < MAX_NEST) {
+                    excStack[excDepth++] = e->a;
+                }
+                json_event("{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+                           exc_name(e->a, name, sizeof(name)), ts_us());
+            } else if (e->b == 2U) {
+                if ((excDepth != 0U) && (excStack[excDepth - 1U] == e->a)) {
+                    --excDepth;
+                    json_event("{\"name\":\"%s\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+                               exc_name(e->a, name, sizeof(name)), ts_us());
+                }
+            }
+            break;
+
+        case EV_COUNTER:
+            for (i = 0; i < 6U; ++i) {
+                if (e->a & (1U << i)) {
+                    ++wraps[i];
+                    json_event("{\"name\":\"DWT %s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,"
+                               "\"args\":{\"count\":%llu}}", counterName[i], ts_us(),
+                               (unsigned long long)wraps[i] * ((i == 5U) ? 1024U : 256U));
+                }
+            }
+            break;
+
+        case EV_PC:
+            ++pcSamples;
+            break;
+
+        case EV_DATA:
+            ++dataHits;
+            json_event("{\"name\":\"DWT comp %u %s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":2,"
+                       "\"args\":{\"value\":%u}}", e->a & 3U, (e->a & 4U) ? "write" : "read",
+                       ts_us(), e->b);
+            break;
+    }
+}
+
+static void flush_pending(void) {
+
+    unsigned i;
+
+    for (i = 0; i < npending; ++i) {
+        emit(&pending[i]);
+    }
+
+    npending = 0;
+}
+
+static void add_event(ev_kind_t kind, uint32_t a, uint32_t b, uint32_t size) {
+
+    if (npending == MAX_PENDING) {
+        flush_pending();
+    }
+
+    pending[npending].kind = kind;
+    pending[npending].a    = a;
+    pending[npending].b    = b;
+    pending[npending].size = size;
+    ++npending;
+}
+
+/*
+    hardware source packet (DWT)
+*/
+static void hw_packet(uint32_t id, uint32_t v, uint32_t size) {
+
+    if (id == 0U) {
+        add_event(EV_COUNTER, v & 0x3FU, 0, size);
+    } else if (id == 1U) {
+        add_event(EV_EXC, v & 0x1FFU, (v >> 12) & 3U, size);
+    } else if (id == 2U) {
+        add_event(EV_PC, 0, v, size);
+    } else if ((id >= 8U) && (id < 16U)) {
+        /* data trace PC value / address offset, counted with the value */
+    } else if ((id >= 16U) && (id < 24U)) {
+        add_event(EV_DATA, ((id >> 1) & 3U) | ((id & 1U) << 2), v, size);
+    } else {
+        ++unknown;
+    }
+}
+
+/*
+    advance the time base to the global timestamp, only
+    while no local timestamp has been seen
+*/
+static void gts_update(void) {
+
+    uint64_t g = (gtsHi << 26) | gtsLo;
+
+    if (nPkt[P_LTS] != 0U) {
+        return;
+    }
+
+    if (gtsSeen && (g >= gtsLast)) {
+        now += g - gtsLast;
+        flush_pending();
+    }
+
+    gtsLast = g;
+    gtsSeen = 1;
+}
+
+static void decode(const uint8_t * cap, size_t size) {
+
+    size_t   pos   = 0;
+    unsigned zeros = 0;
+
+    while (pos < size) {
+
+        uint8_t  h = cap[pos++];
+        uint32_t v = 0;
+        uint32_t n;
+        uint32_t i;
+
+        /*
+            synchronisation: >= 47 zero bits then a one
+        */
+        if (h == 0x00U) {
+            ++zeros;
+            continue;
+        }
+
+        if ((h == 0x80U) && (zeros >= 5U)) {
+            zeros = 0;
+            ++syncs;
+            ++nPkt[P_SYNC];
+            continue;
+        }
+
+        zeros = 0;
+
+        if (h == 0x70U) {
+            /*
+                overflow: packets were lost, nesting is unknown
+            */
+            ++overflows;
+            ++nPkt[P_OVF];
+            flush_pending();
+            json_event("{\"name\":\"overflow\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":1,\"tid\":1}", ts_us());
+            continue;
+        }
+
+        if ((h & 0x0FU) == 0x00U) {
+
+            /*
+                local timestamp: format 1 with continuation
+                bytes, format 2 is the 3-bit value itself
+            */
+            if ((h & 0xCFU) == 0xC0U) {
+                for (i = 0; (i < 4U) && (pos < size); ++i) {
+                    uint8_t c = cap[pos++];
+                    v |= (uint32_t)(c & 0x7FU) << (7U * i);
+                    if (!(c & 0x80U)) {
+                        break;
+                    }
+                }
+            } else if (!(h & 0x80U)) {
+                v = (h >> 4) & 7U;
+            } else {
+                ++unknown;
+                continue;
+            }
+
+            ++nPkt[P_LTS];
+            now += v;
+            flush_pending();
+            continue;
+        }
+
+        if (h == 0x94U) {
+
+            /*
+                GTS1: 7 bits per byte, bits [25:21], ClkCh and
+                Wrap in the 4th. Bytes left out of a compressed
+                packet keep their previous value.
+            */
+            uint64_t mask = 0;
+            uint32_t last = 0;
+
+            for (i = 0; (i < 4U) && (pos < size); ++i) {
+
+                last = cap[pos++];
+
+                if (i < 3U) {
+                    v    |= (last & 0x7FU) << (7U * i);
+                    mask |= 0x7FULL << (7U * i);
+                } else {
+                    v    |= (last & 0x1FU) << 21;
+                    mask |= 0x1FULL << 21;
+                }
+
+                if (!(last & 0x80U)) {
+                    break;
+                }
+            }
+
+            gtsLo = (gtsLo & ~mask) | v;
+            ++nPkt[P_GTS];
+
+            if ((i == 3U) && (last & 0x40U)) {
+                gtsWrap = 1;
+            } else {
+                gts_update();
+            }
+            continue;
+        }
+
+        if (h == 0xB4U) {
+
+            /*
+                GTS2: high bits [47:26] (3 bytes) or [63:26] (5)
+            */
+            uint64_t hi = 0;
+
+            for (i = 0; (i < 5U) && (pos < size); ++i) {
+
+                uint8_t c = cap[pos++];
+
+                hi |= (uint64_t)(c & 0x7FU) << (7U * i);
+
+                if (!(c & 0x80U)) {
+                    break;
+                }
+            }
+
+            gtsHi = hi;
+            ++nPkt[P_GTS];
+
+            if (gtsWrap) {
+                gtsWrap = 0;
+                gts_update();
+            }
+            continue;
+        }
+
+        if ((h & 0x0BU) == 0x08U) {
+
+            /* extension, e.g. stimulus port page */
+            if (h & 0x80U) {
+                while ((pos < size) && (cap[pos++] & 0x80U));
+            }
+
+            ++nPkt[P_EXT];
+            continue;
+        }
+
+        if ((h & 0x03U) == 0U) {
+            ++unknown;
+            continue;
+        }
+
+        /*
+            source packet: payload of 1, 2 or 4 bytes
+        */
+        n = ((h & 3U) == 3U) ? 4U : (h & 3U);
+
+        if (pos + n > size) {
+            break;
+        }
+
+        for (i = 0; i < n; ++i) {
+            v |= (uint32_t)cap[pos++] << (8U * i);
+        }
+
+        if (h & 0x04U) {
+            ++nPkt[P_HW];
+            hw_packet(h >> 3, v, n);
+        } else {
+            ++nPkt[P_SW];
+            portBytes[h >> 3] += n;
+            add_event(EV_STIM, h >> 3, v, n);
+        }
+    }
+
+    flush_pending();
+}
+
+/*
+    synthetic capture
+*/
+static FILE * gen;
+
+static void g_byte(uint32_t b) {
+    fputc((int)(b & 0xFFU), gen);
+}
+
+static void g_sync(void) {
+
+    int i;
+
+    for (i = 0; i < 5; ++i) {
+        g_byte(0x00U);
+    }
+
+    g_byte(0x80U);
+}
+
+static void g_source(uint32_t hw, uint32_t id, uint32_t v, uint32_t size) {
+
+    uint32_t i;
+
+    g_byte((id << 3) | (hw << 2) | ((size == 4U) ? 3U : size));
+
+    for (i = 0; i < size; ++i) {
+        g_byte(v >> (8U * i));
+    }
+}
+
+static void g_lts(uint32_t delta) {
+
+    if ((delta >= 1U) && (delta <= 6U)) {
+        g_byte(delta << 4);
+        return;
+    }
+
+    g_byte(0xC0U);
+
+    while (delta > 0x7FU) {
+        g_byte((delta & 0x7FU) | 0x80U);
+        delta >>= 7;
+    }
+
+    g_byte(delta);
+}
+
+static void g_text(const char * s) {
+
+    while (*s != '\0') {
+
+        uint32_t w = 0;
+        uint32_t n = 0;
+
+        while ((n < 4U) && (s[n] != '\0')) {
+            w |= (uint32_t)(uint8_t)s[n] << (8U * n);
+            ++n;
+        }
+
+        g_source(0, 0, w, (n == 3U) ? 1U : n);
+
+        if (n == 3U) {
+            g_source(0, 0, w >> 8, 2U);
+        }
+
+        s += n;
+    }
+}
+
+static void g_exc(uint32_t exc, uint32_t fn) {
+    g_source(1, 1, (exc & 0x1FFU) | (fn << 12), 2U);
+}
+
+static void generate(const char * name) {
+
+    char     line[64];
+    uint32_t k;
+
+    gen = fopen(name, "wb");
+
+    if (gen == NULL) {
+        perror(name);
+        exit(1);
+    }
+
+    g_sync();
+    g_byte(0x94U);
+    g_byte(0x00U);
+
+    for (k = 0; k < 40U; ++k) {
+
+        snprintf(line, sizeof(line), "loop %u\n", k);
+        g_text(line);
+        g_lts(120U);
+
+        g_source(0, 2, k, 4U);                  /* event port 2 */
+        g_lts(3U);
+
+        /*
+            SysTick, every 4th time USART3 nests on top
+        */
+        g_exc(15U, 1U);
+        g_lts(12U);
+
+        if ((k & 3U) == 0U) {
+            g_exc(16U + 39U, 1U);
+            g_lts(40U + k);
+            g_exc(16U + 39U, 2U);
+            g_exc(15U, 3U);
+            g_lts(6U);
+        }
+
+        g_exc(15U, 2U);
+        g_exc(0U, 3U);
+        g_lts(30U);
+
+        /* DWT comparator 1 sees a write of k */
+        g_source(1, 16U + (1U << 1) + 1U, k, 4U);
+        g_lts(2U);
+
+        if ((k % 5U) == 4U) {
+            g_source(1, 0, (1U << 0) | (1U << 3), 1U);   /* CPI and LSU wrap */
+            g_lts(1U);
+        }
+
+        if (k == 20U) {
+            g_byte(0x70U);
+            g_sync();
+        }
+
+        g_lts(800U);
+    }
+
+    fclose(gen);
+}
+
+static uint8_t * read_file(const char * name, size_t * size) {
+
+    FILE    * f = fopen(name, "rb");
+    uint8_t * buf;
+    long      len;
+
+    if (f == NULL) {
+        perror(name);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = malloc((size_t)len + 1U);
+
+    if ((buf == NULL) || (fread(buf, 1, (size_t)len, f) != (size_t)len)) {
+        fprintf(stderr, "%s: read error\n", name);
+        exit(1);
+    }
+
+    fclose(f);
+    *size = (size_t)len;
+
+    return buf;
+}
+
+int main(int argc, char ** argv) {
+
+    const char * jsonName = NULL;
+    size_t       size;
+    uint8_t    * cap;
+    unsigned     i;
+    int          opt = 1;
+
+    while ((opt + 1 < argc) && (argv[opt][0] == '-')) {
+
+        if (strcmp(argv[opt], "-f") == 0) {
+            hz = strtod(argv[opt + 1], NULL);
+        } else if (strcmp(argv[opt], "-o") == 0) {
+            prefix = argv[opt + 1];
+        } else if (strcmp(argv[opt], "-j") == 0) {
+            jsonName = argv[opt + 1];
+        } else if (strcmp(argv[opt], "-g") == 0) {
+            generate(argv[opt + 1]);
+            return 0;
+        } else {
+            break;
+        }
+
+        opt += 2;
+    }
+
+    if (argc - opt != 1) {
+        fprintf(stderr, "usage: %s [-f trace_hz] [-o prefix] [-j trace.json] capture.bin\n"
+                        "       %s -g capture.bin\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    cap = read_file(argv[opt], &size);
+
+    if (jsonName != NULL) {
+
+        json = fopen(jsonName, "w");
+
+        if (json == NULL) {
+            perror(jsonName);
+            return 1;
+        }
+
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", json);
+        json_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"exceptions\"}}");
+        json_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"data trace\"}}");
+        json_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":100,\"args\":{\"name\":\"port 0 text\"}}");
+    }
+
+    if (prefix != NULL) {
+        for (i = 0; i < PORT_COUNT; ++i) {
+
+            char name[512];
+
+            snprintf(name, sizeof(name), "%s_port%02u.bin", prefix, i);
+            portFile[i] = fopen(name, "wb");
+        }
+    }
+
+    decode(cap, size);
+
+    /*
+        close slices still open at end of capture
+    */
+    while (excDepth != 0U) {
+
+        char name[32];
+
+        --excDepth;
+        json_event("{\"name\":\"%s\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+                   exc_name(excStack[excDepth], name, sizeof(name)), ts_us());
+    }
+
+    if (json != NULL) {
+        fputs("\n]}\n", json);
+        fclose(json);
+    }
+
+    if (prefix != NULL) {
+        for (i = 0; i < PORT_COUNT; ++i) {
+
+            char name[512];
+
+            if (portFile[i] == NULL) {
+                continue;
+            }
+
+            fclose(portFile[i]);
+
+            /* keep only ports that carried data */
+            if (portBytes[i] == 0U) {
+                snprintf(name, sizeof(name), "%s_port%02u.bin", prefix, i);
+                remove(name);
+            }
+        }
+    }
+
+    printf("%zu bytes, %llu trace clocks\n", size, (unsigned long long)now);
+    printf("packets: sync %lu, overflow %lu, local ts %lu, global ts %lu, extension %lu, "
+           "instrumentation %lu, hardware %lu, unknown %lu\n",
+           nPkt[P_SYNC], nPkt[P_OVF], nPkt[P_LTS], nPkt[P_GTS], nPkt[P_EXT],
+           nPkt[P_SW], nPkt[P_HW], unknown);
+    printf("exception events %lu, PC samples %lu, data trace %lu\n", excEvents, pcSamples, dataHits);
+
+    for (i = 0; i < 6U; ++i) {
+        if (wraps[i] != 0U) {
+            printf("DWT %-5s wraps %llu\n", counterName[i], (unsigned long long)wraps[i]);
+        }
+    }
+
+    for (i = 0; i < PORT_COUNT; ++i) {
+        if (portBytes[i] != 0U) {
+            printf("port %2u: %lu bytes\n", i, portBytes[i]);
+        }
+    }
+
+    return 0;
+}
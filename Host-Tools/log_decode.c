@@ -0,0 +1,301 @@
+/*
+@descp:     Host (Linux) decoder for the deferred LOG() packets
+            sent by Printf-to-UART (USART3) and Printf-to-Debugger
+            (ITM stimulus port 1).
+
+            Format strings never leave the target, the packet
+            only carries their flash address. The strings are
+            read back from the loadable sections of the .axf
+            the firmware was built into.
+
+            packet (little endian 32-bit words):
+                word 0:   0xA << 28 | nargs << 24 | (ID & 0xFFFFFF)
+                word 1:   DWT->CYCCNT
+                word 2..: arguments
+
+@build:     gcc -O2 -Wall -o log_decode log_decode.c
+
+@usage:     log_decode [-b flash_base] [-f cpu_hz] firmware.axf capture.bin
+
+            capture.bin is the raw USART3 byte stream, or the
+            payload of ITM port 1 (e.g. as saved by the debugger).
+
+@warrenty:  void
+*/
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_SYNC            0xAU
+#define LOG_MAX_ARGS        8U
+
+/*
+    loadable section of the firmware image
+*/
+typedef struct {
+    uint32_t    addr;
+    uint32_t    size;
+    uint8_t   * data;
+} section_t;
+
+static section_t * sections;
+static unsigned    nsections;
+
+static uint8_t * read_file(const char * name, size_t * size) {
+
+    FILE    * f = fopen(name, "rb");
+    uint8_t * buf;
+    long      len;
+
+    if (f == NULL) {
+        perror(name);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = malloc((size_t)len + 1U);
+
+    if ((buf == NULL) || (fread(buf, 1, (size_t)len, f) != (size_t)len)) {
+        fprintf(stderr, "%s: read error\n", name);
+        exit(1);
+    }
+
+    fclose(f);
+    *size = (size_t)len;
+
+    return buf;
+}
+
+/*
+    collect all SHF_ALLOC PROGBITS sections of an ELF32 image
+*/
+static void load_elf(const char * name) {
+
+    size_t              size;
+    uint8_t           * img = read_file(name, &size);
+    const Elf32_Ehdr  * eh  = (const Elf32_Ehdr *)img;
+    const Elf32_Shdr  * sh;
+    unsigned            i;
+
+    if ((size < sizeof(*eh)) || (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0) ||
+        (eh->e_ident[EI_CLASS] != ELFCLASS32) ||
+        (eh->e_shoff + (size_t)eh->e_shnum * sizeof(*sh) > size)) {
+        fprintf(stderr, "%s: not an ELF32 image\n", name);
+        exit(1);
+    }
+
+    sh       = (const Elf32_Shdr *)(img + eh->e_shoff);
+    sections = calloc(eh->e_shnum, sizeof(*sections));
+
+    for (i = 0; i < eh->e_shnum; ++i) {
+
+        if ((sh[i].sh_type != SHT_PROGBITS) || !(sh[i].sh_flags & SHF_ALLOC) ||
+            (sh[i].sh_offset + (size_t)sh[i].sh_size > size)) {
+            continue;
+        }
+
+        sections[nsections].addr = sh[i].sh_addr;
+        sections[nsections].size = sh[i].sh_size;
+        sections[nsections].data = img + sh[i].sh_offset;
+        ++nsections;
+    }
+}
+
+/*
+    NUL terminated string at target address, NULL if unknown
+*/
+static const char * target_string(uint32_t addr) {
+
+    unsigned i;
+
+    for (i = 0; i < nsections; ++i) {
+
+        if ((addr >= sections[i].addr) && (addr - sections[i].addr < sections[i].size)) {
+
+            uint32_t off = addr - sections[i].addr;
+
+            if (memchr(sections[i].data + off, '\0', sections[i].size - off) == NULL) {
+                return NULL;
+            }
+
+            return (const char *)sections[i].data + off;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    printf-like formatting of 32-bit raw arguments.
+    Integer conversions only, %s resolves target strings.
+*/
+static void format(const char * fmt, const uint32_t * args, uint32_t nargs) {
+
+    char     spec[32];
+    uint32_t n = 0;
+
+    while (*fmt != '\0') {
+
+        size_t      len;
+        const char *s;
+
+        if (*fmt != '%') {
+            putchar(*fmt++);
+            continue;
+        }
+
+        if (fmt[1] == '%') {
+            putchar('%');
+            fmt += 2;
+            continue;
+        }
+
+        /*
+            copy one conversion spec, drop length modifiers
+        */
+        len = strspn(fmt + 1, "-+ #0123456789.");
+
+        if (len + 3U > sizeof(spec)) {
+            fputs(fmt, stdout);
+            return;
+        }
+
+        memcpy(spec, fmt, len + 1U);
+        fmt += len + 1U;
+
+        while ((*fmt == 'l') || (*fmt == 'h') || (*fmt == 'z') || (*fmt == 't')) {
+            ++fmt;
+        }
+
+        if (*fmt == '\0') {
+            break;
+        }
+
+        spec[len + 1U] = *fmt;
+        spec[len + 2U] = '\0';
+
+        if (n >= nargs) {
+            fputs("<?>", stdout);
+            ++fmt;
+            continue;
+        }
+
+        switch (*fmt) {
+
+            case 'd':
+            case 'i':
+                printf(spec, (int32_t)args[n]);
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'c':
+                printf(spec, args[n]);
+                break;
+
+            case 'p':
+                printf("0x%08x", args[n]);
+                break;
+
+            case 's':
+                s = target_string(args[n]);
+                printf(spec, (s != NULL) ? s : "<?>");
+                break;
+
+            default:
+                printf("<%%%c?>", *fmt);
+                break;
+        }
+
+        ++n;
+        ++fmt;
+    }
+}
+
+static uint32_t get_word(const uint8_t * p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int main(int argc, char ** argv) {
+
+    uint32_t  base  = 0x08000000U;
+    double    hz    = 0.0;
+    size_t    size;
+    size_t    pos   = 0;
+    uint8_t * cap;
+    unsigned long skipped = 0;
+    int       opt   = 1;
+
+    while ((opt + 1 < argc) && (argv[opt][0] == '-')) {
+
+        if (strcmp(argv[opt], "-b") == 0) {
+            base = (uint32_t)strtoul(argv[opt + 1], NULL, 0);
+        } else if (strcmp(argv[opt], "-f") == 0) {
+            hz = strtod(argv[opt + 1], NULL);
+        } else {
+            break;
+        }
+
+        opt += 2;
+    }
+
+    if (argc - opt != 2) {
+        fprintf(stderr, "usage: %s [-b flash_base] [-f cpu_hz] firmware.axf capture.bin\n", argv[0]);
+        return 1;
+    }
+
+    load_elf(argv[opt]);
+    cap = read_file(argv[opt + 1], &size);
+
+    while (pos + 8U <= size) {
+
+        uint32_t     hdr   = get_word(&cap[pos]);
+        uint32_t     nargs = (hdr >> 24) & 0xFU;
+        uint32_t     args[LOG_MAX_ARGS];
+        const char * fmt;
+        uint32_t     ts;
+        uint32_t     i;
+
+        fmt = ((hdr >> 28) == LOG_SYNC) ? target_string(base + (hdr & 0xFFFFFFU)) : NULL;
+
+        /*
+            not a packet start (line noise, dropped bytes):
+            resynchronise one byte further
+        */
+        if ((fmt == NULL) || (nargs > LOG_MAX_ARGS) || (pos + 8U + 4U * nargs > size)) {
+            ++pos;
+            ++skipped;
+            continue;
+        }
+
+        ts = get_word(&cap[pos + 4U]);
+
+        for (i = 0; i < nargs; ++i) {
+            args[i] = get_word(&cap[pos + 8U + 4U * i]);
+        }
+
+        pos += 8U + 4U * nargs;
+
+        if (hz > 0.0) {
+            printf("[%12.6f] ", ts / hz);
+        } else {
+            printf("[%10u] ", ts);
+        }
+
+        format(fmt, args, nargs);
+    }
+
+    if (skipped != 0U) {
+        fprintf(stderr, "%lu bytes skipped while resynchronising\n", skipped);
+    }
+
+    return 0;
+}
@@ -0,0 +1,326 @@
+/*
+@descp:     Host (Linux) flat profile from PC samples of the
+            Printf-to-Debugger PC sampling profiler.
+
+            Samples are read either from a raw SWO / ITM capture
+            (DWT PC sample packets, PROF_PC_SAMPLING 1) or with -r
+            from a memory dump of pcSample[] (32-bit little endian
+            words, PROF_PC_SAMPLING 2, zero words are unused).
+
+            Each PC is looked up in the function symbols (STT_FUNC)
+            of the .axf the firmware was built into, e.g.
+            Printf-to-Debugger/Objects/Printf-to-Debugger.axf.
+            Sleep samples (PC sample packet while the core is in
+            WFI/WFE) are counted separately.
+
+@build:     gcc -O2 -Wall -o pc_profile pc_profile.c
+
+@usage:     pc_profile [-r] [-n lines] firmware.axf samples.bin
+
+@warrenty:  void
+*/
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    function symbol with its sample count
+*/
+typedef struct {
+    uint32_t        addr;
+    uint32_t        size;
+    const char    * name;
+    unsigned long   hits;
+} func_t;
+
+static func_t      * funcs;
+static unsigned      nfuncs;
+
+static unsigned long total;
+static unsigned long sleeping;
+static unsigned long unknownPc;
+
+static uint8_t * read_file(const char * name, size_t * size) {
+
+    FILE    * f = fopen(name, "rb");
+    uint8_t * buf;
+    long      len;
+
+    if (f == NULL) {
+        perror(name);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = malloc((size_t)len + 1U);
+
+    if ((buf == NULL) || (fread(buf, 1, (size_t)len, f) != (size_t)len)) {
+        fprintf(stderr, "%s: read error\n", name);
+        exit(1);
+    }
+
+    fclose(f);
+    *size = (size_t)len;
+
+    return buf;
+}
+
+static int by_addr(const void * a, const void * b) {
+
+    const func_t * x = a;
+    const func_t * y = b;
+
+    if (x->addr != y->addr) {
+        return (x->addr > y->addr) - (x->addr < y->addr);
+    }
+
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+static int by_hits(const void * a, const void * b) {
+
+    const func_t * x = a;
+    const func_t * y = b;
+
+    return (x->hits < y->hits) - (x->hits > y->hits);
+}
+
+/*
+    collect STT_FUNC symbols of an ELF32 image,
+    Thumb bit cleared, sorted by address
+*/
+static void load_elf(const char * name) {
+
+    size_t              size;
+    uint8_t           * img = read_file(name, &size);
+    const Elf32_Ehdr  * eh  = (const Elf32_Ehdr *)img;
+    const Elf32_Shdr  * sh;
+    unsigned            i;
+    unsigned            n;
+
+    if ((size < sizeof(*eh)) || (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0) ||
+        (eh->e_ident[EI_CLASS] != ELFCLASS32) ||
+        (eh->e_shoff + (size_t)eh->e_shnum * sizeof(*sh) > size)) {
+        fprintf(stderr, "%s: not an ELF32 image\n", name);
+        exit(1);
+    }
+
+    sh = (const Elf32_Shdr *)(img + eh->e_shoff);
+
+    for (i = 0; i < eh->e_shnum; ++i) {
+
+        const Elf32_Sym * sym;
+        const char      * str;
+        unsigned          k;
+
+        if ((sh[i].sh_type != SHT_SYMTAB) || (sh[i].sh_link >= eh->e_shnum) ||
+            (sh[i].sh_offset + (size_t)sh[i].sh_size > size)) {
+            continue;
+        }
+
+        sym = (const Elf32_Sym *)(img + sh[i].sh_offset);
+        str = (const char *)img + sh[sh[i].sh_link].sh_offset;
+        n   = sh[i].sh_size / sizeof(*sym);
+
+        funcs = realloc(funcs, (nfuncs + n) * sizeof(*funcs));
+
+        for (k = 0; k < n; ++k) {
+
+            if ((ELF32_ST_TYPE(sym[k].st_info) != STT_FUNC) || (sym[k].st_shndx == SHN_UNDEF)) {
+                continue;
+            }
+
+            funcs[nfuncs].addr = sym[k].st_value & ~1U;
+            funcs[nfuncs].size = sym[k].st_size;
+            funcs[nfuncs].name = str + sym[k].st_name;
+            funcs[nfuncs].hits = 0;
+            ++nfuncs;
+        }
+    }
+
+    if (nfuncs == 0U) {
+        fprintf(stderr, "%s: no function symbols\n", name);
+        exit(1);
+    }
+
+    qsort(funcs, nfuncs, sizeof(*funcs), by_addr);
+
+    /*
+        aliases: keep the largest symbol of an address
+    */
+    for (i = 1, n = 1; i < nfuncs; ++i) {
+        if (funcs[i].addr != funcs[n - 1U].addr) {
+            funcs[n++] = funcs[i];
+        }
+    }
+
+    nfuncs = n;
+}
+
+/*
+    function containing pc. Symbols without size
+    extend up to the next symbol.
+*/
+static void add_sample(uint32_t pc) {
+
+    unsigned lo = 0;
+    unsigned hi = nfuncs;
+
+    ++total;
+
+    while (hi - lo > 1U) {
+
+        unsigned mid = (lo + hi) / 2U;
+
+        if (funcs[mid].addr <= pc) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if ((funcs[lo].addr > pc) ||
+        ((funcs[lo].size != 0U) && (pc - funcs[lo].addr >= funcs[lo].size)) ||
+        ((funcs[lo].size == 0U) && (lo + 1U == nfuncs))) {
+        ++unknownPc;
+        return;
+    }
+
+    ++funcs[lo].hits;
+}
+
+/*
+    PC sample packets (hardware source, ID 2) of an
+    ITM capture, all other packets are skipped
+*/
+static void parse_itm(const uint8_t * cap, size_t size) {
+
+    size_t   pos   = 0;
+    unsigned zeros = 0;
+
+    while (pos < size) {
+
+        uint8_t  h = cap[pos++];
+        uint32_t v = 0;
+        uint32_t n;
+        uint32_t i;
+
+        if (h == 0x00U) {
+            ++zeros;
+            continue;
+        }
+
+        if ((h == 0x80U) && (zeros >= 5U)) {
+            zeros = 0;
+            continue;
+        }
+
+        zeros = 0;
+
+        if (h == 0x70U) {
+            continue;
+        }
+
+        /*
+            timestamps and extensions:
+            skip continuation bytes
+        */
+        if (((h & 0x0FU) == 0x00U) || (h == 0x94U) || (h == 0xB4U) || ((h & 0x0BU) == 0x08U)) {
+            if (h & 0x80U) {
+                while ((pos < size) && (cap[pos++] & 0x80U));
+            }
+            continue;
+        }
+
+        if ((h & 0x03U) == 0U) {
+            continue;
+        }
+
+        n = ((h & 3U) == 3U) ? 4U : (h & 3U);
+
+        if (pos + n > size) {
+            break;
+        }
+
+        for (i = 0; i < n; ++i) {
+            v |= (uint32_t)cap[pos++] << (8U * i);
+        }
+
+        if ((h & 0x04U) && ((h >> 3) == 2U)) {
+            if (n == 4U) {
+                add_sample(v);
+            } else {
+                ++total;
+                ++sleeping;
+            }
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+
+    int       raw   = 0;
+    unsigned  lines = 30U;
+    size_t    size;
+    size_t    pos;
+    uint8_t * cap;
+    unsigned  i;
+    int       opt   = 1;
+
+    while ((opt < argc) && (argv[opt][0] == '-')) {
+
+        if (strcmp(argv[opt], "-r") == 0) {
+            raw = 1;
+            opt += 1;
+        } else if ((strcmp(argv[opt], "-n") == 0) && (opt + 1 < argc)) {
+            lines = (unsigned)strtoul(argv[opt + 1], NULL, 0);
+            opt += 2;
+        } else {
+            break;
+        }
+    }
+
+    if (argc - opt != 2) {
+        fprintf(stderr, "usage: %s [-r] [-n lines] firmware.axf samples.bin\n", argv[0]);
+        return 1;
+    }
+
+    load_elf(argv[opt]);
+    cap = read_file(argv[opt + 1], &size);
+
+    if (raw) {
+        for (pos = 0; pos + 4U <= size; pos += 4U) {
+
+            uint32_t pc = (uint32_t)cap[pos] | ((uint32_t)cap[pos + 1U] << 8) |
+                          ((uint32_t)cap[pos + 2U] << 16) | ((uint32_t)cap[pos + 3U] << 24);
+
+            if (pc != 0U) {
+                add_sample(pc);
+            }
+        }
+    } else {
+        parse_itm(cap, size);
+    }
+
+    if (total == 0U) {
+        fprintf(stderr, "no PC samples\n");
+        return 1;
+    }
+
+    qsort(funcs, nfuncs, sizeof(*funcs), by_hits);
+
+    printf("%lu samples, %lu sleeping, %lu outside known functions\n\n", total, sleeping, unknownPc);
+    printf("%10s %7s  %s\n", "samples", "%", "function");
+
+    for (i = 0; (i < nfuncs) && (i < lines) && (funcs[i].hits != 0U); ++i) {
+        printf("%10lu %6.2f%%  %s\n", funcs[i].hits, 100.0 * funcs[i].hits / total, funcs[i].name);
+    }
+
+    return 0;
+}
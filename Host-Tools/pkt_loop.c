@@ -0,0 +1,522 @@
+/*
+@descp:     Host (Linux) loopback test of the UART-Interrupt
+            packet layer (PKT_MODE): COBS framing, length limit
+            and CRC-32.
+
+            Packets with random payloads (0..PKT_MAX_PAYLOAD
+            bytes, zero runs and trailing zeros included) are
+            sent one at a time, the echo must come back with
+            the same payload. Every -e'th packet is sent with a
+            bad CRC instead and must NOT come back, alternately
+            - one CRC bit flipped
+            - the CRC of the payload zero padded to whole words,
+              which a length blind CRC would accept
+
+            The far end is either the board on a serial port or,
+            with -l, a pseudo-terminal pair: a child process on
+            the master side decodes, checks and echoes frames
+            the way pkt_poll() / pkt_received() do, the test
+            talks to the slave side like to a serial port.
+
+            -l only checks this file against itself. -f runs a
+            command on the master side instead, with the pty as
+            its stdin / stdout: the UART-Interrupt firmware
+            itself (PKT_MODE 1) under the uart_bench register
+            model, so its COBS encoder and CRC unit use are
+            checked by the decoder here:
+                g++ ... -DBENCH_INTERRUPT -DBENCH_PKT=1 \
+                    -o uart_bench_PKT uart_bench.cpp
+                pkt_loop -f "./uart_bench_PKT -P"
+
+            Frame (see PKT_MODE in UART-Interrupt/Source/main.c):
+                COBS(payload | CRC-32 little endian) 0x00
+            CRC-32: poly 0x04C11DB7, init 0xFFFFFFFF, no reflection,
+            no final xor, payload as little endian 32-bit words,
+            the last 1..3 bytes one by one, MSB first.
+
+@build:     gcc -O2 -Wall -o pkt_loop pkt_loop.c
+
+@usage:     pkt_loop [-n packets] [-e n] [-b baud] [-t ms] [-s seed]
+                     (-l | -f command | tty)
+
+            -n  packets to send (1000)
+            -e  every n'th packet with a bad CRC, 0 = none (10)
+            -b  baud rate of tty (9600)
+            -t  reply timeout in ms (500, 50 with -l)
+            -s  random seed (1)
+            -l  loopback over a pseudo-terminal pair, no board
+            -f  command at the far end of a pseudo-terminal pair
+
+            Exit status 0 if every good packet came back intact
+            and no bad one did.
+
+@warrenty:  void
+*/
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define PKT_MAX_PAYLOAD     250U
+#define PKT_CRC_SIZE        4U
+#define PKT_FRAME_SIZE      (1U + PKT_MAX_PAYLOAD + PKT_CRC_SIZE + 1U)
+
+/*
+    frame decoder state, as in pkt_t
+*/
+typedef struct {
+    uint8_t     rx[PKT_MAX_PAYLOAD + PKT_CRC_SIZE];
+    uint32_t    rxLen;
+    uint32_t    rxCode;
+    uint32_t    rxLeft;
+    uint32_t    rxBad;
+} decoder_t;
+
+static uint32_t crc_bits(uint32_t crc, uint32_t w, int bits) {
+
+    int b;
+
+    crc ^= w;
+
+    for (b = 0; b < bits; ++b) {
+        crc = (crc & 0x80000000U) ? ((crc << 1) ^ 0x04C11DB7U) : (crc << 1);
+    }
+
+    return crc;
+}
+
+/*
+    same result as crc32_hw() on the target
+*/
+static uint32_t crc32(const uint8_t * buf, uint32_t len) {
+
+    uint32_t crc = 0xFFFFFFFFU;
+
+    while (len >= 4U) {
+        crc  = crc_bits(crc, (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+                             ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24), 32);
+        buf += 4;
+        len -= 4U;
+    }
+
+    while (len != 0U) {
+        crc = crc_bits(crc, (uint32_t)*buf++ << 24, 8);
+        --len;
+    }
+
+    return crc;
+}
+
+/*
+    CRC over the payload padded with zeros to whole words
+*/
+static uint32_t crc32_padded(const uint8_t * buf, uint32_t len) {
+
+    uint8_t w[PKT_MAX_PAYLOAD + 3U];
+
+    memset(w, 0, sizeof(w));
+    memcpy(w, buf, len);
+
+    return crc32(w, (len + 3U) & ~3U);
+}
+
+/*
+    payload and CRC to a COBS frame with delimiter,
+    returns the frame length
+*/
+static uint32_t frame_encode(uint8_t * f, const uint8_t * payload, uint32_t len, uint32_t crc) {
+
+    uint32_t code = 0;
+    uint32_t i;
+
+    memcpy(&f[1], payload, len);
+
+    f[len + 1U] = (uint8_t)(crc);
+    f[len + 2U] = (uint8_t)(crc >> 8);
+    f[len + 3U] = (uint8_t)(crc >> 16);
+    f[len + 4U] = (uint8_t)(crc >> 24);
+
+    len += PKT_CRC_SIZE;
+
+    for (i = 1; i <= len; ++i) {
+        if (f[i] == 0U) {
+            f[code] = (uint8_t)(i - code);
+            code = i;
+        }
+    }
+
+    f[code]     = (uint8_t)(i - code);
+    f[len + 1U] = 0U;
+
+    return len + 2U;
+}
+
+/*
+    one received byte, returns the payload length once a
+    frame with a good CRC is complete, -2 for a complete
+    frame that is broken or fails the CRC, -1 otherwise
+*/
+static int frame_decode(decoder_t * d, uint8_t b) {
+
+    uint32_t len;
+    uint32_t crc;
+    int      ok = -1;
+
+    if (b == 0U) {
+
+        len = d->rxLen - PKT_CRC_SIZE;
+
+        if ((d->rxCode != 0U) && !d->rxBad && (d->rxLeft == 0U) && (d->rxLen >= PKT_CRC_SIZE)) {
+
+            crc = (uint32_t)d->rx[len] | ((uint32_t)d->rx[len + 1U] << 8) |
+                  ((uint32_t)d->rx[len + 2U] << 16) | ((uint32_t)d->rx[len + 3U] << 24);
+
+            ok = (crc32(d->rx, len) == crc) ? (int)len : -2;
+
+        } else if (d->rxCode != 0U) {
+            ok = -2;
+        }
+
+        d->rxLen  = 0;
+        d->rxCode = 0;
+        d->rxLeft = 0;
+        d->rxBad  = 0;
+
+    } else if (d->rxBad) {
+        /* skip rest of a broken frame */
+    } else if (d->rxLeft == 0U) {
+
+        if ((d->rxCode != 0U) && (d->rxCode != 0xFFU)) {
+            if (d->rxLen == sizeof(d->rx)) {
+                d->rxBad = 1;
+            } else {
+                d->rx[d->rxLen++] = 0U;
+            }
+        }
+
+        d->rxCode = b;
+        d->rxLeft = b - 1U;
+
+    } else {
+
+        if (d->rxLen == sizeof(d->rx)) {
+            d->rxBad = 1;
+        } else {
+            d->rx[d->rxLen++] = b;
+        }
+
+        --d->rxLeft;
+    }
+
+    return ok;
+}
+
+static void write_all(int fd, const uint8_t * buf, uint32_t len) {
+
+    ssize_t n;
+
+    while (len != 0U) {
+
+        n = write(fd, buf, len);
+
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+
+        buf += n;
+        len -= (uint32_t)n;
+    }
+}
+
+/*
+    -l: the board, echoes every good frame
+*/
+static void echo_loop(int fd) {
+
+    static decoder_t d;
+    uint8_t          f[PKT_FRAME_SIZE];
+    uint8_t          b;
+    int              len;
+
+    while (read(fd, &b, 1) == 1) {
+
+        len = frame_decode(&d, b);
+
+        if (len >= 0) {
+            write_all(fd, f, frame_encode(f, d.rx, (uint32_t)len, crc32(d.rx, (uint32_t)len)));
+        }
+    }
+
+    _exit(0);
+}
+
+static void raw_mode(int fd, speed_t speed) {
+
+    struct termios t;
+
+    if (tcgetattr(fd, &t) != 0) {
+        perror("tcgetattr");
+        exit(1);
+    }
+
+    cfmakeraw(&t);
+    cfsetispeed(&t, speed);
+    cfsetospeed(&t, speed);
+
+    if (tcsetattr(fd, TCSANOW, &t) != 0) {
+        perror("tcsetattr");
+        exit(1);
+    }
+}
+
+static speed_t baud_speed(unsigned baud) {
+
+    switch (baud) {
+        case 9600:   return B9600;
+        case 19200:  return B19200;
+        case 38400:  return B38400;
+        case 57600:  return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default:
+            fprintf(stderr, "unsupported baud rate %u\n", baud);
+            exit(1);
+    }
+}
+
+/*
+    wait for the next frame, returns its payload length,
+    -2 for a bad frame or -1 on timeout
+*/
+static int receive(int fd, decoder_t * d, int ms) {
+
+    struct pollfd p;
+    uint8_t       b;
+    int           len;
+
+    p.fd     = fd;
+    p.events = POLLIN;
+
+    for (;;) {
+
+        if (poll(&p, 1, ms) <= 0) {
+            return -1;
+        }
+
+        if (read(fd, &b, 1) != 1) {
+            return -1;
+        }
+
+        if ((len = frame_decode(d, b)) != -1) {
+            return len;
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+
+    static decoder_t d;
+    uint8_t          payload[PKT_MAX_PAYLOAD];
+    uint8_t          f[PKT_FRAME_SIZE];
+    unsigned         packets = 1000U;
+    unsigned         every   = 10U;
+    unsigned         baud    = 9600U;
+    unsigned         seed    = 1U;
+    int              ms      = -1;
+    int              loop    = 0;
+    const char     * cmd     = NULL;
+    unsigned         ok      = 0;
+    unsigned         lost    = 0;
+    unsigned         wrong   = 0;
+    unsigned         bad     = 0;
+    unsigned         passed  = 0;
+    unsigned         k;
+    uint32_t         len;
+    uint32_t         crc;
+    uint32_t         i;
+    pid_t            pid     = -1;
+    int              fd;
+    int              opt;
+    int              n;
+
+    while ((opt = getopt(argc, argv, "n:e:b:t:s:lf:")) != -1) {
+
+        switch (opt) {
+            case 'n': packets = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 'e': every   = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 'b': baud    = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 't': ms      = atoi(optarg);                       break;
+            case 's': seed    = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 'l': loop    = 1;                                  break;
+            case 'f': loop    = 1; cmd = optarg;                    break;
+            default:
+                fprintf(stderr, "usage: %s [-n packets] [-e n] [-b baud] [-t ms] [-s seed] "
+                                "(-l | -f command | tty)\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (ms < 0) {
+        ms = (loop && (cmd == NULL)) ? 50 : 500;
+    }
+
+    if (loop) {
+
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+        if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0)) {
+            perror("posix_openpt");
+            return 1;
+        }
+
+        fd = open(ptsname(master), O_RDWR | O_NOCTTY);
+
+        if (fd < 0) {
+            perror(ptsname(master));
+            return 1;
+        }
+
+        raw_mode(master, B9600);
+        raw_mode(fd, B9600);
+
+        pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+
+            close(fd);
+
+            if (cmd == NULL) {
+                echo_loop(master);
+            }
+
+            dup2(master, 0);
+            dup2(master, 1);
+            close(master);
+            execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+            perror("/bin/sh");
+            _exit(1);
+        }
+
+        close(master);
+
+    } else {
+
+        if (optind >= argc) {
+            fprintf(stderr, "no tty, use -l for a pseudo-terminal loopback\n");
+            return 1;
+        }
+
+        fd = open(argv[optind], O_RDWR | O_NOCTTY);
+
+        if (fd < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+
+        raw_mode(fd, baud_speed(baud));
+        tcflush(fd, TCIOFLUSH);
+    }
+
+    srand(seed);
+
+    for (k = 1; k <= packets; ++k) {
+
+        /*
+            random length, bytes biased to zero so that
+            zero runs, trailing zeros and 0xFF blocks occur
+        */
+        len = (uint32_t)rand() % (PKT_MAX_PAYLOAD + 1U);
+
+        for (i = 0; i < len; ++i) {
+            payload[i] = (rand() & 3) ? 0U : (uint8_t)rand();
+        }
+
+        if ((k & 7U) == 0U) {
+            memset(payload, 0xA5, len);
+        }
+
+        crc = crc32(payload, len);
+
+        if ((every != 0U) && ((k % every) == 0U)) {
+
+            /*
+                bad CRC: must be dropped. The zero padded CRC
+                is only wrong when the length is not a whole
+                number of words.
+            */
+            if (((k / every) & 1U) && ((len & 3U) != 0U)) {
+                crc = crc32_padded(payload, len);
+            } else {
+                crc ^= 1U << (rand() & 31);
+            }
+
+            write_all(fd, f, frame_encode(f, payload, len, crc));
+
+            if (receive(fd, &d, ms) != -1) {
+                ++bad;
+            } else {
+                ++passed;
+            }
+
+            continue;
+        }
+
+        write_all(fd, f, frame_encode(f, payload, len, crc));
+
+        n = receive(fd, &d, ms);
+
+        if (n < 0) {
+            ++lost;
+        } else if (((uint32_t)n != len) || (memcmp(d.rx, payload, len) != 0)) {
+            ++wrong;
+        } else {
+            ++ok;
+        }
+    }
+
+    printf("%s: %u packets\n", (cmd != NULL) ? cmd : (loop ? "pty loopback" : argv[optind]), packets);
+    printf("  good CRC    echoed %u, lost %u, wrong payload %u\n", ok, lost, wrong);
+    printf("  bad CRC     dropped %u, echoed %u\n", passed, bad);
+
+    if (pid > 0) {
+
+        close(fd);
+
+        /*
+            -f: the command sees end of input, give it
+            a second to report and exit
+        */
+        for (k = 0; (cmd != NULL) && (k < 100U); ++k) {
+            if (waitpid(pid, NULL, WNOHANG) == pid) {
+                pid = -1;
+                break;
+            }
+            usleep(10000);
+        }
+
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+        }
+    }
+
+    return ((lost == 0U) && (wrong == 0U) && (bad == 0U)) ? 0 : 1;
+}
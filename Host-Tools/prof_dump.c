@@ -0,0 +1,415 @@
+/*
+@descp:     Host (Linux) report of the DWT cycle counter probes
+            (prof[]) of GPIO-Interrupt, Timers-Blinky,
+            UART-Interrupt and SPI-Interrupt.
+
+            Input is a memory dump of prof[], either Intel HEX
+            as written by the uVision SAVE command
+                SAVE prof.hex &prof[0], &prof[PROF_COUNT]
+            or raw bytes (gdb: dump binary memory). Each probe
+            is a little endian prof_t
+                uint64_t sum, uint32_t count, min, max,
+                uint32_t hist[PROF_BINS]
+            padded to 8 bytes.
+
+            -i: input is a raw SWO / ITM capture holding the
+            stream of prof_itm_dump() (Common/prof.h) on
+            stimulus port 4, or -p port. The capture of that
+            port alone (itm_trace -o prefix_portNN.bin) is
+            recognised without -i. The stream header gives
+            the number of bins, the last complete dump of the
+            capture is printed.
+
+            Probe names are given in the order of the PROF_xxx
+            enum of the example, unnamed probes print as their
+            index. Probes that never ran are skipped.
+
+            -r cycles: reference worst case, e.g. the USART3
+            probe of a UART_ISR_REF 1 build of UART-Interrupt.
+            Each probe max is printed against it and the probes
+            going over are flagged.
+
+@build:     gcc -O2 -Wall -o prof_dump prof_dump.c
+
+@usage:     prof_dump [-b bins] [-r cycles] prof.hex [name ...]
+            prof_dump [-r cycles] -i [-p port] swo.bin [name ...]
+
+@warrenty:  void
+*/
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROF_ITM_MAGIC      0x464F5250U     /* "PROF", Common/prof.h */
+
+static uint8_t * read_file(const char * name, size_t * size) {
+
+    FILE    * f = fopen(name, "rb");
+    uint8_t * buf;
+    long      len;
+
+    if (f == NULL) {
+        perror(name);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = malloc((size_t)len + 1U);
+
+    if ((buf == NULL) || (fread(buf, 1, (size_t)len, f) != (size_t)len)) {
+        fprintf(stderr, "%s: read error\n", name);
+        exit(1);
+    }
+
+    fclose(f);
+    buf[len] = '\0';
+    *size    = (size_t)len;
+
+    return buf;
+}
+
+static int hex_byte(const char * s) {
+
+    char t[3] = { s[0], s[1], '\0' };
+
+    if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1])) {
+        return -1;
+    }
+
+    return (int)strtoul(t, NULL, 16);
+}
+
+/*
+    Intel HEX to flat bytes. Data records are placed by
+    their address relative to the first one, extended
+    linear / segment address records are followed.
+    return: number of bytes, 0 on a bad record
+*/
+static size_t hex_decode(const char * text, uint8_t ** out) {
+
+    uint8_t     * buf   = NULL;
+    size_t        size  = 0;
+    uint32_t      upper = 0;
+    uint32_t      base  = 0;
+    int           first = 1;
+    const char  * s     = text;
+
+    while ((s = strchr(s, ':')) != NULL) {
+
+        uint8_t  rec[256 + 5];
+        int      n;
+        int      i;
+        int      b;
+        uint8_t  sum = 0;
+        uint32_t addr;
+
+        ++s;
+        n = hex_byte(s);
+
+        if (n < 0) {
+            return 0;
+        }
+
+        for (i = 0; i < n + 5; ++i) {
+
+            b = hex_byte(&s[2 * i]);
+
+            if (b < 0) {
+                return 0;
+            }
+
+            rec[i] = (uint8_t)b;
+            sum   += (uint8_t)b;
+        }
+
+        if (sum != 0U) {
+            fprintf(stderr, "hex: bad checksum\n");
+            return 0;
+        }
+
+        s += 2 * (n + 5);
+        addr = upper + (((uint32_t)rec[1] << 8) | rec[2]);
+
+        switch (rec[3]) {
+
+        case 0x00:
+            if (first) {
+                base  = addr;
+                first = 0;
+            }
+
+            if (addr < base) {
+                fprintf(stderr, "hex: record below the first one\n");
+                return 0;
+            }
+
+            if ((addr - base + (uint32_t)n) > size) {
+                buf = realloc(buf, addr - base + (uint32_t)n);
+
+                if (buf == NULL) {
+                    return 0;
+                }
+
+                memset(&buf[size], 0, addr - base + (uint32_t)n - size);
+                size = addr - base + (uint32_t)n;
+            }
+
+            memcpy(&buf[addr - base], &rec[4], (size_t)n);
+            break;
+
+        case 0x01:
+            *out = buf;
+            return size;
+
+        case 0x02:
+            upper = (((uint32_t)rec[4] << 8) | rec[5]) << 4;
+            break;
+
+        case 0x04:
+            upper = (((uint32_t)rec[4] << 8) | rec[5]) << 16;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    *out = buf;
+    return size;
+}
+
+static uint32_t get32(const uint8_t * p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+    Payload bytes of one stimulus port out of a raw SWO /
+    ITM capture, other packets are skipped (the packet
+    layout is decoded in full by itm_trace.c).
+    return: number of bytes written to out (size at most)
+*/
+static size_t itm_port_bytes(const uint8_t * cap, size_t size, unsigned port, uint8_t * out) {
+
+    size_t   pos = 0;
+    size_t   len = 0;
+    uint32_t n;
+
+    while (pos < size) {
+
+        uint8_t h = cap[pos++];
+
+        /*
+            synchronisation zeros, overflow, 0x80 ending a
+            synchronisation
+        */
+        if ((h == 0x00U) || (h == 0x70U) || (h == 0x80U)) {
+            continue;
+        }
+
+        /*
+            local timestamp format 1, GTS1 / GTS2, extension:
+            continuation bytes while bit 7 is set. Format 2
+            local timestamps are the header alone.
+        */
+        if (((h & 0x0FU) == 0x00U) || (h == 0x94U) || (h == 0xB4U) || ((h & 0x0BU) == 0x08U)) {
+            if (h & 0x80U) {
+                while ((pos < size) && (cap[pos++] & 0x80U));
+            }
+            continue;
+        }
+
+        if ((h & 0x03U) == 0U) {
+            continue;
+        }
+
+        n = ((h & 3U) == 3U) ? 4U : (h & 3U);
+
+        if (pos + n > size) {
+            break;
+        }
+
+        if (!(h & 0x04U) && ((unsigned)(h >> 3) == port)) {
+            memcpy(&out[len], &cap[pos], n);
+            len += n;
+        }
+
+        pos += n;
+    }
+
+    return len;
+}
+
+/*
+    Last complete prof_itm_dump() of a port stream: two
+    word header then count probes. The stream is 32-bit
+    words, so the header is word aligned.
+    return: 0 if there is none, data / size / bins set
+*/
+static int itm_find_dump(const uint8_t * s, size_t len, const uint8_t ** data,
+                         size_t * size, unsigned * bins) {
+
+    size_t off = len & ~(size_t)3U;
+
+    while (off >= 4U) {
+
+        off -= 4U;
+
+        if ((off + 8U <= len) && (get32(&s[off]) == PROF_ITM_MAGIC)) {
+
+            uint32_t hdr   = get32(&s[off + 4]);
+            unsigned b     = hdr >> 16;
+            size_t   count = hdr & 0xFFFFU;
+            size_t   rec   = (20U + (4U * b) + 7U) & ~(size_t)7U;
+
+            if ((b != 0U) && (b <= 32U) && (off + 8U + (count * rec) <= len)) {
+                *data = &s[off + 8];
+                *size = count * rec;
+                *bins = b;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: prof_dump [-b bins] [-r cycles] prof.hex [name ...]\n"
+                    "       prof_dump [-r cycles] -i [-p port] swo.bin [name ...]\n");
+    exit(2);
+}
+
+int main(int argc, char * argv[]) {
+
+    unsigned    bins = 16;
+    unsigned    ref  = 0;
+    unsigned    over = 0;
+    unsigned    port = 4;
+    int         itm  = 0;
+    uint8_t   * file;
+    const uint8_t * data;
+    uint8_t   * hex    = NULL;
+    uint8_t   * stream = NULL;
+    size_t      size;
+    size_t      rec;
+    size_t      i;
+    unsigned    b;
+    int         opt;
+
+    while ((opt = getopt(argc, argv, "b:r:ip:")) != -1) {
+        switch (opt) {
+        case 'b': bins = (unsigned)strtoul(optarg, NULL, 0); break;
+        case 'r': ref  = (unsigned)strtoul(optarg, NULL, 0); break;
+        case 'i': itm  = 1;                                  break;
+        case 'p': port = (unsigned)strtoul(optarg, NULL, 0); break;
+        default:  usage();
+        }
+    }
+
+    if ((optind >= argc) || (bins == 0U) || (bins > 32U) || (port > 31U)) {
+        usage();
+    }
+
+    file = read_file(argv[optind], &size);
+    data = file;
+
+    if (itm || ((size >= 4U) && (get32(file) == PROF_ITM_MAGIC))) {
+
+        const uint8_t * s   = file;
+        size_t          len = size;
+
+        if (itm) {
+            stream = malloc(size + 1U);
+
+            if (stream == NULL) {
+                return 1;
+            }
+
+            len = itm_port_bytes(file, size, port, stream);
+            s   = stream;
+        }
+
+        if (!itm_find_dump(s, len, &data, &size, &bins)) {
+            fprintf(stderr, "%s: no complete prof_itm_dump() on port %u\n", argv[optind], port);
+            return 1;
+        }
+
+    } else if (file[0] == ':') {
+
+        size = hex_decode((const char *)file, &hex);
+        data = hex;
+
+        if (size == 0U) {
+            fprintf(stderr, "%s: not a valid Intel HEX file\n", argv[optind]);
+            return 1;
+        }
+    }
+
+    /*
+        sum (8) + count, min, max (12) + hist, 8-byte aligned
+    */
+    rec = (20U + (4U * bins) + 7U) & ~(size_t)7U;
+
+    if ((size % rec) != 0U) {
+        fprintf(stderr, "warning: %zu bytes is not a multiple of %zu (%u bins), last %zu ignored\n",
+                size, rec, bins, size % rec);
+    }
+
+    for (i = 0; i < size / rec; ++i) {
+
+        const uint8_t * p     = &data[i * rec];
+        uint64_t        sum   = (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32);
+        uint32_t        count = get32(p + 8);
+        uint32_t        min   = get32(p + 12);
+        uint32_t        max   = get32(p + 16);
+        const char    * name  = ((size_t)(optind + 1) + i < (size_t)argc) ? argv[optind + 1 + i] : NULL;
+        char            idx[32];
+
+        if (count == 0U) {
+            continue;
+        }
+
+        if (name == NULL) {
+            snprintf(idx, sizeof(idx), "probe %zu", i);
+            name = idx;
+        }
+
+        printf("%-24s n %u  min %u  max %u  mean %u cycles",
+               name, count, min, max, (unsigned)(sum / count));
+
+        if (ref != 0U) {
+            printf("  (ref %u%s)", ref, (max > ref) ? ", OVER" : "");
+            over += (max > ref);
+        }
+
+        printf("\n  log2");
+
+        for (b = 0; b < bins; ++b) {
+
+            uint32_t h = get32(p + 20 + (4 * b));
+
+            if (h != 0U) {
+                printf(" %u:%u", b, h);
+            }
+        }
+
+        printf("\n");
+    }
+
+    if (ref != 0U) {
+        printf("%u probe(s) over the reference of %u cycles\n", over, ref);
+    }
+
+    free(hex);
+    free(stream);
+    free(file);
+
+    return (over != 0U) ? 1 : 0;
+}
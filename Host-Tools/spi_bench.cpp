@@ -0,0 +1,1752 @@
+/*
+@descp:     Host (Linux) benchmark of the SPI-Interrupt W25Qxx
+            flash log (SPI_FLASH): write throughput, write
+            amplification and read throughput without hardware.
+            With -S, the SPI-1 -> SPI-2 engine sweep
+            (spi_sweep()) instead, for regression tracking.
+            With -A, I2S playback on SPI-3 (SPI_I2S) against
+            its deadline.
+
+            The example's main.c is compiled unmodified against
+            spi_model/stm32f4xx.h, a register model of SPI,
+            DMA streams, GPIO, NVIC and PendSV:
+
+            - SPI: master frames timed from BR and DFF (SPI-1 on
+              84Mhz APB2, SPI-2/3 on 42Mhz APB1), TXE, RXNE, BSY,
+              OVR, TXE/RXNE/ERR interrupts and DMA requests.
+              SPI-2 as slave on the SPI-1 bus while its NSS
+              (spiDevLoop CS) is low, empty Tx buffer counted
+              as underrun.
+              SPI-3 as I2S master transmitter: word time from
+              PLLI2S (PLLI2SCFGR, PLLM), I2SDIV, ODD and MCKOE,
+              the clock runs on while I2SE is set, an empty Tx
+              buffer sends 0 (starved word).
+            - RCC: PLL and PLLI2S ready as soon as on.
+            - DMA: peripheral <-> memory, byte and halfword,
+              transfer complete / half transfer flags and
+              interrupts.
+            - NVIC: level triggered, no nesting, priorities from
+              NVIC_SetPriority(), then lowest number first,
+              PRIMASK honoured. PendSV through SCB->ICSR.
+              WFI lets time run on to the next interrupt.
+
+            A W25Q NOR flash sits on SPI-1, selected by the CS
+            pin of spiDevFlash (ODR / BSRR writes). It decodes
+            WREN, RDSR1, JEDEC ID, READ, FAST READ, PAGE PROGRAM
+            and SECTOR ERASE. Program and erase take the
+            W25Q16JV data sheet times, typical or (-x) maximum:
+
+                page program    30us first byte, 0.4ms (3ms) full page
+                sector erase    45ms (400ms)
+
+            A command while WIP is set, program / erase without
+            WEL and programming a 0 bit back to 1 are counted as
+            driver errors.
+
+            Simulated time only moves with the firmware: a fixed
+            cost per register access and per function call
+            (-finstrument-functions). Both are rough figures for
+            a Cortex-M4 at 168Mhz and can be changed on the
+            command line.
+
+            The bench calls the firmware's init functions, then
+            logs -b bytes of records with flash_write() as fast
+            as the pipeline takes them (or at -p bytes/s),
+            flash_flush() every -F records, and reads the log
+            back with flash_read().
+
+            Reported:
+            - write throughput, records that found the pipeline full
+            - program commands per page, bytes programmed and
+              erased per byte logged (write amplification)
+            - read throughput and contents check
+            - ISR: calls, maximum and mean duration, CPU load
+
+            -S prints the firmware's sweep table (bytes/s, CPU
+            cycles per byte, worst SPI-1 interrupt per prescaler,
+            frame size and engine) plus bus errors and ISR
+            totals, exit status 1 if a run had errors.
+
+            -A n plays n halves through i2s_start(). The half
+            callback only flags the half, the bench spends -d us
+            (plus up to -j us, pseudo random) on it, then fills
+            it with L = frame number, R = L ^ 0x5555 and calls
+            i2s_ready(). Reported: measured Fs, the firmware's
+            i2s statistics (underruns, fill max against the
+            deadline), and from the model halves the DMA started
+            before they were filled, the smallest slack, jumps
+            in the L sequence and torn frames (bad R). Exit
+            status 1 on a missed half or bad output. The CS43L22
+            is not modelled (I2S_CODEC 0).
+
+            Modelling limits: no SPI CRC, slave frames end with
+            the master's, memcpy() inside the firmware costs
+            nothing.
+
+@build:     g++ -O2 -Wall                                               \
+                -finstrument-functions                                  \
+                -finstrument-functions-exclude-file-list=spi_bench,spi_model,/usr/ \
+                -IHost-Tools/spi_model                                  \
+                -o spi_bench Host-Tools/spi_bench.cpp
+
+            -DFLASH_PIPE=n builds the firmware with an n page
+            write pipeline (power of 2, default 4).
+
+@usage:     spi_bench [-b bytes] [-r size] [-F records] [-p B/s] [-M mbit]
+                      [-x] [-v] [-S] [-A halves [-d us] [-j us]]
+                      [-a cycles] [-c cycles]
+
+            -b  bytes to log (262144)
+            -r  record size (16)
+            -F  flash_flush() every n records, 0 = never (0)
+            -p  offered rate in bytes/s, 0 = as fast as possible (0)
+            -M  flash size in Mbit, 8 .. 128 (16)
+            -x  maximum instead of typical program / erase times
+            -v  print the firmware's ITM output
+            -S  engine sweep instead of the flash log
+            -A  I2S playback of n halves instead of the flash log
+            -d  I2S: work per half in us (0)
+            -j  I2S: up to this many us more per half (0)
+            -a  CPU cycles per register access (2)
+            -c  CPU cycles per function call (8)
+
+@warrenty:  void
+*/
+
+#include "stm32f4xx.h"
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+    Firmware under test, renamed main()
+*/
+#define       main              firmware_main
+#define       SPI_DMA           1
+#define       SPI_QUEUE         1
+#define       SPI_FLASH         1
+#define       SPI_I2S           1
+#define       I2S_CODEC         0       /* no I2C in the model */
+#include "../SPI-Interrupt/main.c"
+#undef        main
+
+#if (!SPI_FLASH)
+#error "build SPI-Interrupt with SPI_FLASH 1"
+#endif
+
+/*
+    PLL 168Mhz, APB1 = HCLK / 4, APB2 = HCLK / 2
+*/
+#define       CPU_HZ            168000000U
+#define       PCLK1_HZ          42000000U
+#define       PCLK2_HZ          84000000U
+
+#define       ISR_ENTRY_CYCLES  12U
+#define       ISR_EXIT_CYCLES   10U
+#define       WFI_STEP_CYCLES   4U
+
+/*
+    SPI SR bits
+*/
+#define       SR_RXNE           (1U << 0)
+#define       SR_TXE            (1U << 1)
+#define       SR_CRCERR         (1U << 4)
+#define       SR_OVR            (1U << 6)
+#define       SR_BSY            (1U << 7)
+
+#define       NEVER             (~(uint64_t)0)
+
+#define       US(___us)         ((uint64_t)((___us) * (CPU_HZ / 1000000.0)))
+
+/*
+    Register blocks seen by the firmware
+*/
+SPI_TypeDef         sim_spi[SIM_SPI_COUNT];
+DMA_TypeDef         sim_dma[2];
+DMA_Stream_TypeDef  sim_dma_stream[2][8];
+RCC_TypeDef         sim_rcc;
+FLASH_TypeDef       sim_flash;
+SCB_Type            sim_scb;
+DWT_Type            sim_dwt;
+CoreDebug_Type      sim_coredebug;
+ITM_Type            sim_itm;
+uint8_t             sim_gpio[9][0x400];
+uint32_t            sim_primask;
+uint32_t            SystemCoreClock = CPU_HZ;
+
+/*
+    SPI internal state
+*/
+typedef struct {
+    uint32_t    sr;                 /* RXNE, TXE, OVR, CRCERR */
+    uint16_t    rdr;
+    uint16_t    tdr;
+    int         tdrFull;
+    uint16_t    shift;
+    uint64_t    shiftDone;          /* end of frame in shift register, NEVER if idle */
+    int         ovrDr;              /* DR read since OVR, SR read clears it */
+    int         slaveActive;        /* slave: shift loaded for a master frame */
+    int         i2sIdle;            /* I2S: word clocked out without data */
+    uint64_t    i2sWords;           /* I2S: words since I2SE */
+    uint64_t    i2sT0;
+} spi_state_t;
+
+/*
+    I2S output check: the bench plays L = n, R = n ^ 0x5555
+    for frame n
+*/
+typedef struct {
+    uint64_t    words;
+    uint64_t    starved;            /* Tx buffer empty at word start */
+    uint64_t    jumps;              /* L not one more than the frame before */
+    uint64_t    badR;
+    uint64_t    first;              /* first and last word end */
+    uint64_t    last;
+    uint16_t    left;
+    int         synced;
+} i2s_out_t;
+
+/*
+    DMA stream internal state
+*/
+typedef struct {
+    uint32_t    ndtr0;
+    uint32_t    pos;                /* bytes from M0AR */
+} stream_state_t;
+
+/*
+    W25Q NOR flash on SPI-1
+*/
+typedef struct {
+    uint8_t   * mem;
+    uint32_t    size;
+    uint8_t     capacity;           /* JEDEC: log2(size) */
+    int         selected;
+    uint32_t    count;              /* bytes in this CS frame */
+    uint8_t     op;
+    uint32_t    addr;
+    uint8_t     latch[256];
+    uint8_t     loaded[256];
+    uint32_t    latchBytes;
+    int         wel;
+    uint64_t    busyUntil;
+    int         maxTimes;
+
+    uint16_t  * pageProgs;          /* per page */
+    uint32_t  * sectorErases;       /* per sector */
+
+    uint64_t    ppOps;
+    uint64_t    ppBytes;
+    uint64_t    seOps;
+    uint64_t    readBytes;
+    uint64_t    busyCmds;           /* command other than RDSR1 while WIP */
+    uint64_t    noWel;
+    uint64_t    overwrite;          /* bytes with a 0 bit programmed to 1 */
+} w25_t;
+
+typedef struct {
+    int         irq;                /* exception number - 16 */
+    void     (* fn)(void);
+    const char* name;
+    int         kind;               /* 0: DMA stream, 1: SPI, 2: PendSV */
+    int         idx;
+} vector_t;
+
+typedef struct {
+    uint64_t    calls;
+    uint64_t    cycles;
+    uint64_t    max;
+} isr_stat_t;
+
+/*
+    exception number order, PendSV first
+*/
+static const vector_t vectors[] = {
+    { PendSV_IRQn,       PendSV_Handler,          "PendSV",       2,  0 },
+    { DMA1_Stream0_IRQn, DMA1_Stream0_IRQHandler, "DMA1_Stream0", 0,  0 },
+    { DMA1_Stream1_IRQn, DMA1_Stream1_IRQHandler, "DMA1_Stream1", 0,  1 },
+    { DMA1_Stream2_IRQn, DMA1_Stream2_IRQHandler, "DMA1_Stream2", 0,  2 },
+    { DMA1_Stream3_IRQn, DMA1_Stream3_IRQHandler, "DMA1_Stream3", 0,  3 },
+    { DMA1_Stream4_IRQn, DMA1_Stream4_IRQHandler, "DMA1_Stream4", 0,  4 },
+    { DMA1_Stream5_IRQn, DMA1_Stream5_IRQHandler, "DMA1_Stream5", 0,  5 },
+    { DMA1_Stream6_IRQn, DMA1_Stream6_IRQHandler, "DMA1_Stream6", 0,  6 },
+    { SPI1_IRQn,         SPI1_IRQHandler,         "SPI1",         1,  SIM_SPI1 },
+    { SPI2_IRQn,         SPI2_IRQHandler,         "SPI2",         1,  SIM_SPI2 },
+    { DMA1_Stream7_IRQn, DMA1_Stream7_IRQHandler, "DMA1_Stream7", 0,  7 },
+    { SPI3_IRQn,         SPI3_IRQHandler,         "SPI3",         1,  SIM_SPI3 },
+    { DMA2_Stream0_IRQn, DMA2_Stream0_IRQHandler, "DMA2_Stream0", 0,  8 },
+    { DMA2_Stream1_IRQn, DMA2_Stream1_IRQHandler, "DMA2_Stream1", 0,  9 },
+    { DMA2_Stream2_IRQn, DMA2_Stream2_IRQHandler, "DMA2_Stream2", 0, 10 },
+    { DMA2_Stream3_IRQn, DMA2_Stream3_IRQHandler, "DMA2_Stream3", 0, 11 },
+    { DMA2_Stream4_IRQn, DMA2_Stream4_IRQHandler, "DMA2_Stream4", 0, 12 },
+    { DMA2_Stream5_IRQn, DMA2_Stream5_IRQHandler, "DMA2_Stream5", 0, 13 },
+    { DMA2_Stream6_IRQn, DMA2_Stream6_IRQHandler, "DMA2_Stream6", 0, 14 },
+    { DMA2_Stream7_IRQn, DMA2_Stream7_IRQHandler, "DMA2_Stream7", 0, 15 },
+};
+
+#define       VECTOR_COUNT      (sizeof(vectors) / sizeof(vectors[0]))
+
+static const uint8_t dmaShift[4] = { 0U, 6U, 16U, 22U };
+
+static spi_state_t    spiState[SIM_SPI_COUNT];
+static stream_state_t streamState[2][8];
+static w25_t          w25;
+static isr_stat_t     isrStat[VECTOR_COUNT];
+static i2s_out_t      i2sOut;
+
+/* a circular stream starts (done 0) or has read (done 1) half h */
+static void        (* streamHalf)(int c, int n, int h, int done);
+
+static uint64_t       simNow;
+static uint64_t       simEnd;
+static jmp_buf        simExit;
+static int            simInIsr;
+static uint32_t       nvicEnabled[(SIM_IRQ_COUNT + 31) / 32];
+static uint8_t        nvicPrio[SIM_IRQ_COUNT + 16];
+static int            pendSv;
+static uint32_t       cycBase;
+static int            csLevel = 1;
+static uint64_t       txOverwrite;
+static uint64_t       overruns;
+static uint64_t       slaveUnderruns;
+
+static uint32_t       accessCycles = 2U;
+static uint32_t       callCycles   = 8U;
+static int            verbose;
+
+static void sim_tick(uint32_t cycles);
+
+/*
+    Duration of one frame in CPU cycles, from BR and DFF
+*/
+static int spi_i2s(int i) {
+    return (sim_spi[i].I2SCFGR.v >> 11) & 1U;
+}
+
+/*
+    I2S: one 16-bit word (half a stereo frame) in CPU
+    cycles. I2SCLK from PLLI2S, input 16Mhz / PLLM;
+    16-bit channel: Fs = I2SCLK / (32 * (2 * I2SDIV + ODD)),
+    with MCKOE 8 times lower.
+*/
+static double i2s_word_cycles(int i) {
+
+    uint32_t pllm = sim_rcc.PLLCFGR & 0x3FU;
+    uint32_t plln = (sim_rcc.PLLI2SCFGR >> 6) & 0x1FFU;
+    uint32_t pllr = (sim_rcc.PLLI2SCFGR >> 28) & 7U;
+    uint32_t pr   = sim_spi[i].I2SPR.v;
+    uint32_t div  = 2U * (pr & 0xFFU) + ((pr >> 8) & 1U);
+    double   fs;
+
+    if ((pllm < 2U) || (pllr < 2U) || (div < 4U)) {
+        return (double)CPU_HZ;
+    }
+
+    fs = 16e6 / pllm * plln / pllr / (32.0 * div);
+
+    if (pr & (1U << 9)) {
+        fs /= 8.0;
+    }
+
+    return CPU_HZ / (2.0 * fs);
+}
+
+static uint64_t frame_cycles(int i) {
+
+    uint32_t cr1  = sim_spi[i].CR1.v;
+    uint32_t pclk = (i == SIM_SPI1) ? PCLK2_HZ : PCLK1_HZ;
+    uint32_t bits = (cr1 & (1U << 11)) ? 16U : 8U;
+    uint32_t div  = 2U << ((cr1 >> 3) & 7U);
+
+    return (uint64_t)bits * div * (CPU_HZ / pclk);
+}
+
+/*
+    W25Q program time for n bytes: first byte, then
+    linear up to the full page time
+*/
+static uint64_t w25_pp_time(uint32_t n) {
+
+    double full = w25.maxTimes ? 3000.0 : 400.0;
+    double first = 30.0;
+
+    return US(first + (full - first) * (double)(n - 1U) / 255.0);
+}
+
+static void w25_select(void) {
+    w25.selected = 1;
+    w25.count    = 0;
+}
+
+/*
+    CS rising edge: WREN, PAGE PROGRAM and SECTOR
+    ERASE take effect
+*/
+static void w25_deselect(void) {
+
+    uint32_t i;
+    uint32_t a;
+
+    w25.selected = 0;
+
+    if ((w25.count == 0U) || (simNow < w25.busyUntil)) {
+        return;
+    }
+
+    switch (w25.op) {
+
+        case 0x06U:
+            w25.wel = 1;
+            break;
+
+        case 0x04U:
+            w25.wel = 0;
+            break;
+
+        case 0x02U:
+            if (w25.count <= 4U) {
+                break;
+            }
+
+            if (!w25.wel) {
+                ++w25.noWel;
+                break;
+            }
+
+            for (i = 0; i < 256U; ++i) {
+
+                if (!w25.loaded[i]) {
+                    continue;
+                }
+
+                a = ((w25.addr & ~0xFFU) | i) & (w25.size - 1U);
+
+                if (~w25.mem[a] & w25.latch[i]) {
+                    ++w25.overwrite;
+                }
+
+                w25.mem[a] &= w25.latch[i];
+            }
+
+            ++w25.ppOps;
+            w25.ppBytes += w25.latchBytes;
+            ++w25.pageProgs[(w25.addr & (w25.size - 1U)) >> 8];
+
+            w25.busyUntil = simNow + w25_pp_time(w25.latchBytes < 256U ? w25.latchBytes : 256U);
+            w25.wel       = 0;
+            break;
+
+        case 0x20U:
+            if (w25.count != 4U) {
+                break;
+            }
+
+            if (!w25.wel) {
+                ++w25.noWel;
+                break;
+            }
+
+            a = w25.addr & (w25.size - 1U) & ~0xFFFU;
+            memset(&w25.mem[a], 0xFF, 4096U);
+
+            ++w25.seOps;
+            ++w25.sectorErases[a >> 12];
+
+            w25.busyUntil = simNow + US(w25.maxTimes ? 400000.0 : 45000.0);
+            w25.wel       = 0;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+    One byte clocked while selected: MOSI in, MISO out
+*/
+static uint8_t w25_byte(uint8_t mosi) {
+
+    uint32_t n = w25.count++;
+    int      busy = (simNow < w25.busyUntil);
+
+    if (n == 0U) {
+
+        w25.op = mosi;
+
+        if (busy && (mosi != 0x05U)) {
+            ++w25.busyCmds;
+            w25.op = 0U;
+        }
+
+        if (w25.op == 0x02U) {
+            memset(w25.loaded, 0, sizeof(w25.loaded));
+            w25.latchBytes = 0;
+        }
+
+        return 0xFFU;
+    }
+
+    switch (w25.op) {
+
+        case 0x05U:
+            return (uint8_t)((busy ? 1U : 0U) | (w25.wel ? 2U : 0U));
+
+        case 0x9FU:
+            return (n == 1U) ? 0xEFU : (n == 2U) ? 0x40U : (n == 3U) ? w25.capacity : 0xFFU;
+
+        case 0x02U:
+        case 0x20U:
+        case 0x03U:
+        case 0x0BU:
+            if (n <= 3U) {
+                w25.addr = (w25.addr << 8) | mosi;
+                return 0xFFU;
+            }
+            break;
+
+        default:
+            return 0xFFU;
+    }
+
+    if (w25.op == 0x02U) {
+
+        uint32_t i = (w25.addr + (n - 4U)) & 0xFFU;
+
+        if (!w25.loaded[i]) {
+            w25.loaded[i] = 1;
+            ++w25.latchBytes;
+        }
+
+        w25.latch[i] = mosi;
+        return 0xFFU;
+    }
+
+    if ((w25.op == 0x0BU) && (n == 4U)) {
+        return 0xFFU;
+    }
+
+    if ((w25.op == 0x03U) || (w25.op == 0x0BU)) {
+        ++w25.readBytes;
+        return w25.mem[(w25.addr + n - ((w25.op == 0x0BU) ? 5U : 4U)) & (w25.size - 1U)];
+    }
+
+    return 0xFFU;
+}
+
+/*
+    CS of the flash changed
+*/
+static void gpio_changed(void) {
+
+    GPIO_TypeDef * port  = spiDevFlash.csPort;
+    int            level = (port->ODR.v >> spiDevFlash.csPin) & 1U;
+
+    if (level == csLevel) {
+        return;
+    }
+
+    csLevel = level;
+
+    if (level) {
+        w25_deselect();
+    } else {
+        w25_select();
+    }
+}
+
+/*
+    SPI-2 as slave on the SPI-1 bus: enabled, not master,
+    NSS low. Hardware NSS is PB.12, wired to the CS pin of
+    spiDevLoop.
+*/
+static int spi_slave_selected(int i) {
+
+    uint32_t cr1 = sim_spi[i].CR1.v;
+
+    if (!(cr1 & (1U << 6)) || (cr1 & (1U << 2))) {
+        return 0;
+    }
+
+    if (cr1 & (1U << 9)) {
+        return !(cr1 & (1U << 8));
+    }
+
+    return !((spiDevLoop.csPort->ODR.v >> spiDevLoop.csPin) & 1U);
+}
+
+/*
+    Master frame starts: the slave moves its Tx buffer
+    to the shift register, empty buffer sends 0
+*/
+static void spi_slave_start(int i) {
+
+    spi_state_t * s = &spiState[i];
+
+    s->slaveActive = spi_slave_selected(i);
+
+    if (!s->slaveActive) {
+        return;
+    }
+
+    if (s->tdrFull) {
+        s->shift   = s->tdr;
+        s->tdrFull = 0;
+        s->sr     |= SR_TXE;
+    } else {
+        s->shift = 0U;
+        ++slaveUnderruns;
+    }
+}
+
+/*
+    Master frame ends: the slave receives MOSI
+*/
+static uint16_t spi_slave_exchange(int i, uint16_t mosi) {
+
+    spi_state_t * s = &spiState[i];
+
+    if (s->sr & SR_RXNE) {
+        s->sr |= SR_OVR;
+        ++overruns;
+    } else {
+        s->rdr = mosi;
+        s->sr |= SR_RXNE;
+    }
+
+    s->slaveActive = 0;
+
+    return s->shift;
+}
+
+/*
+    Device on the far side of an SPI master
+*/
+static uint16_t bus_exchange(int i, uint16_t mosi) {
+
+    uint16_t miso = 0xFFFFU;
+
+    if (i != SIM_SPI1) {
+        return miso;
+    }
+
+    /* every selected device samples MOSI */
+    if (spiState[SIM_SPI2].slaveActive) {
+        miso = spi_slave_exchange(SIM_SPI2, mosi);
+    }
+
+    if (w25.selected) {
+        miso = w25_byte((uint8_t)mosi);
+    }
+
+    return miso;
+}
+
+static int spi_master(int i) {
+
+    uint32_t cfg = sim_spi[i].I2SCFGR.v;
+
+    /* I2S: enabled, master transmit or receive */
+    if (cfg & (1U << 11)) {
+        return (cfg & (1U << 10)) && (((cfg >> 8) & 3U) >= 2U);
+    }
+
+    return (sim_spi[i].CR1.v & (1U << 6)) && (sim_spi[i].CR1.v & (1U << 2));
+}
+
+/*
+    I2S master: the clock runs while I2SE is set, an
+    empty Tx buffer sends 0
+*/
+static void i2s_word_start(int i) {
+
+    spi_state_t * s = &spiState[i];
+
+    if (s->i2sWords == 0U) {
+        s->i2sT0 = simNow;
+    }
+
+    if (s->tdrFull) {
+        s->shift   = s->tdr;
+        s->tdrFull = 0;
+        s->sr     |= SR_TXE;
+        s->i2sIdle = 0;
+    } else {
+        s->shift   = 0U;
+        s->i2sIdle = 1;
+    }
+
+    s->shiftDone = s->i2sT0 + (uint64_t)((double)(s->i2sWords + 1U) * i2s_word_cycles(i));
+}
+
+/*
+    I2S word clocked out: left on even words
+*/
+static void i2s_word_done(int i) {
+
+    spi_state_t * s = &spiState[i];
+    i2s_out_t   * o = &i2sOut;
+    uint16_t      v = s->shift;
+
+    if (o->words++ == 0U) {
+        o->first = simNow;
+    }
+
+    o->last = simNow;
+
+    if (s->i2sIdle) {
+        ++o->starved;
+    } else if ((s->i2sWords & 1U) == 0U) {
+
+        if (o->synced && (v != (uint16_t)(o->left + 1U))) {
+            ++o->jumps;
+        }
+
+        o->left   = v;
+        o->synced = 1;
+    } else if (v != (uint16_t)(o->left ^ 0x5555U)) {
+        ++o->badR;
+    }
+
+    ++s->i2sWords;
+}
+
+/*
+    Tx buffer to shift register, master only
+*/
+static void spi_start(int i) {
+
+    spi_state_t * s = &spiState[i];
+
+    if (!spi_master(i) || (s->shiftDone != NEVER)) {
+        return;
+    }
+
+    if (spi_i2s(i)) {
+        i2s_word_start(i);
+        return;
+    }
+
+    if (!s->tdrFull) {
+        return;
+    }
+
+    s->shift     = s->tdr;
+    s->tdrFull   = 0;
+    s->sr       |= SR_TXE;
+    s->shiftDone = simNow + frame_cycles(i);
+
+    if (i == SIM_SPI1) {
+        spi_slave_start(SIM_SPI2);
+    }
+}
+
+static void spi_frame_done(int i) {
+
+    spi_state_t * s    = &spiState[i];
+    uint16_t      miso;
+
+    if (spi_i2s(i)) {
+        i2s_word_done(i);
+        s->shiftDone = NEVER;
+        spi_start(i);
+        return;
+    }
+
+    miso = bus_exchange(i, s->shift);
+
+    if (!(sim_spi[i].CR1.v & (1U << 11))) {
+        miso &= 0xFFU;
+    }
+
+    if (s->sr & SR_RXNE) {
+        s->sr |= SR_OVR;
+        ++overruns;
+    } else {
+        s->rdr = miso;
+        s->sr |= SR_RXNE;
+    }
+
+    s->shiftDone = NEVER;
+    spi_start(i);
+}
+
+static void spi_write_dr(int i, uint16_t v) {
+
+    spi_state_t * s = &spiState[i];
+
+    if (s->tdrFull) {
+        ++txOverwrite;
+    }
+
+    s->tdr     = v;
+    s->tdrFull = 1;
+    s->sr     &= ~SR_TXE;
+
+    spi_start(i);
+}
+
+static void stream_flag(int c, int n, uint32_t flag) {
+
+    volatile uint32_t * isr = (n < 4) ? &sim_dma[c].LISR : &sim_dma[c].HISR;
+
+    *isr |= flag << dmaShift[n & 3];
+}
+
+/*
+    Move every frame an SPI is requesting on enabled
+    streams, one pass over the streams
+
+    return: frames moved
+*/
+static unsigned dma_service_pass(void) {
+
+    unsigned moved = 0;
+    int      c;
+    int      n;
+    int      i;
+
+    for (c = 0; c < 2; ++c) {
+        for (n = 0; n < 8; ++n) {
+
+            DMA_Stream_TypeDef * st = &sim_dma_stream[c][n];
+            stream_state_t     * ss = &streamState[c][n];
+            uint32_t             cr = st->CR.v;
+            uint32_t             sz = ((cr >> 13) & 3U) ? 2U : 1U;
+            uint8_t            * mem;
+
+            if (!(cr & 1U)) {
+                continue;
+            }
+
+            for (i = 0; i < SIM_SPI_COUNT; ++i) {
+                if (st->PAR.v == (uintptr_t)&sim_spi[i].DR) {
+                    break;
+                }
+            }
+
+            if (i == SIM_SPI_COUNT) {
+                continue;
+            }
+
+            mem = (uint8_t *)(uintptr_t)st->M0AR.v;
+
+            for (;;) {
+
+                spi_state_t * s = &spiState[i];
+                uint32_t      cr2 = sim_spi[i].CR2.v;
+
+                if ((((cr >> 6) & 3U) == 0U) && (s->sr & SR_RXNE) && (cr2 & (1U << 0))) {
+                    if (sz == 2U) {
+                        memcpy(&mem[ss->pos], &s->rdr, 2U);
+                    } else {
+                        mem[ss->pos] = (uint8_t)s->rdr;
+                    }
+                    s->sr &= ~SR_RXNE;
+                } else if ((((cr >> 6) & 3U) == 1U) && (s->sr & SR_TXE) && (cr2 & (1U << 1))) {
+                    uint16_t v = mem[ss->pos];
+                    if ((cr & (1U << 8)) && (streamHalf != NULL) &&
+                        ((ss->pos == 0U) || (ss->pos == ss->ndtr0 * sz / 2U))) {
+                        streamHalf(c, n, ss->pos != 0U, 0);
+                    }
+                    if (sz == 2U) {
+                        memcpy(&v, &mem[ss->pos], 2U);
+                    }
+                    spi_write_dr(i, v);
+                } else {
+                    break;
+                }
+
+                ++moved;
+
+                if (cr & (1U << 10)) {
+                    ss->pos += sz;
+                }
+
+                if (--st->NDTR.v == ss->ndtr0 / 2U) {
+                    stream_flag(c, n, 1U << 4);
+
+                    if ((cr & (1U << 8)) && (streamHalf != NULL)) {
+                        streamHalf(c, n, 0, 1);
+                    }
+                }
+
+                if (st->NDTR.v == 0U) {
+                    stream_flag(c, n, 1U << 5);
+
+                    if ((cr & (1U << 8)) && (streamHalf != NULL)) {
+                        streamHalf(c, n, 1, 1);
+                    }
+
+                    if (cr & (1U << 8)) {
+                        st->NDTR.v = ss->ndtr0;
+                        ss->pos    = 0;
+                    } else {
+                        st->CR.v &= ~1U;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return moved;
+}
+
+/*
+    A frame moved on one stream can start a request on
+    another (master Tx starts the slave's frame), repeat
+    until nothing moves
+*/
+static void dma_service(void) {
+    while (dma_service_pass() != 0U);
+}
+
+/*
+    Write-only flag clear registers take effect
+*/
+static void dma_clear_flags(void) {
+
+    int c;
+
+    for (c = 0; c < 2; ++c) {
+        sim_dma[c].LISR &= ~sim_dma[c].LIFCR;
+        sim_dma[c].HISR &= ~sim_dma[c].HIFCR;
+        sim_dma[c].LIFCR = 0;
+        sim_dma[c].HIFCR = 0;
+    }
+}
+
+/*
+    Process frame ends up to time t
+*/
+static void sim_run(uint64_t t) {
+
+    for (;;) {
+
+        uint64_t next = NEVER;
+        int      what = -1;
+        int      i;
+
+        for (i = 0; i < SIM_SPI_COUNT; ++i) {
+            if (spiState[i].shiftDone < next) {
+                next = spiState[i].shiftDone;
+                what = i;
+            }
+        }
+
+        if ((what < 0) || (next > t)) {
+            break;
+        }
+
+        spi_frame_done(what);
+        dma_service();
+    }
+}
+
+static int irq_pending(const vector_t * v) {
+
+    if (v->fn == NULL) {
+        return 0;
+    }
+
+    if (v->kind == 2) {
+        return pendSv;
+    }
+
+    if (!(nvicEnabled[v->irq >> 5] & (1U << (v->irq & 31)))) {
+        return 0;
+    }
+
+    if (v->kind == 0) {
+
+        int      c     = v->idx >> 3;
+        int      n     = v->idx & 7;
+        uint32_t cr    = sim_dma_stream[c][n].CR.v;
+        uint32_t flags = ((n < 4) ? sim_dma[c].LISR : sim_dma[c].HISR) >> dmaShift[n & 3];
+
+        return ((cr & (1U << 4)) && (flags & (1U << 5))) ||
+               ((cr & (1U << 3)) && (flags & (1U << 4))) ||
+               ((cr & (1U << 2)) && (flags & (1U << 3))) ||
+               ((cr & (1U << 1)) && (flags & (1U << 2)));
+    } else {
+
+        uint32_t sr  = spiState[v->idx].sr;
+        uint32_t cr2 = sim_spi[v->idx].CR2.v;
+
+        return ((cr2 & (1U << 6)) && (sr & SR_RXNE)) ||
+               ((cr2 & (1U << 7)) && (sr & SR_TXE)) ||
+               ((cr2 & (1U << 5)) && (sr & (SR_OVR | SR_CRCERR)));
+    }
+}
+
+static int sim_irq_pending(void) {
+
+    unsigned k;
+
+    dma_clear_flags();
+
+    for (k = 0; k < VECTOR_COUNT; ++k) {
+        if (irq_pending(&vectors[k])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Take pending interrupts, highest priority first,
+    then lowest exception number
+*/
+static void sim_dispatch(void) {
+
+    unsigned k;
+    unsigned best;
+
+    while (!sim_primask) {
+
+        uint64_t t0 = simNow;
+
+        dma_clear_flags();
+
+        best = VECTOR_COUNT;
+
+        for (k = 0; k < VECTOR_COUNT; ++k) {
+            if (irq_pending(&vectors[k]) &&
+                ((best == VECTOR_COUNT) || (nvicPrio[vectors[k].irq + 16] < nvicPrio[vectors[best].irq + 16]))) {
+                best = k;
+            }
+        }
+
+        if (best == VECTOR_COUNT) {
+            return;
+        }
+
+        if (vectors[best].kind == 2) {
+            pendSv = 0;
+        }
+
+        simInIsr = 1;
+        sim_tick(ISR_ENTRY_CYCLES);
+        vectors[best].fn();
+        sim_tick(ISR_EXIT_CYCLES);
+        simInIsr = 0;
+
+        isrStat[best].calls  += 1U;
+        isrStat[best].cycles += simNow - t0;
+
+        if (simNow - t0 > isrStat[best].max) {
+            isrStat[best].max = simNow - t0;
+        }
+
+        if (simNow >= simEnd) {
+            longjmp(simExit, 1);
+        }
+    }
+}
+
+/*
+    CPU spends cycles: advance the bus, then take interrupts
+*/
+static void sim_tick(uint32_t cycles) {
+
+    dma_clear_flags();
+
+    simNow += cycles;
+    sim_run(simNow);
+
+    if (!simInIsr) {
+
+        sim_dispatch();
+
+        if (simNow >= simEnd) {
+            longjmp(simExit, 1);
+        }
+    }
+}
+
+void sim_unmasked(void) {
+
+    if (!sim_primask && !simInIsr) {
+        sim_dispatch();
+    }
+}
+
+/*
+    WFI: time runs on to the next interrupt
+*/
+void sim_wfi(void) {
+
+    while (!sim_irq_pending()) {
+        sim_tick(WFI_STEP_CYCLES);
+    }
+}
+
+/*
+    Locate a register: block index and register number
+*/
+#define       REG_IN(___r, ___base, ___type, ___count)                            \
+    (((const char *)(___r) >= (const char *)(___base)) &&                           \
+     ((const char *)(___r) <  (const char *)(___base) + sizeof(___type) * (___count)))
+
+#define       REG_IDX(___r, ___base, ___type)                                      \
+    ((int)(((const char *)(___r) - (const char *)(___base)) / sizeof(___type)))
+
+#define       REG_NUM(___r, ___base, ___type)                                      \
+    ((int)((((const char *)(___r) - (const char *)(___base)) % sizeof(___type)) / sizeof(sim_reg)))
+
+uint32_t sim_reg_read(sim_reg * r) {
+
+    sim_tick(accessCycles);
+
+    if (REG_IN(r, sim_spi, SPI_TypeDef, SIM_SPI_COUNT)) {
+
+        int           i = REG_IDX(r, sim_spi, SPI_TypeDef);
+        spi_state_t * s = &spiState[i];
+        uint32_t      v;
+
+        switch (REG_NUM(r, sim_spi, SPI_TypeDef)) {
+
+            case 2:
+                v = s->sr;
+
+                if (spi_master(i) ? (s->tdrFull || ((s->shiftDone != NEVER) && !s->i2sIdle)) :
+                                    (s->slaveActive != 0)) {
+                    v |= SR_BSY;
+                }
+
+                if (s->ovrDr) {
+                    s->sr   &= ~SR_OVR;
+                    s->ovrDr = 0;
+                }
+                return v;
+
+            case 3:
+                if (s->sr & SR_OVR) {
+                    s->ovrDr = 1;
+                }
+
+                s->sr &= ~SR_RXNE;
+                return s->rdr;
+
+            default:
+                return r->v;
+        }
+    }
+
+    if (r == &sim_dwt.CYCCNT) {
+        return (uint32_t)simNow - cycBase;
+    }
+
+    /* HSI, HSE, PLL, PLLI2S ready as soon as on */
+    if (r == &sim_rcc.CR) {
+        return r->v | ((r->v & ((1U << 0) | (1U << 16) | (1U << 24) | (1U << 26))) << 1);
+    }
+
+    if (r == &sim_scb.ICSR) {
+        return pendSv ? SCB_ICSR_PENDSVSET_Msk : 0U;
+    }
+
+    if (REG_IN(r, sim_gpio, uint8_t[0x400], 9) &&
+        ((((const uint8_t *)r - sim_gpio[0]) & 0x3FFU) == offsetof(GPIO_TypeDef, BSRR))) {
+        return 0U;
+    }
+
+    return r->v;
+}
+
+void sim_reg_write(sim_reg * r, uintptr_t a) {
+
+    uint32_t v = (uint32_t)a;
+
+    sim_tick(accessCycles);
+
+    if (REG_IN(r, sim_spi, SPI_TypeDef, SIM_SPI_COUNT)) {
+
+        int i = REG_IDX(r, sim_spi, SPI_TypeDef);
+
+        switch (REG_NUM(r, sim_spi, SPI_TypeDef)) {
+
+            case 0:
+                r->v = v;
+                spi_start(i);
+                break;
+
+            case 2:
+                spiState[i].sr &= v | ~SR_CRCERR;
+                break;
+
+            case 3:
+                spi_write_dr(i, (uint16_t)v);
+                break;
+
+            /* I2SCFGR: I2SE starts and stops the I2S clock */
+            case 7:
+                r->v = v;
+
+                if (!spi_master(i) && spi_i2s(i)) {
+                    spiState[i].shiftDone = NEVER;
+                    spiState[i].i2sWords  = 0;
+                    spiState[i].i2sIdle   = 0;
+                }
+
+                spi_start(i);
+                break;
+
+            default:
+                r->v = v;
+                break;
+        }
+
+    } else if (REG_IN(r, sim_dma_stream, DMA_Stream_TypeDef, 16)) {
+
+        int c = REG_IDX(r, sim_dma_stream, DMA_Stream_TypeDef) >> 3;
+        int n = REG_IDX(r, sim_dma_stream, DMA_Stream_TypeDef) & 7;
+
+        /*
+            EN rising edge latches NDTR
+        */
+        if ((REG_NUM(r, sim_dma_stream, DMA_Stream_TypeDef) == 0) && !(r->v & 1U) && (v & 1U)) {
+            streamState[c][n].ndtr0 = sim_dma_stream[c][n].NDTR.v;
+            streamState[c][n].pos   = 0;
+
+            if (streamState[c][n].ndtr0 == 0U) {
+                v &= ~1U;
+            }
+        }
+
+        /*
+            PAR, M0AR and M1AR keep the full host address
+        */
+        switch (REG_NUM(r, sim_dma_stream, DMA_Stream_TypeDef)) {
+            case 2: case 3: case 4:
+                r->v = a;
+                break;
+            default:
+                r->v = v;
+                break;
+        }
+
+    } else if (REG_IN(r, sim_gpio, uint8_t[0x400], 9)) {
+
+        GPIO_TypeDef * port = (GPIO_TypeDef *)(void *)sim_gpio[((const uint8_t *)r - sim_gpio[0]) / 0x400];
+
+        if (r == &port->BSRR) {
+            port->ODR.v = (port->ODR.v | (v & 0xFFFFU)) & ~(v >> 16);
+        } else {
+            r->v = v;
+        }
+
+        gpio_changed();
+
+    } else if (r == &sim_dwt.CYCCNT) {
+        cycBase = (uint32_t)simNow - v;
+    } else if (r == &sim_scb.ICSR) {
+        if (v & SCB_ICSR_PENDSVSET_Msk) {
+            pendSv = 1;
+        }
+    } else {
+        r->v = v;
+    }
+
+    dma_service();
+}
+
+void SystemCoreClockUpdate(void) {
+    SystemCoreClock = CPU_HZ;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    nvicEnabled[irq >> 5] |= 1U << (irq & 31);
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    nvicEnabled[irq >> 5] &= ~(1U << (irq & 31));
+}
+
+void NVIC_SetPriority(IRQn_Type irq, uint32_t prio) {
+    nvicPrio[irq + 16] = (uint8_t)prio;
+}
+
+uint32_t ITM_SendChar(uint32_t ch) {
+
+    if (verbose) {
+        putchar((int)ch);
+    }
+
+    return ch;
+}
+
+/*
+    Function entry costs time
+*/
+extern "C" void __cyg_profile_func_enter(void * fn, void * site) {
+    (void)fn;
+    (void)site;
+    sim_tick(callCycles);
+}
+
+extern "C" void __cyg_profile_func_exit(void * fn, void * site) {
+    (void)fn;
+    (void)site;
+}
+
+/*
+    log contents: byte at log position pos
+*/
+static uint8_t pattern(uint32_t pos) {
+    return (uint8_t)((pos * 131U) ^ (pos >> 8) ^ (pos >> 16));
+}
+
+/*
+    DMA buffers must have 32-bit addresses: not on the stack
+*/
+static uint8_t      rd[FLASH_READ_CHUNK];
+static volatile int readBusy;
+
+static void bench_read_done(uint32_t err, void * arg) {
+    (void)err;
+    (void)arg;
+    readBusy = 0;
+}
+
+/*
+    spi_sweep() prints its table on ITM, the model
+    adds bus errors and interrupt totals. Exit status 1
+    if a run had errors.
+*/
+static int bench_sweep(void) {
+
+    uint32_t errors = 0;
+    unsigned k;
+
+    printf("SPI-Interrupt engine sweep: SPI-1 -> SPI-2, %u bytes per run, core %u Hz, "
+           "%u cycles per access, %u per call\n",
+           SPI_SWEEP_BYTES, CPU_HZ, accessCycles, callCycles);
+
+    verbose = 1;
+    spi_sweep();
+    verbose = 0;
+
+    for (k = 0; k < sizeof(spiSweep) / sizeof(spiSweep[0]); ++k) {
+        errors += spiSweep[k].errors;
+    }
+
+    printf("  bus         SPI overrun %llu, slave Tx underrun %llu, Tx overwrite %llu\n",
+           (unsigned long long)overruns, (unsigned long long)slaveUnderruns,
+           (unsigned long long)txOverwrite);
+
+    for (k = 0; k < VECTOR_COUNT; ++k) {
+        if (isrStat[k].calls != 0U) {
+            printf("  ISR %-13s %8llu calls, max %5llu cycles (%.2f us), mean %.1f cycles\n",
+                   vectors[k].name, (unsigned long long)isrStat[k].calls,
+                   (unsigned long long)isrStat[k].max, isrStat[k].max * 1e6 / CPU_HZ,
+                   (double)isrStat[k].cycles / isrStat[k].calls);
+        }
+    }
+
+    return (errors != 0U) ? 1 : 0;
+}
+
+/*
+    I2S playback: the application's half callback only
+    flags the half, the main loop spends -d us (+ up to
+    -j us) on it, then fills it and calls i2s_ready()
+*/
+static volatile uint8_t audioFree[2];
+static uint8_t          audioCommitted[2];
+static uint64_t         audioCommitAt[2];
+static uint64_t         audioMisses;
+static uint64_t         audioSlackMin = NEVER;
+static uint16_t         audioFrame;
+
+static void bench_i2s_half(i2s_t * s, int16_t * half, uint32_t frames) {
+    (void)frames;
+    audioFree[(half == s->buf[0]) ? 0U : 1U] = 1;
+}
+
+/*
+    DMA1 Stream5 starts reading a half: filled since it
+    was last read or not. Read to the end: a fill from
+    now on is for the next round.
+*/
+static void bench_stream_half(int c, int n, int h, int done) {
+
+    if ((c != 0) || (n != 5)) {
+        return;
+    }
+
+    if (done) {
+        audioCommitted[h] = 0;
+        return;
+    }
+
+    /* 2: filled before i2s_start(), no deadline */
+    if (audioCommitted[h] == 1U) {
+        if (simNow - audioCommitAt[h] < audioSlackMin) {
+            audioSlackMin = simNow - audioCommitAt[h];
+        }
+    } else if (audioCommitted[h] == 0U) {
+        ++audioMisses;
+    }
+}
+
+static void bench_i2s_fill(uint32_t h) {
+
+    uint32_t i;
+
+    for (i = 0; i < I2S_HALF_FRAMES; ++i, ++audioFrame) {
+        i2s.buf[h][2U * i]      = (int16_t)audioFrame;
+        i2s.buf[h][2U * i + 1U] = (int16_t)(audioFrame ^ 0x5555U);
+    }
+
+    i2s_ready(&i2s, i2s.buf[h]);
+
+    audioCommitted[h] = 1;
+    audioCommitAt[h]  = simNow;
+}
+
+/*
+    exit status 1 if a half was not filled in time or
+    the output was not the sequence written
+*/
+static int bench_audio(uint32_t halves, double workUs, double jitterUs) {
+
+    uint64_t starved;
+    uint64_t t0;
+    uint32_t h;
+    unsigned k;
+
+    memset(isrStat, 0, sizeof(isrStat));
+
+    i2s.half   = bench_i2s_half;
+    streamHalf = bench_stream_half;
+    srand(1);
+
+    bench_i2s_fill(0U);
+    bench_i2s_fill(1U);
+    audioCommitted[0] = 2;
+    audioCommitted[1] = 2;
+
+    t0     = simNow;
+    simEnd = simNow + (uint64_t)CPU_HZ * (2U + halves * I2S_HALF_FRAMES / I2S_FS);
+
+    i2s_start(&i2s);
+
+    while (i2s.halves < halves) {
+
+        __disable_irq();
+
+        while (!audioFree[0] && !audioFree[1]) {
+            __WFI();
+            __enable_irq();
+            __disable_irq();
+        }
+
+        __enable_irq();
+
+        for (h = 0; h < 2U; ++h) {
+
+            uint64_t due;
+
+            if (!audioFree[h]) {
+                continue;
+            }
+
+            audioFree[h] = 0;
+            due = simNow + US(workUs + jitterUs * rand() / RAND_MAX);
+
+            while (simNow < due) {
+                sim_tick(callCycles);
+            }
+
+            bench_i2s_fill(h);
+        }
+    }
+
+    starved = i2sOut.starved;
+    i2s_stop(&i2s);
+
+    printf("SPI-Interrupt I2S: SPI-3 %u Hz stereo, %u frames per half (%.3f ms deadline), "
+           "core %u Hz\n",
+           I2S_FS, I2S_HALF_FRAMES, i2s.deadline * 1e3 / CPU_HZ, CPU_HZ);
+    printf("  work        %.1f us + up to %.1f us per half\n", workUs, jitterUs);
+    printf("  played      %llu frames in %.3f s, Fs %.1f Hz\n",
+           (unsigned long long)(i2sOut.words / 2U), (double)(simNow - t0) / CPU_HZ,
+           (i2sOut.words > 2U) ? (i2sOut.words - 1U) / 2.0 * CPU_HZ / (double)(i2sOut.last - i2sOut.first)
+                               : 0.0);
+    printf("  firmware    halves %u, underruns %u, late %u, fill max %.1f us, DMA errors %u\n",
+           i2s.halves, i2s.underruns, i2s.late, i2s.fillMax * 1e6 / CPU_HZ, i2s.dmaErrors);
+    printf("  model       halves missed %llu, min slack %.1f us, jumps %llu, bad R %llu, "
+           "starved words %llu\n",
+           (unsigned long long)audioMisses,
+           (audioSlackMin != NEVER) ? audioSlackMin * 1e6 / CPU_HZ : 0.0,
+           (unsigned long long)i2sOut.jumps, (unsigned long long)i2sOut.badR,
+           (unsigned long long)starved);
+
+    for (k = 0; k < VECTOR_COUNT; ++k) {
+        if (isrStat[k].calls != 0U) {
+            printf("  ISR %-13s %8llu calls, max %5llu cycles (%.2f us), mean %.1f cycles\n",
+                   vectors[k].name, (unsigned long long)isrStat[k].calls,
+                   (unsigned long long)isrStat[k].max, isrStat[k].max * 1e6 / CPU_HZ,
+                   (double)isrStat[k].cycles / isrStat[k].calls);
+        }
+    }
+
+    return ((audioMisses != 0U) || (i2sOut.jumps != 0U) || (i2sOut.badR != 0U) ||
+            (starved != 0U)) ? 1 : 0;
+}
+
+int main(int argc, char ** argv) {
+
+    uint32_t bytes   = 256U * 1024U;
+    uint32_t recSize = 16U;
+    uint32_t flushN  = 0U;
+    double   rate    = 0.0;
+    uint32_t mbit    = 16U;
+    uint8_t  rec[256];
+    uint64_t t0;
+    uint64_t tw;
+    uint64_t tr;
+    uint64_t isrCycles = 0;
+    uint64_t stalls    = 0;
+    uint64_t bad       = 0;
+    uint32_t pos;
+    uint32_t recs;
+    uint32_t maxProgs  = 0;
+    uint32_t maxErases = 0;
+    uint32_t i;
+    int      waited;
+    int      sweep   = 0;
+    uint32_t halves  = 0U;
+    double   workUs  = 0.0;
+    double   jitter  = 0.0;
+    int      opt;
+    unsigned k;
+
+    while ((opt = getopt(argc, argv, "b:r:F:p:M:xvSA:d:j:a:c:")) != -1) {
+
+        switch (opt) {
+            case 'b': bytes        = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'r': recSize      = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'F': flushN       = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'p': rate         = strtod(optarg, NULL);               break;
+            case 'M': mbit         = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'x': w25.maxTimes = 1;                                  break;
+            case 'v': verbose      = 1;                                  break;
+            case 'S': sweep        = 1;                                  break;
+            case 'A': halves       = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'd': workUs       = strtod(optarg, NULL);               break;
+            case 'j': jitter       = strtod(optarg, NULL);               break;
+            case 'a': accessCycles = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'c': callCycles   = (uint32_t)strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-b bytes] [-r size] [-F records] [-p B/s] [-M mbit] "
+                                "[-x] [-v] [-S] [-A halves [-d us] [-j us]] [-a cycles] [-c cycles]\n",
+                                argv[0]);
+                return 1;
+        }
+    }
+
+    if ((recSize == 0U) || (recSize > sizeof(rec)) || (bytes < recSize) ||
+        (mbit < 8U) || (mbit > 128U) || (mbit & (mbit - 1U))) {
+        fprintf(stderr, "bad record size, byte count or flash size\n");
+        return 1;
+    }
+
+    bytes -= bytes % recSize;
+
+    /*
+        the chip as delivered: erased, with data from an
+        earlier log
+    */
+    w25.size         = mbit * 1024U * 1024U / 8U;
+    w25.capacity     = (uint8_t)(__builtin_ctz(w25.size));
+    w25.mem          = (uint8_t *)malloc(w25.size);
+    w25.pageProgs    = (uint16_t *)calloc(w25.size / 256U, sizeof(uint16_t));
+    w25.sectorErases = (uint32_t *)calloc(w25.size / 4096U, sizeof(uint32_t));
+
+    if ((w25.mem == NULL) || (w25.pageProgs == NULL) || (w25.sectorErases == NULL)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < w25.size; ++i) {
+        w25.mem[i] = (uint8_t)(i * 7U);
+    }
+
+    for (i = 0; i < SIM_SPI_COUNT; ++i) {
+        spiState[i].sr        = SR_TXE;
+        spiState[i].shiftDone = NEVER;
+    }
+
+    /* PLL input as SysClock_configPLL() leaves it: 16Mhz / 8 */
+    sim_rcc.PLLCFGR = 8U;
+
+    simEnd = NEVER;
+
+    if (setjmp(simExit) != 0) {
+        fprintf(stderr, "simulation stopped at %.3f s\n", (double)simNow / CPU_HZ);
+        return 1;
+    }
+
+    /*
+        firmware_main() without the demo loop
+    */
+    prof_init(prof, PROF_COUNT);
+    spis_init(&spis, &spi[SPI_2]);
+    configLED();
+    configureSPIPins();
+    configureSPIBus();
+    spi_dma_init();
+    spiq_init(&spiq, &spi[SPI_1]);
+    spi_dev_init(&spiDevLoop);
+    flash_init(&flash, &spiq, &spiDevFlash);
+    i2s_init(&i2s, NULL);
+
+    /* a second per 100KiB is plenty, also at maximum times */
+    simEnd = simNow + (uint64_t)CPU_HZ * (10U + bytes / (100U * 1024U));
+
+    while (flash.state == FLASH_ID) {
+        flash_ready(&flash);
+    }
+
+    if (!flash_ready(&flash)) {
+        fprintf(stderr, "no flash found\n");
+        return 1;
+    }
+
+    if (sweep) {
+        return bench_sweep();
+    }
+
+    if (halves != 0U) {
+        return bench_audio(halves, workUs, jitter);
+    }
+
+    /*
+        write
+    */
+    t0   = simNow;
+    recs = 0;
+
+    for (pos = 0; pos < bytes; pos += recSize) {
+
+        if (rate > 0.0) {
+            uint64_t due = t0 + (uint64_t)(pos / rate * CPU_HZ);
+
+            while (simNow < due) {
+                sim_tick(callCycles);
+            }
+        }
+
+        for (i = 0; i < recSize; ++i) {
+            rec[i] = pattern(pos + i);
+        }
+
+        for (i = 0, waited = 0; i < recSize; ) {
+
+            uint32_t n = flash_write(&flash, &rec[i], recSize - i);
+
+            if ((n == 0U) && !waited) {
+                waited = 1;
+                ++stalls;
+            }
+
+            i += n;
+        }
+
+        if ((flushN != 0U) && (++recs % flushN == 0U)) {
+            flash_flush(&flash);
+        }
+    }
+
+    flash_flush(&flash);
+
+    while (!flash_idle(&flash));
+
+    tw = simNow - t0;
+
+    for (k = 0; k < VECTOR_COUNT; ++k) {
+        isrCycles += isrStat[k].cycles;
+    }
+
+    /*
+        read back, after the erase ahead
+    */
+    while (flash.state != FLASH_IDLE) {
+        flash_idle(&flash);
+    }
+
+    t0 = simNow;
+
+    for (pos = 0; pos < bytes; pos += sizeof(rd)) {
+
+        uint32_t n = (bytes - pos < sizeof(rd)) ? bytes - pos : (uint32_t)sizeof(rd);
+
+        readBusy = 1;
+        flash_read(&flash, pos, rd, n, bench_read_done, NULL);
+
+        while (readBusy) {
+            flash_idle(&flash);
+        }
+
+        for (i = 0; i < n; ++i) {
+            if ((bytes <= w25.size) && (rd[i] != pattern(pos + i))) {
+                ++bad;
+            }
+        }
+    }
+
+    tr = simNow - t0;
+
+    for (i = 0; i < w25.size / 256U; ++i) {
+        if (w25.pageProgs[i] > maxProgs) {
+            maxProgs = w25.pageProgs[i];
+        }
+    }
+
+    for (i = 0; i < w25.size / 4096U; ++i) {
+        if (w25.sectorErases[i] > maxErases) {
+            maxErases = w25.sectorErases[i];
+        }
+    }
+
+    printf("SPI-Interrupt flash log: W25Q %u Mbit, %s times, pipeline %u pages, core %u Hz\n",
+           mbit, w25.maxTimes ? "maximum" : "typical", (unsigned)FLASH_PIPE, CPU_HZ);
+    printf("  logged      %u bytes in %u byte records, flush every %u records\n",
+           bytes, recSize, flushN);
+    printf("  write       %10.0f B/s  (%.3f s), records stalled %llu\n",
+           bytes / ((double)tw / CPU_HZ), (double)tw / CPU_HZ, (unsigned long long)stalls);
+    printf("  programs    %llu commands, %.2f per page, max %u on one page\n",
+           (unsigned long long)w25.ppOps, w25.ppOps / (bytes / 256.0), maxProgs);
+    printf("  amplif.     programmed %.3f, erased %.3f bytes per byte logged\n",
+           (double)w25.ppBytes / bytes, (double)w25.seOps * 4096.0 / bytes);
+    printf("  erases      %llu sectors, max %u on one sector\n",
+           (unsigned long long)w25.seOps, maxErases);
+    printf("  firmware    pages %u, sectors %u, polls %u, max PP %.0f us, max SE %.1f ms, errors %u\n",
+           flash.pages, flash.sectors, flash.polls, flash.progMax * 1e6 / CPU_HZ,
+           flash.eraseMax * 1e3 / CPU_HZ, flash.errors);
+    printf("  driver      busy commands %llu, no WEL %llu, overwrites %llu, SPI overrun %llu\n",
+           (unsigned long long)w25.busyCmds, (unsigned long long)w25.noWel,
+           (unsigned long long)w25.overwrite, (unsigned long long)overruns);
+    printf("  read        %10.0f B/s  (%.3f s), bad bytes %llu%s\n",
+           bytes / ((double)tr / CPU_HZ), (double)tr / CPU_HZ, (unsigned long long)bad,
+           (bytes > w25.size) ? " (log wrapped, not checked)" : "");
+    printf("  CPU in ISRs %9.1f %%     while writing\n", 100.0 * isrCycles / tw);
+
+    for (k = 0; k < VECTOR_COUNT; ++k) {
+        if (isrStat[k].calls != 0U) {
+            printf("  ISR %-13s %8llu calls, max %5llu cycles (%.2f us), mean %.1f cycles\n",
+                   vectors[k].name, (unsigned long long)isrStat[k].calls,
+                   (unsigned long long)isrStat[k].max, isrStat[k].max * 1e6 / CPU_HZ,
+                   (double)isrStat[k].cycles / isrStat[k].calls);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,1147 @@
+/*
+@descp:     Host (Linux) throughput benchmark of the UART-Polling
+            and UART-Interrupt drivers.
+
+            The example's main.c is compiled unmodified against
+            uart_model/stm32f4xx.h, a register model of USART,
+            DMA streams, CRC and NVIC:
+
+            - USART: DR, SR, TXE, TC, RXNE, IDLE, ORE, FE timed
+              from BRR and OVER8, 10 bit frames.
+            - DMA: peripheral <-> memory byte transfers, circular
+              mode, half/full transfer flags and interrupts.
+            - NVIC: level triggered, no nesting, lowest IRQ number
+              first, PRIMASK honoured.
+
+            Simulated time only moves with the firmware: a fixed
+            cost per register access and per function call
+            (-finstrument-functions). Both are rough figures for
+            a Cortex-M4 and can be changed on the command line.
+
+            A peer on the far side of USART3 sends a byte counter
+            in bursts and checks what is echoed back. Line errors
+            (framing error, corrupted byte) can be injected.
+
+            -W (UART-Interrupt only) tests the Tx path instead:
+            the bench calls uart_write() with a byte counter in
+            random chunks of 1..2 * TX_RING_SIZE bytes, retrying
+            what did not fit in the ring. The peer then has to
+            receive every byte once and in order. If it does not,
+            the exit status is 1.
+
+            -P makes the peer a byte stream instead: bytes read
+            from stdin arrive at USART3 back to back at the
+            line rate, bytes USART3 shifts out are written to
+            stdout. The run lasts until stdin is closed, the
+            results go to stderr. Built with -DBENCH_PKT=1 the
+            firmware runs with PKT_MODE 1, so pkt_loop -f can
+            test the real packet layer (COBS framing, CRC unit)
+            with its own decoder over a pseudo-terminal:
+                pkt_loop -f "./uart_bench_INTERRUPT -P"
+
+            Reported per run:
+            - throughput: bytes echoed correctly per second
+            - CPU busy:   1 - (main loop rate / idle main loop rate),
+                          measured against a run without traffic
+            - ISR:        calls, maximum and mean duration
+
+            Modelling limits: SR read alone clears IDLE, ORE, NF
+            and FE (a discarded "(void)USART3->DR" is not visible
+            to the model), no flow control, no Tx DMA errors.
+
+@build:     for variant in POLLING INTERRUPT; do
+                g++ -O2 -Wall                                           \
+                    -finstrument-functions                              \
+                    -finstrument-functions-exclude-file-list=uart_bench,uart_model,/usr/ \
+                    -IHost-Tools/uart_model -DBENCH_$variant            \
+                    -DBENCH_BAUD=115200                                 \
+                    -o uart_bench_$variant Host-Tools/uart_bench.cpp;
+            done
+
+            BENCH_BAUD and BENCH_OVER8 are compiled into the
+            firmware BRR, defaults 115200 and 0. BENCH_PKT 1
+            (UART-Interrupt) builds the firmware with PKT_MODE.
+
+@usage:     uart_bench_<variant> [-t ms] [-B burst] [-G gap] [-e ppm]
+                                 [-a cycles] [-c cycles] [-s seed]
+                                 [-W bytes] [-P]
+
+            -t  simulated traffic time in ms (100)
+            -B  bytes per burst, 0 = continuous (0)
+            -G  idle frames between bursts (0)
+            -e  injected line errors per million bytes (0)
+            -a  CPU cycles per register access (2)
+            -c  CPU cycles per function call (8)
+            -s  random seed for error injection and -W chunks (1)
+            -W  uart_write() test with this many bytes
+            -P  USART3 peer is stdin / stdout
+
+@warrenty:  void
+*/
+
+#include "stm32f4xx.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef BENCH_BAUD
+#define       BENCH_BAUD        115200U
+#endif
+
+#ifndef BENCH_OVER8
+#define       BENCH_OVER8       0U
+#endif
+
+#ifndef BENCH_PKT
+#define       BENCH_PKT         0
+#endif
+
+/*
+    Firmware under test, renamed main(), echo mode
+*/
+#define       main              firmware_main
+
+#if defined(BENCH_POLLING)
+
+#define       SHELL_MODE        0
+#define       USART3_BAUDRATE   BENCH_BAUD
+#define       USART3_OVER8      BENCH_OVER8
+#include "../UART-Polling/source/main.c"
+
+#define       BENCH_NAME        "UART-Polling"
+#define       BENCH_LOOP_FN     rx_poll
+#define       FW_OVERRUN        rxOverrun
+#define       FW_FRAMING        rxFraming
+#define       FW_DROPPED        rxDropped
+
+#elif defined(BENCH_INTERRUPT)
+
+#define       PKT_MODE          BENCH_PKT
+#define       UART3_BAUDRATE    BENCH_BAUD
+#define       UART_OVER8        BENCH_OVER8
+#include "../UART-Interrupt/Source/main.c"
+
+#define       BENCH_NAME        "UART-Interrupt"
+#define       BENCH_LOOP_FN     uart_rx_span
+#define       FW_OVERRUN        uart[UART_3].rxOverrun
+#define       FW_FRAMING        uart[UART_3].rxFraming
+#define       FW_DROPPED        uart[UART_3].rxDropped
+
+#else
+#error "define BENCH_POLLING or BENCH_INTERRUPT"
+#endif
+
+#undef        main
+
+#ifndef PCLK2_HZ
+#define       PCLK2_HZ          PCLK1_HZ
+#endif
+
+/*
+    HSI, no prescalers: core clock = PCLK1 = PCLK2
+*/
+#define       CPU_HZ            16000000U
+
+#define       ISR_ENTRY_CYCLES  12U
+#define       ISR_EXIT_CYCLES   10U
+
+/*
+    USART SR bits
+*/
+#define       SR_PE             (1U << 0)
+#define       SR_FE             (1U << 1)
+#define       SR_NF             (1U << 2)
+#define       SR_ORE            (1U << 3)
+#define       SR_IDLE           (1U << 4)
+#define       SR_RXNE           (1U << 5)
+#define       SR_TC             (1U << 6)
+#define       SR_TXE            (1U << 7)
+
+#define       NEVER             (~(uint64_t)0)
+
+/*
+    -W byte counter modulus, prime: a byte overwritten or
+    repeated a whole ring size away still breaks the sequence
+*/
+#define       WRITE_SEQ_MOD     251U
+
+/*
+    Register blocks seen by the firmware
+*/
+USART_TypeDef       sim_usart[SIM_USART_COUNT];
+DMA_TypeDef         sim_dma[2];
+DMA_Stream_TypeDef  sim_dma_stream[2][8];
+CRC_TypeDef         sim_crc;
+RCC_TypeDef         sim_rcc;
+DWT_Type            sim_dwt;
+CoreDebug_Type      sim_coredebug;
+ITM_Type            sim_itm;
+uint8_t             sim_gpio[9][0x400];
+uint32_t            sim_primask;
+uint32_t            SystemCoreClock = CPU_HZ;
+
+/*
+    USART internal state
+*/
+typedef struct {
+    uint32_t    sr;
+    uint8_t     rdr;
+    uint8_t     tdr;
+    uint8_t     tsr;
+    int         tdrFull;
+    uint64_t    tsrDone;            /* end of frame in shift register, NEVER if idle */
+    uint64_t    idleAt;             /* IDLE detection time, NEVER if not armed */
+} usart_state_t;
+
+/*
+    DMA stream internal state
+*/
+typedef struct {
+    uint32_t    ndtr0;
+    uint32_t    pos;
+} stream_state_t;
+
+/*
+    Far end of USART3
+*/
+typedef struct {
+    uint64_t    start;
+    uint64_t    stop;
+    uint64_t    nextRx;             /* arrival of next byte at USART3, NEVER when done */
+    uint32_t    burst;
+    uint32_t    gap;
+    uint32_t    burstLeft;
+    uint32_t    errPpm;
+    uint32_t    writeBytes;         /* -W: uart_write() test, no traffic */
+    int         stream;             /* -P: bytes from stdin, to stdout */
+    uint8_t     txSeq;
+    uint8_t     rxSeq;
+} peer_t;
+
+typedef struct {
+    IRQn_Type   irq;
+    void     (* fn)(void);
+    const char* name;
+    int         dma;                /* 0: USART, 1: DMA stream */
+    int         idx;
+} vector_t;
+
+typedef struct {
+    uint64_t    calls;
+    uint64_t    cycles;
+    uint64_t    max;
+} isr_stat_t;
+
+/*
+    Results of one run, passed back from the child process
+*/
+typedef struct {
+    uint64_t    window;
+    uint64_t    loops;
+    uint64_t    sent;
+    uint64_t    echoed;
+    uint64_t    bad;
+    uint64_t    written;            /* -W: bytes accepted by uart_write() */
+    uint64_t    injected;
+    uint64_t    overrun;
+    uint64_t    txOverwrite;
+    uint32_t    fwOverrun;
+    uint32_t    fwFraming;
+    uint32_t    fwDropped;
+    isr_stat_t  isr[22];
+} result_t;
+
+static const vector_t vectors[] = {
+    { DMA1_Stream0_IRQn, DMA1_Stream0_IRQHandler, "DMA1_Stream0", 1,  0 },
+    { DMA1_Stream1_IRQn, DMA1_Stream1_IRQHandler, "DMA1_Stream1", 1,  1 },
+    { DMA1_Stream2_IRQn, DMA1_Stream2_IRQHandler, "DMA1_Stream2", 1,  2 },
+    { DMA1_Stream3_IRQn, DMA1_Stream3_IRQHandler, "DMA1_Stream3", 1,  3 },
+    { DMA1_Stream4_IRQn, DMA1_Stream4_IRQHandler, "DMA1_Stream4", 1,  4 },
+    { DMA1_Stream5_IRQn, DMA1_Stream5_IRQHandler, "DMA1_Stream5", 1,  5 },
+    { DMA1_Stream6_IRQn, DMA1_Stream6_IRQHandler, "DMA1_Stream6", 1,  6 },
+    { USART1_IRQn,       USART1_IRQHandler,       "USART1",       0,  SIM_USART1 },
+    { USART2_IRQn,       USART2_IRQHandler,       "USART2",       0,  SIM_USART2 },
+    { USART3_IRQn,       USART3_IRQHandler,       "USART3",       0,  SIM_USART3 },
+    { DMA1_Stream7_IRQn, DMA1_Stream7_IRQHandler, "DMA1_Stream7", 1,  7 },
+    { UART4_IRQn,        UART4_IRQHandler,        "UART4",        0,  SIM_UART4 },
+    { UART5_IRQn,        UART5_IRQHandler,        "UART5",        0,  SIM_UART5 },
+    { DMA2_Stream0_IRQn, DMA2_Stream0_IRQHandler, "DMA2_Stream0", 1,  8 },
+    { DMA2_Stream1_IRQn, DMA2_Stream1_IRQHandler, "DMA2_Stream1", 1,  9 },
+    { DMA2_Stream2_IRQn, DMA2_Stream2_IRQHandler, "DMA2_Stream2", 1, 10 },
+    { DMA2_Stream3_IRQn, DMA2_Stream3_IRQHandler, "DMA2_Stream3", 1, 11 },
+    { DMA2_Stream4_IRQn, DMA2_Stream4_IRQHandler, "DMA2_Stream4", 1, 12 },
+    { DMA2_Stream5_IRQn, DMA2_Stream5_IRQHandler, "DMA2_Stream5", 1, 13 },
+    { DMA2_Stream6_IRQn, DMA2_Stream6_IRQHandler, "DMA2_Stream6", 1, 14 },
+    { DMA2_Stream7_IRQn, DMA2_Stream7_IRQHandler, "DMA2_Stream7", 1, 15 },
+    { USART6_IRQn,       USART6_IRQHandler,       "USART6",       0,  SIM_USART6 },
+};
+
+#define       VECTOR_COUNT      (sizeof(vectors) / sizeof(vectors[0]))
+
+static const uint8_t dmaShift[4] = { 0U, 6U, 16U, 22U };
+
+static usart_state_t  usartState[SIM_USART_COUNT];
+static stream_state_t streamState[2][8];
+static peer_t         peer;
+static result_t       res;
+
+static uint64_t       simNow;
+static uint64_t       simEnd;
+static jmp_buf        simExit;
+static int            simInIsr;
+static uint32_t       nvicEnabled[(SIM_IRQ_COUNT + 31) / 32];
+static uint32_t       crcValue;
+static uint32_t       cycBase;
+
+/*
+    -P: bytes read from stdin, not yet sent to USART3,
+    and the next time stdin is polled
+*/
+static uint8_t        streamBuf[256];
+static uint32_t       streamPos;
+static uint32_t       streamLen;
+static uint64_t       streamPoll;
+
+static uint32_t       accessCycles = 2U;
+static uint32_t       callCycles   = 8U;
+
+static void sim_tick(uint32_t cycles);
+
+/*
+    Duration of one frame in CPU cycles, from BRR and OVER8
+*/
+static uint64_t frame_cycles(int i) {
+
+    uint32_t brr  = sim_usart[i].BRR.v;
+    uint32_t cr1  = sim_usart[i].CR1.v;
+    uint32_t pclk = ((i == SIM_USART1) || (i == SIM_USART6)) ? PCLK2_HZ : PCLK1_HZ;
+    uint32_t div  = (cr1 & (1U << 15)) ? (((brr >> 4) << 3) | (brr & 7U)) : brr;
+    uint32_t bits = (cr1 & (1U << 12)) ? 11U : 10U;
+
+    if (div == 0U) {
+        div = 16U;
+    }
+
+    return ((uint64_t)bits * div * CPU_HZ + pclk / 2U) / pclk;
+}
+
+static int usart_enabled(int i, uint32_t bit) {
+    return (sim_usart[i].CR1.v & (1U << 13)) && (sim_usart[i].CR1.v & (1U << bit));
+}
+
+/*
+    Byte shifted out of USART3 reaches the peer.
+    A small step forward is taken as lost bytes,
+    anything else as a corrupted byte.
+*/
+static void peer_receive(uint8_t b) {
+
+    if (peer.stream) {
+        if (write(1, &b, 1) != 1) {
+            longjmp(simExit, 1);
+        }
+
+        ++res.echoed;
+        return;
+    }
+
+    /*
+        -W: nothing may be lost or reordered
+    */
+    if (peer.writeBytes != 0U) {
+        if (b == peer.rxSeq) {
+            ++res.echoed;
+        } else {
+            ++res.bad;
+        }
+
+        peer.rxSeq = (uint8_t)((b + 1U) % WRITE_SEQ_MOD);
+        return;
+    }
+
+    if ((uint8_t)(b - peer.rxSeq) < 16U) {
+        ++res.echoed;
+        peer.rxSeq = (uint8_t)(b + 1U);
+    } else {
+        ++res.bad;
+        ++peer.rxSeq;
+    }
+}
+
+static void usart_rx(int i, uint8_t b, int err, uint64_t at) {
+
+    usart_state_t * s = &usartState[i];
+
+    if (!usart_enabled(i, 2)) {
+        return;
+    }
+
+    /*
+        RDR still full: the new byte is lost
+    */
+    if (s->sr & SR_RXNE) {
+        s->sr |= SR_ORE;
+        ++res.overrun;
+    } else {
+        s->rdr = b;
+        s->sr |= SR_RXNE | (err ? SR_FE : 0U);
+    }
+
+    s->idleAt = at + frame_cycles(i);
+}
+
+static void usart_tx(int i, uint8_t b) {
+
+    usart_state_t * s = &usartState[i];
+
+    if (!usart_enabled(i, 3)) {
+        return;
+    }
+
+    if (s->tsrDone == NEVER) {
+        s->tsr     = b;
+        s->tsrDone = simNow + frame_cycles(i);
+        s->sr      = (s->sr | SR_TXE) & ~SR_TC;
+    } else {
+        if (s->tdrFull) {
+            ++res.txOverwrite;
+        }
+
+        s->tdr     = b;
+        s->tdrFull = 1;
+        s->sr     &= ~(SR_TXE | SR_TC);
+    }
+}
+
+static void usart_tx_done(int i) {
+
+    usart_state_t * s = &usartState[i];
+
+    if (i == SIM_USART3) {
+        peer_receive(s->tsr);
+    }
+
+    if (s->tdrFull) {
+        s->tsr      = s->tdr;
+        s->tdrFull  = 0;
+        s->tsrDone += frame_cycles(i);
+        s->sr      |= SR_TXE;
+    } else {
+        s->tsrDone  = NEVER;
+        s->sr      |= SR_TC;
+    }
+}
+
+/*
+    Next byte from the peer arrives at USART3
+*/
+static void peer_send(void) {
+
+    uint64_t at  = peer.nextRx;
+    uint8_t  b   = peer.stream ? streamBuf[streamPos++] : peer.txSeq++;
+    int      err = (peer.errPpm != 0U) && ((uint32_t)(rand() % 1000000) < peer.errPpm);
+
+    if (err) {
+        b ^= 0x5AU;
+        ++res.injected;
+    }
+
+    if (!peer.stream) {
+        ++res.sent;
+    }
+
+    usart_rx(SIM_USART3, b, err, at);
+
+    if ((peer.burst != 0U) && (--peer.burstLeft == 0U)) {
+        peer.burstLeft = peer.burst;
+        at += (uint64_t)peer.gap * frame_cycles(SIM_USART3);
+    }
+
+    at += frame_cycles(SIM_USART3);
+
+    if (peer.stream) {
+        peer.nextRx = (streamPos < streamLen) ? at : NEVER;
+    } else {
+        peer.nextRx = (at < peer.stop) ? at : NEVER;
+    }
+}
+
+/*
+    -P: once per frame time, queue what stdin has ready.
+    End of input ends the run.
+*/
+static void stream_poll(void) {
+
+    struct pollfd p;
+    ssize_t       n;
+
+    if ((peer.nextRx != NEVER) || (simNow < streamPoll)) {
+        return;
+    }
+
+    streamPoll = simNow + frame_cycles(SIM_USART3);
+
+    p.fd     = 0;
+    p.events = POLLIN;
+
+    if (poll(&p, 1, 0) <= 0) {
+        return;
+    }
+
+    n = read(0, streamBuf, sizeof(streamBuf));
+
+    if (n <= 0) {
+        if ((n < 0) && (errno == EINTR)) {
+            return;
+        }
+
+        longjmp(simExit, 1);
+    }
+
+    streamPos   = 0;
+    streamLen   = (uint32_t)n;
+    res.sent   += (uint64_t)n;
+    peer.nextRx = simNow;
+}
+
+static void stream_flag(int c, int n, uint32_t flag) {
+
+    volatile uint32_t * isr = (n < 4) ? &sim_dma[c].LISR : &sim_dma[c].HISR;
+
+    *isr |= flag << dmaShift[n & 3];
+}
+
+/*
+    Move every byte a USART is requesting on enabled streams
+*/
+static void dma_service(void) {
+
+    int c;
+    int n;
+    int i;
+
+    for (c = 0; c < 2; ++c) {
+        for (n = 0; n < 8; ++n) {
+
+            DMA_Stream_TypeDef * st = &sim_dma_stream[c][n];
+            stream_state_t     * ss = &streamState[c][n];
+            uint32_t             cr = st->CR.v;
+            uint8_t            * mem;
+
+            if (!(cr & 1U)) {
+                continue;
+            }
+
+            for (i = 0; i < SIM_USART_COUNT; ++i) {
+                if (st->PAR.v == (uintptr_t)&sim_usart[i].DR) {
+                    break;
+                }
+            }
+
+            if (i == SIM_USART_COUNT) {
+                continue;
+            }
+
+            mem = (uint8_t *)(uintptr_t)st->M0AR.v;
+
+            for (;;) {
+
+                usart_state_t * s = &usartState[i];
+
+                if ((((cr >> 6) & 3U) == 0U) && (s->sr & SR_RXNE) && (sim_usart[i].CR3.v & (1U << 6))) {
+                    mem[ss->pos] = s->rdr;
+                    s->sr &= ~SR_RXNE;
+                } else if ((((cr >> 6) & 3U) == 1U) && (s->sr & SR_TXE) && (sim_usart[i].CR3.v & (1U << 7))) {
+                    usart_tx(i, mem[ss->pos]);
+                } else {
+                    break;
+                }
+
+                if (cr & (1U << 10)) {
+                    ++ss->pos;
+                }
+
+                if (--st->NDTR.v == ss->ndtr0 / 2U) {
+                    stream_flag(c, n, 1U << 4);
+                }
+
+                if (st->NDTR.v == 0U) {
+                    stream_flag(c, n, 1U << 5);
+
+                    if (cr & (1U << 8)) {
+                        st->NDTR.v = ss->ndtr0;
+                        ss->pos    = 0;
+                    } else {
+                        st->CR.v &= ~1U;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+    Write-only flag clear registers take effect
+*/
+static void dma_clear_flags(void) {
+
+    int c;
+
+    for (c = 0; c < 2; ++c) {
+        sim_dma[c].LISR &= ~sim_dma[c].LIFCR;
+        sim_dma[c].HISR &= ~sim_dma[c].HIFCR;
+        sim_dma[c].LIFCR = 0;
+        sim_dma[c].HIFCR = 0;
+    }
+}
+
+/*
+    Process line events up to time t
+*/
+static void sim_run(uint64_t t) {
+
+    if (peer.stream) {
+        stream_poll();
+    }
+
+    for (;;) {
+
+        uint64_t next = peer.nextRx;
+        int      what = -1;
+        int      i;
+
+        for (i = 0; i < SIM_USART_COUNT; ++i) {
+            if (usartState[i].tsrDone < next) {
+                next = usartState[i].tsrDone;
+                what = i;
+            }
+        }
+
+        for (i = 0; i < SIM_USART_COUNT; ++i) {
+            if (usartState[i].idleAt < next) {
+                next = usartState[i].idleAt;
+                what = SIM_USART_COUNT + i;
+            }
+        }
+
+        if (next > t) {
+            break;
+        }
+
+        if (what < 0) {
+            peer_send();
+        } else if (what < SIM_USART_COUNT) {
+            usart_tx_done(what);
+        } else {
+            usartState[what - SIM_USART_COUNT].sr    |= SR_IDLE;
+            usartState[what - SIM_USART_COUNT].idleAt = NEVER;
+        }
+
+        dma_service();
+    }
+}
+
+static int irq_pending(const vector_t * v) {
+
+    if (v->fn == NULL) {
+        return 0;
+    }
+
+    if (!(nvicEnabled[v->irq >> 5] & (1U << (v->irq & 31)))) {
+        return 0;
+    }
+
+    if (v->dma) {
+
+        int      c     = v->idx >> 3;
+        int      n     = v->idx & 7;
+        uint32_t cr    = sim_dma_stream[c][n].CR.v;
+        uint32_t flags = ((n < 4) ? sim_dma[c].LISR : sim_dma[c].HISR) >> dmaShift[n & 3];
+
+        return ((cr & (1U << 4)) && (flags & (1U << 5))) ||
+               ((cr & (1U << 3)) && (flags & (1U << 4))) ||
+               ((cr & (1U << 2)) && (flags & (1U << 3))) ||
+               ((cr & (1U << 1)) && (flags & (1U << 2)));
+    } else {
+
+        uint32_t sr  = usartState[v->idx].sr;
+        uint32_t cr1 = sim_usart[v->idx].CR1.v;
+        uint32_t cr3 = sim_usart[v->idx].CR3.v;
+
+        return ((cr1 & (1U << 5)) && (sr & (SR_RXNE | SR_ORE))) ||
+               ((cr1 & (1U << 7)) && (sr & SR_TXE)) ||
+               ((cr1 & (1U << 6)) && (sr & SR_TC)) ||
+               ((cr1 & (1U << 4)) && (sr & SR_IDLE)) ||
+               ((cr3 & (1U << 0)) && (cr3 & (1U << 6)) && (sr & (SR_FE | SR_NF | SR_ORE)));
+    }
+}
+
+/*
+    Take pending interrupts, lowest IRQ number first
+*/
+static void sim_dispatch(void) {
+
+    unsigned k;
+
+    while (!sim_primask) {
+
+        uint64_t t0 = simNow;
+
+        dma_clear_flags();
+
+        for (k = 0; k < VECTOR_COUNT; ++k) {
+            if (irq_pending(&vectors[k])) {
+                break;
+            }
+        }
+
+        if (k == VECTOR_COUNT) {
+            return;
+        }
+
+        simInIsr = 1;
+        sim_tick(ISR_ENTRY_CYCLES);
+        vectors[k].fn();
+        sim_tick(ISR_EXIT_CYCLES);
+        simInIsr = 0;
+
+        dma_clear_flags();
+
+        res.isr[k].calls  += 1U;
+        res.isr[k].cycles += simNow - t0;
+
+        if (simNow - t0 > res.isr[k].max) {
+            res.isr[k].max = simNow - t0;
+        }
+
+        if (simNow >= simEnd) {
+            longjmp(simExit, 1);
+        }
+    }
+}
+
+/*
+    CPU spends cycles: advance the line, then take interrupts
+*/
+static void sim_tick(uint32_t cycles) {
+
+    simNow += cycles;
+    sim_run(simNow);
+
+    if (!simInIsr) {
+
+        sim_dispatch();
+
+        if (simNow >= simEnd) {
+            longjmp(simExit, 1);
+        }
+    }
+}
+
+static uint32_t crc_word(uint32_t crc, uint32_t w) {
+
+    int b;
+
+    crc ^= w;
+
+    for (b = 0; b < 32; ++b) {
+        crc = (crc & 0x80000000U) ? ((crc << 1) ^ 0x04C11DB7U) : (crc << 1);
+    }
+
+    return crc;
+}
+
+/*
+    Locate a register: block index and register number
+*/
+#define       REG_IN(___r, ___base, ___type, ___count)                            \
+    (((const char *)(___r) >= (const char *)(___base)) &&                           \
+     ((const char *)(___r) <  (const char *)(___base) + sizeof(___type) * (___count)))
+
+#define       REG_IDX(___r, ___base, ___type)                                      \
+    ((int)(((const char *)(___r) - (const char *)(___base)) / sizeof(___type)))
+
+#define       REG_NUM(___r, ___base, ___type)                                      \
+    ((int)((((const char *)(___r) - (const char *)(___base)) % sizeof(___type)) / sizeof(sim_reg)))
+
+uint32_t sim_reg_read(sim_reg * r) {
+
+    sim_tick(accessCycles);
+
+    if (REG_IN(r, sim_usart, USART_TypeDef, SIM_USART_COUNT)) {
+
+        usart_state_t * s = &usartState[REG_IDX(r, sim_usart, USART_TypeDef)];
+        uint32_t        v;
+
+        switch (REG_NUM(r, sim_usart, USART_TypeDef)) {
+
+            case 0:
+                v      = s->sr;
+                s->sr &= ~(SR_IDLE | SR_ORE | SR_NF | SR_FE | SR_PE);
+                return v;
+
+            case 1:
+                s->sr &= ~SR_RXNE;
+                return s->rdr;
+
+            default:
+                return r->v;
+        }
+    }
+
+    if (r == &sim_dwt.CYCCNT) {
+        return (uint32_t)simNow - cycBase;
+    }
+
+    if (r == &sim_crc.DR) {
+        return crcValue;
+    }
+
+    return r->v;
+}
+
+void sim_reg_write(sim_reg * r, uintptr_t a) {
+
+    uint32_t v = (uint32_t)a;
+
+    sim_tick(accessCycles);
+
+    if (REG_IN(r, sim_usart, USART_TypeDef, SIM_USART_COUNT)) {
+
+        int i = REG_IDX(r, sim_usart, USART_TypeDef);
+
+        switch (REG_NUM(r, sim_usart, USART_TypeDef)) {
+
+            case 0:
+                usartState[i].sr &= v | ~(SR_RXNE | SR_TC);
+                break;
+
+            case 1:
+                usart_tx(i, (uint8_t)v);
+                break;
+
+            default:
+                r->v = v;
+                break;
+        }
+
+    } else if (REG_IN(r, sim_dma_stream, DMA_Stream_TypeDef, 16)) {
+
+        int c = REG_IDX(r, sim_dma_stream, DMA_Stream_TypeDef) >> 3;
+        int n = REG_IDX(r, sim_dma_stream, DMA_Stream_TypeDef) & 7;
+
+        /*
+            EN rising edge latches NDTR
+        */
+        if ((REG_NUM(r, sim_dma_stream, DMA_Stream_TypeDef) == 0) && !(r->v & 1U) && (v & 1U)) {
+            streamState[c][n].ndtr0 = sim_dma_stream[c][n].NDTR.v;
+            streamState[c][n].pos   = 0;
+
+            if (streamState[c][n].ndtr0 == 0U) {
+                v &= ~1U;
+            }
+        }
+
+        /*
+            PAR, M0AR and M1AR keep the full host address
+        */
+        switch (REG_NUM(r, sim_dma_stream, DMA_Stream_TypeDef)) {
+            case 2: case 3: case 4:
+                r->v = a;
+                break;
+            default:
+                r->v = v;
+                break;
+        }
+
+    } else if (r == &sim_dwt.CYCCNT) {
+        cycBase = (uint32_t)simNow - v;
+    } else if (r == &sim_crc.DR) {
+        crcValue = crc_word(crcValue, v);
+    } else if (r == &sim_crc.CR) {
+        if (v & 1U) {
+            crcValue = 0xFFFFFFFFU;
+        }
+    } else {
+        r->v = v;
+    }
+
+    dma_service();
+}
+
+void SystemCoreClockUpdate(void) {
+    SystemCoreClock = CPU_HZ;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq) {
+    nvicEnabled[irq >> 5] |= 1U << (irq & 31);
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq) {
+    nvicEnabled[irq >> 5] &= ~(1U << (irq & 31));
+}
+
+/*
+    Function entry costs time, main loop passes are counted
+    while the peer is active
+*/
+extern "C" void __cyg_profile_func_enter(void * fn, void * site) {
+
+    (void)site;
+
+    if (!simInIsr && (fn == (void *)&BENCH_LOOP_FN) &&
+        (simNow >= peer.start) && (simNow < peer.stop)) {
+        ++res.loops;
+    }
+
+    sim_tick(callCycles);
+}
+
+extern "C" void __cyg_profile_func_exit(void * fn, void * site) {
+    (void)fn;
+    (void)site;
+}
+
+#if defined(BENCH_INTERRUPT)
+/*
+    -W: firmware start-up without the echo loop, then
+    uart_write() from the main loop while the TXE
+    interrupt drains the ring
+*/
+static void write_test(uint32_t bytes) {
+
+    static uint8_t chunk[2U * TX_RING_SIZE];
+    uart_t       * u    = &uart[UART_3];
+    uint32_t       seq  = 0;
+    uint32_t       len;
+    uint32_t       n;
+    uint32_t       i;
+
+    SystemCoreClockUpdate();
+    prof_init(prof, PROF_COUNT);
+    uart_init(UART_3);
+
+    simEnd = simNow + 2U * (uint64_t)bytes * frame_cycles(SIM_USART3) + CPU_HZ / 10U;
+
+    while (res.written < bytes) {
+
+        len = 1U + (uint32_t)rand() % sizeof(chunk);
+
+        if (len > bytes - res.written) {
+            len = bytes - (uint32_t)res.written;
+        }
+
+        for (i = 0; i < len; ++i) {
+            chunk[i] = (uint8_t)((seq + i) % WRITE_SEQ_MOD);
+        }
+
+        for (n = 0; n < len; ) {
+            n += uart_write(u, &chunk[n], len - n);
+        }
+
+        seq          = (seq + len) % WRITE_SEQ_MOD;
+        res.written += len;
+    }
+
+    /*
+        last frame shifted out and the ring empty, SR is
+        read first: the ring indexes alone take no time
+    */
+    while (!(USART3->SR & (1U << 6)) || (u->tx.tail != u->tx.head));
+}
+#endif
+
+/*
+    Run the firmware from reset in a child process,
+    the firmware keeps its state in globals.
+*/
+static result_t run(uint64_t window, int traffic, const peer_t * cfg) {
+
+    int      fd[2];
+    pid_t    pid;
+    result_t r;
+    int      i;
+
+    memset(&r, 0, sizeof(r));
+
+    if (pipe(fd) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+
+        close(fd[0]);
+
+        for (i = 0; i < SIM_USART_COUNT; ++i) {
+            usartState[i].sr      = SR_TXE | SR_TC;
+            usartState[i].tsrDone = NEVER;
+            usartState[i].idleAt  = NEVER;
+        }
+
+        /*
+            peer starts once the firmware had 1ms to initialise,
+            stops after the window, then the echo drains
+        */
+        peer           = *cfg;
+        peer.start     = CPU_HZ / 1000U;
+        peer.stop      = peer.start + window;
+        peer.burstLeft = peer.burst;
+        peer.nextRx    = traffic ? peer.start : NEVER;
+        streamPoll     = peer.start;
+        simEnd         = peer.stream ? NEVER : (peer.stop + CPU_HZ / 20U);
+        res.window     = window;
+
+        if (setjmp(simExit) == 0) {
+#if defined(BENCH_INTERRUPT)
+            if (peer.writeBytes != 0U) {
+                write_test(peer.writeBytes);
+            } else
+#endif
+            firmware_main();
+        }
+
+        res.fwOverrun = FW_OVERRUN;
+        res.fwFraming = FW_FRAMING;
+        res.fwDropped = FW_DROPPED;
+
+        if (write(fd[1], &res, sizeof(res)) != (ssize_t)sizeof(res)) {
+            _exit(1);
+        }
+
+        _exit(0);
+    }
+
+    close(fd[1]);
+
+    if (read(fd[0], &r, sizeof(r)) != (ssize_t)sizeof(r)) {
+        fprintf(stderr, "benchmark run failed\n");
+        exit(1);
+    }
+
+    close(fd[0]);
+    waitpid(pid, NULL, 0);
+
+    return r;
+}
+
+int main(int argc, char ** argv) {
+
+    peer_t   cfg;
+    result_t idle;
+    result_t load;
+    double   ms     = 100.0;
+    double   secs;
+    double   line   = BENCH_BAUD / 10.0;
+    double   busy;
+    unsigned seed   = 1U;
+    int      opt;
+    unsigned k;
+
+    memset(&cfg, 0, sizeof(cfg));
+
+    while ((opt = getopt(argc, argv, "t:B:G:e:a:c:s:W:P")) != -1) {
+
+        switch (opt) {
+            case 't': ms           = strtod(optarg, NULL);               break;
+            case 'B': cfg.burst    = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'G': cfg.gap      = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'e': cfg.errPpm   = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'a': accessCycles = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'c': callCycles   = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 's': seed         = (unsigned)strtoul(optarg, NULL, 0); break;
+            case 'W': cfg.writeBytes = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'P': cfg.stream   = 1;                                  break;
+            default:
+                fprintf(stderr, "usage: %s [-t ms] [-B burst] [-G gap] [-e ppm] "
+                                "[-a cycles] [-c cycles] [-s seed] [-W bytes] [-P]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    srand(seed);
+
+    if (cfg.stream) {
+        load = run(0, 0, &cfg);
+
+        fprintf(stderr, "%s: USART3 on stdin / stdout, %u baud%s\n", BENCH_NAME,
+                (unsigned)BENCH_BAUD, BENCH_PKT ? ", PKT_MODE" : "");
+        fprintf(stderr, "  received %llu, sent %llu bytes, overrun %llu, Tx overwrite %llu\n",
+                (unsigned long long)load.sent, (unsigned long long)load.echoed,
+                (unsigned long long)load.overrun, (unsigned long long)load.txOverwrite);
+
+        return 0;
+    }
+
+    if (cfg.writeBytes != 0U) {
+#if defined(BENCH_INTERRUPT)
+        load = run(0, 0, &cfg);
+
+        printf("%s: uart_write() to USART3, %u bytes in chunks of 1..%u, %u baud\n",
+               BENCH_NAME, cfg.writeBytes, 2U * TX_RING_SIZE, (unsigned)BENCH_BAUD);
+        printf("  written %llu, received in order %llu, out of order %llu, missing %llu\n",
+               (unsigned long long)load.written, (unsigned long long)load.echoed,
+               (unsigned long long)load.bad,
+               (unsigned long long)(load.written - load.echoed - load.bad));
+        printf("  line        Tx overwrite %llu\n", (unsigned long long)load.txOverwrite);
+
+        return ((load.written == cfg.writeBytes) && (load.echoed == load.written) &&
+                (load.txOverwrite == 0U)) ? 0 : 1;
+#else
+        fprintf(stderr, "-W needs the UART-Interrupt variant\n");
+        return 1;
+#endif
+    }
+
+    idle = run((uint64_t)(ms * (CPU_HZ / 1000.0)), 0, &cfg);
+    load = run((uint64_t)(ms * (CPU_HZ / 1000.0)), 1, &cfg);
+
+    secs = (double)load.window / CPU_HZ;
+    busy = (idle.loops != 0U) ? 1.0 - (double)load.loops / (double)idle.loops : 0.0;
+
+    if (busy < 0.0) {
+        busy = 0.0;
+    }
+
+    printf("%s: USART3 %u baud, core %u Hz, %u cycles/access, %u cycles/call\n",
+           BENCH_NAME, (unsigned)BENCH_BAUD, CPU_HZ, accessCycles, callCycles);
+    printf("  offered     %10.0f B/s  (%5.1f %% of line)\n", load.sent / secs, 100.0 * load.sent / secs / line);
+    printf("  throughput  %10.0f B/s  (%5.1f %% of line)\n", load.echoed / secs, 100.0 * load.echoed / secs / line);
+    printf("  sent %llu, echoed %llu, bad %llu, lost %llu\n",
+           (unsigned long long)load.sent, (unsigned long long)load.echoed,
+           (unsigned long long)load.bad,
+           (unsigned long long)(load.sent - load.echoed - load.bad));
+    printf("  line        injected %llu, overrun %llu, Tx overwrite %llu\n",
+           (unsigned long long)load.injected, (unsigned long long)load.overrun,
+           (unsigned long long)load.txOverwrite);
+    printf("  firmware    rxOverrun %u, rxFraming %u, rxDropped %u\n",
+           load.fwOverrun, load.fwFraming, load.fwDropped);
+    printf("  CPU busy    %10.1f %%     (main loop %llu / %llu idle)\n", 100.0 * busy,
+           (unsigned long long)load.loops, (unsigned long long)idle.loops);
+
+    for (k = 0; k < VECTOR_COUNT; ++k) {
+        if (load.isr[k].calls != 0U) {
+            printf("  ISR %-13s %8llu calls, max %5llu cycles (%.2f us), mean %.1f cycles\n",
+                   vectors[k].name, (unsigned long long)load.isr[k].calls,
+                   (unsigned long long)load.isr[k].max, load.isr[k].max * 1e6 / CPU_HZ,
+                   (double)load.isr[k].cycles / load.isr[k].calls);
+        }
+    }
+
+    return 0;
+}
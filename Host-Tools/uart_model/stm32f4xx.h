@@ -0,0 +1,294 @@
+/*
+@descp:     Host register model standing in for the CMSIS device
+            header, see uart_bench.cpp.
+
+            Only what the UART-Polling and UART-Interrupt
+            examples touch is declared. USART, DMA stream,
+            CRC and DWT->CYCCNT registers are sim_reg objects:
+            every access goes through the model, which advances
+            simulated time, moves DMA data and calls the
+            interrupt handlers. RCC, GPIO and the DMA flag
+            registers are plain memory.
+
+            Peripheral and buffer addresses are handed to the
+            model as uintptr_t, a DMA stream keeps them at full
+            width in PAR / M0AR / M1AR, so the bench links as a
+            normal (PIE) executable and builds warning-clean.
+
+@warrenty:  void
+*/
+
+#ifndef __UART_MODEL_STM32F4XX_H
+#define __UART_MODEL_STM32F4XX_H
+
+#include <stdint.h>
+
+#ifndef __cplusplus
+#error "the register model is C++, build the firmware with g++ -x c++"
+#endif
+
+#define     __I         volatile const
+#define     __O         volatile
+#define     __IO        volatile
+
+/*
+    Peripheral register: reads and writes are routed to the model
+*/
+struct sim_reg;
+
+uint32_t sim_reg_read(sim_reg * r);
+void     sim_reg_write(sim_reg * r, uintptr_t v);
+
+/*
+    v is uintptr_t so a DMA address register can hold
+    a host address, every other register is 32 bits wide
+    and the model truncates the value written to it
+*/
+struct sim_reg {
+
+    uintptr_t v;
+
+    operator uint32_t ()                    { return sim_reg_read(this); }
+
+    sim_reg & operator= (uintptr_t x)       { sim_reg_write(this, x); return *this; }
+    sim_reg & operator= (sim_reg & o)       { sim_reg_write(this, (uint32_t)o); return *this; }
+    sim_reg & operator|= (uint32_t x)       { sim_reg_write(this, sim_reg_read(this) | x); return *this; }
+    sim_reg & operator&= (uint32_t x)       { sim_reg_write(this, sim_reg_read(this) & x); return *this; }
+    sim_reg & operator^= (uint32_t x)       { sim_reg_write(this, sim_reg_read(this) ^ x); return *this; }
+};
+
+typedef struct {
+    sim_reg SR;
+    sim_reg DR;
+    sim_reg BRR;
+    sim_reg CR1;
+    sim_reg CR2;
+    sim_reg CR3;
+    sim_reg GTPR;
+} USART_TypeDef;
+
+typedef struct {
+    sim_reg CR;
+    sim_reg NDTR;
+    sim_reg PAR;
+    sim_reg M0AR;
+    sim_reg M1AR;
+    sim_reg FCR;
+} DMA_Stream_TypeDef;
+
+typedef struct {
+    __IO uint32_t LISR;
+    __IO uint32_t HISR;
+    __IO uint32_t LIFCR;
+    __IO uint32_t HIFCR;
+} DMA_TypeDef;
+
+typedef struct {
+    sim_reg DR;
+    sim_reg IDR;
+    sim_reg CR;
+} CRC_TypeDef;
+
+typedef struct {
+    __IO uint32_t MODER;
+    __IO uint32_t OTYPER;
+    __IO uint32_t OSPEEDR;
+    __IO uint32_t PUPDR;
+    __IO uint32_t IDR;
+    __IO uint32_t ODR;
+    __IO uint32_t BSRR;
+    __IO uint32_t LCKR;
+    __IO uint32_t AFR[2];
+} GPIO_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR;
+    __IO uint32_t PLLCFGR;
+    __IO uint32_t CFGR;
+    __IO uint32_t CIR;
+    __IO uint32_t AHB1RSTR;
+    __IO uint32_t AHB2RSTR;
+    __IO uint32_t AHB3RSTR;
+    __IO uint32_t APB1RSTR;
+    __IO uint32_t APB2RSTR;
+    __IO uint32_t AHB1ENR;
+    __IO uint32_t AHB2ENR;
+    __IO uint32_t AHB3ENR;
+    __IO uint32_t APB1ENR;
+    __IO uint32_t APB2ENR;
+} RCC_TypeDef;
+
+typedef struct {
+    __IO uint32_t CTRL;             /* NUMCOMP 0: no comparators */
+    sim_reg       CYCCNT;
+    __IO uint32_t CPICNT;
+    __IO uint32_t EXCCNT;
+    __IO uint32_t SLEEPCNT;
+    __IO uint32_t LSUCNT;
+    __IO uint32_t FOLDCNT;
+    __IO uint32_t PCSR;
+    __IO uint32_t COMP0;
+    __IO uint32_t MASK0;
+    __IO uint32_t FUNCTION0;
+         uint32_t RESERVED0[13];
+} DWT_Type;
+
+typedef struct {
+    union {
+        __O  uint8_t  u8;
+        __O  uint16_t u16;
+        __O  uint32_t u32;
+    }             PORT[32];
+    __IO uint32_t TER;
+    __IO uint32_t TCR;
+    __O  uint32_t LAR;
+} ITM_Type;
+
+typedef struct {
+    __IO uint32_t DHCSR;
+    __IO uint32_t DCRSR;
+    __IO uint32_t DCRDR;
+    __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef enum IRQn {
+    DMA1_Stream0_IRQn   = 11,
+    DMA1_Stream1_IRQn   = 12,
+    DMA1_Stream2_IRQn   = 13,
+    DMA1_Stream3_IRQn   = 14,
+    DMA1_Stream4_IRQn   = 15,
+    DMA1_Stream5_IRQn   = 16,
+    DMA1_Stream6_IRQn   = 17,
+    USART1_IRQn         = 37,
+    USART2_IRQn         = 38,
+    USART3_IRQn         = 39,
+    DMA1_Stream7_IRQn   = 47,
+    UART4_IRQn          = 52,
+    UART5_IRQn          = 53,
+    DMA2_Stream0_IRQn   = 56,
+    DMA2_Stream1_IRQn   = 57,
+    DMA2_Stream2_IRQn   = 58,
+    DMA2_Stream3_IRQn   = 59,
+    DMA2_Stream4_IRQn   = 60,
+    DMA2_Stream5_IRQn   = 68,
+    DMA2_Stream6_IRQn   = 69,
+    DMA2_Stream7_IRQn   = 70,
+    USART6_IRQn         = 71,
+    SIM_IRQ_COUNT       = 82
+} IRQn_Type;
+
+/*
+    Model state, defined in uart_bench.cpp
+*/
+enum { SIM_USART1, SIM_USART2, SIM_USART3, SIM_UART4, SIM_UART5, SIM_USART6, SIM_USART_COUNT };
+
+extern USART_TypeDef        sim_usart[SIM_USART_COUNT];
+extern DMA_TypeDef          sim_dma[2];
+extern DMA_Stream_TypeDef   sim_dma_stream[2][8];
+extern CRC_TypeDef          sim_crc;
+extern RCC_TypeDef          sim_rcc;
+extern DWT_Type             sim_dwt;
+extern CoreDebug_Type       sim_coredebug;
+extern ITM_Type             sim_itm;
+extern uint8_t              sim_gpio[9][0x400];
+extern uint32_t             sim_primask;
+
+#define     USART1          (&sim_usart[SIM_USART1])
+#define     USART2          (&sim_usart[SIM_USART2])
+#define     USART3          (&sim_usart[SIM_USART3])
+#define     UART4           (&sim_usart[SIM_UART4])
+#define     UART5           (&sim_usart[SIM_UART5])
+#define     USART6          (&sim_usart[SIM_USART6])
+
+#define     DMA1            (&sim_dma[0])
+#define     DMA2            (&sim_dma[1])
+#define     DMA1_Stream0    (&sim_dma_stream[0][0])
+#define     DMA1_Stream1    (&sim_dma_stream[0][1])
+#define     DMA1_Stream2    (&sim_dma_stream[0][2])
+#define     DMA1_Stream3    (&sim_dma_stream[0][3])
+#define     DMA1_Stream4    (&sim_dma_stream[0][4])
+#define     DMA1_Stream5    (&sim_dma_stream[0][5])
+#define     DMA1_Stream6    (&sim_dma_stream[0][6])
+#define     DMA1_Stream7    (&sim_dma_stream[0][7])
+#define     DMA2_Stream0    (&sim_dma_stream[1][0])
+#define     DMA2_Stream1    (&sim_dma_stream[1][1])
+#define     DMA2_Stream2    (&sim_dma_stream[1][2])
+#define     DMA2_Stream3    (&sim_dma_stream[1][3])
+#define     DMA2_Stream4    (&sim_dma_stream[1][4])
+#define     DMA2_Stream5    (&sim_dma_stream[1][5])
+#define     DMA2_Stream6    (&sim_dma_stream[1][6])
+#define     DMA2_Stream7    (&sim_dma_stream[1][7])
+
+#define     CRC             (&sim_crc)
+#define     RCC             (&sim_rcc)
+#define     DWT             (&sim_dwt)
+#define     CoreDebug       (&sim_coredebug)
+#define     ITM             (&sim_itm)
+
+/*
+    GPIO ports 0x400 apart as on the chip, the firmware
+    derives the port index from the address
+*/
+#define     GPIOA_BASE      ((uintptr_t)sim_gpio[0])
+#define     GPIOA           ((GPIO_TypeDef *)(void *)sim_gpio[0])
+#define     GPIOB           ((GPIO_TypeDef *)(void *)sim_gpio[1])
+#define     GPIOC           ((GPIO_TypeDef *)(void *)sim_gpio[2])
+#define     GPIOD           ((GPIO_TypeDef *)(void *)sim_gpio[3])
+#define     GPIOE           ((GPIO_TypeDef *)(void *)sim_gpio[4])
+#define     GPIOF           ((GPIO_TypeDef *)(void *)sim_gpio[5])
+#define     GPIOG           ((GPIO_TypeDef *)(void *)sim_gpio[6])
+#define     GPIOH           ((GPIO_TypeDef *)(void *)sim_gpio[7])
+#define     GPIOI           ((GPIO_TypeDef *)(void *)sim_gpio[8])
+
+/*
+    Core
+*/
+extern uint32_t SystemCoreClock;
+
+void SystemCoreClockUpdate(void);
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+
+static inline void     __DMB(void)                  { }
+static inline void     __DSB(void)                  { }
+static inline void     __ISB(void)                  { }
+static inline uint32_t __get_PRIMASK(void)          { return sim_primask; }
+static inline void     __set_PRIMASK(uint32_t m)    { sim_primask = m & 1U; }
+static inline void     __disable_irq(void)          { sim_primask = 1U; }
+static inline void     __enable_irq(void)           { sim_primask = 0U; }
+static inline uint32_t __CLZ(uint32_t x)            { return (x != 0U) ? (uint32_t)__builtin_clz(x) : 32U; }
+
+/*
+    no debugger attached
+*/
+static inline uint32_t ITM_SendChar(uint32_t ch)    { return ch; }
+
+/*
+    Interrupt handlers the firmware may define
+*/
+extern "C" {
+void USART1_IRQHandler(void)        __attribute__((weak));
+void USART2_IRQHandler(void)        __attribute__((weak));
+void USART3_IRQHandler(void)        __attribute__((weak));
+void UART4_IRQHandler(void)         __attribute__((weak));
+void UART5_IRQHandler(void)         __attribute__((weak));
+void USART6_IRQHandler(void)        __attribute__((weak));
+void DMA1_Stream0_IRQHandler(void)  __attribute__((weak));
+void DMA1_Stream1_IRQHandler(void)  __attribute__((weak));
+void DMA1_Stream2_IRQHandler(void)  __attribute__((weak));
+void DMA1_Stream3_IRQHandler(void)  __attribute__((weak));
+void DMA1_Stream4_IRQHandler(void)  __attribute__((weak));
+void DMA1_Stream5_IRQHandler(void)  __attribute__((weak));
+void DMA1_Stream6_IRQHandler(void)  __attribute__((weak));
+void DMA1_Stream7_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream0_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream1_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream2_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream3_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream4_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream5_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream6_IRQHandler(void)  __attribute__((weak));
+void DMA2_Stream7_IRQHandler(void)  __attribute__((weak));
+}
+
+#endif
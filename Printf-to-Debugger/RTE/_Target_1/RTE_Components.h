@@ -17,7 +17,7 @@
 #define CMSIS_device_header "stm32f4xx.h"
 
 #define RTE_Compiler_IO_STDOUT          /* Compiler I/O: STDOUT */
-          #define RTE_Compiler_IO_STDOUT_ITM      /* Compiler I/O: STDOUT ITM */
+          #define RTE_Compiler_IO_STDOUT_User     /* Compiler I/O: STDOUT User */
 #define RTE_DEVICE_STARTUP_STM32F4XX    /* Device Startup for STM32F4 */
 
 #endif /* RTE_COMPONENTS_H */
@@ -7,6 +7,23 @@
             usb cable connected to STM32f4-Discovery
             board that programms the onboard micro-
             controller- no extra hardware is required.
+            
+            With LOG_DEFERRED, LOG() sends only a format string
+            ID, a cycle timestamp and the raw arguments on ITM
+            stimulus port 1. Text is rebuilt on the PC by
+            Host-Tools/log_decode.c
+            
+            ITM output never waits: when a stimulus port FIFO
+            is full the message is dropped and counted, so a
+            slow or absent debugger cannot stall the program.
+            printf is retargeted with stdout_putchar (RTE
+            Compiler I/O STDOUT: User).
+            
+            PC sampling profiler (PROF_PC_SAMPLING): the DWT
+            sends the sampled program counter through the ITM,
+            or without SWO a TIM7 interrupt records the stacked
+            PC into pcSample[]. Host-Tools/pc_profile.c turns
+            the samples into a flat profile per function.
 
 @warrenty:  void
 */
@@ -17,29 +34,393 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include "stm32f4xx.h"
 
 extern void SystemCoreClockUpdate(void);
 
 extern uint32_t SystemCoreClock;
 
+/*
+	1: main loop uses deferred binary LOG() instead of printf
+	(off by default)
+*/
+#ifndef LOG_DEFERRED
+#define LOG_DEFERRED		0
+#endif
+
+/*
+	ITM stimulus ports, one per channel. Enable them in
+	debugger trace settings (ITM Stimulus Ports).
+*/
+#define ITM_PORT_TEXT		0U	/* printf text */
+#define ITM_PORT_LOG		1U	/* deferred LOG() packets */
+#define ITM_PORT_EVENT		2U	/* binary events, one word each */
+#define ITM_PORT_COUNTER	3U	/* counter id, value pairs */
+
+/*
+	Ports the program may write, one bit per stimulus port.
+	The debugger enables ports with ITM->TER, this mask can
+	additionally mute channels at runtime (watch window or
+	itm_set_mask()).
+*/
+volatile uint32_t itmPortMask = (1U << ITM_PORT_TEXT) | (1U << ITM_PORT_LOG)
+							  | (1U << ITM_PORT_EVENT) | (1U << ITM_PORT_COUNTER);
+
+/*
+	PC sampling profiler
+	0: off
+	1: DWT PC sample packets on SWO, one every
+	   (PROF_PC_POSTPRESET + 1) * (PROF_PC_CYCTAP ? 1024 : 64)
+	   cycles (16384 cycles = 1ms at 16Mhz HSI by default).
+	   Enable "PC Sampling" in debugger trace settings or
+	   capture raw SWO and run pc_profile on it.
+	2: no SWO, TIM7 interrupt at PROF_TIM_HZ stores the
+	   stacked PC into pcSample[]. Save the buffer from
+	   the debugger, e.g.
+	       SAVE pc.bin &pcSample[0], &pcSample[PROF_PC_BUF]
+	   and run pc_profile -r on it.
+*/
+#ifndef PROF_PC_SAMPLING
+#define PROF_PC_SAMPLING	0
+#endif
+
+#define PROF_PC_CYCTAP		1U		/* 0: CYCCNT bit 6, 1: bit 10 */
+#define PROF_PC_POSTPRESET	15U		/* 0..15 */
+
+/*
+	not a divisor of the main loop period, so that
+	samples do not lock onto the same place
+*/
+#define PROF_TIM_HZ			997U
+#define PROF_PC_BUF			1024U
+
+volatile uint32_t pcSample[PROF_PC_BUF];
+volatile uint32_t pcSampleCount = 0;
+
+/*
+	messages dropped per port because its FIFO was full
+*/
+volatile uint32_t itmDropped[32];
+
+/*
+	printf text is packed into 32-bit words,
+	flushed when full or at end of line
+*/
+static uint32_t textWord = 0;
+static uint32_t textLen = 0;
+
+/*
+	Deferred logging.
+	Format strings are not formatted on target, they stay in
+	flash (section "log_fmt") and only their address is sent
+	as ID together with a DWT cycle timestamp and the raw
+	arguments, 32-bit words:
+	
+		word 0:   0xA << 28 | nargs << 24 | (ID & 0xFFFFFF)
+		word 1:   DWT->CYCCNT
+		word 2..: arguments
+	
+	Interrupts are masked while a packet is written, so LOG()
+	can be called from ISRs. Arguments must be integers,
+	at most LOG_MAX_ARGS; use LOG0() for no arguments.
+*/
+#define LOG_MAX_ARGS		8U
+
+#define LOG0(___fmt)																		\
+	do {																					\
+		static const char __logFmt[] __attribute__((section("log_fmt"))) = ___fmt;		\
+		log_emit(__logFmt, 0U, 0);															\
+	} while (0)
+
+#define LOG(___fmt, ...)																	\
+	do {																					\
+		static const char __logFmt[] __attribute__((section("log_fmt"))) = ___fmt;		\
+		const uint32_t __logArg[] = { __VA_ARGS__ };										\
+		(void)sizeof(char[(sizeof(__logArg) <= (4U * LOG_MAX_ARGS)) ? 1 : -1]);			\
+		log_emit(__logFmt, sizeof(__logArg) / sizeof(__logArg[0]), __logArg);				\
+	} while (0)
+
+void log_emit (const char *fmt, uint32_t nargs, const uint32_t *args);
+int itm_send (uint32_t port, const uint32_t *words, uint32_t n);
+void itm_event (uint32_t id);
+void itm_counter (uint32_t id, uint32_t value);
+void itm_set_mask (uint32_t mask);
+int stdout_putchar (int ch);
+void prof_pc_init (void);
+
 
 int main () {
 
 	volatile int i = 0;
+	uint32_t loop = 0;
 
   /*
     once the SystemCoreClockUpdate gets executed. 
     Examine SystemCoreClock in watch window.
   */  
   SystemCoreClockUpdate();
+  
+  /*
+    enable DWT cycle counter, used as log timestamp
+  */
+  CoreDebug->DEMCR |= (1U << 24);
+  DWT->CTRL |= (1U << 0);
+  
+  prof_pc_init();
 
 	while (1) {
 		/*
 			This string will be redirected to STLINK on STM32f4-Discovery
 		*/
-		printf("String redirection to STlink Debugger :-)\n");
+#if (LOG_DEFERRED)
+		LOG("String redirection to STlink Debugger :-) loop %u, clock %u\n", loop, SystemCoreClock);
+#else
+		printf("String redirection to STlink Debugger :-) loop %u, clock %u\n", loop, SystemCoreClock);
+#endif
+		/*
+			loop event and drop counters (id = port) on their own channels
+		*/
+		itm_event(loop);
+		itm_counter(ITM_PORT_TEXT, itmDropped[ITM_PORT_TEXT]);
+		itm_counter(ITM_PORT_LOG, itmDropped[ITM_PORT_LOG]);
+		++loop;
 		
 		for (i = 0; i < 5000; i++);
 	}
 }
 
+/*
+	write one deferred log packet, see LOG()
+*/
+void log_emit (const char *fmt, uint32_t nargs, const uint32_t *args) {
+	
+	uint32_t pkt[2U + LOG_MAX_ARGS];
+	uint32_t i;
+	
+	pkt[0] = 0xA0000000U | (nargs << 24) | ((uint32_t)fmt & 0xFFFFFFU);
+	pkt[1] = DWT->CYCCNT;
+	
+	for (i = 0; i < nargs; ++i) {
+		pkt[2U + i] = args[i];
+	}
+	
+	itm_send(ITM_PORT_LOG, pkt, 2U + nargs);
+}
+
+/*
+	1 if the debugger and itmPortMask enable the port
+*/
+static __inline int itm_port_on (uint32_t port) {
+	return ((ITM->TCR & ITM_TCR_ITMENA_Msk) != 0U) &&
+		   ((ITM->TER & itmPortMask & (1U << port)) != 0U);
+}
+
+/*
+	Write a message of 32-bit words to a stimulus port.
+	The FIFO ready bit is checked once per word, never
+	waited for. A message that does not fit is cut short
+	and counted in itmDropped[port], the host side
+	resynchronises on the next packet header.
+	Interrupts are masked so that messages of the same
+	port do not interleave, it is safe to call from ISRs.
+	
+	return: 1 sent, 0 port disabled or message dropped
+*/
+int itm_send (uint32_t port, const uint32_t *words, uint32_t n) {
+	
+	uint32_t primask;
+	uint32_t i;
+	
+	if (!itm_port_on(port)) {
+		return 0;
+	}
+	
+	primask = __get_PRIMASK();
+	__disable_irq();
+	
+	for (i = 0; i < n; ++i) {
+		
+		if (ITM->PORT[port].u32 == 0U) {
+			++itmDropped[port];
+			break;
+		}
+		
+		ITM->PORT[port].u32 = words[i];
+	}
+	
+	__set_PRIMASK(primask);
+	
+	return (i == n);
+}
+
+void itm_event (uint32_t id) {
+	itm_send(ITM_PORT_EVENT, &id, 1U);
+}
+
+void itm_counter (uint32_t id, uint32_t value) {
+	
+	uint32_t pair[2];
+	
+	pair[0] = id;
+	pair[1] = value;
+	
+	itm_send(ITM_PORT_COUNTER, pair, 2U);
+}
+
+void itm_set_mask (uint32_t mask) {
+	itmPortMask = mask;
+}
+
+/*
+	printf retarget (RTE STDOUT User). Characters are
+	collected into a word, a partial word at end of line
+	goes out byte by byte. Never blocks, text that finds
+	the FIFO full is dropped.
+*/
+int stdout_putchar (int ch) {
+	
+	uint32_t i;
+	
+	textWord |= ((uint32_t)ch & 0xFFU) << (8U * textLen);
+	++textLen;
+	
+	if ((textLen < 4U) && (ch != '\n')) {
+		return ch;
+	}
+	
+	if (textLen == 4U) {
+		itm_send(ITM_PORT_TEXT, &textWord, 1U);
+	} else if (itm_port_on(ITM_PORT_TEXT)) {
+		
+		for (i = 0; i < textLen; ++i) {
+			
+			if (ITM->PORT[ITM_PORT_TEXT].u32 == 0U) {
+				++itmDropped[ITM_PORT_TEXT];
+				break;
+			}
+			
+			ITM->PORT[ITM_PORT_TEXT].u8 = (uint8_t)(textWord >> (8U * i));
+		}
+	}
+	
+	textWord = 0;
+	textLen = 0;
+	
+	return ch;
+}
+
+/*
+	Start PC sampling, see PROF_PC_SAMPLING
+*/
+void prof_pc_init (void) {
+	
+#if (PROF_PC_SAMPLING == 1)
+	
+	uint32_t ctrl;
+	
+	/*
+		DWT_CTRL:
+		bit 12:		PCSAMPLENA, PC sample on POSTCNT underflow
+		bit 9:		CYCTAP, POSTCNT clock tap on CYCCNT
+		bit 4:1:	POSTPRESET, POSTCNT reload value
+		bit 0:		CYCCNTENA
+		POSTCNT is reloaded only when it runs out, so
+		the counter is stopped before changing its preset.
+	*/
+	DWT->CTRL &= ~((1U << 12) | (1U << 0));
+	
+	ctrl = DWT->CTRL & ~((1U << 9) | (0xFU << 1));
+	ctrl |= (PROF_PC_CYCTAP << 9) | (PROF_PC_POSTPRESET << 1);
+	DWT->CTRL = ctrl | (1U << 0);
+	DWT->CTRL = ctrl | (1U << 12) | (1U << 0);
+	
+	/*
+		ITM_TCR (unlocked by LAR):
+		bit 3:	TXENA, forward DWT packets to the TPIU
+		bit 2:	SYNCENA, synchronisation packets
+		The debugger sets ITMENA and the SWO clock when
+		trace is enabled.
+	*/
+	ITM->LAR = 0xC5ACCE55U;
+	ITM->TCR |= (1U << 3) | (1U << 2);
+	
+#elif (PROF_PC_SAMPLING == 2)
+	
+	uint32_t timClk = SystemCoreClock;
+	uint32_t ppre1 = (RCC->CFGR >> 10) & 7U;
+	
+	/*
+		APB1 timers run at twice PCLK1 when it is divided
+	*/
+	if (ppre1 >= 4U) {
+		timClk = SystemCoreClock >> (ppre1 - 4U);
+	}
+	
+	/* TIM7 clock enable, APB1 bit 5 */
+	RCC->APB1ENR |= (1U << 5);
+	
+	TIM7->PSC = 0;
+	TIM7->ARR = (timClk / PROF_TIM_HZ) - 1U;
+	TIM7->EGR = 1U;
+	TIM7->SR = 0;
+	TIM7->DIER = 1U;
+	
+	/*
+		highest priority: other handlers get sampled too
+	*/
+	NVIC_SetPriority(TIM7_IRQn, 0);
+	NVIC_EnableIRQ(TIM7_IRQn);
+	
+	TIM7->CR1 = 1U;
+	
+#endif
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if (PROF_PC_SAMPLING == 2)
+
+/*
+	frame: exception stack frame of the interrupted code,
+	R0, R1, R2, R3, R12, LR, PC, xPSR
+*/
+void prof_pc_sample (const uint32_t *frame) {
+	
+	TIM7->SR = 0;
+	
+	pcSample[pcSampleCount % PROF_PC_BUF] = frame[6];
+	++pcSampleCount;
+}
+
+/*
+	pass the active stack pointer (EXC_RETURN bit 2)
+	to prof_pc_sample
+*/
+#if defined(__CC_ARM)
+__asm void TIM7_IRQHandler (void) {
+	IMPORT	prof_pc_sample
+	TST		LR, #4
+	ITE		EQ
+	MRSEQ	R0, MSP
+	MRSNE	R0, PSP
+	B		prof_pc_sample
+}
+#else
+__attribute__((naked)) void TIM7_IRQHandler (void) {
+	__asm volatile (
+		"tst	lr, #4		\n"
+		"ite	eq			\n"
+		"mrseq	r0, msp		\n"
+		"mrsne	r0, psp		\n"
+		"b		prof_pc_sample	\n"
+	);
+}
+#endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,14 @@
 
 @descp:     This Program configures USART3 and redirect
 			printf strings to USART3 Tx PB.10
+			
+			printf output is collected in one of two buffers,
+			a full (or flushed) buffer is sent by DMA1 Stream3
+			while the CPU keeps filling the other one.
+			
+			With LOG_DEFERRED, LOG() sends only a format string
+			ID, a cycle timestamp and the raw arguments. Text is
+			rebuilt on the PC by Host-Tools/log_decode.c
 
 @warrenty:  void
 */
@@ -13,26 +21,147 @@
 
 #include <stm32f4xx.h>
 #include <stdio.h>
+#include "../Common/usart_brr.h"
+
+/*
+	Clock feeding USART3 (APB1). Must follow the system
+	clock configuration, see Clock Sources tutorial:
+	    HSI (default)       ->  PCLK1 = 16Mhz
+	    SysClock_configPLL  ->  PCLK1 = 42Mhz   (PCLK2 = 84Mhz)
+*/
+#define PCLK1_HZ          16000000U
+
+#define USART3_BAUDRATE   9600U
+#define USART3_OVER8      0U
+
+USART_BRR_CHECK(USART3, PCLK1_HZ, USART3_BAUDRATE, USART3_OVER8);
+
+/*
+	size of each of the two printf buffers, must be power of 2
+*/
+#define STDOUT_BUF_SIZE		128U
+
+#if (STDOUT_BUF_SIZE & (STDOUT_BUF_SIZE - 1U))
+#error "STDOUT_BUF_SIZE must be a power of 2"
+#endif
+
+/*
+	what stdout_putchar does when the active buffer is full
+	and the other one is still being sent by DMA
+*/
+#define STDOUT_BLOCK		0U	/* wait for DMA to finish */
+#define STDOUT_DROP			1U	/* drop new characters */
+#define STDOUT_OVERWRITE	2U	/* discard as many of the oldest unsent
+								   characters as needed */
+
+#define STDOUT_FULL_POLICY	STDOUT_BLOCK
+
+static uint8_t outBuf[2][STDOUT_BUF_SIZE];
+
+/*
+	buffer being filled by printf, its oldest character and
+	fill level. It is a ring so OVERWRITE drops the oldest
+	character by moving outHead, not the data.
+*/
+static uint32_t outActive = 0;
+static uint32_t outHead = 0;
+static uint32_t outLen = 0;
+
+/* second part of a wrapped buffer, started by the DMA ISR */
+static const uint8_t *txNext = 0;
+static uint32_t txNextLen = 0;
+
+/* set while DMA owns the other buffer, cleared by ISR */
+static volatile uint32_t dmaBusy = 0;
+
+/* characters lost due to DROP/OVERWRITE policy */
+volatile uint32_t stdoutDropped = 0;
+
+/*
+	1: main loop uses deferred binary LOG() instead of printf
+	(off by default)
+*/
+#ifndef LOG_DEFERRED
+#define LOG_DEFERRED		0
+#endif
+
+/*
+	Deferred logging.
+	Format strings are not formatted on target, they stay in
+	flash (section "log_fmt") and only their address is sent
+	as ID together with a DWT cycle timestamp and the raw
+	arguments, little endian 32-bit words:
+	
+		word 0:   0xA << 28 | nargs << 24 | (ID & 0xFFFFFF)
+		word 1:   DWT->CYCCNT
+		word 2..: arguments
+	
+	A packet is queued whole or dropped whole, so LOG() is
+	safe to call from ISRs. Arguments must be integers,
+	at most LOG_MAX_ARGS; use LOG0() for no arguments.
+*/
+#define LOG_MAX_ARGS		8U
+
+#define LOG0(___fmt)																		\
+	do {																					\
+		static const char __logFmt[] __attribute__((section("log_fmt"))) = ___fmt;		\
+		log_emit(__logFmt, 0U, 0);															\
+	} while (0)
+
+#define LOG(___fmt, ...)																	\
+	do {																					\
+		static const char __logFmt[] __attribute__((section("log_fmt"))) = ___fmt;		\
+		const uint32_t __logArg[] = { __VA_ARGS__ };										\
+		(void)sizeof(char[(sizeof(__logArg) <= (4U * LOG_MAX_ARGS)) ? 1 : -1]);			\
+		log_emit(__logFmt, sizeof(__logArg) / sizeof(__logArg[0]), __logArg);				\
+	} while (0)
+
+/* log packets lost because both buffers were busy */
+volatile uint32_t logDropped = 0;
 
 static void init_usart3 (void);
+static void init_tx_dma (void);
+static void tx_dma_start (const uint8_t *buf, uint32_t len);
+static void tx_swap (void);
 int stdout_putchar (int);
+int stdout_flush (void);
+void log_emit (const char *fmt, uint32_t nargs, const uint32_t *args);
 
 int main () {
 	
 	volatile int x = 0;
+	uint32_t loop = 0;
+	
+	/*
+		enable DWT cycle counter, used as log timestamp
+	*/
+	CoreDebug->DEMCR |= (1U << 24);
+	DWT->CTRL |= (1U << 0);
 	
 	/*
 		configure DESIRED USART to which printf string will 
 		be redirected. 
 	*/
 	init_usart3();
+	init_tx_dma();
 	
 	for (;;) {
 		
 		/*
 			Transmit string PB.10
 		*/
-		printf ("Test String redirection to UART\n");
+#if (LOG_DEFERRED)
+		LOG("Test String redirection to UART, loop %u\n", loop);
+#else
+		printf ("Test String redirection to UART, loop %u\n", loop);
+#endif
+		++loop;
+		
+		/*
+			hand the partially filled buffer to DMA,
+			same as stdout_flush()
+		*/
+		fflush(stdout);
 
 		for (x = 0; x < 5000; x++);
 	}
@@ -40,14 +169,257 @@ int main () {
 
 int stdout_putchar (int ch) {
 	
-	USART3->DR = ch;
+	uint32_t primask;
+	
+#if (STDOUT_FULL_POLICY == STDOUT_BLOCK)
+	while ((outLen == STDOUT_BUF_SIZE) && dmaBusy);
+#endif
+	
+	/*
+		buffer is shared with LOG() from ISRs
+	*/
+	primask = __get_PRIMASK();
+	__disable_irq();
+	
+	if ((outLen == STDOUT_BUF_SIZE) && !dmaBusy) {
+		tx_swap();
+	}
+	
+	if (outLen == STDOUT_BUF_SIZE) {
+		
+		++stdoutDropped;
+		
+#if (STDOUT_FULL_POLICY == STDOUT_OVERWRITE)
+		/*
+			room for one: drop the oldest character.
+			A LOG() packet cut this way is skipped by
+			log_decode while it resynchronises.
+		*/
+		outHead = (outHead + 1U) & (STDOUT_BUF_SIZE - 1U);
+		--outLen;
+#else
+		/*
+			DROP, or BLOCK refilled by a LOG() from
+			an ISR since the wait
+		*/
+		__set_PRIMASK(primask);
+		return ch;
+#endif
+	}
+	
+	outBuf[outActive][(outHead + outLen) & (STDOUT_BUF_SIZE - 1U)] = (uint8_t)ch;
+	++outLen;
+	
+	__set_PRIMASK(primask);
 	
-	/* wait until the transmission completes */
-	while ((USART3->SR & (1U << 6)) != (1U << 6));
+	return ch;
+}
+
+/*
+	send whatever is in the active buffer.
+	waits only if the previous buffer is still being sent.
+*/
+int stdout_flush (void) {
+	
+	uint32_t primask;
+	
+	if (outLen == 0U) {
+		return 0;
+	}
+	
+	while (dmaBusy);
+	
+	/*
+		a LOG() from an ISR may have swapped meanwhile
+	*/
+	primask = __get_PRIMASK();
+	__disable_irq();
+	
+	if ((outLen != 0U) && !dmaBusy) {
+		tx_swap();
+	}
+	
+	__set_PRIMASK(primask);
 	
-	return 1;
+	return 0;
 }
 
+/*
+	fflush(stdout) (or fflush(NULL)) also sends the active
+	buffer. armlink $Sub$$/$Super$$ wraps the library's
+	fflush, the retarget component has no flush hook.
+*/
+#if defined(__CC_ARM)
+extern int $Super$$fflush (FILE *stream);
+
+int $Sub$$fflush (FILE *stream) {
+	
+	int ret = $Super$$fflush(stream);
+	
+	if ((stream == stdout) || (stream == NULL)) {
+		stdout_flush();
+	}
+	
+	return ret;
+}
+#endif
+
+/*
+	hand active buffer to DMA and switch to the other one.
+	DMA must be idle.
+*/
+static void tx_swap (void) {
+	
+	uint32_t len = STDOUT_BUF_SIZE - outHead;
+	
+	/*
+		a ring wrapped by OVERWRITE is sent in two parts,
+		the DMA ISR starts the one at the buffer start
+	*/
+	if (outLen > len) {
+		txNext = outBuf[outActive];
+		txNextLen = outLen - len;
+	} else {
+		len = outLen;
+	}
+	
+	tx_dma_start(&outBuf[outActive][outHead], len);
+	
+	outActive ^= 1U;
+	outHead = 0;
+	outLen = 0;
+}
+
+/*
+	queue one deferred log packet, see LOG()
+*/
+void log_emit (const char *fmt, uint32_t nargs, const uint32_t *args) {
+	
+	uint32_t primask;
+	uint32_t len = 4U * (2U + nargs);
+	uint32_t w;
+	uint32_t i;
+	uint32_t pos;
+	
+	primask = __get_PRIMASK();
+	__disable_irq();
+	
+	if ((outLen + len) > STDOUT_BUF_SIZE) {
+		
+		if (dmaBusy) {
+			++logDropped;
+			__set_PRIMASK(primask);
+			return;
+		}
+		
+		tx_swap();
+	}
+	
+	pos = outHead + outLen;
+	outLen += len;
+	
+	for (i = 0; i < (2U + nargs); ++i) {
+		
+		if (i == 0U) {
+			w = 0xA0000000U | (nargs << 24) | ((uint32_t)fmt & 0xFFFFFFU);
+		} else if (i == 1U) {
+			w = DWT->CYCCNT;
+		} else {
+			w = args[i - 2U];
+		}
+		
+		outBuf[outActive][pos++ & (STDOUT_BUF_SIZE - 1U)] = (uint8_t)(w);
+		outBuf[outActive][pos++ & (STDOUT_BUF_SIZE - 1U)] = (uint8_t)(w >> 8);
+		outBuf[outActive][pos++ & (STDOUT_BUF_SIZE - 1U)] = (uint8_t)(w >> 16);
+		outBuf[outActive][pos++ & (STDOUT_BUF_SIZE - 1U)] = (uint8_t)(w >> 24);
+	}
+	
+	__set_PRIMASK(primask);
+}
+
+static void tx_dma_start (const uint8_t *buf, uint32_t len) {
+	
+	dmaBusy = 1;
+	
+	/*
+		clear Stream3 flags (FEIF, DMEIF, TEIF, HTIF, TCIF)
+	*/
+	DMA1->LIFCR = (0x3DU << 22);
+	
+	DMA1_Stream3->M0AR = (uint32_t)buf;
+	DMA1_Stream3->NDTR = len;
+	
+	/*
+		enable stream
+	*/
+	DMA1_Stream3->CR |= (1U << 0);
+}
+
+static void init_tx_dma (void) {
+	
+	/*
+		USART3_TX is mapped on DMA1 Stream3 Channel4.
+		enable clock to DMA1
+	*/
+	RCC->AHB1ENR |= (1U << 21);
+	
+	DMA1_Stream3->CR &= ~(1U << 0);
+	while (DMA1_Stream3->CR & (1U << 0));
+	
+	DMA1_Stream3->PAR = (uint32_t)&USART3->DR;
+	
+	/*
+		Channel 4, byte transfers, memory increment,
+		memory to peripheral, transfer complete and
+		transfer error interrupts
+	*/
+	DMA1_Stream3->CR = (4U << 25) | (1U << 16) | (1U << 10) | (1U << 6)
+					 | (1U << 4) | (1U << 2);
+	
+	/*
+		direct mode, no FIFO
+	*/
+	DMA1_Stream3->FCR = 0;
+	
+	/*
+		let USART3 request DMA on Tx empty
+	*/
+	USART3->CR3 |= (1U << 7);
+	
+	NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+}
+
+#ifdef __cplusplus 
+  extern "C" {
+#endif
+
+void DMA1_Stream3_IRQHandler (void) {
+	
+	uint32_t isr = DMA1->LISR;
+	
+	/*
+		transfer complete: send the second part of a
+		wrapped buffer if any, else release the buffer.
+		error: drop the rest.
+	*/
+	if (isr & ((1U << 27) | (1U << 25))) {
+		
+		DMA1->LIFCR = (1U << 27) | (1U << 25);
+		
+		if ((txNextLen != 0U) && !(isr & (1U << 25))) {
+			tx_dma_start(txNext, txNextLen);
+			txNextLen = 0;
+		} else {
+			txNextLen = 0;
+			dmaBusy = 0;
+		}
+	}
+}
+
+#ifdef __cplusplus 
+}
+#endif
+
 static void init_usart3 (void) {
 
 	/*
@@ -74,13 +446,20 @@ static void init_usart3 (void) {
 		f = 16000000
 		OVER8 = 0
 		
-		==> USARTDIV 	= 104
+		==> USARTDIV 	= 104.1666
 		
-		fraction = 0
+		fraction = 3
 		mantissa = 104
+		
+		computed at compile time by USART_BRR()
 	*/
+#if (USART3_OVER8)
+	USART3->CR1 |= (1U << 15);
+#else
+	USART3->CR1 &= ~(1U << 15);
+#endif
 	
-	USART3->BRR = (104U << 4);
+	USART3->BRR = USART_BRR(PCLK1_HZ, USART3_BAUDRATE, USART3_OVER8);
 	
 	/*
 		enabble Transmission
@@ -5,6 +5,54 @@
             SPI-1 (master) to SPI-2. Upon successful 
             reception, PD.15 (on board BLUE LED) is
             toggled.
+            
+            With SPI_DMA (off by default), SPI-1 and SPI-2 move
+            whole blocks by DMA (spi_xfer_async(), callback on
+            completion) and the button (or spiBenchRun) runs a
+            throughput benchmark at 168Mhz:
+            SPI-1 alone at 42Mbit/s and SPI-1 -> SPI-2 loopback
+            at 21Mbit/s. Results: spiBench[] in watch window
+            and ITM printf viewer.
+            
+            Wiring for the loopback:
+            PA.5 (SCK)  -> PB.10
+            PA.7 (MOSI) -> PC.3
+            PA.6 (MISO) <- PC.2
+            PE.7 (CS)   -> PB.12 (SPI-2 NSS, SPI_QUEUE only)
+            
+            With SPI_QUEUE (off by default, needs SPI_DMA),
+            transactions for several devices on SPI-1 are queued
+            (spiq_submit()), each device has its own chip select
+            and clock mode. The demo reads the on board LIS3DSH
+            accelerometer (CS PE.3) between loopback blocks to
+            SPI-2. SPI-2 then uses hardware NSS on PB.12, which
+            must be wired to PE.7.
+            
+            SPI-2 slave receive: the interrupts only store the
+            data (ring buffer, or DMA for long frames), it is
+            parsed and checked in PendSV (spis_parse()).
+            
+            With SPI_FLASH (off by default), a W25Qxx NOR flash
+            on SPI-1 (CS PE.11) keeps a circular log: paged
+            writes, erases and status polls run in the
+            background by DMA (flash_write(), flash_read()).
+            
+            spi_set_format() selects 16-bit frames and the
+            hardware CRC. The third benchmark run sends 16-bit
+            frames with CRC-16 over the link layer (spiLink),
+            blocks with a CRC error are sent again.
+            
+            spiSweepRun runs SPI-1 -> SPI-2 at every prescaler,
+            8 and 16-bit frames, fed by polling, interrupt or
+            DMA: bytes/s, CPU cycles per byte and worst
+            interrupt time on ITM (spi_sweep()).
+            
+            With SPI_I2S (off by default), SPI-3 plays 48khz
+            16-bit stereo to the on board CS43L22 by DMA from
+            two halves of a buffer (i2s_ready()). i2sDemoRun
+            plays a 1khz tone, underruns and the time taken to
+            refill a half against the deadline: i2s in watch
+            window.
 
 @warrenty:  void
 */
@@ -14,7 +62,12 @@
 */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include "stm32f4xx.h"
+#include "../Common/gpio_config.h"
+#include "../Common/prof.h"
+#include "../Common/gpio_atomic.h"
 
 #define       __setbit(___reg, ___bit)      ((___reg) |= (1U << (___bit)))
 #define       __clearbit(___reg, ___bit)    ((___reg) &= (~(1U << (___bit))))
@@ -25,18 +78,825 @@ void configLED(void);
 void configUserBtn (void);
 void configureSPIPins(void);
 void configureSPIBus(void);
+void SysClock_configPLL(void);
+
+/*
+    DWT cycle counter probes (Common/prof.h), one per
+    entry, dumped with prof_dump in this order
+*/
+enum {
+    PROF_SPI2,          /* SPI2_IRQHandler */
+    PROF_SPI1_DMA,      /* SPI1 DMA IRQs */
+    PROF_SPI2_DMA,      /* SPI2 DMA IRQs */
+    PROF_SPIS_PARSE,    /* PendSV spis_parse */
+    PROF_SPI1,          /* SPI1_IRQHandler */
+    PROF_I2S,           /* I2S DMA IRQ */
+    PROF_COUNT
+};
+
+static prof_t prof[PROF_COUNT];
+
+static void prof_puts(const char * s);
+
+/*
+    SPI DMA engine.
+    
+    1: block transfers by DMA, SPI-2 RXNE interrupt is not used
+    0: the original example, the button sends 0x55
+*/
+#ifndef SPI_DMA
+#define       SPI_DMA           0
+#endif
+
+/*
+    DMA request mapping (RM0090 DMA1/DMA2 request tables)
+    
+        SPI1  Tx DMA2 Stream3 Ch3  Rx DMA2 Stream0 Ch3
+              (or Tx Stream5 Ch3, Rx Stream2 Ch3)
+        SPI2  Tx DMA1 Stream4 Ch0  Rx DMA1 Stream3 Ch0
+    
+    Full duplex: a transfer is complete when the Rx stream
+    has received the last byte, so only the Rx stream
+    interrupts on transfer complete. Both interrupt on
+    transfer error.
+*/
+typedef struct {
+    SPI_TypeDef         * spi;
+    uint8_t               dmaRccBit;    /* AHB1ENR: 21 -> DMA1, 22 -> DMA2 */
+    uint8_t               dmaChannel;
+    
+    DMA_Stream_TypeDef  * txStream;
+    volatile uint32_t   * txIsr;        /* DMAx->LISR or DMAx->HISR */
+    volatile uint32_t   * txIfcr;       /* DMAx->LIFCR or DMAx->HIFCR */
+    uint8_t               txShift;      /* stream flags offset: 0, 6, 16, 22 */
+    IRQn_Type             txIrq;
+    
+    DMA_Stream_TypeDef  * rxStream;
+    volatile uint32_t   * rxIsr;
+    volatile uint32_t   * rxIfcr;
+    uint8_t               rxShift;
+    IRQn_Type             rxIrq;
+} spi_hw_t;
+
+typedef enum { SPI_1, SPI_2, SPI_COUNT } spi_id_t;
+
+static const spi_hw_t spiHw[SPI_COUNT] = {
+    { SPI1, 22U, 3U,
+      DMA2_Stream3, &DMA2->LISR, &DMA2->LIFCR, 22U, DMA2_Stream3_IRQn,
+      DMA2_Stream0, &DMA2->LISR, &DMA2->LIFCR,  0U, DMA2_Stream0_IRQn },
+    { SPI2, 21U, 0U,
+      DMA1_Stream4, &DMA1->HISR, &DMA1->HIFCR,  0U, DMA1_Stream4_IRQn,
+      DMA1_Stream3, &DMA1->LISR, &DMA1->LIFCR, 22U, DMA1_Stream3_IRQn },
+};
+
+/*
+    err bits passed to the completion callback
+*/
+#define       SPI_ERR_DMA       (1U << 0)   /* DMA transfer error */
+#define       SPI_ERR_OVR       (1U << 1)   /* SPI overrun */
+#define       SPI_ERR_CRC       (1U << 2)   /* received CRC does not match */
+#define       SPI_ERR_START     (1U << 3)   /* not started: bus busy or bad length */
+#define       SPI_ERR_CRC_LATE  (1U << 4)   /* CRC frame did not arrive */
+
+/*
+    Hardware CRC (spi_set_format()): the CRC frame is sent
+    automatically after the last Tx DMA frame and checked
+    against the received one (CRCERR). The DMA interrupt
+    only stops the streams, the CRC frame is collected in
+    PendSV (spi_crc_finish()) so that no interrupt waits on
+    the bus. Polynomials:
+    CRC-8 (x^8 + x^2 + x + 1) for 8-bit frames,
+    CRC-16-CCITT (x^16 + x^12 + x^5 + 1) for 16-bit frames.
+*/
+#define       SPI_CRC_POLY8     0x07U
+#define       SPI_CRC_POLY16    0x1021U
+
+/*
+    polls for the CRC frame after the last data frame
+    (PendSV), enough for one 16-bit frame at prescaler /256
+*/
+#define       SPI_CRC_WAIT      4096U
+
+typedef struct spi_s spi_t;
+
+/*
+    completion callback, called from the DMA interrupt,
+    from PendSV with hardware CRC
+*/
+typedef void (* spi_done_t)(spi_t * s, uint32_t err, void * arg);
+
+struct spi_s {
+    const spi_hw_t    * hw;
+    volatile uint32_t   busy;
+    uint32_t            len;
+    spi_done_t          done;
+    void              * arg;
+    
+    /* frame format, see spi_set_format() */
+    uint8_t             frame16;
+    uint8_t             crc;
+    
+    /* source / sink when tx or rx is NULL */
+    uint16_t            dummyTx;
+    uint16_t            dummyRx;
+    
+    /* data done, CRC frame left to PendSV */
+    volatile uint32_t   crcPending;
+    uint32_t            crcErr;
+    
+    /*
+        statistics, examine in watch window.
+    */
+    volatile uint32_t   xfers;
+    volatile uint32_t   bytes;
+    volatile uint32_t   dmaErrors;
+    volatile uint32_t   ovrErrors;
+    volatile uint32_t   crcErrors;      /* CRCERR */
+    volatile uint32_t   crcTimeouts;    /* no CRC frame */
+};
+
+spi_t spi[SPI_COUNT];
+
+void spi_dma_init(void);
+void spi_set_prescaler(spi_t * s, uint32_t br);
+void spi_set_format(spi_t * s, uint32_t frame16, uint32_t crc);
+int spi_xfer_async(spi_t * s, const uint8_t * tx, uint8_t * rx, uint32_t len,
+                   spi_done_t done, void * arg);
+static void spi_dma_rx_isr(spi_t * s);
+static void spi_dma_tx_isr(spi_t * s);
+static void spi_finish(spi_t * s, uint32_t err);
+static void spi_complete(spi_t * s, uint32_t err);
+static void spi_crc_finish(spi_t * s);
+static void spi_crc_reset(spi_t * s);
+
+/*
+    CRC link between SPI-1 (master) and SPI-2 (slave).
+    A block goes both ways at once, each end checks the
+    CRC of the frames it received. A block with a CRC
+    error on either end is sent again, up to
+    SPI_LINK_RETRIES times. Here both ends are local, with
+    a remote slave its result would come back in a
+    status frame.
+*/
+#define       SPI_LINK_RETRIES  3U
+
+typedef struct spi_link_s spi_link_t;
+
+typedef void (* spi_link_done_t)(spi_link_t * l, uint32_t err, void * arg);
+
+struct spi_link_s {
+    spi_t             * master;
+    spi_t             * slave;
+    
+    /* current block */
+    const uint8_t     * mtx;
+    uint8_t           * mrx;
+    const uint8_t     * stx;
+    uint8_t           * srx;
+    uint32_t            len;
+    uint32_t            pending;        /* ends not finished */
+    uint32_t            err;
+    uint32_t            tries;
+    spi_link_done_t     done;
+    void              * arg;
+    
+    /*
+        statistics, examine in watch window.
+    */
+    volatile uint32_t   blocks;
+    volatile uint32_t   crcMaster;      /* slave -> master corrupted */
+    volatile uint32_t   crcSlave;       /* master -> slave corrupted */
+    volatile uint32_t   retries;
+    volatile uint32_t   failures;       /* given up after retries */
+};
+
+spi_link_t spiLink = { .master = &spi[SPI_1], .slave = &spi[SPI_2] };
+
+int spi_link_xfer(spi_link_t * l, const uint8_t * mtx, uint8_t * mrx,
+                  const uint8_t * stx, uint8_t * srx, uint32_t len,
+                  spi_link_done_t done, void * arg);
+
+/*
+    Throughput benchmark: SPI_BENCH_BLOCKS blocks back to
+    back, the next block is started from the completion
+    callback. CPU load is the time spent in the DMA
+    interrupts (PROF probes) over the elapsed time.
+*/
+#define       SPI_BLOCK_SIZE    4096U
+#define       SPI_BENCH_BLOCKS  64U
+
+typedef struct {
+    const char        * name;
+    uint32_t            br;             /* CR1 BR: f(SCK) = f(PCLK) / 2^(br + 1) */
+    uint32_t            loopback;       /* 1: SPI-2 slave takes part */
+    uint32_t            frame16;        /* 16-bit frames */
+    uint32_t            crc;            /* CRC link with retries (loopback only) */
+    uint32_t            bytes;
+    uint32_t            cycles;
+    uint32_t            bitsPerSec;
+    uint32_t            cpuLoadPermille;
+    uint32_t            errors;         /* transfer errors, data mismatch */
+    
+    /* run state */
+    volatile uint32_t   running;
+    uint32_t            pending;        /* callbacks outstanding for the block */
+    uint32_t            blocksLeft;
+    uint32_t            blockErr;       /* errors of the current block */
+} spi_bench_t;
+
+spi_bench_t spiBench[3] = {
+    { .name = "SPI1 /2 (42Mbit/s)",       .br = 0U, .loopback = 0U },
+    { .name = "SPI1->SPI2 /4 (21Mbit/s)", .br = 1U, .loopback = 1U },
+    { .name = "SPI1->SPI2 /4 16-bit CRC", .br = 1U, .loopback = 1U, .frame16 = 1U, .crc = 1U },
+};
+
+volatile uint32_t spiBenchRun = 0;
+
+/* halfword aligned for 16-bit frames */
+static uint16_t masterTx16[SPI_BLOCK_SIZE / 2U];
+static uint16_t masterRx16[SPI_BLOCK_SIZE / 2U];
+static uint16_t slaveTx16[SPI_BLOCK_SIZE / 2U];
+static uint16_t slaveRx16[SPI_BLOCK_SIZE / 2U];
+
+#define       masterTx          ((uint8_t *)masterTx16)
+#define       masterRx          ((uint8_t *)masterRx16)
+#define       slaveTx           ((uint8_t *)slaveTx16)
+#define       slaveRx           ((uint8_t *)slaveRx16)
+
+void spi_bench(void);
+
+/*
+    Engine sweep: SPI-1 -> SPI-2 loopback over every
+    prescaler (/2 .. /256), 8 and 16-bit frames and three
+    ways of feeding SPI-1:
+        SPI_ENG_POLL    CPU waits on TXE / RXNE
+        SPI_ENG_IRQ     one frame per RXNE interrupt
+        SPI_ENG_DMA     spi_xfer_async()
+    SPI-2 answers by DMA in every run, it is the test
+    fixture, not the engine under test. At /2 (42Mbit/s)
+    it is over its f(PCLK1) / 2 limit, SPI-1 runs alone.
+
+    CPU cycles per byte: the whole transfer for polling,
+    start up plus time in the SPI-1 interrupts otherwise.
+    Set spiSweepRun to 1 (watch window), results in
+    spiSweep[] and on ITM.
+*/
+#define       SPI_SWEEP_BYTES   1024U
+#define       SPI_SWEEP_WAIT    168000U     /* cycles, SPI-2 done after SPI-1 */
+
+enum { SPI_ENG_POLL, SPI_ENG_IRQ, SPI_ENG_DMA, SPI_ENG_COUNT };
+
+typedef struct {
+    uint8_t             br;
+    uint8_t             frame16;
+    uint8_t             engine;
+    uint8_t             loopback;
+    uint32_t            cycles;         /* first frame written .. last frame read */
+    uint32_t            cpuCycles;
+    uint32_t            bytesPerSec;
+    uint32_t            cyclesPerByte100;   /* CPU cycles per byte x 100 */
+    uint32_t            isrMax;         /* worst SPI-1 interrupt, cycles */
+    uint32_t            errors;         /* overrun, data mismatch */
+} spi_sweep_t;
+
+spi_sweep_t spiSweep[8U * 2U * SPI_ENG_COUNT];
+
+volatile uint32_t spiSweepRun = 0;
+
+/*
+    SPI_ENG_IRQ transfer state
+*/
+typedef struct {
+    SPI_TypeDef       * spi;
+    const uint8_t     * tx;
+    uint8_t           * rx;
+    uint32_t            frames;
+    uint32_t            pos;
+    uint8_t             frame16;
+    volatile uint8_t    overrun;
+    volatile uint32_t   busy;
+} spi_pio_t;
+
+spi_pio_t spiPio = { .spi = SPI1 };
+
+void spi_sweep(void);
+static void spi_pio_isr(spi_pio_t * p);
+
+/*
+    SPI-1 transaction queue, needs SPI_DMA.
+    
+    A device is a chip select pin plus its CR1 setting
+    (clock mode, prescaler). Transactions are queued and
+    run one after another from the DMA completion interrupt:
+    - CR1 is only rewritten when the device changes
+    - back to back transactions to the same device share
+      one chip select frame, unless SPI_TR_CS_END is set
+      (e.g. a command that must end with CS high)
+    - CS goes high when the queue runs empty
+*/
+#ifndef SPI_QUEUE
+#define       SPI_QUEUE         0
+#endif
+#define       SPIQ_SIZE         16U     /* power of 2 */
+
+#if (SPI_QUEUE && !SPI_DMA)
+#error "SPI_QUEUE needs SPI_DMA"
+#endif
+
+typedef struct {
+    GPIO_TypeDef      * csPort;
+    uint8_t             csPin;
+    uint8_t             mode;           /* CPOL << 1 | CPHA */
+    uint8_t             br;             /* CR1 BR, f(PCLK) / 2^(br + 1) */
+    uint16_t            cr1;            /* set by spi_dev_init() */
+} spi_dev_t;
+
+/*
+    transaction flags
+*/
+#define       SPI_TR_CS_END     (1U << 0)   /* release CS after this one */
+
+typedef struct spi_tr_s spi_tr_t;
+
+/*
+    called from the DMA interrupt, may submit
+    further transactions
+*/
+typedef void (* spi_tr_done_t)(spi_tr_t * t, uint32_t err);
+
+struct spi_tr_s {
+    const spi_dev_t   * dev;
+    const uint8_t     * tx;             /* NULL: 0xFF */
+    uint8_t           * rx;             /* NULL: discard */
+    uint16_t            len;
+    uint16_t            flags;
+    spi_tr_done_t       done;
+    void              * arg;
+};
+
+typedef struct {
+    spi_t             * bus;
+    spi_tr_t          * ring[SPIQ_SIZE];
+    volatile uint32_t   head;           /* spiq_submit(), interrupts masked */
+    volatile uint32_t   tail;           /* DMA interrupt */
+    spi_tr_t * volatile active;
+    const spi_dev_t   * csDev;          /* device with CS low */
+    const spi_dev_t   * cfgDev;         /* device CR1 is set up for */
+    
+    /*
+        statistics, examine in watch window.
+    */
+    volatile uint32_t   transactions;
+    volatile uint32_t   csFrames;
+    volatile uint32_t   cr1Writes;
+    volatile uint32_t   queueFull;
+    volatile uint32_t   rejected;       /* completed with SPI_ERR_START */
+} spiq_t;
+
+spiq_t spiq;
+
+void spi_dev_init(spi_dev_t * d);
+void spiq_init(spiq_t * q, spi_t * bus);
+int spiq_submit(spiq_t * q, spi_tr_t * t);
+static void spiq_next(spiq_t * q);
+static void spiq_complete(spiq_t * q, uint32_t err);
+static void spiq_done(spi_t * s, uint32_t err, void * arg);
+
+/*
+    demo devices
+    LIS3DSH on STM32F4-Discovery: CS PE.3, mode 3, 10Mhz max
+    SPI-2 loopback slave: CS PE.7 -> PB.12, mode 2
+*/
+spi_dev_t spiDevAccel = { GPIOE, 3U, 3U, 3U, 0U };      /* 5.25Mhz */
+spi_dev_t spiDevLoop  = { GPIOE, 7U, 2U, 1U, 0U };      /* 21Mhz */
+
+/*
+    demo results, examine in watch window.
+*/
+volatile uint8_t  accelWhoAmI;                          /* 0x3F */
+volatile int16_t  accel[3];
+volatile uint32_t loopRounds;
+volatile uint32_t loopErrors;
+
+static void spiq_demo_init(void);
+static void spiq_demo_poll(void);
+
+/*
+    SPI-2 slave receive path.
+    
+    The interrupts only move data, parsing and validation
+    are deferred to PendSV (lowest priority, runs as soon
+    as no other interrupt is active):
+    - short frames (!SPI_DMA): SPI2_IRQHandler takes at
+      most SPIS_BURST frames per interrupt into spis.rx,
+      a few dozen cycles whatever the frame contents
+    - long frames (SPI_DMA): received by DMA with
+      spis_receive(), the completion only queues the block
+    
+    spis_parse() (PendSV) handles the commands of the
+    short frames (0x55: toggle BLUE LED) and compares long
+    frames against spis.expect. Set spisStress to 1 (watch
+    window, !SPI_DMA) to clock SPIS_STRESS_LEN bytes back
+    to back from SPI-1: stressCommands is the number of
+    commands parsed, stressFailed counts runs where that
+    was not SPIS_STRESS_LEN (see rxOverrun, rxDropped).
+*/
+#define       SPIS_RING_SIZE    256U    /* power of 2 */
+#define       SPIS_BURST        4U
+#define       SPIS_BLOCKS       4U      /* power of 2 */
+#define       SPIS_STRESS_LEN   1024U
+
+#define       SPIS_CMD_LED      0x55U
+
+/*
+    Single producer / single consumer ring buffer.
+    head is written only by the producer, tail only by
+    the consumer, so no locking is required between the
+    ISR and PendSV.
+*/
+typedef struct {
+    uint8_t           * buf;
+    uint32_t            mask;
+    volatile uint32_t   head;
+    volatile uint32_t   tail;
+} ring_t;
+
+/*
+    long frame received by DMA
+*/
+typedef struct {
+    const uint8_t     * buf;
+    uint32_t            len;
+    uint32_t            err;
+} spis_blk_t;
+
+typedef struct {
+    spi_t             * spi;
+    ring_t              rx;             /* short frames */
+    spis_blk_t          blk[SPIS_BLOCKS];
+    volatile uint32_t   blkHead;        /* DMA interrupt */
+    volatile uint32_t   blkTail;        /* PendSV */
+    spis_blk_t          dma;            /* block being received */
+    const uint8_t     * expect;         /* long frame contents, NULL: not checked */
+    
+    /*
+        statistics, examine in watch window.
+    */
+    volatile uint32_t   rxBytes;
+    volatile uint32_t   rxDropped;      /* ring full */
+    volatile uint32_t   rxOverrun;      /* OVR, frame lost in the SPI */
+    volatile uint32_t   rxMaxLevel;
+    volatile uint32_t   commands;
+    volatile uint32_t   unknown;        /* not a command */
+    volatile uint32_t   stressCommands; /* last spis_stress() run */
+    volatile uint32_t   stressFailed;
+    volatile uint32_t   blocks;
+    volatile uint32_t   blockErrors;    /* transfer error or contents */
+    volatile uint32_t   blocksDropped;  /* block queue full */
+} spis_t;
+
+spis_t spis;
+
+volatile uint32_t spisStress = 0;
+
+static uint8_t spisRxBuf[SPIS_RING_SIZE];
+
+void spis_init(spis_t * p, spi_t * s);
+int spis_receive(spis_t * p, const uint8_t * tx, uint8_t * rx, uint32_t len);
+static void spis_block_done(spi_t * s, uint32_t err, void * arg);
+static void spis_parse(spis_t * p);
+#if (!SPI_DMA)
+static void spis_stress(spis_t * p);
+#endif
+
+/*
+    W25Qxx NOR flash log on SPI-1, needs SPI_QUEUE.
+    
+    flash_write() appends to a circular log over the whole
+    chip and only copies into the write pipeline, FLASH_PIPE
+    pages. Programming, erasing and status polling run in
+    the background from the DMA interrupt:
+    - a full page goes out as WREN + PAGE PROGRAM, then the
+      status register is read by DMA until WIP clears: the
+      chip repeats it while CS is low, one transaction
+      reads FLASH_POLL_PP (program) or FLASH_POLL_SE
+      (erase) bytes and only its last byte is looked at. The next page is already in the
+      pipeline and is started from that same interrupt,
+      meanwhile flash_write() keeps filling free pages.
+    - sectors are erased ahead of the log (FLASH_ERASE_AHEAD)
+      when the pipeline is empty, or right before a page
+      that would land in a sector not yet erased
+    - flash_read() streams with FAST READ by DMA, in
+      FLASH_READ_CHUNK pieces so that other devices on the
+      bus get their turn
+    Each command is a short queue transaction, the
+    accelerometer and loopback transfers of the demo go
+    in between.
+    
+    Wiring (W25Q16 .. W25Q128 module):
+    PA.5 (SCK) -> CLK, PA.7 (MOSI) -> DI, PA.6 (MISO) <- DO
+    PE.11      -> /CS
+    
+    Set flashDemoRun to 1 (watch window) to log
+    FLASH_DEMO_BYTES of records, read them back and print
+    write / read throughput on ITM.
+    
+    Off by default: needs the external module. The host
+    bench (Host-Tools/spi_bench.cpp) builds with it on.
+*/
+#ifndef SPI_FLASH
+#define       SPI_FLASH         0
+#endif
+
+#if (SPI_FLASH && !SPI_QUEUE)
+#error "SPI_FLASH needs SPI_QUEUE"
+#endif
+
+#if (SPI_FLASH)
+#define       FLASH_PAGE        256U
+#define       FLASH_SECTOR      4096U
+#ifndef FLASH_PIPE
+#define       FLASH_PIPE        4U      /* pages in the write pipeline, power of 2 */
+#endif
+#define       FLASH_ERASE_AHEAD 1U      /* sectors kept erased ahead of the log */
+#define       FLASH_POLL_PP     64U     /* status bytes per poll: 12us at 42Mhz */
+#define       FLASH_POLL_SE     256U    /* 49us, erase takes 45ms and more */
+#define       FLASH_READ_CHUNK  4096U   /* bytes per FAST READ command */
+#define       FLASH_DEMO_BYTES  (64U * 1024U)
+
+/*
+    W25Qxx commands, status register 1
+*/
+#define       W25_WREN          0x06U
+#define       W25_RDSR1         0x05U
+#define       W25_PP            0x02U
+#define       W25_SE            0x20U
+#define       W25_FAST_READ     0x0BU
+#define       W25_JEDEC_ID      0x9FU
+
+#define       W25_SR_WIP        (1U << 0)
+
+/*
+    background engine state
+*/
+enum { FLASH_ID, FLASH_IDLE, FLASH_PROGRAM, FLASH_ERASE, FLASH_READ };
+
+typedef void (* flash_done_t)(uint32_t err, void * arg);
+
+typedef struct {
+    spiq_t            * q;
+    const spi_dev_t   * dev;
+    uint32_t            size;           /* bytes, from JEDEC ID, 0: no flash */
+    uint8_t             id[4];          /* dummy, manufacturer, type, capacity */
+    
+    /*
+        log positions count bytes since flash_init(),
+        the flash address is pos & (size - 1)
+    */
+    uint32_t            wrPos;          /* next byte for flash_write() */
+    volatile uint32_t   erasedPos;      /* erased up to */
+    
+    /*
+        write pipeline, page[n & (FLASH_PIPE - 1)]
+        head: pages handed over by flash_write()
+        tail: pages programmed (DMA interrupt)
+        fill: bytes in page[head], not yet handed over
+    */
+    uint8_t             page[FLASH_PIPE][FLASH_PAGE];
+    uint32_t            pagePos[FLASH_PIPE];
+    uint16_t            pageLen[FLASH_PIPE];
+    volatile uint32_t   head;
+    volatile uint32_t   tail;
+    uint32_t            fill;
+    
+    /* background engine */
+    volatile uint32_t   state;
+    uint32_t            opStart;        /* CYCCNT */
+    uint8_t             wren;
+    uint8_t             cmd[5];
+    uint8_t             pollTx[FLASH_POLL_SE + 1U];
+    uint8_t             pollRx[FLASH_POLL_SE + 1U];
+    spi_tr_t            trWren;
+    spi_tr_t            trCmd;
+    spi_tr_t            trData;
+    spi_tr_t            trPoll;
+    
+    /* streaming read */
+    uint8_t           * rdBuf;
+    uint32_t            rdAddr;
+    uint32_t            rdLen;
+    uint32_t            rdErr;
+    volatile uint32_t   rdPending;
+    flash_done_t        rdDone;
+    void              * rdArg;
+    
+    /*
+        statistics, examine in watch window.
+    */
+    volatile uint32_t   pages;          /* page program commands */
+    volatile uint32_t   programmed;     /* bytes */
+    volatile uint32_t   sectors;        /* sector erases */
+    volatile uint32_t   polls;
+    volatile uint32_t   progMax;        /* cycles, command to WIP clear */
+    volatile uint32_t   eraseMax;
+    volatile uint32_t   stalls;         /* flash_write() found the pipeline full */
+    volatile uint32_t   readBytes;
+    volatile uint32_t   errors;         /* SPI transfer errors */
+} flash_t;
+
+flash_t flash;
+
+/*
+    LIS3DSH and W25Q share SPI-1, modes 0 and 3 both fine
+    for the flash. /2: 42Mhz, below the 50Mhz of READ
+    and the 104Mhz of FAST READ.
+*/
+spi_dev_t spiDevFlash = { GPIOE, 11U, 3U, 0U, 0U };
+
+volatile uint32_t flashDemoRun = 0;
+
+void flash_init(flash_t * f, spiq_t * q, spi_dev_t * dev);
+int flash_ready(flash_t * f);
+int flash_idle(flash_t * f);
+uint32_t flash_write(flash_t * f, const void * data, uint32_t len);
+void flash_flush(flash_t * f);
+int flash_read(flash_t * f, uint32_t addr, void * buf, uint32_t len,
+               flash_done_t done, void * arg);
+static void flash_kick(flash_t * f);
+static void flash_next(flash_t * f);
+static void flash_demo(void);
+#endif
+
+/*
+    I2S audio on SPI-3, needs SPI_DMA (PLL input 2Mhz).
+
+    16-bit stereo at I2S_FS, Philips standard, master
+    transmit with MCLK (256 x Fs) for the on board CS43L22:
+    PA.4 -> WS, PC.7 -> MCK, PC.10 -> CK, PC.12 -> SD
+    (all AF6), PD.4 -> DAC /RESET.
+
+    I2S clock from PLLI2S, f(in) = 16Mhz / PLLM = 2Mhz:
+        f(VCO)    = 2Mhz * 129 = 258Mhz
+        I2SCLK    = 258Mhz / 3 = 86Mhz
+        Fs        = 86Mhz / (256 * (2 * 3 + 1)) = 47991Hz
+
+    DMA1 Stream5 Ch0 (SPI3_TX) runs circular over both
+    halves of s->buf. Half transfer: half 0 played, DMA
+    reads half 1; transfer complete: the other way round.
+    The freed half is handed to s->half() from the DMA
+    interrupt, the application fills it there or later
+    and calls i2s_ready(). A half that starts playing
+    before i2s_ready() is an underrun (old samples are
+    played again). The deadline is one half:
+    I2S_HALF_FRAMES / Fs.
+    
+    Off by default: it adds SPI-3, DMA1 Stream5, PLLI2S
+    and the codec on I2C-1 to the SPI example. The host
+    bench (Host-Tools/spi_bench.cpp) builds with it on.
+*/
+#ifndef SPI_I2S
+#define       SPI_I2S           0
+#endif
+
+#if (SPI_I2S && !SPI_DMA)
+#error "SPI_I2S needs SPI_DMA"
+#endif
+
+#if (SPI_I2S)
+#ifndef I2S_CODEC
+#define       I2S_CODEC         1       /* CS43L22 set up over I2C-1 */
+#endif
+
+#define       I2S_FS            48000U
+#ifndef I2S_HALF_FRAMES
+#define       I2S_HALF_FRAMES   240U    /* stereo frames per half, 5ms */
+#endif
+
+#define       I2S_PLLN          129U
+#define       I2S_PLLR          3U
+#define       I2S_DIV           3U
+#define       I2S_ODD           1U
+
+typedef struct i2s_s i2s_t;
+
+/*
+    called from the DMA interrupt with the half that
+    has just been played
+*/
+typedef void (* i2s_half_t)(i2s_t * s, int16_t * half, uint32_t frames);
+
+struct i2s_s {
+    int16_t             buf[2][I2S_HALF_FRAMES * 2U];   /* L, R interleaved */
+    volatile uint8_t    ready[2];       /* filled since it was played */
+    uint32_t            freeAt[2];      /* CYCCNT, half handed to the application */
+    uint32_t            deadline;       /* cycles, one half */
+    uint8_t             running;
+    i2s_half_t          half;
+
+    /*
+        statistics, examine in watch window.
+    */
+    volatile uint32_t   halves;
+    volatile uint32_t   underruns;
+    volatile uint32_t   late;           /* HT and TC seen in one interrupt */
+    volatile uint32_t   fillMax;        /* cycles, half free to i2s_ready() */
+    volatile uint32_t   dmaErrors;
+};
+
+i2s_t i2s;
+
+volatile uint32_t i2sDemoRun = 0;
+
+void i2s_init(i2s_t * s, i2s_half_t half);
+void i2s_start(i2s_t * s);
+void i2s_stop(i2s_t * s);
+void i2s_ready(i2s_t * s, int16_t * half);
+static void i2s_dma_isr(i2s_t * s);
+static void i2s_demo_poll(void);
+#endif
 
 int main () {
 
   volatile unsigned int i = 0;
   
+#if (SPI_DMA)
+    SysClock_configPLL();
+    SystemCoreClockUpdate();
+#endif
+    
+    prof_init(prof, PROF_COUNT);
+    spis_init(&spis, &spi[SPI_2]);
     configLED();
     configUserBtn();
     configureSPIPins();
     configureSPIBus();
+    
+#if (SPI_DMA)
+    spi_dma_init();
+#endif
+
+#if (SPI_QUEUE)
+    spiq_init(&spiq, &spi[SPI_1]);
+    spiq_demo_init();
+#endif
+
+#if (SPI_FLASH)
+    flash_init(&flash, &spiq, &spiDevFlash);
+#endif
+
+#if (SPI_I2S)
+    i2s_init(&i2s, NULL);
+#endif
   
     while (1) {
       
+      prof_itm_poll(prof, PROF_COUNT);
+      
+#if (!SPI_DMA)
+      if (spisStress) {
+        spisStress = 0;
+        spis_stress(&spis);
+      }
+#endif
+      
+#if (SPI_I2S)
+      i2s_demo_poll();
+#endif
+      
+#if (SPI_FLASH)
+      if (flashDemoRun && flash_ready(&flash)) {
+        flashDemoRun = 0;
+        flash_demo();
+      }
+#endif
+      
+#if (SPI_QUEUE)
+      spiq_demo_poll();
+      
+      /* the benchmark needs the bus to itself */
+      if (spiBenchRun && (spiq.active == NULL)) {
+        spiBenchRun = 0;
+        spi_bench();
+        spiq.cfgDev = NULL;
+      }
+      
+      if (spiSweepRun && (spiq.active == NULL)) {
+        spiSweepRun = 0;
+        spi_sweep();
+        spiq.cfgDev = NULL;
+      }
+#elif (SPI_DMA)
+      if (spiBenchRun) {
+        spiBenchRun = 0;
+        spi_bench();
+      }
+      
+      if (spiSweepRun) {
+        spiSweepRun = 0;
+        spi_sweep();
+      }
+#endif
+      
       /*
         check if button is pressed
       */
@@ -50,11 +910,15 @@ int main () {
         /* read after debounce compensation */
         if (GPIOA->IDR &0x1) {
 
+#if (SPI_DMA)
+          spiBenchRun = 1;
+#else
           /* send data from SPI-1 */
           SPI1->DR = 0x55;
         
           /* wait unit data is transmitted */
           while (!(SPI1->SR & 2U));
+#endif
           /*
             prevent multiple transmission on single button press
           */
@@ -160,8 +1024,13 @@ void configureSPIBus(void) {
   /* MSB first */
   __clearbit(SPI2->CR1, 7);
   
+#if (SPI_QUEUE)
+  /* NSS pin PB.12, the slave leaves the bus to other devices */
+  __clearbit(SPI2->CR1, 9);
+#else
   /* Software Slave Management */
   __setbit(SPI2->CR1, 9);
+#endif
 
   
   /*
@@ -184,6 +1053,7 @@ void configureSPIBus(void) {
   */
   __clearbit(SPI2->CR1, 15);
   
+#if (!SPI_DMA)
   /*
     enable data reception interrupt for SPI-2
   */
@@ -193,6 +1063,7 @@ void configureSPIBus(void) {
     enable IRQ#36 - SPI-2
   */
   NVIC_EnableIRQ(SPI2_IRQn);
+#endif
   
   /*
     enable SPI-2 Unit
@@ -201,234 +1072,2396 @@ void configureSPIBus(void) {
 
 }
 
-void configureSPIPins(void) {
-  
-    /**************************************  
-                SPI-1 - Pins          
-          Pins:
-            PA.5  ->  SCK
-            PA.6  ->  MISO
-            PA.7  ->  MOSI
-    ***************************************/
+/*
+    SPI-1: PA.5 -> SCK, PA.6 -> MISO, PA.7 -> MOSI
+*/
+#define       SPI1_PINS(___pin)                                                     \
+    ___pin(5U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)                       \
+    ___pin(6U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)                       \
+    ___pin(7U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)
 
-  /*
-    enabled clock to to PA
-  */
-  __setbit(RCC->AHB1ENR, 0);
-  
-  /*
-     PA.5-7 Configuratoin
-     -> See GPIOs tutorial for more info
-  */
-  
-  /*
-    As an alternate function
-  */
-  GPIOA->MODER |=  (0xA8U <<8);
+/*
+    SPI-2: PB.10 -> SCK, PB.12 -> NSS (SPI_QUEUE only),
+    PC.2 -> MISO, PC.3 -> MOSI
+*/
+#if (SPI_QUEUE)
+#define       SPI2_NSS_PIN(___pin)                                                  \
+    ___pin(12U, GPIO_AF, GPIO_PP, GPIO_LOW, GPIO_NOPULL, 5U)
+#else
+#define       SPI2_NSS_PIN(___pin)
+#endif
 
-  /*
-    output push-pull
-  */
-  GPIOA->OTYPER &= (~(0x7U << 5));
-  
-  /*
-    Speed: very high
-  */
-  
-  GPIOA->OSPEEDR |=  (0xFCU <<8);  
-  
-  /*
-    connect PA.5-7 to SPI pins for alternate function
-  */
-  
-  GPIOA->AFR[0] |= (0x555U << 20);
-  
+#define       SPI2_PORTB_PINS(___pin)                                               \
+    ___pin(10U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)                      \
+    SPI2_NSS_PIN(___pin)
 
+#define       SPI2_PORTC_PINS(___pin)                                               \
+    ___pin(2U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)                       \
+    ___pin(3U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)
 
-    /**************************************  
-                SPI-2 - Pins          
-          Pins:
-            PB.10   ->  SCK
-            PC.2    ->  MISO
-            PC.3    ->  MOSI
-    ***************************************/
+void configureSPIPins(void) {
   
   /*
-     PB.10 Configuratoin
-     -> See GPIOs tutorial for more info
+    enable clock to PA, PB, PC
   */
-
-  /*
-    enabled clock to to PB
-  */
-  __setbit(RCC->AHB1ENR, 1);
-
+  RCC->AHB1ENR |= (1U << 0) | (1U << 1) | (1U << 2);
+  
   /*
-    As an alternate function
+    alternate function 5, push-pull, very high speed
+    -> See GPIOs tutorial for more info
   */
-  __clearbit(GPIOB->MODER, 20);
-  __setbit(GPIOB->MODER, 21);
+  GPIO_CONFIGURE(GPIOA, SPI1_PINS);
+  GPIO_CONFIGURE(GPIOB, SPI2_PORTB_PINS);
+  GPIO_CONFIGURE(GPIOC, SPI2_PORTC_PINS);
+}
 
+/*
+    On STM32F4-Discovery BLUE-LED -> PD.15
+*/
+#define       LED_PINS(___pin)                                                      \
+    ___pin(15U, GPIO_OUT, GPIO_PP, GPIO_MEDIUM, GPIO_NOPULL, 0U)
 
+void configLED(void) {
+    
+    // enable clock to GPIOD
+    __setbit(RCC->AHB1ENR, 3);
+    
+    /*
+        general purpose output, push-pull, medium
+        speed, no pull-up/down
+    */
+    GPIO_CONFIGURE(GPIOD, LED_PINS);
+}
+
+void configUserBtn (void) {
+
+   /******************************************
+  
+            User Btn is connected to PA.0
+  
+    ****************************************/
+
+    
+    // enable clock to GPIOA
+    __setbit(RCC->AHB1ENR, 0);
+    
+    /*
+        On STM32F4-Discovery
+        User Btn   -->   PA.0  
+    */
+    
+    /*
+        configure PA.0 as digital input
+    */
+    __clearbit(GPIOA->MODER, 0);
+    __clearbit(GPIOA->MODER, 1);
+    
+    
+    /*
+        Lets keep GPIO speed: Medium
+    */
+    __setbit(GPIOA->OSPEEDR, 0);
+    __clearbit(GPIOA->OSPEEDR, 1);
+    
+    /*
+      Initial Level: Pull Down --> Logic-0
+    */
+    __clearbit(GPIOA->PUPDR, 0);
+    __setbit(GPIOA->PUPDR, 1);
+    
+}
+
+#ifdef __cplusplus 
+  extern "C" {
+#endif
+  
+void SPI2_IRQHandler(void) {
+
+  uint32_t head;
+  uint32_t n;
+  uint32_t sr;
+  uint8_t  b;
+  
+  PROF_BEGIN(PROF_SPI2);
+  
   /*
-    output push-pull
+    if you have enabled multiple interrupt for SPI,
+    then you need to check which interrupt e.g RXNEIE, TXEIE etc.
+    has generated interrupt.
+    
+    In our case we have enabled only RXNEIE interrupt only so no 
+    need to put a check here.
   */
-  GPIOB->OTYPER &= (~(0x1U << 10));
-  
+    
   /*
-    Speed: very high
+    move the received frames into the ring, at most
+    SPIS_BURST so the time in here stays bounded. A frame
+    still waiting raises the interrupt again.
   */
+  head = spis.rx.head;
   
-  GPIOB->OSPEEDR |=  (0x3U <<20);  
+  for (n = 0; n < SPIS_BURST; ++n) {
+    
+    sr = SPI2->SR;
+    
+    if (!(sr & 1U)) {
+      break;
+    }
+    
+    b = (uint8_t)SPI2->DR;
+    
+    /*
+      bit 6: OVR, a frame arrived while b was still in DR
+      and was lost. Reading DR then SR clears it, count it
+      here or it goes unnoticed.
+    */
+    if (sr & (1U << 6)) {
+      (void)SPI2->SR;
+      ++spis.rxOverrun;
+    }
+    
+    if ((head - spis.rx.tail) > spis.rx.mask) {
+      ++spis.rxDropped;
+    } else {
+      spis.rx.buf[head & spis.rx.mask] = b;
+      ++head;
+    }
+  }
   
   /*
-    connect PA.5-7 to SPI pins for alternate function
+    publish the bytes only after they are stored,
+    data is checked in PendSV
   */
+  __DMB();
+  spis.rx.head = head;
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
   
-  GPIOB->AFR[1] |= (0x5U << 8);
+  PROF_END(PROF_SPI2);
+}
 
+void PendSV_Handler(void) {
 
+  uint32_t id;
+  
+  PROF_BEGIN(PROF_SPIS_PARSE);
+  
+  for (id = 0; id < SPI_COUNT; ++id) {
+    if (spi[id].crcPending) {
+      spi_crc_finish(&spi[id]);
+    }
+  }
+  
+  spis_parse(&spis);
+  PROF_END(PROF_SPIS_PARSE);
+}
 
-  /*
-     PC.2-3 Configuratoin
-     -> See GPIOs tutorial for more info
-  */
+void SPI1_IRQHandler(void) {
+  PROF_BEGIN(PROF_SPI1);
+  spi_pio_isr(&spiPio);
+  PROF_END(PROF_SPI1);
+}
+
+void DMA2_Stream0_IRQHandler (void) {
+  PROF_BEGIN(PROF_SPI1_DMA);
+  spi_dma_rx_isr(&spi[SPI_1]);
+  PROF_END(PROF_SPI1_DMA);
+}
+
+void DMA2_Stream3_IRQHandler (void) {
+  PROF_BEGIN(PROF_SPI1_DMA);
+  spi_dma_tx_isr(&spi[SPI_1]);
+  PROF_END(PROF_SPI1_DMA);
+}
+
+void DMA1_Stream3_IRQHandler (void) {
+  PROF_BEGIN(PROF_SPI2_DMA);
+  spi_dma_rx_isr(&spi[SPI_2]);
+  PROF_END(PROF_SPI2_DMA);
+}
+
+void DMA1_Stream4_IRQHandler (void) {
+  PROF_BEGIN(PROF_SPI2_DMA);
+  spi_dma_tx_isr(&spi[SPI_2]);
+  PROF_END(PROF_SPI2_DMA);
+}
+
+#if (SPI_I2S)
+void DMA1_Stream5_IRQHandler (void) {
+  PROF_BEGIN(PROF_I2S);
+  i2s_dma_isr(&i2s);
+  PROF_END(PROF_I2S);
+}
+#endif
+
+#ifdef __cplusplus 
+}
+#endif
+
+/*
+  select PLL as main system clock, 168Mhz from the
+  internal 16Mhz oscillator (see Clock Sources)
+  APB1 = 42Mhz: SPI-2 up to 21Mbit/s
+  APB2 = 84Mhz: SPI-1 up to 42Mbit/s
+*/
+void SysClock_configPLL(void) {
 
+  uint32_t regVal = 0;
+  
   /*
-    enabled clock to to PC
+    disable PLL 
   */
-  __setbit(RCC->AHB1ENR, 2);
+  RCC->CR &= ~(1U << 24);
+
+#define   PLLN    168U
+#define   PLLM    8U
+#define   PLLP    0U  /* 00: PLLP = 2 */
+#define   PLLQ    7U
 
   /*
-    As an alternate function
+    f(vco) = 16Mhz * 168 / 8 = 336Mhz
+    f(pll out) = 336Mhz / 2 = 168Mhz
   */
-  GPIOC->MODER |=  (0xAU << 4);
+  regVal = (PLLQ << 24)| (PLLP << 16) | (PLLN << 6) | (PLLM);
+  
+  RCC->PLLCFGR = regVal;
 
   /*
-    output push-pull
+    turn on PLL, wait until PLL get stable (PLLRDY)
   */
-  GPIOC->OTYPER &= (~(0x3U << 2));
-  
+  RCC->CR |= (1U << 24);
+  while (!(RCC->CR & (1U << 25)));
+
   /*
-    Speed: very high
+    flash: 5 wait states, prefetch, instruction
+    and data cache
   */
-  
-  GPIOC->OSPEEDR |=  (0xFU << 4);  
-  
+  regVal = FLASH->ACR & ~0x7U;
+  regVal |= 5U | (1U << 8) | (1U << 9) | (1U << 10);
+  FLASH->ACR = regVal;
+  while ((FLASH->ACR & 0x7U) != 5U);
+
+#define AHB_PRESCALER   0U   /* 0xxx: system clock not divided (HCLK  = SYSCLK) */
+#define APB1_PRESCALER  5U   /* 101: AHB clock divided by 4 (PCLK1 = HCLK / 4 = 42Mhz) */
+#define APB2_PRESCALER  4U   /* 100: AHB clock divided by 2 (PCLK2 = HCLK / 2 = 84Mhz) */
+
+  regVal = (AHB_PRESCALER << 4) | (APB2_PRESCALER << 13) | (APB1_PRESCALER << 10);
+
   /*
-    connect PC.2,3 to SPI pins for alternate function
+    switch to PLL as main system clock
   */
+  regVal |= 0x2;
+  RCC->CFGR = regVal;
   
-  GPIOC->AFR[0] |= (0x55U << 8);
+  while (((RCC->CFGR >> 2) & 0x3U) != 0x2U);
+}
+
+/*
+    DMA clocks, stream interrupts. The SPI units are
+    configured by configureSPIBus().
+*/
+void spi_dma_init(void) {
 
+    uint32_t id;
+    
+    for (id = 0; id < SPI_COUNT; ++id) {
+        
+        const spi_hw_t * hw = &spiHw[id];
+        
+        spi[id].hw      = hw;
+        spi[id].dummyTx = 0xFFFFU;
+        
+        __setbit(RCC->AHB1ENR, hw->dmaRccBit);
+        
+        NVIC_EnableIRQ(hw->txIrq);
+        NVIC_EnableIRQ(hw->rxIrq);
+    }
+    
+    /* CRC frames are collected in PendSV, lowest priority */
+    NVIC_SetPriority(PendSV_IRQn, (1U << __NVIC_PRIO_BITS) - 1U);
 }
 
-void configLED(void) {
+/*
+    CR1 BR (bits 5:3), f(SCK) = f(PCLK) / 2^(br + 1).
+    The unit is disabled while it changes.
+*/
+void spi_set_prescaler(spi_t * s, uint32_t br) {
 
+    SPI_TypeDef * spix = s->hw->spi;
+    
+    /* wait for BSY to clear */
+    while (spix->SR & (1U << 7));
+    
+    __clearbit(spix->CR1, 6);
+    spix->CR1 = (spix->CR1 & ~(0x7U << 3)) | ((br & 0x7U) << 3);
+    __setbit(spix->CR1, 6);
+}
 
-    /******************************************
-  
-            LED is connected to PD.15
-  
-    ****************************************/
+/*
+    Frame size and hardware CRC, both ends of a link must
+    agree. CR1 bit 11: DFF, 16-bit frames. bit 13: CRCEN.
+    Both only change with the unit disabled.
+*/
+void spi_set_format(spi_t * s, uint32_t frame16, uint32_t crc) {
+
+    SPI_TypeDef * spix = s->hw->spi;
     
-    // enable clock to GPIOD
-    __setbit(RCC->AHB1ENR, 3);
+    while (spix->SR & (1U << 7));
+    
+    __clearbit(spix->CR1, 6);
+    spix->CR1 &= ~((1U << 11) | (1U << 13));
+    spix->CRCPR = frame16 ? SPI_CRC_POLY16 : SPI_CRC_POLY8;
+    spix->CR1 |= (frame16 ? (1U << 11) : 0U) | (crc ? (1U << 13) : 0U);
+    __setbit(spix->CR1, 6);
+    
+    s->frame16 = (uint8_t)(frame16 != 0U);
+    s->crc     = (uint8_t)(crc != 0U);
+}
+
+/*
+    clearing CRCEN resets TXCRCR/RXCRCR, so that
+    every block starts a new CRC
+*/
+static void spi_crc_reset(spi_t * s) {
+
+    SPI_TypeDef * spix = s->hw->spi;
+    
+    while (spix->SR & (1U << 7));
+    
+    __clearbit(spix->CR1, 6);
+    __clearbit(spix->CR1, 13);
+    __setbit(spix->CR1, 13);
+    __setbit(spix->CR1, 6);
+}
+
+/*
+    Start a full duplex block transfer of len (1..65535)
+    bytes. tx NULL: sends 0xFF, rx NULL: received data is
+    discarded. With 16-bit frames len must be even and the
+    buffers halfword aligned. Buffers must stay valid until done(s, err,
+    arg) is called from the DMA interrupt (PendSV with CRC).
+    A slave must be started before its master clocks.
+    
+    return: 1 started, 0 busy or bad length
+*/
+int spi_xfer_async(spi_t * s, const uint8_t * tx, uint8_t * rx, uint32_t len,
+                   spi_done_t done, void * arg) {
+
+    const spi_hw_t * hw = s->hw;
+    uint32_t         size;
+    uint32_t         frames;
+    
+    if (s->busy || (len == 0U) || (len > 0xFFFFU) || (s->frame16 && (len & 1U))) {
+        return 0;
+    }
     
     /*
-        On STM32F4-Discovery
-        BLUE-LED     -->   PD.15  
+        PSIZE (bit 12:11), MSIZE (bit 14:13): 0 byte, 1 halfword
     */
+    size   = s->frame16 ? ((1U << 13) | (1U << 11)) : 0U;
+    frames = s->frame16 ? (len / 2U) : len;
+    
+    s->busy = 1;
+    s->len  = len;
+    s->done = done;
+    s->arg  = arg;
     
     /*
-        configure PD.15 as general purpose output
+        drop stale data and a pending overrun:
+        read DR, then SR
     */
-    __setbit(GPIOD->MODER, 30);
-    __clearbit(GPIOD->MODER, 31);
+    (void)hw->spi->DR;
+    (void)hw->spi->SR;
     
     /*
-        GPIOs output type: Push-Pull
-        so that it can be pulled high (logic-1) and pulled down (logic-0)
+        clear TCIF, HTIF, TEIF, DMEIF, FEIF of both streams
     */
-    __clearbit(GPIOD->OTYPER, 15);
+    *hw->rxIfcr = 0x3DU << hw->rxShift;
+    *hw->txIfcr = 0x3DU << hw->txShift;
     
     /*
-        Lets keep GPIO speed: Medium
+        Rx stream:
+        bit 27:25:  channel
+        bit 17:16:  priority very high, Rx must never lag
+        bit 14:11:  memory / peripheral data size
+        bit 10:     memory increment
+        bit 7:6:    00, peripheral to memory
+        bit 4:      transfer complete interrupt
+        bit 2:      transfer error interrupt
     */
-    __setbit(GPIOD->OSPEEDR, 30);
-    __clearbit(GPIOD->OSPEEDR, 31);
+    hw->rxStream->CR   = ((uint32_t)hw->dmaChannel << 25) | (3U << 16) | size |
+                         ((rx != NULL) ? (1U << 10) : 0U) | (1U << 4) | (1U << 2);
+    hw->rxStream->PAR  = (uintptr_t)&hw->spi->DR;
+    hw->rxStream->M0AR = (rx != NULL) ? (uintptr_t)rx : (uintptr_t)&s->dummyRx;
+    hw->rxStream->NDTR = frames;
     
     /*
-    Initial Level: Logic High --> No Pull-up/down
+        Tx stream: priority high, memory to peripheral
     */
-    __clearbit(GPIOD->PUPDR, 30);
-    __clearbit(GPIOD->PUPDR, 31);
-      
+    hw->txStream->CR   = ((uint32_t)hw->dmaChannel << 25) | (2U << 16) | size |
+                         ((tx != NULL) ? (1U << 10) : 0U) | (1U << 6) | (1U << 2);
+    hw->txStream->PAR  = (uintptr_t)&hw->spi->DR;
+    hw->txStream->M0AR = (tx != NULL) ? (uintptr_t)tx : (uintptr_t)&s->dummyTx;
+    hw->txStream->NDTR = frames;
+    
+    /*
+        RXDMAEN, both streams, then TXDMAEN starts the
+        first Tx request
+    */
+    __setbit(hw->spi->CR2, 0);
+    __setbit(hw->rxStream->CR, 0);
+    __setbit(hw->txStream->CR, 0);
+    __setbit(hw->spi->CR2, 1);
+    
+    return 1;
 }
 
-void configUserBtn (void) {
+/*
+    DMA stream flags: bit 5 TCIF, bit 3 TEIF
+*/
+static __inline void spi_dma_rx_isr(spi_t * s) {
 
-   /******************************************
-  
-            User Btn is connected to PA.0
-  
-    ****************************************/
+    const spi_hw_t * hw = s->hw;
+    uint32_t         flags = (*hw->rxIsr >> hw->rxShift) & 0x3DU;
+    
+    *hw->rxIfcr = flags << hw->rxShift;
+    
+    if (!s->busy) {
+        return;
+    }
+    
+    if (flags & (1U << 3)) {
+        ++s->dmaErrors;
+        spi_finish(s, SPI_ERR_DMA);
+    } else if (flags & (1U << 5)) {
+        spi_finish(s, 0U);
+    }
+}
 
+static __inline void spi_dma_tx_isr(spi_t * s) {
+
+    const spi_hw_t * hw = s->hw;
+    uint32_t         flags = (*hw->txIsr >> hw->txShift) & 0x3DU;
     
-    // enable clock to GPIOA
-    __setbit(RCC->AHB1ENR, 0);
+    *hw->txIfcr = flags << hw->txShift;
     
-    /*
-        On STM32F4-Discovery
-        User Btn   -->   PA.0  
-    */
+    if (s->busy && (flags & (1U << 3))) {
+        ++s->dmaErrors;
+        spi_finish(s, SPI_ERR_DMA);
+    }
+}
+
+static void spi_finish(spi_t * s, uint32_t err) {
+
+    const spi_hw_t * hw = s->hw;
     
     /*
-        configure PA.0 as digital input
+        streams stop by themselves on completion,
+        on error they are disabled here
     */
-    __clearbit(GPIOA->MODER, 0);
-    __clearbit(GPIOA->MODER, 1);
+    __clearbit(hw->txStream->CR, 0);
+    __clearbit(hw->rxStream->CR, 0);
     
+    hw->spi->CR2 &= ~0x3U;
     
     /*
-        Lets keep GPIO speed: Medium
+        CRC: the CRC frame follows the last data frame
+        (one frame time), do not wait for it here. An
+        aborted transfer has none.
     */
-    __setbit(GPIOA->OSPEEDR, 0);
-    __clearbit(GPIOA->OSPEEDR, 1);
+    if (s->crc && !(err & (SPI_ERR_DMA | SPI_ERR_START))) {
+        s->crcErr     = err;
+        s->crcPending = 1;
+        SCB->ICSR     = SCB_ICSR_PENDSVSET_Msk;
+        return;
+    }
+    
+    spi_complete(s, err);
+}
+
+/*
+    PendSV: read the CRC frame to clear RXNE, then SR
+    bit 4: CRCERR, cleared by writing 0. Runs below every
+    interrupt, the wait only holds up the main loop.
+*/
+static void spi_crc_finish(spi_t * s) {
+
+    SPI_TypeDef * spix = s->hw->spi;
+    uint32_t      err  = s->crcErr;
+    uint32_t      i;
+    
+    s->crcPending = 0;
+    
+    for (i = 0; (i < SPI_CRC_WAIT) && !(spix->SR & (1U << 0)); ++i);
+    
+    (void)spix->DR;
+    
+    if (i == SPI_CRC_WAIT) {
+        ++s->crcTimeouts;
+        err |= SPI_ERR_CRC_LATE;
+    } else if (spix->SR & (1U << 4)) {
+        __clearbit(spix->SR, 4);
+        ++s->crcErrors;
+        err |= SPI_ERR_CRC;
+    }
+    
+    spi_crc_reset(s);
+    spi_complete(s, err);
+}
+
+/*
+    overrun check, statistics, then the callback
+*/
+static void spi_complete(spi_t * s, uint32_t err) {
+
+    const spi_hw_t * hw = s->hw;
+    
+    /* SR bit 6: OVR */
+    if (hw->spi->SR & (1U << 6)) {
+        (void)hw->spi->DR;
+        (void)hw->spi->SR;
+        ++s->ovrErrors;
+        err |= SPI_ERR_OVR;
+    }
+    
+    ++s->xfers;
+    s->bytes += s->len;
+    s->busy = 0;
+    
+    if (s->done != NULL) {
+        s->done(s, err, s->arg);
+    }
+}
+
+static void spi_link_start(spi_link_t * l);
+
+/*
+    both ends of a link block report here
+*/
+static void spi_link_end_done(spi_t * s, uint32_t err, void * arg) {
+
+    spi_link_t * l = (spi_link_t *)arg;
+    
+    if (err & SPI_ERR_CRC) {
+        if (s == l->master) {
+            ++l->crcMaster;
+        } else {
+            ++l->crcSlave;
+        }
+    }
+    
+    l->err |= err;
+    
+    if (--l->pending != 0U) {
+        return;
+    }
+    
+    if ((l->err != 0U) && (l->tries <= SPI_LINK_RETRIES)) {
+        ++l->retries;
+        spi_link_start(l);
+        return;
+    }
+    
+    if (l->err != 0U) {
+        ++l->failures;
+    }
+    
+    ++l->blocks;
+    
+    if (l->done != NULL) {
+        l->done(l, l->err, l->arg);
+    }
+}
+
+static void spi_link_start(spi_link_t * l) {
+
+    l->err     = 0;
+    l->pending = 2U;
+    ++l->tries;
     
     /*
-      Initial Level: Pull Down --> Logic-0
+        slave first, it waits for the master clock. A start
+        that is refused fails its end with SPI_ERR_START,
+        a slave left without master clock is stopped.
     */
-    __clearbit(GPIOA->PUPDR, 0);
-    __setbit(GPIOA->PUPDR, 1);
+    if (!spi_xfer_async(l->slave, l->stx, l->srx, l->len, spi_link_end_done, l)) {
+        spi_link_end_done(l->slave, SPI_ERR_START, l);
+        spi_link_end_done(l->master, SPI_ERR_START, l);
+        return;
+    }
     
+    if (!spi_xfer_async(l->master, l->mtx, l->mrx, l->len, spi_link_end_done, l)) {
+        spi_finish(l->slave, SPI_ERR_START);
+        spi_link_end_done(l->master, SPI_ERR_START, l);
+    }
 }
 
-#ifdef __cplusplus 
-  extern "C" {
-#endif
-  
-void SPI2_IRQHandler(void) {
+/*
+    Exchange one block over the link: master sends mtx
+    and receives into mrx, slave the other way round.
+    done(l, err, arg) is called once the block got through
+    or failed SPI_LINK_RETRIES retries (err != 0).
+    
+    return: 1 started, 0 link busy
+*/
+int spi_link_xfer(spi_link_t * l, const uint8_t * mtx, uint8_t * mrx,
+                  const uint8_t * stx, uint8_t * srx, uint32_t len,
+                  spi_link_done_t done, void * arg) {
 
-  /*
-    if you have enabled multiple interrupt for SPI,
-    then you need to check which interrupt e.g RXNEIE, TXEIE etc.
-    has generated interrupt.
+    if (l->master->busy || l->slave->busy) {
+        return 0;
+    }
     
-    In our case we have enabled only RXNEIE interrupt only so no 
-    need to put a check here.
-  */
+    l->mtx   = mtx;
+    l->mrx   = mrx;
+    l->stx   = stx;
+    l->srx   = srx;
+    l->len   = len;
+    l->tries = 0;
+    l->done  = done;
+    l->arg   = arg;
     
-  /*
-    receive SPI-2 data and check data validity
-  */
-  if (SPI2->DR == 0x55) {        
-    __togglebit(GPIOD->ODR, 15);
-  }
-  
+    spi_link_start(l);
+    
+    return 1;
 }
 
-#ifdef __cplusplus 
+static void spi_bench_block(spi_bench_t * b);
+static void spi_bench_done(spi_t * s, uint32_t err, void * arg);
+
+static void spi_bench_link_done(spi_link_t * l, uint32_t err, void * arg) {
+
+    spi_bench_t * b = (spi_bench_t *)arg;
+    
+    b->pending = 1U;
+    spi_bench_done(NULL, err, b);
 }
-#endif
 
+/*
+    both ends of a block report here, the last
+    one starts the next block
+*/
+static void spi_bench_done(spi_t * s, uint32_t err, void * arg) {
+
+    spi_bench_t * b = (spi_bench_t *)arg;
+    
+    if (err != 0U) {
+        ++b->errors;
+        b->blockErr |= err;
+    }
+    
+    if (--b->pending != 0U) {
+        return;
+    }
+    
+    /*
+        a refused start ends the run with this block,
+        retrying at once would be refused again
+    */
+    if (b->blockErr & SPI_ERR_START) {
+        b->blocksLeft = 1U;
+    } else {
+        b->bytes += SPI_BLOCK_SIZE;
+    }
+    
+    if (--b->blocksLeft == 0U) {
+        b->cycles  = DWT->CYCCNT - b->cycles;
+        b->running = 0;
+        return;
+    }
+    
+    spi_bench_block(b);
+}
+
+static void spi_bench_block(spi_bench_t * b) {
+
+    b->blockErr = 0;
+    
+    if (b->crc) {
+        if (!spi_link_xfer(&spiLink, masterTx, masterRx, slaveTx, slaveRx, SPI_BLOCK_SIZE,
+                           spi_bench_link_done, b)) {
+            spi_bench_link_done(&spiLink, SPI_ERR_START, b);
+        }
+        return;
+    }
+    
+    b->pending = b->loopback ? 2U : 1U;
+    
+    /*
+        refused starts complete their end with SPI_ERR_START,
+        SPI-2 is stopped if SPI-1 does not clock it
+    */
+    if (b->loopback &&
+        !spi_xfer_async(&spi[SPI_2], slaveTx, slaveRx, SPI_BLOCK_SIZE, spi_bench_done, b)) {
+        spi_bench_done(&spi[SPI_2], SPI_ERR_START, b);
+        spi_bench_done(&spi[SPI_1], SPI_ERR_START, b);
+        return;
+    }
+    
+    if (!spi_xfer_async(&spi[SPI_1], masterTx, masterRx, SPI_BLOCK_SIZE, spi_bench_done, b)) {
+        if (b->loopback) {
+            spi_finish(&spi[SPI_2], SPI_ERR_START);
+        }
+        spi_bench_done(&spi[SPI_1], SPI_ERR_START, b);
+    }
+}
+
+/*
+    run both benchmarks, report on ITM
+*/
+void spi_bench(void) {
+
+    char     line[96];
+    uint32_t i;
+    uint32_t k;
+    uint32_t retries;
+    uint64_t isr;
+    
+    for (k = 0; k < SPI_BLOCK_SIZE; ++k) {
+        masterTx[k] = (uint8_t)(k * 7U + 1U);
+        slaveTx[k]  = (uint8_t)~k;
+    }
+    
+    for (i = 0; i < sizeof(spiBench) / sizeof(spiBench[0]); ++i) {
+        
+        spi_bench_t * b = &spiBench[i];
+        
+        /*
+            SPI-2 only listens in the loopback run, it can
+            not follow SPI-1 at 42Mbit/s
+        */
+        if (b->loopback) {
+            __setbit(SPI2->CR1, 6);
+        } else {
+            __clearbit(SPI2->CR1, 6);
+        }
+        
+#if (SPI_QUEUE)
+        /* SPI-2 NSS */
+        spiDevLoop.csPort->BSRR = 1U << (spiDevLoop.csPin + (b->loopback ? 16U : 0U));
+#endif
+        
+        spi_set_prescaler(&spi[SPI_1], b->br);
+        spi_set_format(&spi[SPI_1], b->frame16, b->crc);
+        spi_set_format(&spi[SPI_2], b->frame16, b->crc);
+        
+        retries = spiLink.retries;
+        
+        b->bytes      = 0;
+        b->errors     = 0;
+        b->blocksLeft = SPI_BENCH_BLOCKS;
+        b->running    = 1;
+        
+        isr = prof[PROF_SPI1_DMA].sum + prof[PROF_SPI2_DMA].sum;
+        b->cycles = DWT->CYCCNT;
+        
+        spi_bench_block(b);
+        
+        while (b->running);
+        
+        isr = prof[PROF_SPI1_DMA].sum + prof[PROF_SPI2_DMA].sum - isr;
+        
+        b->bitsPerSec      = (uint32_t)((uint64_t)b->bytes * 8U * SystemCoreClock / b->cycles);
+        b->cpuLoadPermille = (uint32_t)(isr * 1000U / b->cycles);
+        
+        if (b->loopback) {
+            for (k = 0; k < SPI_BLOCK_SIZE; ++k) {
+                if ((slaveRx[k] != masterTx[k]) || (masterRx[k] != slaveTx[k])) {
+                    ++b->errors;
+                }
+            }
+        }
+        
+        snprintf(line, sizeof(line), "%-26s %u bytes  %u bit/s  CPU %u.%u%%  errors %u  retries %u\n",
+                 b->name, b->bytes, b->bitsPerSec, b->cpuLoadPermille / 10U,
+                 b->cpuLoadPermille % 10U, b->errors, spiLink.retries - retries);
+        prof_puts(line);
+    }
+    
+    spi_set_format(&spi[SPI_1], 0U, 0U);
+    spi_set_format(&spi[SPI_2], 0U, 0U);
+    __setbit(SPI2->CR1, 6);
+    spi_set_prescaler(&spi[SPI_1], 3U);
+    
+#if (SPI_QUEUE)
+    spiDevLoop.csPort->BSRR = 1U << spiDevLoop.csPin;
+#endif
+}
+
+static __inline uint32_t spi_frame_get(const uint8_t * buf, uint32_t i, uint32_t frame16) {
+    return frame16 ? ((const uint16_t *)buf)[i] : buf[i];
+}
+
+static __inline void spi_frame_put(uint8_t * buf, uint32_t i, uint32_t frame16, uint32_t v) {
+    if (frame16) {
+        ((uint16_t *)buf)[i] = (uint16_t)v;
+    } else {
+        buf[i] = (uint8_t)v;
+    }
+}
+
+/*
+    SPI_ENG_POLL: the next frame goes into DR as soon as
+    TXE is set, the bus only idles if the CPU falls
+    behind. A received frame not read within one frame
+    time is lost (OVR).
+
+    return: 1 overrun, 0 ok
+*/
+static uint32_t spi_poll_xfer(SPI_TypeDef * spix, const uint8_t * tx, uint8_t * rx,
+                              uint32_t frames, uint32_t frame16) {
+
+    uint32_t i;
+    uint32_t sr;
+    uint32_t ovr = 0;
+
+    (void)spix->DR;
+    (void)spix->SR;
+
+    spix->DR = spi_frame_get(tx, 0U, frame16);
+
+    for (i = 0; i < frames; ++i) {
+
+        /* SR bit 1: TXE */
+        if (i + 1U < frames) {
+            while (!(spix->SR & (1U << 1)));
+            spix->DR = spi_frame_get(tx, i + 1U, frame16);
+        }
+
+        /*
+            SR bit 0: RXNE, bit 6: OVR. Reading SR after
+            DR clears OVR, keep it here.
+        */
+        while (!((sr = spix->SR) & (1U << 0)));
+        ovr |= sr;
+
+        spi_frame_put(rx, i, frame16, spix->DR);
+    }
+
+    return __getbit(ovr | spix->SR, 6);
+}
+
+/*
+    SPI_ENG_IRQ: one frame in flight, the next one is
+    written from the RXNE interrupt of the last, so every
+    frame pays the interrupt latency on the bus.
+*/
+static void spi_pio_start(spi_pio_t * p, const uint8_t * tx, uint8_t * rx,
+                          uint32_t frames, uint32_t frame16) {
+
+    p->tx      = tx;
+    p->rx      = rx;
+    p->frames  = frames;
+    p->pos     = 0;
+    p->frame16 = (uint8_t)frame16;
+    p->overrun = 0;
+    p->busy    = 1;
+
+    (void)p->spi->DR;
+    (void)p->spi->SR;
+
+    /* CR2 bit 6: RXNEIE */
+    __setbit(p->spi->CR2, 6);
+
+    p->spi->DR = spi_frame_get(tx, 0U, frame16);
+}
+
+static void spi_pio_isr(spi_pio_t * p) {
+    
+    SPI_TypeDef * spix = p->spi;
+    
+    if (!p->busy) {
+        __clearbit(spix->CR2, 6);
+        return;
+    }
+    
+    if (spix->SR & (1U << 6)) {
+        p->overrun = 1;
+    }
+    
+    spi_frame_put(p->rx, p->pos, p->frame16, spix->DR);
+    
+    if (++p->pos < p->frames) {
+        spix->DR = spi_frame_get(p->tx, p->pos, p->frame16);
+        return;
+    }
+    
+    __clearbit(spix->CR2, 6);
+    p->busy = 0;
+}
+
+/*
+    sleep until the interrupt clears *busy. Masked, a
+    pending interrupt still ends WFI, so one that comes
+    between the test and WFI is not missed.
+*/
+static void spi_sleep_while(volatile uint32_t * busy) {
+    
+    __disable_irq();
+    
+    while (*busy) {
+        __WFI();
+        __enable_irq();
+        __disable_irq();
+    }
+    
+    __enable_irq();
+}
+
+static void spi_sweep_done(spi_t * s, uint32_t err, void * arg) {
+    
+    spi_sweep_t * r = (spi_sweep_t *)arg;
+    
+    if (err != 0U) {
+        ++r->errors;
+    }
+}
+
+/*
+    one sweep point. SPI-2 is started first, its DMA
+    waits for the clock.
+*/
+static void spi_sweep_run(spi_sweep_t * r) {
+    
+    prof_t * p      = &prof[(r->engine == SPI_ENG_DMA) ? PROF_SPI1_DMA : PROF_SPI1];
+    uint32_t frames = r->frame16 ? (SPI_SWEEP_BYTES / 2U) : SPI_SWEEP_BYTES;
+    uint32_t isrMax;
+    uint64_t isrSum;
+    uint32_t start;
+    uint32_t k;
+    
+    if (r->loopback) {
+        __setbit(SPI2->CR1, 6);
+    } else {
+        __clearbit(SPI2->CR1, 6);
+    }
+    
+#if (SPI_QUEUE)
+    spiDevLoop.csPort->BSRR = 1U << (spiDevLoop.csPin + (r->loopback ? 16U : 0U));
+#endif
+    
+    spi_set_prescaler(&spi[SPI_1], r->br);
+    spi_set_format(&spi[SPI_1], r->frame16, 0U);
+    spi_set_format(&spi[SPI_2], r->frame16, 0U);
+    
+    memset(masterRx, 0, SPI_SWEEP_BYTES);
+    memset(slaveRx, 0, SPI_SWEEP_BYTES);
+    
+    /*
+        worst interrupt of this run only, the
+        overall maximum is put back afterwards
+    */
+    isrMax = p->max;
+    isrSum = p->sum;
+    p->max = 0;
+    
+    r->errors = 0;
+    
+    if (r->loopback &&
+        !spi_xfer_async(&spi[SPI_2], slaveTx, slaveRx, SPI_SWEEP_BYTES, spi_sweep_done, r)) {
+        spi_sweep_done(&spi[SPI_2], SPI_ERR_START, r);
+    }
+    
+    start = DWT->CYCCNT;
+    
+    switch (r->engine) {
+    
+        case SPI_ENG_POLL:
+            r->errors   += spi_poll_xfer(SPI1, masterTx, masterRx, frames, r->frame16);
+            r->cycles    = DWT->CYCCNT - start;
+            r->cpuCycles = r->cycles;
+            break;
+    
+        case SPI_ENG_IRQ:
+            spi_pio_start(&spiPio, masterTx, masterRx, frames, r->frame16);
+            r->cpuCycles = DWT->CYCCNT - start;
+            spi_sleep_while(&spiPio.busy);
+            r->cycles    = DWT->CYCCNT - start;
+            r->errors   += spiPio.overrun;
+            break;
+    
+        default:
+            if (!spi_xfer_async(&spi[SPI_1], masterTx, masterRx, SPI_SWEEP_BYTES, spi_sweep_done, r)) {
+                spi_sweep_done(&spi[SPI_1], SPI_ERR_START, r);
+            }
+            r->cpuCycles = DWT->CYCCNT - start;
+            spi_sleep_while(&spi[SPI_1].busy);
+            r->cycles    = DWT->CYCCNT - start;
+            break;
+    }
+    
+    /*
+        SPI-2 has its last frame with the last one of
+        SPI-1, unless frames were lost
+    */
+    start = DWT->CYCCNT;
+    
+    while (spi[SPI_2].busy && ((DWT->CYCCNT - start) < SPI_SWEEP_WAIT));
+    
+    if (spi[SPI_2].busy) {
+        spi_finish(&spi[SPI_2], SPI_ERR_DMA);
+    }
+    
+    r->cpuCycles += (uint32_t)(p->sum - isrSum);
+    r->isrMax     = p->max;
+    
+    if (isrMax > p->max) {
+        p->max = isrMax;
+    }
+    
+    if (r->loopback) {
+        for (k = 0; k < SPI_SWEEP_BYTES; ++k) {
+            if ((slaveRx[k] != masterTx[k]) || (masterRx[k] != slaveTx[k])) {
+                ++r->errors;
+            }
+        }
+    }
+    
+    r->bytesPerSec     = (uint32_t)((uint64_t)SPI_SWEEP_BYTES * SystemCoreClock / r->cycles);
+    r->cyclesPerByte100 = (uint32_t)((uint64_t)r->cpuCycles * 100U / SPI_SWEEP_BYTES);
+}
+
+/*
+    run every prescaler, frame size and engine,
+    one line per run on ITM
+*/
+void spi_sweep(void) {
+    
+    static const char * const engName[SPI_ENG_COUNT] = { "poll", "irq", "dma" };
+    
+    char     line[96];
+    uint32_t i;
+    uint32_t k;
+    
+    for (k = 0; k < SPI_SWEEP_BYTES; ++k) {
+        masterTx[k] = (uint8_t)(k * 7U + 1U);
+        slaveTx[k]  = (uint8_t)~k;
+    }
+    
+    NVIC_EnableIRQ(SPI1_IRQn);
+    
+    prof_puts("SPI1 sweep, engine  bytes/s  CPU cycles/byte  worst ISR cycles  errors\n");
+    
+    for (i = 0; i < sizeof(spiSweep) / sizeof(spiSweep[0]); ++i) {
+    
+        spi_sweep_t * r = &spiSweep[i];
+    
+        r->br       = (uint8_t)(i / (2U * SPI_ENG_COUNT));
+        r->frame16  = (uint8_t)((i / SPI_ENG_COUNT) & 1U);
+        r->engine   = (uint8_t)(i % SPI_ENG_COUNT);
+        r->loopback = (uint8_t)(r->br != 0U);
+    
+        spi_sweep_run(r);
+    
+        snprintf(line, sizeof(line), "/%-3u %2u-bit %-4s %9u B/s  %5u.%02u  %6u  %u%s\n",
+                 2U << r->br, r->frame16 ? 16U : 8U, engName[r->engine], r->bytesPerSec,
+                 r->cyclesPerByte100 / 100U, r->cyclesPerByte100 % 100U, r->isrMax, r->errors,
+                 r->loopback ? "" : "  (SPI-1 alone)");
+        prof_puts(line);
+    }
+    
+    spi_set_format(&spi[SPI_1], 0U, 0U);
+    spi_set_format(&spi[SPI_2], 0U, 0U);
+    __setbit(SPI2->CR1, 6);
+    spi_set_prescaler(&spi[SPI_1], 3U);
+    
+#if (SPI_QUEUE)
+    spiDevLoop.csPort->BSRR = 1U << spiDevLoop.csPin;
+#endif
+}
+
+/*
+    CS pin: output, push-pull, high speed, idle high.
+    cr1: master, software NSS, BR, CPOL/CPHA, enabled
+*/
+void spi_dev_init(spi_dev_t * d) {
+
+    uint32_t pin = d->csPin;
+    
+    /* GPIO ports are 0x400 apart, AHB1ENR bit = port index */
+    __setbit(RCC->AHB1ENR, ((uintptr_t)d->csPort - GPIOA_BASE) / 0x400U);
+    
+    d->csPort->BSRR = 1U << pin;
+    d->csPort->MODER   = (d->csPort->MODER & ~(3U << (2U * pin))) | (1U << (2U * pin));
+    d->csPort->OTYPER &= ~(1U << pin);
+    d->csPort->OSPEEDR |= (3U << (2U * pin));
+    
+    /*
+        bit 9:8  SSM, SSI
+        bit 6:   SPE
+        bit 5:3  BR
+        bit 2:   MSTR
+        bit 1:0  CPOL, CPHA
+    */
+    d->cr1 = (uint16_t)((1U << 9) | (1U << 8) | (1U << 6) | ((uint32_t)(d->br & 7U) << 3) |
+                        (1U << 2) | (d->mode & 3U));
+}
+
+void spiq_init(spiq_t * q, spi_t * bus) {
+
+    q->bus    = bus;
+    q->head   = 0;
+    q->tail   = 0;
+    q->active = NULL;
+    q->csDev  = NULL;
+    q->cfgDev = NULL;
+}
+
+/*
+    Queue a transaction, safe from interrupts. t must stay
+    valid until its done callback.
+    
+    return: 1 queued, 0 queue full
+*/
+int spiq_submit(spiq_t * q, spi_tr_t * t) {
+
+    uint32_t primask = __get_PRIMASK();
+    
+    __disable_irq();
+    
+    if ((q->head - q->tail) >= SPIQ_SIZE) {
+        ++q->queueFull;
+        __set_PRIMASK(primask);
+        return 0;
+    }
+    
+    q->ring[q->head & (SPIQ_SIZE - 1U)] = t;
+    ++q->head;
+    
+    if (q->active == NULL) {
+        spiq_next(q);
+    }
+    
+    __set_PRIMASK(primask);
+    
+    return 1;
+}
+
+static __inline void spi_cs_release(spiq_t * q) {
+    if (q->csDev != NULL) {
+        q->csDev->csPort->BSRR = 1U << q->csDev->csPin;
+        q->csDev = NULL;
+    }
+}
+
+/*
+    start the transaction at the tail, with interrupts
+    masked or from the DMA interrupt. A transaction the bus refuses
+    (busy, len 0, odd len with 16-bit frames) completes
+    with SPI_ERR_START and the next one is tried, the
+    queue never stalls on it.
+*/
+static void spiq_next(spiq_t * q) {
+
+    spi_tr_t    * t;
+    SPI_TypeDef * spix = q->bus->hw->spi;
+    
+    for (;;) {
+    
+        if (q->tail == q->head) {
+            q->active = NULL;
+            spi_cs_release(q);
+            return;
+        }
+        
+        t = q->ring[q->tail & (SPIQ_SIZE - 1U)];
+        q->active = t;
+        
+        if (q->csDev != t->dev) {
+            spi_cs_release(q);
+        }
+        
+        /*
+            new clock mode / speed, only with SPE off
+        */
+        if (q->cfgDev != t->dev) {
+            while (spix->SR & (1U << 7));
+            __clearbit(spix->CR1, 6);
+            spix->CR1 = t->dev->cr1 & ~(1U << 6);
+            spix->CR1 = t->dev->cr1;
+            q->cfgDev = t->dev;
+            ++q->cr1Writes;
+        }
+        
+        if (q->csDev == NULL) {
+            t->dev->csPort->BSRR = 1U << (t->dev->csPin + 16U);
+            q->csDev = t->dev;
+            ++q->csFrames;
+        }
+        
+        if (spi_xfer_async(q->bus, t->tx, t->rx, t->len, spiq_done, q)) {
+            return;
+        }
+        
+        ++q->rejected;
+        spiq_complete(q, SPI_ERR_START);
+    }
+}
+
+/*
+    retire the active transaction: release CS unless the
+    next one continues the frame, then call back. q->active
+    is still set, a done callback that submits does not
+    start the bus itself.
+*/
+static void spiq_complete(spiq_t * q, uint32_t err) {
+
+    spi_tr_t * t = q->active;
+    spi_tr_t * next;
+    
+    ++q->tail;
+    ++q->transactions;
+    
+    next = (q->tail != q->head) ? q->ring[q->tail & (SPIQ_SIZE - 1U)] : NULL;
+    
+    if ((t->flags & SPI_TR_CS_END) || (next == NULL) || (next->dev != t->dev)) {
+        spi_cs_release(q);
+    }
+    
+    if (t->done != NULL) {
+        t->done(t, err);
+    }
+}
+
+static void spiq_done(spi_t * s, uint32_t err, void * arg) {
+
+    spiq_t * q = (spiq_t *)arg;
+    
+    spiq_complete(q, err);
+    spiq_next(q);
+}
+
+/*
+    Demo round: accelerometer X/Y/Z as register address +
+    data in one CS frame, then a loopback block to SPI-2.
+*/
+static const uint8_t accelCfg[2]    = { 0x20U, 0x67U };    /* CTRL_REG4: 100Hz, XYZ on */
+static const uint8_t accelWhoCmd[2] = { 0x8FU, 0xFFU };    /* read WHO_AM_I */
+static const uint8_t accelOutCmd    = 0xA8U;               /* read OUT_X_L.., auto increment */
+static uint8_t       accelWhoRx[2];
+static uint8_t       accelOut[6];
+
+static spi_tr_t trAccelCfg  = { &spiDevAccel, accelCfg, NULL, 2U, SPI_TR_CS_END, NULL, NULL };
+static spi_tr_t trAccelWho  = { &spiDevAccel, accelWhoCmd, accelWhoRx, 2U, SPI_TR_CS_END, NULL, NULL };
+static spi_tr_t trAccelAddr = { &spiDevAccel, &accelOutCmd, NULL, 1U, 0U, NULL, NULL };
+static spi_tr_t trAccelData;
+static spi_tr_t trLoop;
+
+static volatile uint32_t demoPending;
+
+static void spiq_demo_accel_done(spi_tr_t * t, uint32_t err) {
+    
+    uint32_t i;
+    
+    for (i = 0; i < 3U; ++i) {
+        accel[i] = (int16_t)(accelOut[2U * i] | (accelOut[2U * i + 1U] << 8));
+    }
+    
+    --demoPending;
+}
+
+static void spiq_demo_loop_done(spi_tr_t * t, uint32_t err) {
+    
+    ++loopRounds;
+    
+    if (err != 0U) {
+        ++loopErrors;
+    }
+    
+    --demoPending;
+}
+
+static void spiq_demo_init(void) {
+
+    spi_dev_init(&spiDevAccel);
+    spi_dev_init(&spiDevLoop);
+    
+    trAccelData.dev  = &spiDevAccel;
+    trAccelData.rx   = accelOut;
+    trAccelData.len  = sizeof(accelOut);
+    trAccelData.done = spiq_demo_accel_done;
+    
+    trLoop.dev   = &spiDevLoop;
+    trLoop.tx    = masterTx;
+    trLoop.rx    = masterRx;
+    trLoop.len   = 256U;
+    trLoop.flags = SPI_TR_CS_END;
+    trLoop.done  = spiq_demo_loop_done;
+    
+    spis.expect  = masterTx;
+    
+    spiq_submit(&spiq, &trAccelCfg);
+    spiq_submit(&spiq, &trAccelWho);
+    
+    while (spiq.active != NULL);
+    
+    accelWhoAmI = accelWhoRx[1];
+}
+
+static void spiq_demo_poll(void) {
+
+    uint32_t primask;
+    
+    if (demoPending != 0U) {
+        return;
+    }
+    
+    demoPending = 2U;
+    
+    /* slave waits for its NSS */
+    spis_receive(&spis, slaveTx, slaveRx, trLoop.len);
+    
+    /*
+        address and data share one CS frame, nothing
+        submitted from an interrupt may get in between
+    */
+    primask = __get_PRIMASK();
+    __disable_irq();
+    spiq_submit(&spiq, &trAccelAddr);
+    spiq_submit(&spiq, &trAccelData);
+    __set_PRIMASK(primask);
+    
+    spiq_submit(&spiq, &trLoop);
+}
+
+/*
+    PendSV at the lowest priority: parsing never delays
+    the receive interrupts
+*/
+void spis_init(spis_t * p, spi_t * s) {
+
+    p->spi     = s;
+    p->rx.buf  = spisRxBuf;
+    p->rx.mask = SPIS_RING_SIZE - 1U;
+    
+    NVIC_SetPriority(PendSV_IRQn, (1U << __NVIC_PRIO_BITS) - 1U);
+}
+
+/*
+    Receive a long frame into rx by DMA, tx is sent
+    back meanwhile (NULL: 0xFF). Checked in PendSV once
+    complete, rx must stay untouched until then.
+    
+    return: 1 started, 0 slave busy
+*/
+int spis_receive(spis_t * p, const uint8_t * tx, uint8_t * rx, uint32_t len) {
+
+    if (p->spi->busy) {
+        return 0;
+    }
+    
+    p->dma.buf = rx;
+    p->dma.len = len;
+    
+    return spi_xfer_async(p->spi, tx, rx, len, spis_block_done, p);
+}
+
+/*
+    DMA interrupt: queue the block for PendSV
+*/
+static void spis_block_done(spi_t * s, uint32_t err, void * arg) {
+
+    spis_t   * p    = (spis_t *)arg;
+    uint32_t   head = p->blkHead;
+    
+    if ((head - p->blkTail) >= SPIS_BLOCKS) {
+        ++p->blocksDropped;
+        return;
+    }
+    
+    p->blk[head & (SPIS_BLOCKS - 1U)]     = p->dma;
+    p->blk[head & (SPIS_BLOCKS - 1U)].err = err;
+    
+    __DMB();
+    p->blkHead = head + 1U;
+    
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/*
+    PendSV: drain the short frame ring and the
+    long frame queue
+*/
+static void spis_parse(spis_t * p) {
+
+    uint32_t tail  = p->rx.tail;
+    uint32_t head  = p->rx.head;
+    uint32_t level = head - tail;
+    uint8_t  b;
+    
+    if (level > p->rxMaxLevel) {
+        p->rxMaxLevel = level;
+    }
+    
+    __DMB();
+    
+    while (tail != head) {
+        
+        b = p->rx.buf[tail & p->rx.mask];
+        ++tail;
+        
+        if (b == SPIS_CMD_LED) {
+            /* BSRR, PendSV may preempt other PD pin updates */
+            gpio_toggle(GPIOD, 1U << 15);
+            ++p->commands;
+        } else {
+            ++p->unknown;
+        }
+    }
+    
+    __DMB();
+    p->rx.tail  = tail;
+    p->rxBytes += level;
+    
+    while (p->blkTail != p->blkHead) {
+        
+        const spis_blk_t * k = &p->blk[p->blkTail & (SPIS_BLOCKS - 1U)];
+        uint32_t           i;
+        uint32_t           bad = (k->err != 0U);
+        
+        for (i = 0; (p->expect != NULL) && !bad && (i < k->len); ++i) {
+            bad = (k->buf[i] != p->expect[i]);
+        }
+        
+        ++p->blocks;
+        
+        if (bad) {
+            ++p->blockErrors;
+        }
+        
+        __DMB();
+        ++p->blkTail;
+    }
+}
+
+#if (!SPI_DMA)
+/*
+    main loop only: SPIS_STRESS_LEN commands back to
+    back at the SPI-1 clock, then check every one of
+    them reached spis_parse()
+*/
+static void spis_stress(spis_t * p) {
+
+    uint32_t i;
+    uint32_t start = p->commands;
+    
+    for (i = 0; i < SPIS_STRESS_LEN; ++i) {
+        while (!(SPI1->SR & 2U));
+        SPI1->DR = SPIS_CMD_LED;
+    }
+    
+    while (SPI1->SR & (1U << 7));
+    
+    /* master Rx is not used */
+    (void)SPI1->DR;
+    (void)SPI1->SR;
+    
+    /*
+        the last frame may still be in SPI2->DR or in
+        the ring: wait for SPI2_IRQHandler and PendSV,
+        both preempt the main loop
+    */
+    while ((SPI2->SR & 1U) || (p->rx.tail != p->rx.head));
+    
+    p->stressCommands = p->commands - start;
+    
+    if (p->stressCommands != SPIS_STRESS_LEN) {
+        ++p->stressFailed;
+    }
+}
+#endif
+
+#if (SPI_FLASH)
+static void flash_id_done(spi_tr_t * t, uint32_t err);
+static void flash_cmd_done(spi_tr_t * t, uint32_t err);
+static void flash_poll_done(spi_tr_t * t, uint32_t err);
+static void flash_read_done(spi_tr_t * t, uint32_t err);
+
+/*
+    Reads the JEDEC ID in the background, the log
+    starts at address 0 once flash_ready().
+*/
+void flash_init(flash_t * f, spiq_t * q, spi_dev_t * dev) {
+
+    uint32_t i;
+    
+    memset(f, 0, sizeof(*f));
+    
+    f->q     = q;
+    f->dev   = dev;
+    f->state = FLASH_ID;
+    f->wren  = W25_WREN;
+    
+    spi_dev_init(dev);
+    
+    f->pollTx[0] = W25_RDSR1;
+    
+    for (i = 1; i <= FLASH_POLL_SE; ++i) {
+        f->pollTx[i] = 0xFFU;
+    }
+    
+    f->trWren.dev   = dev;
+    f->trWren.tx    = &f->wren;
+    f->trWren.len   = 1U;
+    f->trWren.flags = SPI_TR_CS_END;
+    
+    f->trCmd.dev    = dev;
+    f->trCmd.tx     = f->cmd;
+    f->trCmd.arg    = f;
+    
+    f->trData.dev   = dev;
+    f->trData.flags = SPI_TR_CS_END;
+    f->trData.arg   = f;
+    
+    f->trPoll.dev   = dev;
+    f->trPoll.tx    = f->pollTx;
+    f->trPoll.rx    = f->pollRx;
+    f->trPoll.flags = SPI_TR_CS_END;
+    f->trPoll.done  = flash_poll_done;
+    f->trPoll.arg   = f;
+    
+    f->cmd[0]       = W25_JEDEC_ID;
+    f->cmd[1]       = 0xFFU;
+    f->cmd[2]       = 0xFFU;
+    f->cmd[3]       = 0xFFU;
+    f->trCmd.rx     = f->id;
+    f->trCmd.len    = 4U;
+    f->trCmd.flags  = SPI_TR_CS_END;
+    f->trCmd.done   = flash_id_done;
+    
+    spiq_submit(q, &f->trCmd);
+}
+
+/*
+    JEDEC ID: manufacturer 0xEF (Winbond), capacity
+    byte n: 2^n bytes
+*/
+static void flash_id_done(spi_tr_t * t, uint32_t err) {
+
+    flash_t * f = (flash_t *)t->arg;
+    
+    f->trCmd.rx = NULL;
+    
+    if ((err == 0U) && (f->id[1] != 0x00U) && (f->id[1] != 0xFFU) &&
+        (f->id[3] >= 0x10U) && (f->id[3] <= 0x19U)) {
+        f->size = 1U << f->id[3];
+    } else {
+        ++f->errors;
+    }
+    
+    f->state = FLASH_IDLE;
+}
+
+int flash_ready(flash_t * f) {
+    return (f->state != FLASH_ID) && (f->size != 0U);
+}
+
+/*
+    everything handed to flash_write() is programmed,
+    an erase ahead may still run
+*/
+int flash_idle(flash_t * f) {
+    return (f->head == f->tail) && (f->fill == 0U) && (f->state != FLASH_PROGRAM);
+}
+
+/*
+    Main loop only: copy up to len bytes into the write
+    pipeline. Full pages are handed to the background
+    engine right away, the rest with flash_flush().
+    
+    return: bytes taken, less than len when the pipeline
+            is full (try again later)
+*/
+uint32_t flash_write(flash_t * f, const void * data, uint32_t len) {
+
+    const uint8_t * src = (const uint8_t *)data;
+    uint32_t        n   = 0;
+    uint32_t        slot;
+    uint32_t        chunk;
+    
+    if (!flash_ready(f)) {
+        return 0;
+    }
+    
+    while (n < len) {
+        
+        if ((f->head - f->tail) >= FLASH_PIPE) {
+            ++f->stalls;
+            break;
+        }
+        
+        slot = f->head & (FLASH_PIPE - 1U);
+        
+        if (f->fill == 0U) {
+            f->pagePos[slot] = f->wrPos;
+        }
+        
+        /* up to the end of the flash page */
+        chunk = FLASH_PAGE - (f->wrPos & (FLASH_PAGE - 1U));
+        
+        if (chunk > len - n) {
+            chunk = len - n;
+        }
+        
+        memcpy(&f->page[slot][f->fill], &src[n], chunk);
+        
+        f->fill  += chunk;
+        f->wrPos += chunk;
+        n        += chunk;
+        
+        if ((f->wrPos & (FLASH_PAGE - 1U)) == 0U) {
+            flash_flush(f);
+        }
+    }
+    
+    return n;
+}
+
+/*
+    Main loop only: hand the partly filled page to the
+    engine. The rest of that flash page is programmed by
+    a later command, NOR pages can be programmed in parts.
+*/
+void flash_flush(flash_t * f) {
+
+    if (f->fill == 0U) {
+        return;
+    }
+    
+    f->pageLen[f->head & (FLASH_PIPE - 1U)] = (uint16_t)f->fill;
+    f->fill = 0;
+    
+    __DMB();
+    ++f->head;
+    
+    flash_kick(f);
+}
+
+/*
+    Stream len bytes from addr into buf by DMA, done(err,
+    arg) is called from the DMA interrupt. Reads wait for
+    a program or erase in progress, then go first.
+    
+    return: 1 started, 0 a read is pending or no flash
+*/
+int flash_read(flash_t * f, uint32_t addr, void * buf, uint32_t len,
+               flash_done_t done, void * arg) {
+
+    if (!flash_ready(f) || f->rdPending || (len == 0U)) {
+        return 0;
+    }
+    
+    f->rdBuf     = (uint8_t *)buf;
+    f->rdAddr    = addr;
+    f->rdLen     = len;
+    f->rdErr     = 0;
+    f->rdDone    = done;
+    f->rdArg     = arg;
+    f->rdPending = 1;
+    
+    flash_kick(f);
+    
+    return 1;
+}
+
+/*
+    start the engine if it waits for work
+*/
+static void flash_kick(flash_t * f) {
+
+    uint32_t primask = __get_PRIMASK();
+    
+    __disable_irq();
+    
+    if (f->state == FLASH_IDLE) {
+        flash_next(f);
+    }
+    
+    __set_PRIMASK(primask);
+}
+
+static __inline void flash_addr(flash_t * f, uint8_t op, uint32_t addr) {
+
+    addr &= f->size - 1U;
+    
+    f->cmd[0] = op;
+    f->cmd[1] = (uint8_t)(addr >> 16);
+    f->cmd[2] = (uint8_t)(addr >> 8);
+    f->cmd[3] = (uint8_t)addr;
+    f->cmd[4] = 0xFFU;                  /* FAST READ dummy byte */
+}
+
+static void flash_read_chunk(flash_t * f) {
+
+    uint32_t n = (f->rdLen < FLASH_READ_CHUNK) ? f->rdLen : FLASH_READ_CHUNK;
+    
+    flash_addr(f, W25_FAST_READ, f->rdAddr);
+    
+    f->trCmd.len    = 5U;
+    f->trCmd.flags  = 0U;
+    f->trCmd.done   = NULL;
+    
+    f->trData.tx    = NULL;
+    f->trData.rx    = f->rdBuf;
+    f->trData.len   = (uint16_t)n;
+    f->trData.done  = flash_read_done;
+    
+    spiq_submit(f->q, &f->trCmd);
+    spiq_submit(f->q, &f->trData);
+}
+
+/*
+    WREN, then a PAGE PROGRAM or SECTOR ERASE command
+*/
+static void flash_write_cmd(flash_t * f, uint8_t op, uint32_t pos, const uint8_t * data, uint32_t len) {
+
+    flash_addr(f, op, pos);
+    
+    f->opStart    = DWT->CYCCNT;
+    f->trPoll.len = (uint16_t)(((op == W25_SE) ? FLASH_POLL_SE : FLASH_POLL_PP) + 1U);
+    
+    spiq_submit(f->q, &f->trWren);
+    
+    if (data == NULL) {
+        f->trCmd.len   = 4U;
+        f->trCmd.flags = SPI_TR_CS_END;
+        f->trCmd.done  = flash_cmd_done;
+        spiq_submit(f->q, &f->trCmd);
+        return;
+    }
+    
+    f->trCmd.len   = 4U;
+    f->trCmd.flags = 0U;
+    f->trCmd.done  = NULL;
+    
+    f->trData.tx   = data;
+    f->trData.rx   = NULL;
+    f->trData.len  = (uint16_t)len;
+    f->trData.done = flash_cmd_done;
+    
+    spiq_submit(f->q, &f->trCmd);
+    spiq_submit(f->q, &f->trData);
+}
+
+/*
+    Pick the next job: pending read, next page (after
+    erasing its sector if needed), erase ahead. With
+    interrupts masked or from the DMA interrupt.
+*/
+static void flash_next(flash_t * f) {
+
+    uint32_t slot;
+    
+    if (f->rdPending) {
+        f->state = FLASH_READ;
+        flash_read_chunk(f);
+        return;
+    }
+    
+    if (f->tail != f->head) {
+        
+        slot = f->tail & (FLASH_PIPE - 1U);
+        
+        if ((int32_t)(f->pagePos[slot] + f->pageLen[slot] - f->erasedPos) > 0) {
+            f->state = FLASH_ERASE;
+            flash_write_cmd(f, W25_SE, f->erasedPos, NULL, 0U);
+        } else {
+            f->state = FLASH_PROGRAM;
+            flash_write_cmd(f, W25_PP, f->pagePos[slot], f->page[slot], f->pageLen[slot]);
+        }
+        return;
+    }
+    
+    if ((int32_t)(f->erasedPos - f->wrPos) < (int32_t)(FLASH_ERASE_AHEAD * FLASH_SECTOR)) {
+        f->state = FLASH_ERASE;
+        flash_write_cmd(f, W25_SE, f->erasedPos, NULL, 0U);
+        return;
+    }
+    
+    f->state = FLASH_IDLE;
+}
+
+/*
+    program / erase command sent, poll for WIP
+*/
+static void flash_cmd_done(spi_tr_t * t, uint32_t err) {
+
+    flash_t * f = (flash_t *)t->arg;
+    
+    if (err != 0U) {
+        ++f->errors;
+    }
+    
+    spiq_submit(f->q, &f->trPoll);
+}
+
+/*
+    pollRx[1..]: the status register, over and over.
+    The last byte is the latest.
+*/
+static void flash_poll_done(spi_tr_t * t, uint32_t err) {
+
+    flash_t * f = (flash_t *)t->arg;
+    uint32_t  cycles;
+    uint32_t  slot;
+    
+    ++f->polls;
+    
+    if ((err != 0U) || (f->pollRx[t->len - 1U] & W25_SR_WIP)) {
+        spiq_submit(f->q, &f->trPoll);
+        return;
+    }
+    
+    cycles = DWT->CYCCNT - f->opStart;
+    
+    if (f->state == FLASH_PROGRAM) {
+        
+        slot = f->tail & (FLASH_PIPE - 1U);
+        
+        ++f->pages;
+        f->programmed += f->pageLen[slot];
+        
+        if (cycles > f->progMax) {
+            f->progMax = cycles;
+        }
+        
+        __DMB();
+        ++f->tail;
+        
+    } else {
+        
+        f->erasedPos += FLASH_SECTOR;
+        ++f->sectors;
+        
+        if (cycles > f->eraseMax) {
+            f->eraseMax = cycles;
+        }
+    }
+    
+    flash_next(f);
+}
+
+static void flash_read_done(spi_tr_t * t, uint32_t err) {
+
+    flash_t * f = (flash_t *)t->arg;
+    uint32_t  n = t->len;
+    
+    f->rdErr     |= err;
+    f->rdBuf     += n;
+    f->rdAddr    += n;
+    f->rdLen     -= n;
+    f->readBytes += n;
+    
+    if (f->rdLen != 0U) {
+        flash_read_chunk(f);
+        return;
+    }
+    
+    f->rdPending = 0;
+    
+    if (f->rdDone != NULL) {
+        f->rdDone(f->rdErr, f->rdArg);
+    }
+    
+    flash_next(f);
+}
+
+/*
+    demo record, 16 bytes
+*/
+typedef struct {
+    uint32_t    seq;
+    uint32_t    cycles;
+    int16_t     accel[3];
+    uint16_t    check;                  /* ~seq */
+} flash_rec_t;
+
+static uint8_t           flashRdBuf[FLASH_READ_CHUNK];
+static volatile uint32_t flashRdBusy;
+
+static void flash_demo_read_done(uint32_t err, void * arg) {
+    flashRdBusy = 0;
+}
+
+static int flash_demo_reading(void) {
+    return flashRdBusy != 0U;
+}
+
+/*
+    Log FLASH_DEMO_BYTES of records as fast as the pipeline
+    takes them, then read them back. Throughput includes
+    the sector erases.
+*/
+static void flash_demo(void) {
+
+    flash_rec_t rec;
+    char        line[96];
+    uint32_t    start = flash.wrPos;
+    uint32_t    seq   = 0;
+    uint32_t    bad   = 0;
+    uint32_t    cycles;
+    uint32_t    pos;
+    uint32_t    i;
+    
+    cycles = DWT->CYCCNT;
+    
+    for (pos = 0; pos < FLASH_DEMO_BYTES; pos += sizeof(rec)) {
+        
+        rec.seq      = seq;
+        rec.cycles   = DWT->CYCCNT;
+        rec.accel[0] = accel[0];
+        rec.accel[1] = accel[1];
+        rec.accel[2] = accel[2];
+        rec.check    = (uint16_t)~seq;
+        ++seq;
+        
+        for (i = 0; i < sizeof(rec); i += flash_write(&flash, (uint8_t *)&rec + i, sizeof(rec) - i));
+    }
+    
+    flash_flush(&flash);
+    
+    while (!flash_idle(&flash));
+    
+    cycles = DWT->CYCCNT - cycles;
+    
+    snprintf(line, sizeof(line), "flash write %u bytes  %u B/s  %u pages  %u sectors  max PP %u cycles\n",
+             FLASH_DEMO_BYTES, (uint32_t)((uint64_t)FLASH_DEMO_BYTES * SystemCoreClock / cycles),
+             flash.pages, flash.sectors, flash.progMax);
+    prof_puts(line);
+    
+    cycles = DWT->CYCCNT;
+    seq    = 0;
+    
+    for (pos = 0; pos < FLASH_DEMO_BYTES; pos += sizeof(flashRdBuf)) {
+        
+        flashRdBusy = 1;
+        flash_read(&flash, start + pos, flashRdBuf, sizeof(flashRdBuf), flash_demo_read_done, NULL);
+        
+        while (flash_demo_reading());
+        
+        for (i = 0; i < sizeof(flashRdBuf); i += sizeof(rec)) {
+            
+            memcpy(&rec, &flashRdBuf[i], sizeof(rec));
+            
+            if ((rec.seq != seq) || (rec.check != (uint16_t)~seq)) {
+                ++bad;
+            }
+            ++seq;
+        }
+    }
+    
+    cycles = DWT->CYCCNT - cycles;
+    
+    snprintf(line, sizeof(line), "flash read  %u bytes  %u B/s  bad records %u\n",
+             FLASH_DEMO_BYTES, (uint32_t)((uint64_t)FLASH_DEMO_BYTES * SystemCoreClock / cycles), bad);
+    prof_puts(line);
+}
+#endif
+
+#if (SPI_I2S)
+#if (I2S_CODEC)
+/*
+    CS43L22 control port on I2C-1, PB.6 -> SCL, PB.9 -> SDA
+    (AF4, open drain, pull-ups on the board), address 0x94.
+    Register writes only, polled, 100khz.
+*/
+#define       CS43L22_ADDR      0x94U
+
+#define       I2C1_PINS(___pin)                                                     \
+    ___pin(6U, GPIO_AF, GPIO_OD, GPIO_VHIGH, GPIO_NOPULL, 4U)                       \
+    ___pin(9U, GPIO_AF, GPIO_OD, GPIO_VHIGH, GPIO_NOPULL, 4U)
+
+#define       CS43L22_RESET_PINS(___pin)                                            \
+    ___pin(4U, GPIO_OUT, GPIO_PP, GPIO_LOW, GPIO_NOPULL, 0U)
+#define       I2C_WAIT          100000U
+
+volatile uint32_t codecErrors;
+
+/*
+    SR1 bit 10: AF, no acknowledge
+*/
+static int i2c1_wait(uint32_t bit) {
+
+    uint32_t i;
+
+    for (i = 0; i < I2C_WAIT; ++i) {
+
+        if (I2C1->SR1 & (1U << bit)) {
+            return 1;
+        }
+
+        if (I2C1->SR1 & (1U << 10)) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    START, address (SR1 bit 1: ADDR, read SR2 to clear),
+    register (bit 7: TXE), value (bit 2: BTF), STOP
+*/
+static int cs43l22_write(uint8_t reg, uint8_t val) {
+
+    int ok;
+
+    __setbit(I2C1->CR1, 8);
+    ok = i2c1_wait(0);
+
+    if (ok) {
+        I2C1->DR = CS43L22_ADDR;
+        ok = i2c1_wait(1);
+    }
+
+    if (ok) {
+        (void)I2C1->SR2;
+        I2C1->DR = reg;
+        ok = i2c1_wait(7);
+    }
+
+    if (ok) {
+        I2C1->DR = val;
+        ok = i2c1_wait(2);
+    }
+
+    __setbit(I2C1->CR1, 9);
+
+    if (!ok) {
+        __clearbit(I2C1->SR1, 10);
+        ++codecErrors;
+    }
+
+    return ok;
+}
+
+/*
+    power control 1 (0x02): 0x9E powered up, 0x01 down.
+    MCLK must run before power up.
+*/
+static void cs43l22_power(uint32_t on) {
+    cs43l22_write(0x02U, on ? 0x9EU : 0x01U);
+}
+
+static void cs43l22_init(void) {
+
+    /*
+        register, value: headphones on, speaker off,
+        auto clock detect, slave, I2S 16-bit, master
+        volume -12dB, no soft ramp, no limiter
+    */
+    static const uint8_t regs[][2] = {
+        { 0x02U, 0x01U },
+        { 0x04U, 0xAFU },
+        { 0x05U, 0x81U },
+        { 0x06U, 0x04U },
+        { 0x20U, 0xE8U },
+        { 0x21U, 0xE8U },
+        { 0x0AU, 0x00U },
+        { 0x0EU, 0x04U },
+        { 0x27U, 0x00U },
+        { 0x1FU, 0x0FU },
+        { 0x1AU, 0x0AU },
+        { 0x1BU, 0x0AU },
+    };
+
+    uint32_t i;
+
+    RCC->AHB1ENR |= (1U << 1) | (1U << 3);
+
+    GPIO_CONFIGURE(GPIOB, I2C1_PINS);
+
+    /*
+        PD.4: /RESET, held low while I2C-1 is set up
+    */
+    GPIOD->BSRR = 1U << (4U + 16U);
+    GPIO_CONFIGURE(GPIOD, CS43L22_RESET_PINS);
+
+    __setbit(RCC->APB1ENR, 21);
+
+    /* software reset */
+    __setbit(I2C1->CR1, 15);
+    __clearbit(I2C1->CR1, 15);
+
+    /*
+        CR2 FREQ: PCLK1 42Mhz
+        CCR: standard mode, 42Mhz / (2 * 100khz)
+        TRISE: 1000ns * 42Mhz + 1
+    */
+    I2C1->CR2   = 42U;
+    I2C1->CCR   = 210U;
+    I2C1->TRISE = 43U;
+    __setbit(I2C1->CR1, 0);
+
+    GPIOD->BSRR = 1U << 4U;
+
+    for (i = 0; i < sizeof(regs) / sizeof(regs[0]); ++i) {
+        cs43l22_write(regs[i][0], regs[i][1]);
+    }
+}
+#endif
+
+/*
+    I2S-3: PA.4 -> WS, PC.7 -> MCK, PC.10 -> CK, PC.12 -> SD
+*/
+#define       I2S3_PORTA_PINS(___pin)                                               \
+    ___pin(4U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 6U)
+
+#define       I2S3_PORTC_PINS(___pin)                                               \
+    ___pin(7U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 6U)                       \
+    ___pin(10U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 6U)                      \
+    ___pin(12U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 6U)
+
+/*
+    PLLI2S, SPI-3 as I2S master transmitter, DMA stream
+    interrupt. Playback starts with i2s_start().
+*/
+void i2s_init(i2s_t * s, i2s_half_t half) {
+
+    s->half     = half;
+    s->deadline = (uint32_t)((uint64_t)SystemCoreClock * I2S_HALF_FRAMES / I2S_FS);
+
+    /*
+        PLLI2SCFGR: R bits 30:28, N bits 14:6
+        CFGR bit 23: I2SSRC 0, PLLI2S
+        CR bit 26: PLLI2SON, bit 27: PLLI2SRDY
+    */
+    RCC->PLLI2SCFGR = (I2S_PLLR << 28) | (I2S_PLLN << 6);
+    __clearbit(RCC->CFGR, 23);
+    __setbit(RCC->CR, 26);
+    while (!(RCC->CR & (1U << 27)));
+
+    RCC->AHB1ENR |= (1U << 0) | (1U << 2);
+
+    GPIO_CONFIGURE(GPIOA, I2S3_PORTA_PINS);
+    GPIO_CONFIGURE(GPIOC, I2S3_PORTC_PINS);
+
+    __setbit(RCC->APB1ENR, 15);
+    __setbit(RCC->AHB1ENR, 21);
+
+    /*
+        I2SPR: bit 9 MCKOE, bit 8 ODD, bits 7:0 I2SDIV
+        I2SCFGR:
+        bit 11:     I2SMOD, I2S mode
+        bit 9:8:    10, master transmit
+        bit 5:4:    00, Philips standard
+        bit 2:1:    00, 16-bit data
+        bit 0:      0, 16-bit channel
+    */
+    SPI3->I2SCFGR = 0U;
+    SPI3->I2SPR   = (1U << 9) | (I2S_ODD << 8) | I2S_DIV;
+    SPI3->I2SCFGR = (1U << 11) | (2U << 8);
+
+    /* CR2 bit 1: TXDMAEN */
+    __setbit(SPI3->CR2, 1);
+
+    NVIC_EnableIRQ(DMA1_Stream5_IRQn);
+
+#if (I2S_CODEC)
+    cs43l22_init();
+#endif
+}
+
+/*
+    Both halves should be filled (i2s_ready()) before,
+    or they count as underruns.
+*/
+void i2s_start(i2s_t * s) {
+
+    DMA_Stream_TypeDef * st = DMA1_Stream5;
+
+    __clearbit(st->CR, 0);
+    while (st->CR & 1U);
+
+    /* stream 5: HISR / HIFCR bits 11:6 */
+    DMA1->HIFCR = 0x3DU << 6;
+
+    /*
+        bit 27:25:  channel 0
+        bit 17:16:  priority high
+        bit 14:11:  halfword memory and peripheral
+        bit 10:     memory increment
+        bit 8:      circular
+        bit 7:6:    01, memory to peripheral
+        bit 4, 3, 2: transfer complete, half transfer,
+                    transfer error interrupts
+    */
+    st->CR   = (2U << 16) | (1U << 13) | (1U << 11) | (1U << 10) | (1U << 8) |
+               (1U << 6) | (1U << 4) | (1U << 3) | (1U << 2);
+    st->PAR  = (uintptr_t)&SPI3->DR;
+    st->M0AR = (uintptr_t)s->buf;
+    st->NDTR = 2U * 2U * I2S_HALF_FRAMES;
+
+    __setbit(st->CR, 0);
+
+    /* I2SCFGR bit 10: I2SE, clocks start */
+    __setbit(SPI3->I2SCFGR, 10);
+    s->running = 1;
+
+#if (I2S_CODEC)
+    cs43l22_power(1U);
+#endif
+}
+
+/*
+    I2SE is cleared after the last frame: TXE set,
+    BSY clear
+*/
+void i2s_stop(i2s_t * s) {
+
+#if (I2S_CODEC)
+    cs43l22_power(0U);
+#endif
+
+    __clearbit(DMA1_Stream5->CR, 0);
+    while (DMA1_Stream5->CR & 1U);
+
+    while (!(SPI3->SR & (1U << 1)) || (SPI3->SR & (1U << 7)));
+    __clearbit(SPI3->I2SCFGR, 10);
+
+    s->running  = 0;
+    s->ready[0] = 0;
+    s->ready[1] = 0;
+}
+
+/*
+    the application has filled a half
+*/
+void i2s_ready(i2s_t * s, int16_t * half) {
+
+    uint32_t h = (half == s->buf[0]) ? 0U : 1U;
+    uint32_t cycles = DWT->CYCCNT - s->freeAt[h];
+
+    /* not for the halves filled before i2s_start() */
+    if (s->running && (cycles > s->fillMax)) {
+        s->fillMax = cycles;
+    }
+
+    s->ready[h] = 1;
+}
+
+/*
+    half h has been played, the DMA goes on with the
+    other one
+*/
+static void i2s_half_free(i2s_t * s, uint32_t h) {
+
+    if (!s->ready[h ^ 1U]) {
+        ++s->underruns;
+    }
+
+    s->ready[h]  = 0;
+    s->freeAt[h] = DWT->CYCCNT;
+    ++s->halves;
+
+    if (s->half != NULL) {
+        s->half(s, s->buf[h], I2S_HALF_FRAMES);
+    }
+}
+
+/*
+    DMA stream flags: bit 5 TCIF, bit 4 HTIF, bit 3 TEIF.
+    Both HTIF and TCIF set: the interrupt was held off
+    for more than one half.
+*/
+static void i2s_dma_isr(i2s_t * s) {
+
+    uint32_t flags = (DMA1->HISR >> 6) & 0x3DU;
+
+    DMA1->HIFCR = flags << 6;
+
+    if (flags & (1U << 3)) {
+        ++s->dmaErrors;
+    }
+
+    if ((flags & (3U << 4)) == (3U << 4)) {
+        ++s->late;
+    }
+
+    if (flags & (1U << 4)) {
+        i2s_half_free(s, 0U);
+    }
+
+    if (flags & (1U << 5)) {
+        i2s_half_free(s, 1U);
+    }
+}
+
+/*
+    demo: 1khz sine on both channels, the halves are
+    filled in the main loop, i2sDemoRun starts and stops
+*/
+#define       I2S_TONE_LEN      48U     /* samples per period at 48khz */
+
+static int16_t           i2sTone[I2S_TONE_LEN];
+static uint32_t          i2sTonePos;
+static volatile uint8_t  i2sDemoFree[2];
+static uint8_t           i2sDemoPlaying;
+
+static void i2s_demo_half(i2s_t * s, int16_t * half, uint32_t frames) {
+    i2sDemoFree[(half == s->buf[0]) ? 0U : 1U] = 1;
+}
+
+static void i2s_demo_fill(int16_t * half) {
+
+    uint32_t i;
+
+    for (i = 0; i < I2S_HALF_FRAMES; ++i) {
+        half[2U * i]      = i2sTone[i2sTonePos];
+        half[2U * i + 1U] = i2sTone[i2sTonePos];
+
+        if (++i2sTonePos == I2S_TONE_LEN) {
+            i2sTonePos = 0;
+        }
+    }
+
+    i2s_ready(&i2s, half);
+}
+
+static void i2s_demo_poll(void) {
+
+    uint32_t h;
+
+    if (i2sDemoRun && !i2sDemoPlaying) {
+
+        /*
+            y[n] = 2 cos(w) y[n - 1] - y[n - 2],
+            w = 2 pi / 48, amplitude 8000
+        */
+        float y0 = 0.0f;
+        float y1 = 8000.0f * 0.13052619f;
+        float y2;
+
+        for (h = 0; h < I2S_TONE_LEN; ++h) {
+            i2sTone[h] = (int16_t)y0;
+            y2 = 2.0f * 0.99144486f * y1 - y0;
+            y0 = y1;
+            y1 = y2;
+        }
+
+        i2s.half = i2s_demo_half;
+        i2s_demo_fill(i2s.buf[0]);
+        i2s_demo_fill(i2s.buf[1]);
+        i2s_start(&i2s);
+        i2sDemoPlaying = 1;
+    }
+
+    if (!i2sDemoRun && i2sDemoPlaying) {
+        i2s_stop(&i2s);
+        i2sDemoPlaying = 0;
+    }
+
+    for (h = 0; h < 2U; ++h) {
+        if (i2sDemoFree[h]) {
+            i2sDemoFree[h] = 0;
+            i2s_demo_fill(i2s.buf[h]);
+        }
+    }
+}
+#endif
+
+
+static void prof_puts(const char * s) {
+    while (*s != '\0') {
+        ITM_SendChar((uint32_t)*s++);
+    }
+}
@@ -15,6 +15,7 @@
 
 #include <stdint.h>
 #include "stm32f4xx.h"
+#include "../Common/gpio_config.h"
 
 #define       __setbit(___reg, ___bit)      ((___reg) |= (1U << (___bit)))
 #define       __clearbit(___reg, ___bit)    ((___reg) &= (~(1U << (___bit))))
@@ -206,207 +207,74 @@ void configureSPIBus(void) {
 
 }
 
-void configureSPIPins(void) {
-  
-    /**************************************  
-                SPI-1 - Pins          
-          Pins:
-            PA.5  ->  SCK
-            PA.6  ->  MISO
-            PA.7  ->  MOSI
-    ***************************************/
-
-  /*
-    enabled clock to to PA
-  */
-  __setbit(RCC->AHB1ENR, 0);
-  
-  /*
-     PA.5-7 Configuratoin
-     -> See GPIOs tutorial for more info
-  */
-  
-  /*
-    As an alternate function
-  */
-  GPIOA->MODER |=  (0xA8U <<8);
-
-  /*
-    output push-pull
-  */
-  GPIOA->OTYPER &= (~(0x7U << 5));
-  
-  /*
-    Speed: very high
-  */
-  
-  GPIOA->OSPEEDR |=  (0xFCU <<8);  
-  
-  /*
-    connect PA.5-7 to SPI pins for alternate function
-  */
-  
-  GPIOA->AFR[0] |= (0x555U << 20);
-  
-
-
-    /**************************************  
-                SPI-2 - Pins          
-          Pins:
-            PB.10   ->  SCK
-            PC.2    ->  MISO
-            PC.3    ->  MOSI
-    ***************************************/
-  
-  /*
-     PB.10 Configuratoin
-     -> See GPIOs tutorial for more info
-  */
-
-  /*
-    enabled clock to to PB
-  */
-  __setbit(RCC->AHB1ENR, 1);
-
-  /*
-    As an alternate function
-  */
-  __clearbit(GPIOB->MODER, 20);
-  __setbit(GPIOB->MODER, 21);
-
-
-  /*
-    output push-pull
-  */
-  GPIOB->OTYPER &= (~(0x1U << 10));
-  
-  /*
-    Speed: very high
-  */
-  
-  GPIOB->OSPEEDR |=  (0x3U <<20);  
-  
-  /*
-    connect PA.5-7 to SPI pins for alternate function
-  */
-  
-  GPIOB->AFR[1] |= (0x5U << 8);
-
-
-
-  /*
-     PC.2-3 Configuratoin
-     -> See GPIOs tutorial for more info
-  */
+/*
+    SPI-1: PA.5 -> SCK, PA.6 -> MISO, PA.7 -> MOSI
+*/
+#define       SPI1_PINS(___pin)                                                     \
+    ___pin(5U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)                       \
+    ___pin(6U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)                       \
+    ___pin(7U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)
 
-  /*
-    enabled clock to to PC
-  */
-  __setbit(RCC->AHB1ENR, 2);
+/*
+    SPI-2: PB.10 -> SCK, PC.2 -> MISO, PC.3 -> MOSI
+*/
+#define       SPI2_PORTB_PINS(___pin)                                               \
+    ___pin(10U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)
 
-  /*
-    As an alternate function
-  */
-  GPIOC->MODER |=  (0xAU << 4);
+#define       SPI2_PORTC_PINS(___pin)                                               \
+    ___pin(2U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)                       \
+    ___pin(3U, GPIO_AF, GPIO_PP, GPIO_VHIGH, GPIO_NOPULL, 5U)
 
-  /*
-    output push-pull
-  */
-  GPIOC->OTYPER &= (~(0x3U << 2));
+void configureSPIPins(void) {
   
   /*
-    Speed: very high
+    enable clock to PA, PB, PC
   */
-  
-  GPIOC->OSPEEDR |=  (0xFU << 4);  
+  RCC->AHB1ENR |= (1U << 0) | (1U << 1) | (1U << 2);
   
   /*
-    connect PC.2,3 to SPI pins for alternate function
+    alternate function 5, push-pull, very high speed
+    -> See GPIOs tutorial for more info
   */
-  
-  GPIOC->AFR[0] |= (0x55U << 8);
-
+  GPIO_CONFIGURE(GPIOA, SPI1_PINS);
+  GPIO_CONFIGURE(GPIOB, SPI2_PORTB_PINS);
+  GPIO_CONFIGURE(GPIOC, SPI2_PORTC_PINS);
 }
 
-void configLED(void) {
-
+/*
+    On STM32F4-Discovery BLUE-LED -> PD.15
+*/
+#define       LED_PINS(___pin)                                                      \
+    ___pin(15U, GPIO_OUT, GPIO_PP, GPIO_MEDIUM, GPIO_NOPULL, 0U)
 
-    /******************************************
-  
-            LED is connected to PD.15
-  
-    ****************************************/
+void configLED(void) {
     
     // enable clock to GPIOD
     __setbit(RCC->AHB1ENR, 3);
     
     /*
-        On STM32F4-Discovery
-        BLUE-LED     -->   PD.15  
-    */
-    
-    /*
-        configure PD.15 as general purpose output
+        general purpose output, push-pull, medium
+        speed, no pull-up/down
     */
-    __setbit(GPIOD->MODER, 30);
-    __clearbit(GPIOD->MODER, 31);
-    
-    /*
-        GPIOs output type: Push-Pull
-        so that it can be pulled high (logic-1) and pulled down (logic-0)
-    */
-    __clearbit(GPIOD->OTYPER, 15);
-    
-    /*
-        Lets keep GPIO speed: Medium
-    */
-    __setbit(GPIOD->OSPEEDR, 30);
-    __clearbit(GPIOD->OSPEEDR, 31);
-    
-    /*
-    Initial Level: Logic High --> No Pull-up/down
-    */
-    __clearbit(GPIOD->PUPDR, 30);
-    __clearbit(GPIOD->PUPDR, 31);
-      
+    GPIO_CONFIGURE(GPIOD, LED_PINS);
 }
 
-void configUserBtn (void) {
-
-   /******************************************
-  
-            User Btn is connected to PA.0
-  
-    ****************************************/
+/*
+    On STM32F4-Discovery User Btn -> PA.0
+*/
+#define       USER_BTN_PINS(___pin)                                                 \
+    ___pin(0U, GPIO_IN, GPIO_PP, GPIO_MEDIUM, GPIO_PD, 0U)
 
+void configUserBtn (void) {
     
     // enable clock to GPIOA
     __setbit(RCC->AHB1ENR, 0);
     
     /*
-        On STM32F4-Discovery
-        User Btn   -->   PA.0  
+        digital input, medium speed,
+        pull down --> logic-0 when released
     */
-    
-    /*
-        configure PA.0 as digital input
-    */
-    __clearbit(GPIOA->MODER, 0);
-    __clearbit(GPIOA->MODER, 1);
-    
-    
-    /*
-        Lets keep GPIO speed: Medium
-    */
-    __setbit(GPIOA->OSPEEDR, 0);
-    __clearbit(GPIOA->OSPEEDR, 1);
-    
-    /*
-      Initial Level: Pull Down --> Logic-0
-    */
-    __clearbit(GPIOA->PUPDR, 0);
-    __setbit(GPIOA->PUPDR, 1);
-    
+    GPIO_CONFIGURE(GPIOA, USER_BTN_PINS);
 }
 
 
@@ -15,6 +15,8 @@
 
 #include <stdint.h>
 #include "stm32f4xx.h"
+#include "../Common/prof.h"
+#include "../Common/gpio_atomic.h"
 
 #define       __setbit(___reg, ___bit)      ((___reg) |= (1U << (___bit)))
 #define       __clearbit(___reg, ___bit)    ((___reg) &= (~(1U << (___bit))))
@@ -24,12 +26,24 @@
 /* Functions Prototypes */
 static void initLed(void);
 
+/*
+    DWT cycle counter probes (Common/prof.h), one per
+    entry, dumped with prof_dump in this order
+*/
+enum {
+    PROF_TIM2,          /* TIM2_IRQHandler */
+    PROF_COUNT
+};
+
+static prof_t prof[PROF_COUNT];
 
 /* SET UP_COUNTER TO 0 IF DOWN COUNTER IS REQUIRED */
 #define     UP_COUNTER      1
 
 int main () {
     
+    prof_init(prof, PROF_COUNT);
+    
     /*
         For GPIO explanation go to LED Tutorial (GPIO-output)
     */
@@ -90,7 +104,9 @@ int main () {
      /* Start Timer-2 */
      __setbit(TIM2->CR1, 0U);
     
-    for (;;) {}
+    for (;;) {
+        prof_itm_poll(prof, PROF_COUNT);
+    }
 
 }
 
@@ -103,11 +119,15 @@ int main () {
 #endif        
 void TIM2_IRQHandler (void) {
     
+    PROF_BEGIN(PROF_TIM2);
+    
     /* clear timer interrupt */
     __clearbit(TIM2->SR, 0U);
     
-    /* Toggle BLUE-LED PD#15 on timer interrupt*/
-    __togglebit(GPIOD->ODR, 15);
+    /* Toggle BLUE-LED PD#15 on timer interrupt, through BSRR */
+    gpio_toggle(GPIOD, 1U << 15);
+    
+    PROF_END(PROF_TIM2);
 }
 #ifdef   __cplusplus
     }
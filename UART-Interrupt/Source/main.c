@@ -6,7 +6,23 @@
             PB10 ----> Tx
             PB11 ----> Rx
             
-@Method:    Interrupt based reception
+            The driver is table driven: USART1/2/3/6 and UART4/5
+            are described by one entry each (clock, pins, DMA
+            stream, IRQ) and share the same code. Any set of them
+            can run at once, see UART_ENABLED.
+            
+@Method:    Interrupt based reception and transmission.
+            Received bytes are written by DMA into a circular
+            buffer per instance. IDLE line and DMA half/full
+            transfer interrupts publish the write position, the
+            main loop gets whole bursts as (ptr, len) spans and
+            echoes them back through a Tx ring buffer which is
+            drained by the TXE interrupt.
+            The ISR never waits on the USART.
+            
+            With PKT_MODE 1, USART3 carries COBS framed packets
+            protected by a CRC-32 from the CRC unit, received
+            packets are sent back.
 
 @warrenty:  void
 */
@@ -26,246 +42,1253 @@ REQUIREMENTS:
 STEPS:
     1. Configure GPIOs to have alternate function
     2. Configure UART
-    3. In ISR transmit back Data
+    3. Configure DMA stream for circular Rx
+    4. In ISR track received Data, main loop transmits it back
 *************************************************************/
 
 #include <stdint.h>
 #include "stm32f4xx.h"
+#include "../../Common/gpio_config.h"
+#include "../../Common/usart_brr.h"
+#include "../../Common/prof.h"
 
 #define       __setbit(___reg, ___bit)      ((___reg) |= (1U << (___bit)))
 #define       __clearbit(___reg, ___bit)    ((___reg) &= (~(1U << (___bit))))
 #define       __togglebit(___reg, ___bit)   ((___reg) ^= (1U << (___bit)))
 #define       __getbit(___reg, ___bit)      (((___reg) & (1U << (___bit))) >> (___bit))
 
+/*
+    Bus clocks. Must follow the system clock configuration,
+    see Clock Sources tutorial:
+        HSI (default)       ->  PCLK1 = PCLK2 = 16Mhz
+        SysClock_configPLL  ->  PCLK1 = 42Mhz, PCLK2 = 84Mhz
+        
+    USART2/3, UART4/5 are on APB1 (PCLK1)
+    USART1/6          are on APB2 (PCLK2)
+*/
+#define       PCLK1_HZ          16000000U
+#define       PCLK2_HZ          16000000U
+
+#define       UART1_BAUDRATE    9600U
+#define       UART2_BAUDRATE    9600U
+#ifndef UART3_BAUDRATE
+#define       UART3_BAUDRATE    9600U
+#endif
+#define       UART4_BAUDRATE    9600U
+#define       UART5_BAUDRATE    9600U
+#define       UART6_BAUDRATE    9600U
 
+/*
+    OVER8 = 1 halves the oversampling, the maximum baudrate
+    doubles to PCLK / 8:
+        APB2 (USART1/6)      84Mhz  ->  10.5 Mbaud
+        APB1 (USART2/3, 4/5) 42Mhz  ->  5.25 Mbaud
+    at the cost of lower tolerance to clock deviation.
+    USART_BRR_CHECK() rejects unreachable baudrates.
+*/
+#ifndef UART_OVER8
+#define       UART_OVER8        0U
+#endif
 
-void initUSART(void);
-void put_char(int ch); 
-void transmitString( char * buffer );
+USART_BRR_CHECK(UART1, PCLK2_HZ, UART1_BAUDRATE, UART_OVER8);
+USART_BRR_CHECK(UART2, PCLK1_HZ, UART2_BAUDRATE, UART_OVER8);
+USART_BRR_CHECK(UART3, PCLK1_HZ, UART3_BAUDRATE, UART_OVER8);
+USART_BRR_CHECK(UART4, PCLK1_HZ, UART4_BAUDRATE, UART_OVER8);
+USART_BRR_CHECK(UART5, PCLK1_HZ, UART5_BAUDRATE, UART_OVER8);
+USART_BRR_CHECK(UART6, PCLK2_HZ, UART6_BAUDRATE, UART_OVER8);
 
-int main () {
- 
-    initUSART();
+/*
+    Instances, index into uartHw[] and uart[]
+*/
+typedef enum {
+    UART_1 = 0,
+    UART_2,
+    UART_3,
+    UART_4,
+    UART_5,
+    UART_6,
+    UART_COUNT
+} uart_id_t;
+
+/*
+    Instances brought up by main(), one bit per uart_id_t.
+    e.g. (1U << UART_3) | (1U << UART_6)
+*/
+#define       UART_ENABLED      (1U << UART_3)
+
+/*
+    Instances using RTS/CTS hardware flow control, one bit
+    per uart_id_t. Only USART1/2/3 have the pins on the
+    STM32F407VG (USART6 RTS/CTS are on port G).
+*/
+#define       UART_FLOW_CTRL    0U
+
+/*
+    1: UART_STRESS_ID runs a sustained transfer instead of
+    the echo (needs Tx wired to Rx, RTS wired to CTS) and
+    reports throughput and error counters in stress.
+*/
+#define       UART_STRESS       0
+#define       UART_STRESS_ID    UART_3
+
+/*
+    Every UART vector is timed by a DWT probe (prof[]).
+    1: USART3_IRQHandler is replaced by the original hand
+    coded echo (Rx not empty interrupt, read DR, wait for
+    Tx empty, write DR) under the same probe. Its worst
+    case is the reference for the driver ISR, give it to
+    prof_dump -r.
+*/
+#define       UART_ISR_REF      0
+
+/*
+    Buffer sizes, must be power of 2 so that
+    the free running indices can be wrapped with a mask.
+*/
+#define       TX_RING_SIZE      256U
+#define       RX_DMA_SIZE       256U
+
+/*
+    Single producer / single consumer ring buffer.
+    head is written only by the producer, tail only by
+    the consumer, so no locking is required between the
+    main loop and the ISR.
+*/
+typedef struct {
+    uint8_t           * buf;
+    uint32_t            mask;
+    volatile uint32_t   head;
+    volatile uint32_t   tail;
+} ring_t;
+
+/*
+    GPIO pin in alternate function mode
+*/
+typedef struct {
+    GPIO_TypeDef      * port;
+    uint8_t             pin;
+    uint8_t             af;
+} uart_pin_t;
+
+/*
+    Everything that differs between the instances.
+    Constant, lives in flash.
+*/
+typedef struct {
+    USART_TypeDef       * usart;
+    volatile uint32_t   * rccEnr;       /* RCC->APB1ENR or RCC->APB2ENR */
+    uint8_t               rccBit;
+    IRQn_Type             irq;
+    uint16_t              brr;
+    uart_pin_t            tx;
+    uart_pin_t            rx;
+    uart_pin_t            cts;          /* port NULL: no flow control */
+    uart_pin_t            rts;
+    
+    /* Rx DMA stream */
+    DMA_Stream_TypeDef  * rxStream;
+    volatile uint32_t   * dmaIsr;       /* DMAx->LISR or DMAx->HISR */
+    volatile uint32_t   * dmaIfcr;      /* DMAx->LIFCR or DMAx->HIFCR */
+    uint8_t               dmaRccBit;    /* AHB1ENR: 21 -> DMA1, 22 -> DMA2 */
+    uint8_t               dmaShift;     /* stream flags offset: 0, 6, 16, 22 */
+    uint8_t               dmaChannel;
+    IRQn_Type             dmaIrq;
+} uart_hw_t;
+
+/*
+    Run time state of an instance
+*/
+typedef struct {
+    const uart_hw_t   * hw;
+    
+    /* Tx: producer main loop, consumer ISR */
+    ring_t              tx;
     
     /*
-        enable Rx interrupt
+        Rx: producer DMA (position published by ISRs),
+        consumer main loop.
     */
-    __setbit(USART3->CR1,5);
+    uint8_t           * rxBuf;
+    volatile uint32_t   rxWritten;      /* ISR only */
+    uint32_t            rxRead;         /* main loop only */
+    uint32_t            rxDmaPos;       /* ISR only */
     
     /*
-      Allow NVIC to acknowledge USART3 interrupt
+        statistics, examine in watch window.
     */
+    volatile uint32_t   rxOverrun;
+    volatile uint32_t   rxFraming;
+    volatile uint32_t   rxDropped;
+} uart_t;
 
-    NVIC_EnableIRQ(USART3_IRQn);
-  
+/*
+    Pin mux and DMA mapping (STM32F407 reference manual,
+    datasheet alternate function table).
     
-    while (1) {}
+    Not all of them are free on the STM32F4-Discovery, these
+    are shared with on board parts and can not be used
+    together with them:
+        PB6         CS43L22 audio DAC I2C1 SCL
+        PC7         I2S3 MCK   (CS43L22)
+        PC10        I2S3 CK    (CS43L22)
+        PC12        I2S3 SD    (CS43L22)
+        PD4         CS43L22 /RESET
+        PB10        MP45DT02 microphone clock
+        PA11/PA12   USB OTG FS DM/DP (CN5)
+    The microphone is only clocked by an I2S2 master, so
+    USART3 Tx on PB10 is fine unless it is used. The other
+    pins in the table are free.
+    
+                Tx/Rx            CTS/RTS
+        USART1  PB6/PB7    AF7   PA11/PA12  AF7   DMA2 Stream5 Ch4
+        USART2  PA2/PA3    AF7   PD3/PD4    AF7   DMA1 Stream5 Ch4
+        USART3  PB10/PB11  AF7   PB13/PB14  AF7   DMA1 Stream1 Ch4
+        UART4   PC10/PC11  AF8   -                DMA1 Stream2 Ch4
+        UART5   PC12/PD2   AF8   -                DMA1 Stream0 Ch4
+        USART6  PC6/PC7    AF8   -                DMA2 Stream1 Ch5
+*/
+static const uart_hw_t uartHw[UART_COUNT] = {
+    { USART1, &RCC->APB2ENR,  4U, USART1_IRQn,
+      USART_BRR(PCLK2_HZ, UART1_BAUDRATE, UART_OVER8),
+      { GPIOB,  6U, 7U }, { GPIOB,  7U, 7U },
+      { GPIOA, 11U, 7U }, { GPIOA, 12U, 7U },
+      DMA2_Stream5, &DMA2->HISR, &DMA2->HIFCR, 22U,  6U, 4U, DMA2_Stream5_IRQn },
+      
+    { USART2, &RCC->APB1ENR, 17U, USART2_IRQn,
+      USART_BRR(PCLK1_HZ, UART2_BAUDRATE, UART_OVER8),
+      { GPIOA,  2U, 7U }, { GPIOA,  3U, 7U },
+      { GPIOD,  3U, 7U }, { GPIOD,  4U, 7U },
+      DMA1_Stream5, &DMA1->HISR, &DMA1->HIFCR, 21U,  6U, 4U, DMA1_Stream5_IRQn },
+      
+    { USART3, &RCC->APB1ENR, 18U, USART3_IRQn,
+      USART_BRR(PCLK1_HZ, UART3_BAUDRATE, UART_OVER8),
+      { GPIOB, 10U, 7U }, { GPIOB, 11U, 7U },
+      { GPIOB, 13U, 7U }, { GPIOB, 14U, 7U },
+      DMA1_Stream1, &DMA1->LISR, &DMA1->LIFCR, 21U,  6U, 4U, DMA1_Stream1_IRQn },
+      
+    { UART4,  &RCC->APB1ENR, 19U, UART4_IRQn,
+      USART_BRR(PCLK1_HZ, UART4_BAUDRATE, UART_OVER8),
+      { GPIOC, 10U, 8U }, { GPIOC, 11U, 8U },
+      { 0, 0U, 0U },      { 0, 0U, 0U },
+      DMA1_Stream2, &DMA1->LISR, &DMA1->LIFCR, 21U, 16U, 4U, DMA1_Stream2_IRQn },
+      
+    { UART5,  &RCC->APB1ENR, 20U, UART5_IRQn,
+      USART_BRR(PCLK1_HZ, UART5_BAUDRATE, UART_OVER8),
+      { GPIOC, 12U, 8U }, { GPIOD,  2U, 8U },
+      { 0, 0U, 0U },      { 0, 0U, 0U },
+      DMA1_Stream0, &DMA1->LISR, &DMA1->LIFCR, 21U,  0U, 4U, DMA1_Stream0_IRQn },
+      
+    { USART6, &RCC->APB2ENR,  5U, USART6_IRQn,
+      USART_BRR(PCLK2_HZ, UART6_BAUDRATE, UART_OVER8),
+      { GPIOC,  6U, 8U }, { GPIOC,  7U, 8U },
+      { 0, 0U, 0U },      { 0, 0U, 0U },
+      DMA2_Stream1, &DMA2->LISR, &DMA2->LIFCR, 22U,  6U, 5U, DMA2_Stream1_IRQn },
+};
 
-}
+/*
+    1: USART3 echoes COBS framed packets instead of raw bytes
+    (off by default, USART3 echoes raw bytes like the others)
+*/
+#ifndef PKT_MODE
+#define       PKT_MODE          0
+#endif
 
+/*
+    Packet transport.
+    
+    frame on the wire:  COBS( payload | CRC-32 ) | 0x00
+    
+    CRC-32 is computed by the CRC unit (poly 0x04C11DB7,
+    init 0xFFFFFFFF, no reflection, no final xor) over the
+    payload taken as little endian 32-bit words, the last
+    1..3 bytes are added one by one, MSB first, with the
+    same polynomial. It is sent little endian.
+    
+    Payload plus CRC is kept at or below 254 bytes so that
+    COBS adds exactly one code byte and the frame can be
+    encoded in place: the application writes the payload
+    straight into the frame buffer and the finished frame
+    is one contiguous block, ready for a DMA stream.
+*/
+#define       PKT_MAX_PAYLOAD   250U
+#define       PKT_CRC_SIZE      4U
+#define       PKT_FRAME_SIZE    (1U + PKT_MAX_PAYLOAD + PKT_CRC_SIZE + 1U)
 
-#ifdef __cplusplus 
-  extern "C" {
-#endif
+typedef struct {
+    uart_t            * uart;
     
-void USART3_IRQHandler (void) {  
-  
-  /*
-    read contents from USART3 data register
-    and transmit it back
-  */
-  
-  put_char(USART3->DR);
-  
-}  
+    /* Tx frame, payload starts at tx[1] */
+    uint8_t             tx[PKT_FRAME_SIZE];
+    uint32_t            txLen;          /* frame length, 0: idle */
+    uint32_t            txSent;         /* bytes already in Tx ring */
+    
+    /* Rx frame being decoded */
+    uint8_t             rx[PKT_MAX_PAYLOAD + PKT_CRC_SIZE];
+    uint32_t            rxLen;
+    uint32_t            rxCode;         /* current COBS code */
+    uint32_t            rxLeft;         /* data bytes left in code block */
+    uint32_t            rxBad;          /* discard until next delimiter */
+    
+    /*
+        statistics, examine in watch window.
+    */
+    uint32_t            rxOk;
+    uint32_t            rxCrcError;
+    uint32_t            rxFrameError;
+    uint32_t            txOk;
+    uint32_t            txBusy;
+} pkt_t;
 
-#ifdef __cplusplus 
-  }
+pkt_t pkt;
+
+static uint8_t txBuf[UART_COUNT][TX_RING_SIZE];
+static uint8_t rxDmaBuf[UART_COUNT][RX_DMA_SIZE];
+
+uart_t uart[UART_COUNT];
+
+/*
+    Stress mode results, examine in watch window.
+    Line errors are in uart[UART_STRESS_ID].
+*/
+typedef struct {
+    uint8_t             txSeq;          /* next byte to send */
+    uint8_t             rxSeq;          /* next byte expected */
+    uint32_t            windowStart;    /* DWT->CYCCNT */
+    uint32_t            windowBytes;
+    uint32_t            rxBytes;
+    uint32_t            seqErrors;      /* lost or corrupted bytes */
+    uint32_t            bytesPerSec;    /* last one second window */
+} stress_t;
+
+stress_t stress;
+
+void uart_init(uart_id_t id);
+uint32_t uart_write(uart_t * u, const uint8_t * buf, uint32_t len);
+void transmitString(uart_t * u, char * buffer);
+uint32_t uart_rx_span(uart_t * u, const uint8_t ** ptr);
+void uart_rx_release(uart_t * u, uint32_t len);
+
+void pkt_init(pkt_t * p, uart_t * u);
+uint8_t * pkt_tx_payload(pkt_t * p);
+int pkt_send(pkt_t * p, uint32_t len);
+void pkt_poll(pkt_t * p);
+void pkt_received(pkt_t * p, const uint8_t * payload, uint32_t len);
+
+static void pkt_tx_push(pkt_t * p);
+static void pkt_rx_put(pkt_t * p, uint8_t b);
+static void pkt_rx_end(pkt_t * p);
+static uint32_t crc32_hw(const uint8_t * buf, uint32_t len);
+void stress_poll(stress_t * st, uart_t * u);
+
+static void uart_init_pin(const uart_pin_t * p);
+static void uart_init_dma(uart_t * u);
+static void uart_isr(uart_t * u);
+static void uart_dma_isr(uart_t * u);
+static int ring_put(ring_t * r, uint8_t ch);
+static int ring_get(ring_t * r, uint8_t * ch);
+static void rx_dma_update(uart_t * u);
+
+/*
+    DWT cycle counter probes (Common/prof.h), one per
+    entry, dumped with prof_dump in this order
+*/
+enum {
+    PROF_USART1,        /* USART1_IRQHandler */
+    PROF_USART2,        /* USART2_IRQHandler */
+    PROF_USART3,        /* USART3_IRQHandler */
+    PROF_UART4,         /* UART4_IRQHandler */
+    PROF_UART5,         /* UART5_IRQHandler */
+    PROF_USART6,        /* USART6_IRQHandler */
+    PROF_DMA_UART1,     /* DMA2_Stream5_IRQHandler */
+    PROF_DMA_UART2,     /* DMA1_Stream5_IRQHandler */
+    PROF_DMA_UART3,     /* DMA1_Stream1_IRQHandler */
+    PROF_DMA_UART4,     /* DMA1_Stream2_IRQHandler */
+    PROF_DMA_UART5,     /* DMA1_Stream0_IRQHandler */
+    PROF_DMA_UART6,     /* DMA2_Stream1_IRQHandler */
+    PROF_COUNT
+};
+
+static prof_t prof[PROF_COUNT];
+
+/*
+    DWT data trace.
+    
+    dwt_trace_var() sets one of the four DWT comparators
+    (COMPn address, MASKn size, FUNCTIONn action) on a
+    variable. Every matching access is then reported by
+    the DWT itself as an ITM data trace packet with a local
+    timestamp: the traced code is not changed and runs at
+    full speed. Host-Tools/itm_trace.c decodes the packets
+    ("DWT comp n write" events in the trace JSON).
+    
+    DWT_TRACE 1 watches the USART3 ring indices, to see
+    the order of main loop and ISR updates:
+        comparator 0: uart[UART_3].tx.head   (main loop)
+        comparator 1: uart[UART_3].tx.tail   (TXE ISR)
+        comparator 2: uart[UART_3].rxWritten (ISRs)
+        comparator 3: uart[UART_3].rxRead    (main loop)
+    
+    The debugger uses the same comparators for watchpoints,
+    do not set watchpoints while tracing. Enable trace (SWO)
+    in the debugger settings. Off by default.
+*/
+#ifndef DWT_TRACE
+#define       DWT_TRACE         0
 #endif
 
-void initUSART(void) {
+/*
+    DWT_FUNCTION values, data trace through ITM
+*/
+#define       DWT_TRACE_RW      0x2U    /* data value, reads and writes */
+#define       DWT_TRACE_RW_PC   0x3U    /* PC and data value, reads and writes */
+#define       DWT_TRACE_READ    0xCU    /* data value on read */
+#define       DWT_TRACE_WRITE   0xDU    /* data value on write */
+#define       DWT_TRACE_READ_PC 0xEU    /* PC and data value on read */
+#define       DWT_TRACE_WRITE_PC 0xFU   /* PC and data value on write */
+
+int dwt_trace_var(uint32_t comp, volatile const void * addr, uint32_t size, uint32_t function);
+void dwt_trace_off(uint32_t comp);
+
 
+int main () {
+ 
+    const uint8_t * span;
+    uint32_t        len;
+    uint32_t        id;
+ 
+    SystemCoreClockUpdate();
+    prof_init(prof, PROF_COUNT);
+ 
+    for (id = 0; id < UART_COUNT; ++id) {
+      if (UART_ENABLED & (1U << id)) {
+        uart_init((uart_id_t)id);
+      }
+    }
+
+#if (UART_ISR_REF)
     /*
-        USART3 Pins:
-            PB10 ----> Tx
-            PB11 ----> Rx
+        USART3 back to the hand coded setup: no Rx DMA
+        request (CR3.6), no IDLE (CR1.4), Rx not empty
+        interrupt (CR1.5)
     */
+    __clearbit(USART3->CR3, 6);
+    __clearbit(USART3->CR1, 4);
+    __setbit(USART3->CR1, 5);
+#endif
+    
+#if (PKT_MODE)
+    pkt_init(&pkt, &uart[UART_3]);
+#endif
+
+#if (DWT_TRACE)
+    dwt_trace_var(0, &uart[UART_3].tx.head, 4U, DWT_TRACE_WRITE);
+    dwt_trace_var(1, &uart[UART_3].tx.tail, 4U, DWT_TRACE_WRITE);
+    dwt_trace_var(2, &uart[UART_3].rxWritten, 4U, DWT_TRACE_WRITE);
+    dwt_trace_var(3, &uart[UART_3].rxRead, 4U, DWT_TRACE_WRITE);
+#endif
     
-    /* 
-        Before we can use Port.B (PB) clock must be enable to it. 
-    */    
-    __setbit(RCC->AHB1ENR, 1);
+    while (1) {
     
+      prof_itm_poll(prof, PROF_COUNT);
+      
+#if (UART_STRESS)
+      stress_poll(&stress, &uart[UART_STRESS_ID]);
+#endif
+
+#if (PKT_MODE)
+      if (!(UART_STRESS && (UART_STRESS_ID == UART_3))) {
+        pkt_poll(&pkt);
+      }
+#endif
+    
+      /*
+        loop back whatever the DMA has received, straight
+        from the DMA buffer. Only the bytes that made it into
+        the Tx ring are released, the rest is retried.
+      */
+      for (id = 0; id < UART_COUNT; ++id) {
+      
+        if ((UART_ENABLED & (1U << id)) &&
+            !(PKT_MODE && (id == UART_3)) && !(UART_STRESS && (id == UART_STRESS_ID))) {
+          len = uart_rx_span(&uart[id], &span);
+          
+          if (len != 0U) {
+            uart_rx_release(&uart[id], uart_write(&uart[id], span, len));
+          }
+        }
+      }
+    }
+
+}
+
+void uart_init(uart_id_t id) {
+
+    uart_t          * u  = &uart[id];
+    const uart_hw_t * hw = &uartHw[id];
+    
+    u->hw      = hw;
+    u->tx.buf  = txBuf[id];
+    u->tx.mask = TX_RING_SIZE - 1U;
+    u->rxBuf   = rxDmaBuf[id];
+
     /******************************************************************
      *
      *    USART Tx, Rx pins are transition sensitive so set the initial
-     *    GPIO Pins (Tx,Rx) state.
+     *    GPIO Pins (Tx,Rx) state, then connect them to USART as an
+     *    alternate function.
      *
      ******************************************************************/
+    uart_init_pin(&hw->tx);
+    uart_init_pin(&hw->rx);
+
+    /******************************************************************
+     *
+     *      Now GPIO state is set and connected to USART Module
+     *         The final step is to Configure USART Moduele
+     *
+     ******************************************************************/
+    /*
+        enable clock to USART on its APB bus
+    */
+    __setbit(*hw->rccEnr, hw->rccBit);
+    
+    /*
+        Oversampling, then baudrate computed at compile time.
+        See USART_BRR()
+    */
+#if (UART_OVER8)
+    __setbit(hw->usart->CR1 , 15);
+#else
+    __clearbit(hw->usart->CR1 , 15);
+#endif
+
+    hw->usart->BRR = hw->brr;
+    
+    /*
+        Hardware Flow Control: RTSE (CR3.8), CTSE (CR3.9)
+        RTS is asserted only while there is room to receive,
+        Tx waits for CTS.
+    */
+    if ((UART_FLOW_CTRL & (1U << id)) && (hw->cts.port != 0)) {
+        uart_init_pin(&hw->cts);
+        uart_init_pin(&hw->rts);
+        __setbit(hw->usart->CR3 , 8);
+        __setbit(hw->usart->CR3 , 9);
+    } else {
+        __clearbit(hw->usart->CR3 , 8);
+        __clearbit(hw->usart->CR3 , 9);
+    }
     
-    /* 
-        Pins Output Type: Push Pull
-        So that its state can be pulled up (logic-1), pulled down (logic-0).
+    /*
+        1-start bit, 8-bit data
     */
-    __clearbit(GPIOB->OTYPER, 10);
-    __clearbit(GPIOB->OTYPER, 11);
+    __clearbit(hw->usart->CR1 , 12);
     
     /*
-        Set Pins speed to medium.
+        1-stop bit
     */
-    /* ------ for PB10 ------ */
-    __setbit(GPIOB->OSPEEDR, 20);
-    __clearbit(GPIOB->OSPEEDR, 21);
+    __clearbit(hw->usart->CR2 , 12);
+    __clearbit(hw->usart->CR2 , 13);
     
-    /* ------ for PB11 ------ */
-    __setbit(GPIOB->OSPEEDR, 22);
-    __clearbit(GPIOB->OSPEEDR, 23);
+    /*
+        No Parity bit
+    */
+    __clearbit(hw->usart->CR1 , 10);
     
     /*
-        Initial Pin State: High
-        i.e. idle state is high
+        Enable both data Transmission and Reception
     */
-    /* ------ for PB10 ------ */
-    __setbit(GPIOB->PUPDR, 20);
-    __clearbit(GPIOB->PUPDR, 21);
- 
-    /* ------ for PB11 ------ */
-    __setbit(GPIOB->PUPDR, 22);
-    __clearbit(GPIOB->PUPDR, 23);
+    __setbit(hw->usart->CR1 , 2);
+    __setbit(hw->usart->CR1 , 3);
     
+    uart_init_dma(u);
     
-    /******************************************************************
-     *
-     *    Now GPIO module and Pins states are set according to UART, 
-     *  next thing is to connect GPIO pins to UART as an alternate function
-     *      see the GPIO alternate function tutorial for more info.
-     *
-     ******************************************************************/
     /*
-        Configure GPIO Pins as alternate function
+        enable IDLE line interrupt, a burst is
+        handed over as soon as the line goes quiet
     */
-    /* ------ for PB10 ------ */
-    __clearbit(GPIOB->MODER, 20);
-    __setbit(GPIOB->MODER, 21);
- 
-    /* ------ for PB11 ------ */
-    __clearbit(GPIOB->MODER, 22);
-    __setbit(GPIOB->MODER, 23);
-
+    __setbit(hw->usart->CR1, 4);
+    
     /*
-        Connect PB10 Pin to USART. AF7
+        enable error interrupt (framing, noise, overrun)
+        for DMA reception
     */
-    __setbit(GPIOB->AFR[1], 8);
-    __setbit(GPIOB->AFR[1], 9);
-    __setbit(GPIOB->AFR[1], 10);    
-    __clearbit(GPIOB->AFR[1], 11);
+    __setbit(hw->usart->CR3, 0);
+    
+    /*
+      Allow NVIC to acknowledge USART and DMA stream interrupts
+    */
+    NVIC_EnableIRQ(hw->irq);
+    NVIC_EnableIRQ(hw->dmaIrq);
 
     /*
-        Connect PB10 Pin to USART. AF7
+        Finally powerup USART module
     */
-    __setbit(GPIOB->AFR[1], 12);
-    __setbit(GPIOB->AFR[1], 13);
-    __setbit(GPIOB->AFR[1], 14);
-    __clearbit(GPIOB->AFR[1], 15);
+    __setbit(hw->usart->CR1 , 13);
+}
 
+static void uart_init_pin(const uart_pin_t * p) {
 
-    /******************************************************************
-     *
-     *      Now GPIO state is set and connected to USART Module
-     *         The final step is to Configure USART Moduele
-     *
-     ******************************************************************/
     /*
-        USART3 module is connected on APB1, before we can use USART3,
-                        clock must be enabled to it.
+        enable clock to the port, AHB1ENR bit = port index
     */
-    __setbit(RCC->APB1ENR, 18);
+    __setbit(RCC->AHB1ENR, ((uintptr_t)p->port - GPIOA_BASE) >> 10);
     
     /*
-        By default the clock to USART3 is High Speed Internal clock 
-        HSI = 16Mhz
-        
-        Baudrate =  Fclk/ 8 x ( 2 - Over8 ) x USARTDIV
-        
-        OR
+        Alternate function AFx, push-pull, medium speed,
+        pull-up so the idle state is high. AF is selected
+        before MODER, see GPIO_CONFIGURE().
+    */
+#define       UART_PIN(___pin)                                                      \
+    ___pin(p->pin, GPIO_AF, GPIO_PP, GPIO_MEDIUM, GPIO_PU, (uint32_t)p->af)
 
-        USARTDIV =  Fclk/ 8 x ( 2 - Over8 ) x Baudrate
+    GPIO_CONFIGURE(p->port, UART_PIN);
+    
+#undef        UART_PIN
+}
 
-        Fclk = 16000000Hz
-        
-        Over8 = 0
-        
-        Required BR = 9600
-        
-        USARTDIV =  16000000 / 8 x ( 2 - 0 ) x 9600
-        
-        USARTDIV =  104.1666
-        
-        Fraction Part:  16 x 0.1666 = 2.656 ~= 3
-        Mantissa:       104 = 0x68
-        
-        USART_BRR = Mantissa << 4 | Fraction
-        
-        USART_BRR = 0x683
-        
-        USART_BRR = 11010000011
+static void uart_init_dma(uart_t * u) {
+
+    const uart_hw_t    * hw = u->hw;
+    DMA_Stream_TypeDef * s  = hw->rxStream;
+    
+    /*
+        enable clock to DMA controller on AHB1
     */
-    USART3->BRR = 0x683;
+    __setbit(RCC->AHB1ENR, hw->dmaRccBit);
     
     /*
-        Disable Hardware Flow Control
+        stream must be disabled before it can be configured
     */
-    __clearbit(USART3->CR2 , 8);
-    __clearbit(USART3->CR2 , 9);
+    __clearbit(s->CR, 0);
+    while (s->CR & 1U);
     
     /*
-        1-start bit, 8-bit data
+        clear all stream flags (FEIF, DMEIF, TEIF, HTIF, TCIF)
     */
-    __clearbit(USART3->CR1 , 12);
+    *hw->dmaIfcr = (0x3DU << hw->dmaShift);
     
     /*
-        1-stop bit
+        peripheral -> memory
+        source: USART data register
+        destination: circular buffer
     */
-    __clearbit(USART3->CR2 , 12);
-    __clearbit(USART3->CR2 , 13);
+    s->PAR  = (uintptr_t)&hw->usart->DR;
+    s->M0AR = (uintptr_t)u->rxBuf;
+    s->NDTR = RX_DMA_SIZE;
     
     /*
-        No Parity bit
+        high priority, byte sized transfers
+        (PSIZE = MSIZE = 0), memory increment, circular mode,
+        direction peripheral to memory (DIR = 00),
+        transfer complete, half transfer and transfer error
+        interrupts
     */
-    __clearbit(USART3->CR1 , 10);
+    s->CR = ((uint32_t)hw->dmaChannel << 25) | (2U << 16) | (1U << 10) | (1U << 8)
+          | (1U << 4) | (1U << 3) | (1U << 2);
     
     /*
-        Enable both data Transmission and Reception
+        direct mode, no FIFO
     */
-   __setbit(USART3->CR1 , 2);
-   __setbit(USART3->CR1 , 3);
+    s->FCR = 0;
+    
+    /*
+        enable the stream
+    */
+    __setbit(s->CR, 0);
+    
+    /*
+        let USART request DMA on Rx not empty
+    */
+    __setbit(hw->usart->CR3, 6);
+}
 
+/*
+    Common USART interrupt handling, all instances
+*/
+static __inline void uart_isr(uart_t * u) {
+
+  USART_TypeDef * usart = u->hw->usart;
+  uint32_t        sr    = usart->SR;
+  uint8_t         ch;
+  
+  /*
+    Line idle, overrun, noise or framing error.
+    Flags are cleared by reading SR followed by DR,
+    the DMA has already taken the data. Publish the
+    burst received so far.
+  */
+  if (sr & ((1U << 4) | (1U << 3) | (1U << 2) | (1U << 1))) {
+  
+    if (sr & (1U << 3)) {
+      ++u->rxOverrun;
+    }
+    
+    if (sr & (1U << 1)) {
+      ++u->rxFraming;
+    }
+    
+    (void)usart->DR;
+    
+    rx_dma_update(u);
+  }
+  
+  /*
+    Tx empty: feed next byte from Tx ring. When the ring
+    runs dry disable TXE interrupt, uart_write() enables
+    it again.
+  */
+  if ((sr & (1U << 7)) && (usart->CR1 & (1U << 7))) {
+    if (ring_get(&u->tx, &ch)) {
+      usart->DR = ch;
+    } else {
+      __clearbit(usart->CR1, 7);
+    }
+  }
+}
+
+#if (UART_ISR_REF)
+/*
+    The hand coded USART3 handler this driver replaced,
+    echo each byte from the ISR. Reference for the per
+    byte cost, see UART_ISR_REF.
+*/
+static __inline void uart_isr_ref(uart_t * u) {
+
+  USART_TypeDef * usart = u->hw->usart;
+  uint8_t         ch    = (uint8_t)usart->DR;
+  
+  while (!__getbit(usart->SR, 7));
+  usart->DR = ch;
+}
+#endif
 
+/*
+    Common Rx DMA stream interrupt handling, all instances
+*/
+static __inline void uart_dma_isr(uart_t * u) {
+
+  const uart_hw_t * hw = u->hw;
+  
+  /*
+    clear half transfer, transfer complete
+    and transfer error flags of the stream
+  */
+  *hw->dmaIfcr = *hw->dmaIsr & (0x38U << hw->dmaShift);
+  
+  /*
+    half or full buffer received, publish it.
+    This guarantees the position is sampled at
+    least twice per lap of the buffer.
+  */
+  rx_dma_update(u);
+}
+
+#ifdef __cplusplus 
+  extern "C" {
+#endif
+
+/*
+    Interrupt vectors, dispatch to the instance
+    under its DWT probe
+*/
+#define       UART_VECTOR(___name, ___isr, ___id, ___prof)                      \
+              void ___name (void) {                                             \
+                  PROF_BEGIN(___prof);                                          \
+                  ___isr(&uart[___id]);                                         \
+                  PROF_END(___prof);                                            \
+              }
+
+#if (UART_ISR_REF)
+UART_VECTOR(USART3_IRQHandler,       uart_isr_ref, UART_3, PROF_USART3)
+#else
+UART_VECTOR(USART3_IRQHandler,       uart_isr,     UART_3, PROF_USART3)
+#endif
+UART_VECTOR(USART1_IRQHandler,       uart_isr,     UART_1, PROF_USART1)
+UART_VECTOR(USART2_IRQHandler,       uart_isr,     UART_2, PROF_USART2)
+UART_VECTOR(UART4_IRQHandler,        uart_isr,     UART_4, PROF_UART4)
+UART_VECTOR(UART5_IRQHandler,        uart_isr,     UART_5, PROF_UART5)
+UART_VECTOR(USART6_IRQHandler,       uart_isr,     UART_6, PROF_USART6)
+
+UART_VECTOR(DMA2_Stream5_IRQHandler, uart_dma_isr, UART_1, PROF_DMA_UART1)
+UART_VECTOR(DMA1_Stream5_IRQHandler, uart_dma_isr, UART_2, PROF_DMA_UART2)
+UART_VECTOR(DMA1_Stream1_IRQHandler, uart_dma_isr, UART_3, PROF_DMA_UART3)
+UART_VECTOR(DMA1_Stream2_IRQHandler, uart_dma_isr, UART_4, PROF_DMA_UART4)
+UART_VECTOR(DMA1_Stream0_IRQHandler, uart_dma_isr, UART_5, PROF_DMA_UART5)
+UART_VECTOR(DMA2_Stream1_IRQHandler, uart_dma_isr, UART_6, PROF_DMA_UART6)
+
+#ifdef __cplusplus 
+  }
+#endif
+
+/*
+    Sample DMA write position, ISR context only.
+*/
+static void rx_dma_update(uart_t * u) {
+
+  uint32_t pos = RX_DMA_SIZE - u->hw->rxStream->NDTR;
+  
+  if (pos == RX_DMA_SIZE) {
+    pos = 0;
+  }
+  
+  u->rxWritten += (pos - u->rxDmaPos) & (RX_DMA_SIZE - 1U);
+  u->rxDmaPos   = pos;
+}
+
+/*
+    Return contiguous block of received data.
+    *ptr points directly into the DMA buffer, which the
+    circular DMA keeps writing: releasing the span with
+    uart_rx_release() does not hold it off. The data is
+    only intact while fewer than RX_DMA_SIZE - avail
+    further bytes have arrived, a caller that is slower
+    than that reads bytes of the next lap. Copy out what
+    must outlive the next call, the overwritten bytes are
+    then counted in rxDropped by the next uart_rx_span().
+*/
+uint32_t uart_rx_span(uart_t * u, const uint8_t ** ptr) {
+
+  uint32_t avail = u->rxWritten - u->rxRead;
+  uint32_t off;
+  
+  /*
+    DMA has lapped the reader, oldest data is lost
+  */
+  if (avail > RX_DMA_SIZE) {
+    u->rxDropped += avail - RX_DMA_SIZE;
+    u->rxRead    += avail - RX_DMA_SIZE;
+    avail         = RX_DMA_SIZE;
+  }
+  
+  off = u->rxRead & (RX_DMA_SIZE - 1U);
+  
+  if (avail > (RX_DMA_SIZE - off)) {
+    avail = RX_DMA_SIZE - off;
+  }
+  
+  *ptr = &u->rxBuf[off];
+  
+  return avail;
+}
+
+void uart_rx_release(uart_t * u, uint32_t len) {
+  u->rxRead += len;
+}
+
+/*
+    Queue up to len bytes for transmission, never blocks.
+    returns number of bytes actually queued.
+*/
+uint32_t uart_write(uart_t * u, const uint8_t * buf, uint32_t len) {
+
+  uint32_t n = 0;
+  
+  while ((n < len) && ring_put(&u->tx, buf[n])) {
+    ++n;
+  }
+  
+  /*
+    enable TXE interrupt, the ISR will drain the ring
+  */
+  if (n != 0U) {
+    __setbit(u->hw->usart->CR1, 7);
+  }
+  
+  return n;
+}
+
+void transmitString(uart_t * u, char * buffer) {
+
+    uint32_t len = 0;
+    uint32_t sent = 0;
+    
+    while ( buffer[len] != '\0' ) {
+      ++len;
+    }
+    
     /*
-        Finally powerup USART3 module
+      wait for space in Tx ring, call from main loop only
     */
-   __setbit(USART3->CR1 , 13);  
+    while ( sent < len ) {
+      sent += uart_write(u, (const uint8_t *)&buffer[sent], len - sent);
+    }
+}
 
+/*
+    Stress mode, main loop only: keep the Tx ring full with
+    a counting pattern and check it comes back in order.
+*/
+void stress_poll(stress_t * st, uart_t * u) {
+
+  uint8_t         chunk[64];
+  const uint8_t * span;
+  uint32_t        len;
+  uint32_t        now;
+  uint32_t        i;
+  
+  for (i = 0; i < sizeof(chunk); ++i) {
+    chunk[i] = (uint8_t)(st->txSeq + i);
+  }
+  
+  st->txSeq += (uint8_t)uart_write(u, chunk, sizeof(chunk));
+  
+  while ((len = uart_rx_span(u, &span)) != 0U) {
+  
+    for (i = 0; i < len; ++i) {
+      if (span[i] != st->rxSeq) {
+        ++st->seqErrors;
+        st->rxSeq = span[i];
+      }
+      
+      ++st->rxSeq;
+    }
+    
+    st->rxBytes     += len;
+    st->windowBytes += len;
+    uart_rx_release(u, len);
+  }
+  
+  /*
+    throughput over one second windows
+  */
+  now = DWT->CYCCNT;
+  
+  if ((now - st->windowStart) >= SystemCoreClock) {
+    st->bytesPerSec = (uint32_t)(((uint64_t)st->windowBytes * SystemCoreClock) / (now - st->windowStart));
+    st->windowBytes = 0;
+    st->windowStart = now;
+  }
 }
 
-void transmitString( char * buffer ) {
+void pkt_init(pkt_t * p, uart_t * u) {
 
-    volatile int i = 0;
+    p->uart = u;
     
-    while ( buffer[i] != '\0' ) {
-      put_char(buffer[i]);
-      ++i;
+    /*
+        enable clock to CRC unit on AHB1
+    */
+    __setbit(RCC->AHB1ENR, 12);
+}
+
+/*
+    Where the application writes the next payload,
+    up to PKT_MAX_PAYLOAD bytes. Valid while pkt_send()
+    is not busy.
+*/
+uint8_t * pkt_tx_payload(pkt_t * p) {
+    return &p->tx[1];
+}
+
+/*
+    Frame len bytes of payload already written to
+    pkt_tx_payload() and start sending it.
+    returns 0 if the previous frame is still being queued.
+*/
+int pkt_send(pkt_t * p, uint32_t len) {
+
+  uint8_t  * f = p->tx;
+  uint32_t   crc;
+  uint32_t   code = 0;
+  uint32_t   i;
+  
+  if ((p->txLen != 0U) || (len > PKT_MAX_PAYLOAD)) {
+    ++p->txBusy;
+    return 0;
+  }
+  
+  crc = crc32_hw(&f[1], len);
+  
+  f[len + 1U] = (uint8_t)(crc);
+  f[len + 2U] = (uint8_t)(crc >> 8);
+  f[len + 3U] = (uint8_t)(crc >> 16);
+  f[len + 4U] = (uint8_t)(crc >> 24);
+  
+  len += PKT_CRC_SIZE;
+  
+  /*
+    COBS in place: every zero becomes the distance to the
+    next zero, f[0] holds the distance to the first one.
+    len <= 254 so no code block ever needs splitting.
+  */
+  for (i = 1; i <= len; ++i) {
+    if (f[i] == 0U) {
+      f[code] = (uint8_t)(i - code);
+      code = i;
     }
+  }
+  
+  f[code] = (uint8_t)(i - code);
+  
+  /* frame delimiter */
+  f[len + 1U] = 0U;
+  
+  p->txSent = 0;
+  p->txLen  = len + 2U;
+  
+  pkt_tx_push(p);
+  
+  return 1;
+}
+
+/*
+    push as much of the pending Tx frame as fits into the Tx ring
+*/
+static void pkt_tx_push(pkt_t * p) {
+
+  if (p->txLen != 0U) {
+  
+    p->txSent += uart_write(p->uart, &p->tx[p->txSent], p->txLen - p->txSent);
+    
+    if (p->txSent == p->txLen) {
+      p->txLen = 0;
+      ++p->txOk;
+    }
+  }
+}
+
+/*
+    store one decoded byte, flag oversize frames
+*/
+static void pkt_rx_put(pkt_t * p, uint8_t b) {
+
+  if (p->rxLen == sizeof(p->rx)) {
+    p->rxBad = 1;
+  } else {
+    p->rx[p->rxLen++] = b;
+  }
+}
+
+/*
+    frame delimiter received, check and deliver the frame
+*/
+static void pkt_rx_end(pkt_t * p) {
+
+  uint32_t len = p->rxLen - PKT_CRC_SIZE;
+  uint32_t crc;
+  
+  /*
+    back to back delimiters are idle fill, not an error
+  */
+  if ((p->rxCode == 0U) && !p->rxBad) {
+    return;
+  }
+  
+  if (p->rxBad || (p->rxLeft != 0U) || (p->rxLen < PKT_CRC_SIZE)) {
+    ++p->rxFrameError;
+    return;
+  }
+  
+  crc = (uint32_t)p->rx[len] | ((uint32_t)p->rx[len + 1U] << 8) |
+        ((uint32_t)p->rx[len + 2U] << 16) | ((uint32_t)p->rx[len + 3U] << 24);
+  
+  if (crc32_hw(p->rx, len) != crc) {
+    ++p->rxCrcError;
+    return;
+  }
+  
+  ++p->rxOk;
+  pkt_received(p, p->rx, len);
+}
+
+/*
+    Main loop only: push pending Tx frame into the Tx ring
+    and decode received bytes straight from the DMA buffer.
+*/
+void pkt_poll(pkt_t * p) {
+
+  const uint8_t * span;
+  uint32_t        len;
+  uint32_t        i;
+  uint8_t         b;
+  
+  pkt_tx_push(p);
+  
+  while ((len = uart_rx_span(p->uart, &span)) != 0U) {
+  
+    for (i = 0; i < len; ++i) {
+    
+      b = span[i];
+      
+      if (b == 0U) {
+        pkt_rx_end(p);
+        
+        p->rxLen  = 0;
+        p->rxCode = 0;
+        p->rxLeft = 0;
+        p->rxBad  = 0;
+      } else if (p->rxBad) {
+        /* skip rest of a broken frame */
+      } else if (p->rxLeft == 0U) {
+      
+        /*
+          new code byte, the previous block ended
+          with an implied zero unless it was full
+        */
+        if ((p->rxCode != 0U) && (p->rxCode != 0xFFU)) {
+          pkt_rx_put(p, 0U);
+        }
+        
+        p->rxCode = b;
+        p->rxLeft = b - 1U;
+      } else {
+        pkt_rx_put(p, b);
+        --p->rxLeft;
+      }
+    }
+    
+    uart_rx_release(p->uart, len);
+  }
+}
+
+/*
+    A valid packet arrived, echo it back.
+*/
+void pkt_received(pkt_t * p, const uint8_t * payload, uint32_t len) {
+
+  uint8_t * out;
+  uint32_t  i;
+  
+  if (p->txLen != 0U) {
+    ++p->txBusy;
+    return;
+  }
+  
+  out = pkt_tx_payload(p);
+  
+  for (i = 0; i < len; ++i) {
+    out[i] = payload[i];
+  }
+  
+  pkt_send(p, len);
 }
 
-void put_char(int ch) {
+/*
+    CRC-32 by the CRC unit over buf taken as little endian
+    words. The unit only takes whole words, the last 1..3
+    bytes are shifted in by software: zero padding them
+    would give "ab" and "ab\0" the same CRC.
+*/
+static uint32_t crc32_hw(const uint8_t * buf, uint32_t len) {
+
+  uint32_t crc;
+  uint32_t i;
+  
+  /* reset, CRC->DR = 0xFFFFFFFF */
+  CRC->CR = 1U;
   
-  USART3->DR = ch;
+  while (len >= 4U) {
+    CRC->DR = (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+    buf += 4;
+    len -= 4U;
+  }
+  
+  crc = CRC->DR;
+  
+  while (len != 0U) {
+    crc ^= (uint32_t)*buf++ << 24;
+    
+    for (i = 0; i < 8U; ++i) {
+      crc = (crc & 0x80000000U) ? ((crc << 1) ^ 0x04C11DB7U) : (crc << 1);
+    }
+    
+    --len;
+  }
+  
+  return crc;
+}
 
+static int ring_put(ring_t * r, uint8_t ch) {
+
+  uint32_t head = r->head;
+  
+  /* full */
+  if ((head - r->tail) > r->mask) {
+    return 0;
+  }
+  
+  r->buf[head & r->mask] = ch;
+  
   /*
-    Wait until the data is transmitted
+    publish the byte only after it is stored
   */
-  while ( __getbit(USART3->SR, 7) != 1);
+  __DMB();
+  r->head = head + 1U;
+  
+  return 1;
+}
+
+static int ring_get(ring_t * r, uint8_t * ch) {
+
+  uint32_t tail = r->tail;
+  
+  /* empty */
+  if (tail == r->head) {
+    return 0;
+  }
   
+  *ch = r->buf[tail & r->mask];
+  
+  __DMB();
+  r->tail = tail + 1U;
+  
+  return 1;
+}
+
+
+/*
+    Trace accesses of a variable through the DWT comparator
+    comp (0..3). size: 1, 2 or 4 bytes, addr aligned to it.
+    function: DWT_TRACE_xxx
+    
+    return: 1 ok, 0 no such comparator or bad size/alignment
+*/
+int dwt_trace_var(uint32_t comp, volatile const void * addr, uint32_t size, uint32_t function) {
+
+    volatile uint32_t * regs;
+    uint32_t            mask;
+    
+    /* DWT_CTRL bits 31:28, NUMCOMP */
+    if ((comp >= 4U) || (comp >= (DWT->CTRL >> 28))) {
+        return 0;
+    }
+    
+    if ((size != 1U) && (size != 2U) && (size != 4U)) {
+        return 0;
+    }
+    
+    if (((uintptr_t)addr & (size - 1U)) != 0U) {
+        return 0;
+    }
+    
+    /*
+        COMPn, MASKn, FUNCTIONn repeat every 16 bytes
+    */
+    regs = &DWT->COMP0 + (4U * comp);
+    mask = (size == 4U) ? 2U : (size - 1U);
+    
+    /*
+        DEMCR bit 24: TRCENA, DWT and ITM
+        ITM_TCR (unlocked by LAR):
+        bit 3: TXENA, forward DWT packets
+        bit 2: SYNCENA
+        bit 1: TSENA, local timestamps
+    */
+    __setbit(CoreDebug->DEMCR, 24);
+    ITM->LAR = 0xC5ACCE55U;
+    ITM->TCR |= (1U << 3) | (1U << 2) | (1U << 1);
+    
+    regs[2] = 0;
+    regs[0] = (uint32_t)(uintptr_t)addr;
+    regs[1] = mask;
+    regs[2] = function & 0xFU;
+    
+    return 1;
+}
+
+void dwt_trace_off(uint32_t comp) {
+    if (comp < 4U) {
+        (&DWT->FUNCTION0)[4U * comp] = 0;
+    }
 }
 
@@ -5,7 +5,14 @@
             PB10 ----> Tx
             PB11 ----> Rx
             
-@Method:    Polling
+@Method:    Polling. Reception is done by DMA1 Stream1/Channel4
+            into a circular buffer, the application polls
+            the DMA write position and receives whole bursts
+            as contiguous (ptr, len) spans of that buffer.
+            
+            With SHELL_MODE 1 received lines are executed as
+            commands instead of being looped back, e.g.
+                help, clocks, rcc, usart, stats, md <addr> [n]
 
 @warrenty:  void
 */
@@ -28,27 +35,150 @@ APPLICATION: Application should regularly Poll to
 STEPS:
     1. Configure GPIOs to have alternate function
     2. Configure UART
-    3. Poll for Data Rx/Tx
+    3. Configure DMA1 Stream1 for circular Rx
+    4. Poll for Data Rx/Tx
 *************************************************************/
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "stm32f4xx.h"
+#include "../../Common/gpio_config.h"
+#include "../../Common/usart_brr.h"
 
 #define       __setbit(___reg, ___bit)      ((___reg) |= (1U << (___bit)))
 #define       __clearbit(___reg, ___bit)    ((___reg) &= (~(1U << (___bit))))
 #define       __togglebit(___reg, ___bit)   ((___reg) ^= (1U << (___bit)))
 #define       __getbit(___reg, ___bit)      (((___reg) & (1U << (___bit))) >> (___bit))
 
+/*
+    Clock feeding USART3 (APB1). Must follow the system
+    clock configuration, see Clock Sources tutorial:
+        HSI (default)       ->  PCLK1 = 16Mhz
+        SysClock_configPLL  ->  PCLK1 = 42Mhz   (PCLK2 = 84Mhz)
+*/
+#define       PCLK1_HZ          16000000U
+
+#ifndef USART3_BAUDRATE
+#define       USART3_BAUDRATE   9600U
+#endif
+#ifndef USART3_OVER8
+#define       USART3_OVER8      0U
+#endif
+
+USART_BRR_CHECK(USART3, PCLK1_HZ, USART3_BAUDRATE, USART3_OVER8);
+
+
+
+/*
+    Circular DMA Rx buffer size, must be power of 2.
+*/
+#define       RX_DMA_SIZE       256U
+
+static uint8_t rxDmaBuf[RX_DMA_SIZE];
+
+/* total bytes written by DMA (free running) */
+static uint32_t rxWritten = 0;
+
+/* total bytes released by the application (free running) */
+static uint32_t rxRead = 0;
+
+/* last sampled DMA write position in rxDmaBuf */
+static uint32_t rxDmaPos = 0;
+
+/*
+    Rx statistics, examine in watch window.
+*/
+volatile uint32_t rxOverrun = 0;
+volatile uint32_t rxFraming = 0;
+volatile uint32_t rxDropped = 0;
+
+/*
+    1: received lines are shell commands, 0: loop back
+*/
+#ifndef SHELL_MODE
+#define       SHELL_MODE        0
+#endif
+
+#if (SHELL_MODE)
+/*
+    Shell.
+    A line is tokenized in place in the DMA buffer, argv[]
+    points into it. Only a line that wraps round the end of
+    the DMA buffer is gathered in lineBuf. Nothing is
+    allocated, parsing runs in the main loop only.
+*/
+#define       SHELL_MAX_ARGS    8U
+#define       SHELL_LINE_SIZE   80U
+
+typedef void (*shell_fn_t)(int argc, char ** argv);
+
+typedef struct {
+    const char  * name;
+    shell_fn_t    fn;
+    const char  * help;
+} shell_cmd_t;
+
+static void cmd_clocks(int argc, char ** argv);
+static void cmd_help(int argc, char ** argv);
+static void cmd_md(int argc, char ** argv);
+static void cmd_rcc(int argc, char ** argv);
+static void cmd_stats(int argc, char ** argv);
+static void cmd_usart(int argc, char ** argv);
+
+/*
+    Command table, MUST be sorted by name (strcmp order),
+    it is searched with binary search.
+*/
+static const shell_cmd_t shellCmds[] = {
+    { "clocks", cmd_clocks, "SYSCLK, HCLK, PCLK1, PCLK2 in Hz" },
+    { "help",   cmd_help,   "list commands" },
+    { "md",     cmd_md,     "md <addr> [n] : dump n words" },
+    { "rcc",    cmd_rcc,    "RCC registers" },
+    { "stats",  cmd_stats,  "Rx counters, DWT cycle counter" },
+    { "usart",  cmd_usart,  "USART3 registers" },
+};
+
+#define       SHELL_CMD_COUNT   (sizeof(shellCmds) / sizeof(shellCmds[0]))
 
+/* line that wrapped round the DMA buffer end */
+static char     lineBuf[SHELL_LINE_SIZE];
+static uint32_t lineLen = 0;
+
+static void shell_poll(void);
+static void shell_exec(char * line);
+#endif
 
 void initUSART(void);
+void initRxDMA(void);
 void put_char(int ch); 
-void transmitString( char * buffer );
+void transmitString( const char * buffer );
+void put_hex(uint32_t val);
+void put_dec(uint32_t val);
+
+static void rx_poll(void);
+uint32_t uart_rx_span(const uint8_t ** ptr);
+void uart_rx_release(uint32_t len);
 
 int main () {
 
-    char rxCh;
+#if (!SHELL_MODE)
+    const uint8_t * span;
+    uint32_t        len;
+    uint32_t        i;
+#endif
  
     initUSART();
+    initRxDMA();
+    
+#if (SHELL_MODE)
+    /*
+        DWT cycle counter, reported by "stats"
+    */
+    __setbit(CoreDebug->DEMCR, 24);
+    __setbit(DWT->CTRL, 0);
+    
+    transmitString("\r\n> ");
+#endif
   
     while (1) {
       
@@ -59,104 +189,210 @@ int main () {
       ************************/
         
       /*
-          see if there is any data received
+          sample DMA progress, line idle and error flags
+      */
+      rx_poll();
+      
+#if (SHELL_MODE)
+      shell_poll();
+#else
+      /*
+          see if there is any data received, data is
+          used in place from DMA buffer (no copy)
       */
-      if  (__getbit(USART3->SR,5) == 1U) {
-          
-        /* receive character */
-        rxCh = USART3->DR;  
+      len = uart_rx_span(&span);
+      
+      if (len != 0U) {
+        
+        /* loop back received burst */
+        for (i = 0; i < len; ++i) {
+          put_char(span[i]);
+        }
         
-        /* loop back received character */
-        put_char(rxCh);
-               
+        uart_rx_release(len);
       }
+#endif
    }
 }
 
-void initUSART(void) {
+void initRxDMA(void) {
 
     /*
-        USART3 Pins:
-            PB10 ----> Tx
-            PB11 ----> Rx
+        USART3_RX is mapped on DMA1 Stream1 Channel4.
+        enable clock to DMA1 on AHB1
     */
+    __setbit(RCC->AHB1ENR, 21);
     
-    /* 
-        Before we can use Port.B (PB) clock must be enable to it. 
-    */    
-    __setbit(RCC->AHB1ENR, 1);
+    /*
+        stream must be disabled before it can be configured
+    */
+    __clearbit(DMA1_Stream1->CR, 0);
+    while (DMA1_Stream1->CR & 1U);
     
-    /******************************************************************
-     *
-     *    USART Tx, Rx pins are transition sensitive so set the initial
-     *    GPIO Pins (Tx,Rx) state.
-     *
-     ******************************************************************/
+    /*
+        clear all Stream1 flags (FEIF, DMEIF, TEIF, HTIF, TCIF)
+    */
+    DMA1->LIFCR = (0x3DU << 6);
     
-    /* 
-        Pins Output Type: Push Pull
-        So that its state can be pulled up (logic-1), pulled down (logic-0).
+    /*
+        peripheral -> memory
+        source: USART3 data register
+        destination: circular buffer
     */
-    __clearbit(GPIOB->OTYPER, 10);
-    __clearbit(GPIOB->OTYPER, 11);
+    DMA1_Stream1->PAR  = (uintptr_t)&USART3->DR;
+    DMA1_Stream1->M0AR = (uintptr_t)rxDmaBuf;
+    DMA1_Stream1->NDTR = RX_DMA_SIZE;
     
     /*
-        Set Pins speed to medium.
+        Channel 4, high priority, byte sized transfers
+        (PSIZE = MSIZE = 0), memory increment, circular mode,
+        direction peripheral to memory (DIR = 00)
     */
-    /* ------ for PB10 ------ */
-    __setbit(GPIOB->OSPEEDR, 20);
-    __clearbit(GPIOB->OSPEEDR, 21);
+    DMA1_Stream1->CR = (4U << 25) | (2U << 16) | (1U << 10) | (1U << 8);
     
-    /* ------ for PB11 ------ */
-    __setbit(GPIOB->OSPEEDR, 22);
-    __clearbit(GPIOB->OSPEEDR, 23);
+    /*
+        direct mode, no FIFO
+    */
+    DMA1_Stream1->FCR = 0;
     
     /*
-        Initial Pin State: High
-        i.e. idle state is high
+        enable the stream
     */
-    /* ------ for PB10 ------ */
-    __setbit(GPIOB->PUPDR, 20);
-    __clearbit(GPIOB->PUPDR, 21);
- 
-    /* ------ for PB11 ------ */
-    __setbit(GPIOB->PUPDR, 22);
-    __clearbit(GPIOB->PUPDR, 23);
+    __setbit(DMA1_Stream1->CR, 0);
+    
+    /*
+        let USART3 request DMA on Rx not empty
+    */
+    __setbit(USART3->CR3, 6);
+}
+
+/*
+    Sample DMA write position and USART status.
+    Must be called at least once per RX_DMA_SIZE bytes
+    otherwise data is overwritten and counted as dropped.
+*/
+static void rx_poll(void) {
+
+  uint32_t sr = USART3->SR;
+  uint32_t tc;
+  uint32_t pos;
+  uint32_t delta;
+  
+  /*
+    Line idle, overrun, noise or framing error.
+    Flags are cleared by reading SR followed by DR.
+    At this point the DMA has already taken the data.
+  */
+  if (sr & ((1U << 4) | (1U << 3) | (1U << 2) | (1U << 1))) {
+  
+    if (sr & (1U << 3)) {
+      ++rxOverrun;
+    }
+    
+    if (sr & (1U << 1)) {
+      ++rxFraming;
+    }
+    
+    (void)USART3->DR;
+  }
+  
+  /*
+    TCIF (LISR bit 11) and NDTR must belong together: a
+    wrap between the two reads would be counted twice,
+    once by pos and once more by the flag on the next
+    poll. Sample the flag on both sides of NDTR and
+    retry if it changed.
+  */
+  do {
+    tc  = DMA1->LISR & (1U << 11);
+    pos = RX_DMA_SIZE - DMA1_Stream1->NDTR;
+  } while ((DMA1->LISR & (1U << 11)) != tc);
+  
+  if (pos == RX_DMA_SIZE) {
+    pos = 0;
+  }
+  
+  delta = (pos - rxDmaPos) & (RX_DMA_SIZE - 1U);
+  
+  /*
+    transfer complete flag with no apparent wrap means
+    the DMA went round the whole buffer since last poll
+  */
+  if (tc) {
+    DMA1->LIFCR = (1U << 11);
     
+    if (pos >= rxDmaPos) {
+      delta += RX_DMA_SIZE;
+    }
+  }
+  
+  rxDmaPos   = pos;
+  rxWritten += delta;
+}
+
+/*
+    Return contiguous block of received data.
+    *ptr points directly into the DMA buffer, which the
+    DMA keeps writing: releasing the span does not hold
+    it off. The data is only intact while fewer than
+    RX_DMA_SIZE - avail further bytes have arrived, a
+    caller that is slower than that reads bytes of the
+    next lap. Copy out what must outlive the next poll,
+    rx_poll() then counts what was overwritten in
+    rxDropped on the next uart_rx_span().
+*/
+uint32_t uart_rx_span(const uint8_t ** ptr) {
+
+  uint32_t avail = rxWritten - rxRead;
+  uint32_t off;
+  
+  /*
+    DMA has lapped the reader, oldest data is lost
+  */
+  if (avail > RX_DMA_SIZE) {
+    rxDropped += avail - RX_DMA_SIZE;
+    rxRead    += avail - RX_DMA_SIZE;
+    avail      = RX_DMA_SIZE;
+  }
+  
+  off = rxRead & (RX_DMA_SIZE - 1U);
+  
+  if (avail > (RX_DMA_SIZE - off)) {
+    avail = RX_DMA_SIZE - off;
+  }
+  
+  *ptr = &rxDmaBuf[off];
+  
+  return avail;
+}
+
+void uart_rx_release(uint32_t len) {
+  rxRead += len;
+}
+
+/*
+    USART3: PB10 -> Tx, PB11 -> Rx, AF7, push-pull,
+    medium speed, pull-up: the lines idle high
+*/
+#define       USART3_PINS(___pin)                                                   \
+    ___pin(10U, GPIO_AF, GPIO_PP, GPIO_MEDIUM, GPIO_PU, 7U)                         \
+    ___pin(11U, GPIO_AF, GPIO_PP, GPIO_MEDIUM, GPIO_PU, 7U)
+
+void initUSART(void) {
+
+    /* 
+        Before we can use Port.B (PB) clock must be enable to it. 
+    */    
+    __setbit(RCC->AHB1ENR, 1);
     
     /******************************************************************
      *
-     *    Now GPIO module and Pins states are set according to UART, 
-     *  next thing is to connect GPIO pins to UART as an alternate function
-     *      see the GPIO alternate function tutorial for more info.
+     *    USART Tx, Rx pins are transition sensitive: output type,
+     *    speed, pull-up and AF7 are set before MODER switches the
+     *    pins to the alternate function, see GPIO_CONFIGURE().
      *
      ******************************************************************/
-    /*
-        Configure GPIO Pins as alternate function
-    */
-    /* ------ for PB10 ------ */
-    __clearbit(GPIOB->MODER, 20);
-    __setbit(GPIOB->MODER, 21);
- 
-    /* ------ for PB11 ------ */
-    __clearbit(GPIOB->MODER, 22);
-    __setbit(GPIOB->MODER, 23);
-
-    /*
-        Connect PB10 Pin to USART. AF7
-    */
-    __setbit(GPIOB->AFR[1], 8);
-    __setbit(GPIOB->AFR[1], 9);
-    __setbit(GPIOB->AFR[1], 10);    
-    __clearbit(GPIOB->AFR[1], 11);
-
-    /*
-        Connect PB10 Pin to USART. AF7
-    */
-    __setbit(GPIOB->AFR[1], 12);
-    __setbit(GPIOB->AFR[1], 13);
-    __setbit(GPIOB->AFR[1], 14);
-    __clearbit(GPIOB->AFR[1], 15);
+    GPIO_CONFIGURE(GPIOB, USART3_PINS);
 
 
     /******************************************************************
@@ -191,22 +427,29 @@ void initUSART(void) {
         
         USARTDIV =  104.1666
         
-        Fraction Part:  16 x 0.1666 = 2.656 ~= 3
+        Fraction Part:  16 x 0.1666 = 2.666 ~= 3
         Mantissa:       104 = 0x68
         
         USART_BRR = Mantissa << 4 | Fraction
         
         USART_BRR = 0x683
         
-        USART_BRR = 11010000011
+        USART_BRR() does the same at compile time for
+        PCLK1_HZ, USART3_BAUDRATE and USART3_OVER8.
     */
-    USART3->BRR = 0x683;
+#if (USART3_OVER8)
+    __setbit(USART3->CR1 , 15);
+#else
+    __clearbit(USART3->CR1 , 15);
+#endif
+
+    USART3->BRR = USART_BRR(PCLK1_HZ, USART3_BAUDRATE, USART3_OVER8);
     
     /*
-        Disable Hardware Flow Control
+        Disable Hardware Flow Control: RTSE (CR3.8), CTSE (CR3.9)
     */
-    __clearbit(USART3->CR2 , 8);
-    __clearbit(USART3->CR2 , 9);
+    __clearbit(USART3->CR3 , 8);
+    __clearbit(USART3->CR3 , 9);
     
     /*
         1-start bit, 8-bit data
@@ -238,7 +481,286 @@ void initUSART(void) {
 
 }
 
-void transmitString( char * buffer ) {
+#if (SHELL_MODE)
+/*
+    Look for a complete line in the received data.
+    Main loop only.
+*/
+static void shell_poll(void) {
+
+  const uint8_t * span;
+  uint32_t        len;
+  uint32_t        i;
+  
+  while ((len = uart_rx_span(&span)) != 0U) {
+  
+    for (i = 0; i < len; ++i) {
+      if ((span[i] == '\r') || (span[i] == '\n')) {
+        break;
+      }
+    }
+    
+    if ((i == 0U) && (lineLen == 0U) && (span[0] == '\n')) {
+    
+      /*
+        LF of a CR LF pair, the line was already run
+      */
+      uart_rx_release(1U);
+      
+    } else if (i < len) {
+    
+      if (lineLen == 0U) {
+      
+        /*
+          whole line contiguous: terminate and run it in place
+        */
+        ((char *)span)[i] = '\0';
+        shell_exec((char *)span);
+      } else {
+      
+        /*
+          tail of a wrapped line
+        */
+        if ((lineLen + i) < SHELL_LINE_SIZE) {
+          memcpy(&lineBuf[lineLen], span, i);
+          lineBuf[lineLen + i] = '\0';
+          shell_exec(lineBuf);
+        } else {
+          transmitString("line too long\r\n> ");
+        }
+        
+        lineLen = 0;
+      }
+      
+      uart_rx_release(i + 1U);
+      
+    } else if ((span + len) == (rxDmaBuf + RX_DMA_SIZE)) {
+    
+      /*
+        no end of line before the end of the DMA buffer,
+        gather this part, the line continues at the start
+      */
+      if ((lineLen + len) < SHELL_LINE_SIZE) {
+        memcpy(&lineBuf[lineLen], span, len);
+      }
+      
+      lineLen += len;
+      uart_rx_release(len);
+      
+    } else {
+      /* line not complete yet */
+      break;
+    }
+  }
+}
+
+/*
+    Split line into words without copying and dispatch.
+*/
+static void shell_exec(char * line) {
+
+  char * argv[SHELL_MAX_ARGS];
+  int    argc = 0;
+  int    lo = 0;
+  int    hi = (int)SHELL_CMD_COUNT - 1;
+  int    mid;
+  int    cmp;
+  
+  while ((*line != '\0') && (argc < (int)SHELL_MAX_ARGS)) {
+  
+    while (*line == ' ') {
+      *line++ = '\0';
+    }
+    
+    if (*line == '\0') {
+      break;
+    }
+    
+    argv[argc++] = line;
+    
+    while ((*line != ' ') && (*line != '\0')) {
+      ++line;
+    }
+  }
+  
+  if (argc != 0) {
+  
+    /*
+      binary search in sorted command table
+    */
+    while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      cmp = strcmp(argv[0], shellCmds[mid].name);
+      
+      if (cmp == 0) {
+        shellCmds[mid].fn(argc, argv);
+        break;
+      }
+      
+      if (cmp < 0) {
+        hi = mid - 1;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    
+    if (lo > hi) {
+      transmitString("unknown command, try help\r\n");
+    }
+  }
+  
+  transmitString("> ");
+}
+
+/*
+    print "name value" line
+*/
+static void put_reg(const char * name, uint32_t val) {
+  transmitString(name);
+  put_hex(val);
+  transmitString("\r\n");
+}
+
+static void put_val(const char * name, uint32_t val) {
+  transmitString(name);
+  put_dec(val);
+  transmitString("\r\n");
+}
+
+static void cmd_help(int argc, char ** argv) {
+
+  uint32_t i;
+  
+  for (i = 0; i < SHELL_CMD_COUNT; ++i) {
+    transmitString(shellCmds[i].name);
+    transmitString("\t");
+    transmitString(shellCmds[i].help);
+    transmitString("\r\n");
+  }
+}
+
+/*
+    Work out the clock tree from RCC registers
+*/
+static void cmd_clocks(int argc, char ** argv) {
+
+  static const uint8_t ahbShift[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 6, 7, 8, 9 };
+  static const uint8_t apbShift[8]  = { 0, 0, 0, 0, 1, 2, 3, 4 };
+  
+  uint32_t cfgr = RCC->CFGR;
+  uint32_t pll  = RCC->PLLCFGR;
+  uint32_t sysclk;
+  uint32_t hclk;
+  
+  switch ((cfgr >> 2) & 0x3U) {
+  
+    /* HSE, 8Mhz crystal on STM32F4-Discovery */
+    case 1U:
+      sysclk = 8000000U;
+      break;
+    
+    /* PLL: (HSI or HSE) / PLLM * PLLN / PLLP */
+    case 2U:
+      sysclk = ((pll & (1U << 22)) ? 8000000U : 16000000U) / (pll & 0x3FU);
+      sysclk = (sysclk * ((pll >> 6) & 0x1FFU)) / ((((pll >> 16) & 0x3U) + 1U) * 2U);
+      break;
+    
+    /* HSI */
+    default:
+      sysclk = 16000000U;
+      break;
+  }
+  
+  hclk = sysclk >> ahbShift[(cfgr >> 4) & 0xFU];
+  
+  put_val("SYSCLK ", sysclk);
+  put_val("HCLK   ", hclk);
+  put_val("PCLK1  ", hclk >> apbShift[(cfgr >> 10) & 0x7U]);
+  put_val("PCLK2  ", hclk >> apbShift[(cfgr >> 13) & 0x7U]);
+}
+
+static void cmd_rcc(int argc, char ** argv) {
+  put_reg("CR      ", RCC->CR);
+  put_reg("PLLCFGR ", RCC->PLLCFGR);
+  put_reg("CFGR    ", RCC->CFGR);
+  put_reg("AHB1ENR ", RCC->AHB1ENR);
+  put_reg("APB1ENR ", RCC->APB1ENR);
+  put_reg("APB2ENR ", RCC->APB2ENR);
+}
+
+static void cmd_usart(int argc, char ** argv) {
+  put_reg("SR  ", USART3->SR);
+  put_reg("BRR ", USART3->BRR);
+  put_reg("CR1 ", USART3->CR1);
+  put_reg("CR2 ", USART3->CR2);
+  put_reg("CR3 ", USART3->CR3);
+}
+
+static void cmd_stats(int argc, char ** argv) {
+  put_val("rx bytes   ", rxWritten);
+  put_val("rx overrun ", rxOverrun);
+  put_val("rx framing ", rxFraming);
+  put_val("rx dropped ", rxDropped);
+  put_val("cycles     ", DWT->CYCCNT);
+}
+
+/*
+    md <addr> [n]: dump n 32-bit words (default 1).
+    Reading a disabled or reserved peripheral may fault.
+*/
+static void cmd_md(int argc, char ** argv) {
+
+  uint32_t addr;
+  uint32_t n = 1;
+  
+  if (argc < 2) {
+    transmitString("md <addr> [n]\r\n");
+    return;
+  }
+  
+  addr = (uint32_t)strtoul(argv[1], 0, 16) & ~0x3U;
+  
+  if (argc > 2) {
+    n = (uint32_t)strtoul(argv[2], 0, 0);
+  }
+  
+  while (n--) {
+    put_hex(addr);
+    transmitString(": ");
+    put_hex(*(volatile uint32_t *)(uintptr_t)addr);
+    transmitString("\r\n");
+    addr += 4U;
+  }
+}
+#endif
+
+void put_hex(uint32_t val) {
+
+  int i;
+  
+  transmitString("0x");
+  
+  for (i = 28; i >= 0; i -= 4) {
+    put_char("0123456789ABCDEF"[(val >> i) & 0xFU]);
+  }
+}
+
+void put_dec(uint32_t val) {
+
+  char buf[11];
+  int  i = 10;
+  
+  buf[i] = '\0';
+  
+  do {
+    buf[--i] = (char)('0' + (val % 10U));
+    val /= 10U;
+  } while (val != 0U);
+  
+  transmitString(&buf[i]);
+}
+
+void transmitString( const char * buffer ) {
 
     volatile int i = 0;
     